@@ -10,12 +10,15 @@
 #include <QInputDialog>
 #include <QDateTime>
 #include <QTextStream>
+#include <QDir>
 
+#include <cstdlib>
 #include <cstring>
 #include <cerrno>
 #include <iostream>
 #include <sys/select.h>
 #include <QScrollBar>
+#include <zlib.h>
 
 using namespace std;
 
@@ -26,11 +29,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     logView = new QPlainTextEdit(central);
     logView->setReadOnly(true);
     // open activity log file for append
-    logFile.setFileName("client_activity.log");
-    if (!logFile.open(QIODevice::Append | QIODevice::Text)) {
-        // fallback: still continue but emit to UI and attempt to log via appendLog
-        appendLog("Warning: failed to open client_activity.log for writing");
-    }
+    openLog();
     input = new QLineEdit(central);
 
     // server / connection UI removed (manual connect not used)
@@ -49,6 +48,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     // group buttons
     createGroupBtn = new QPushButton("Create Group", central);
     listGroupsBtn = new QPushButton("Groups", central);
+    searchBtn = new QPushButton("Search", central);
     sendBtn = new QPushButton("Send", central);
 
     QVBoxLayout *layout = new QVBoxLayout(central);
@@ -85,6 +85,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     actions->addWidget(usersBtn);
     actions->addWidget(createGroupBtn);
     actions->addWidget(listGroupsBtn);
+    actions->addWidget(searchBtn);
     actions->addWidget(connectBtn);
     actions->addWidget(disconnectBtn);
     layout->addLayout(actions);
@@ -102,6 +103,7 @@ MainWindow::MainWindow(QWidget *parent) : QMainWindow(parent) {
     connect(usersBtn, &QPushButton::clicked, this, &MainWindow::onUsersClicked);
     connect(createGroupBtn, &QPushButton::clicked, this, &MainWindow::onCreateGroupClicked);
     connect(listGroupsBtn, &QPushButton::clicked, this, &MainWindow::onGroupsClicked);
+    connect(searchBtn, &QPushButton::clicked, this, &MainWindow::onSearchClicked);
     connect(convoList, &QListWidget::currentTextChanged, this, &MainWindow::onConversationChanged);
     // We receive responses manually per action (no onReadyRead)
 
@@ -124,12 +126,107 @@ MainWindow::~MainWindow() {
     }
         if (reconnectTimer && reconnectTimer->isActive()) reconnectTimer->stop();
         cleanupSocket();
+    // finish the file in hand; the rest are picked up by the next openLog()
+    {
+        std::lock_guard<std::mutex> lock(archiveMutex);
+        archiveStopping = true;
+        archiveWake.notify_one();
+    }
+    if (archiver.joinable()) archiver.join();
+}
+
+// client_activity.log is renamed to client_activity-<time>.log at this size
+// or age and compressed in the background; this many old files are kept
+static const qint64 LOG_ROTATE_BYTES = 4 << 20;
+static const qint64 LOG_ROTATE_SECONDS = 24 * 3600;
+static const int LOG_KEEP = 5;
+static const char *LOG_TIME_FORMAT = "yyyy-MM-dd HH:mm:ss";
+
+// gzip one rotated log next to itself and drop all but the newest LOG_KEEP;
+// runs on the archiver thread
+static void archiveLog(const QString &path) {
+    QFile in(path);
+    if (in.exists() && in.open(QIODevice::ReadOnly)) {
+        QString target = path + ".gz";
+        gzFile out = gzopen(QFile::encodeName(target).constData(), "wb6");
+        bool ok = out != nullptr;
+        while (ok && !in.atEnd()) {
+            QByteArray chunk = in.read(1 << 16);
+            ok = !chunk.isEmpty() && gzwrite(out, chunk.constData(), chunk.size()) == chunk.size();
+        }
+        if (out) ok = gzclose(out) == Z_OK && ok;
+        in.close();
+        if (ok) QFile::remove(path);
+        else QFile::remove(target);
+    }
+    // names sort by age; a file and its .gz count once
+    QDir dir(".");
+    QStringList rotated = dir.entryList(QStringList() << "client_activity-*.log" << "client_activity-*.log.gz",
+                                        QDir::Files, QDir::Name);
+    QStringList distinct;
+    for (const QString &name : rotated) {
+        QString base = name.endsWith(".gz") ? name.left(name.size() - 3) : name;
+        if (distinct.isEmpty() || distinct.last() != base) distinct.append(base);
+    }
+    for (int i = 0; i + LOG_KEEP < distinct.size(); ++i) {
+        QFile::remove(distinct[i]);
+        QFile::remove(distinct[i] + ".gz");
+    }
+}
+
+void MainWindow::openLog() {
+    logFile.setFileName("client_activity.log");
+    // the file's age runs from its first line
+    logStarted = QDateTime::currentDateTime();
+    if (logFile.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        QString first = QString::fromUtf8(logFile.readLine(64));
+        QDateTime stamped = QDateTime::fromString(first.mid(1, 19), LOG_TIME_FORMAT);
+        if (first.startsWith('[') && stamped.isValid()) logStarted = stamped;
+        logFile.close();
+    }
+    if (!logFile.open(QIODevice::Append | QIODevice::Text)) {
+        // fallback: still continue but emit to UI and attempt to log via appendLog
+        appendLog("Warning: failed to open client_activity.log for writing");
+        return;
+    }
+    // rotated files an earlier run did not get to compress
+    archiveQueue = QDir(".").entryList(QStringList() << "client_activity-*.log", QDir::Files, QDir::Name);
+    archiver = std::thread(&MainWindow::runArchiver, this);
+}
+
+void MainWindow::submitArchive(const QString &path) {
+    std::lock_guard<std::mutex> lock(archiveMutex);
+    archiveQueue.append(path);
+    archiveWake.notify_one();
+}
+
+void MainWindow::runArchiver() {
+    for (;;) {
+        QString path;
+        {
+            std::unique_lock<std::mutex> lock(archiveMutex);
+            archiveWake.wait(lock, [this] { return archiveStopping || !archiveQueue.isEmpty(); });
+            if (archiveStopping) break;
+            path = archiveQueue.takeFirst();
+        }
+        archiveLog(path);
+    }
+}
+
+// A rename and a reopen on this thread; compression happens on another
+void MainWindow::rotateLog(const QDateTime &now) {
+    QString rotated = "client_activity-" + now.toString("yyyyMMdd-HHmmss-zzz") + ".log";
+    logFile.close();
+    bool renamed = QFile::rename(logFile.fileName(), rotated);
+    if (!logFile.open(QIODevice::Append | QIODevice::Text)) return;
+    logStarted = now;
+    if (renamed) submitArchive(rotated);
 }
 
 void MainWindow::appendLog(const QString &text) {
     // timestamped line for file, but show plain text in UI (no timestamp duplication)
-    QString ts = QDateTime::currentDateTime().toString("yyyy-MM-dd HH:mm:ss");
-    QString line = QString("[%1] %2").arg(ts, text);
+    QDateTime now = QDateTime::currentDateTime();
+    QString line = QString("[%1] %2").arg(now.toString(LOG_TIME_FORMAT), text);
     // append to UI
     conversations["All"].append(text);
     // append to file
@@ -137,6 +234,7 @@ void MainWindow::appendLog(const QString &text) {
         QTextStream out(&logFile);
         out << line << "\n";
         out.flush();
+        if (logFile.size() >= LOG_ROTATE_BYTES || logStarted.secsTo(now) >= LOG_ROTATE_SECONDS) rotateLog(now);
     }
 }
 
@@ -174,11 +272,31 @@ void MainWindow::appendLog(const QString &text) {
         appendLog("Connected to server (auto-connect)");
             if (connectBtn) connectBtn->setEnabled(false);
             if (disconnectBtn) disconnectBtn->setEnabled(true);
-        // If not logged in, try auto-login; otherwise flush any queued messages
+        // A new connection is unauthenticated: resume the previous session
+        // if we hold a token, otherwise (or if it was refused) log in again
+        if (loggedIn && !tryResume()) loggedIn = false;
         if (!loggedIn) tryAutoLogin();
         else flushPendingMessages();
     }
 
+    // Re-attach to the server with the resume token; the friend, group and
+    // conversation lists already on screen are kept as they are
+    bool MainWindow::tryResume() {
+        if (resumeToken.isEmpty() || sockfd < 0) return false;
+        Message msg{}, resp{};
+        msg.type = MSG_SESSION_RESUME;
+        memcpy(msg.content, resumeToken.constData(), qMin((size_t)resumeToken.size(), sizeof(msg.content)-1));
+        sendMessage(msg);
+        if (!(recvMessageBlocking(resp, 3000) && resp.type == MSG_AUTH_RESPONSE && resp.content[0] == AUTH_SUCCESS)) {
+            appendLog("Session expired; logging in again");
+            resumeToken.clear();
+            return false;
+        }
+        appendLog("Session resumed");
+        if (pollTimer) pollTimer->start();
+        return true;
+    }
+
     void MainWindow::tryAutoLogin() {
         if (loggedIn || sockfd < 0) return;
         const QString user = usernameEdit->text();
@@ -314,20 +432,55 @@ void MainWindow::flushPendingMessages() {
     }
 }
 
+// True for a MSG_THROTTLED about a request that expects no reply (a chat
+// message or read ack), which must not be taken as some other request's reply
+bool MainWindow::isThrottledSend(const Message &m) {
+    int type = atoi(m.content);
+    return type == MSG_DIRECT_MESSAGE || type == MSG_GROUP_MESSAGE || type == MSG_READ_ACK;
+}
+
 bool MainWindow::recvMessageBlocking(Message &out, int timeoutMs) {
-    if (sockfd < 0) return false;
-    ssize_t got = ::recv(sockfd, &out, sizeof(Message), MSG_WAITALL);
-    if (got == 0) {
-        appendLog("Disconnected by server");
-        cleanupSocket();
-        return false;
-    }
-    if (got < 0) {
-        appendLog("Socket recv error");
-        cleanupSocket();
-        return false;
-    }
-    if (got == (ssize_t)sizeof(Message)) {
+    while (sockfd >= 0) {
+        ssize_t got = ::recv(sockfd, &out, sizeof(Message), MSG_WAITALL);
+        if (got == 0) {
+            appendLog("Disconnected by server");
+            cleanupSocket();
+            return false;
+        }
+        if (got < 0) {
+            appendLog("Socket recv error");
+            cleanupSocket();
+            return false;
+        }
+        if (got != (ssize_t)sizeof(Message)) return false;
+        // chat frames can arrive ahead of the reply (e.g. offline messages
+        // pushed right after login); show them and keep waiting
+        if (out.type == MSG_TEXT || out.type == MSG_GROUP_TEXT) {
+            handleChatMessage(out);
+            continue;
+        }
+        if (out.type == MSG_UNREAD_SUMMARY) {
+            handleUnreadSummary(out);
+            continue;
+        }
+        if (out.type == MSG_SESSION_TOKEN) {
+            resumeToken = QByteArray(out.content, (int)strnlen(out.content, sizeof(out.content)));
+            continue;
+        }
+        // typing / receipt events are never a reply; this client shows none yet
+        if (out.type == MSG_EVENT) continue;
+        // the reply slot is taken by a busy notice; callers see a type they
+        // did not ask for and report failure
+        if (out.type == MSG_BUSY) {
+            appendLog("Server busy, try again shortly");
+            return true;
+        }
+        // a throttled chat message has no reply of its own to stand in for
+        if (out.type == MSG_THROTTLED) {
+            appendLog("Sending too fast, slow down");
+            if (isThrottledSend(out)) continue;
+            return true;
+        }
         // quick debug: log received type
         appendLog(QString("<- RECV type=%1 from=%2").arg(out.type).arg(QString::fromUtf8(out.username)));
         return true;
@@ -346,6 +499,7 @@ void MainWindow::setLoggedInState(bool loggedIn_) {
     if (usersBtn) usersBtn->setEnabled(loggedIn);
     if (createGroupBtn) createGroupBtn->setEnabled(loggedIn);
     if (listGroupsBtn) listGroupsBtn->setEnabled(loggedIn);
+    if (searchBtn) searchBtn->setEnabled(loggedIn);
 }
 
 void MainWindow::onRegisterClicked() {
@@ -745,6 +899,34 @@ void MainWindow::onCreateGroupClicked() {
     }
 }
 
+void MainWindow::onSearchClicked() {
+    if (sockfd < 0) { appendLog("Not connected"); return; }
+    bool ok;
+    QString words = QInputDialog::getText(this, "Search Messages", "Words:", QLineEdit::Normal, "", &ok);
+    if (!ok || words.trimmed().isEmpty()) return;
+    // The server returns one page per response; follow "next: <offset>" for a
+    // few pages so the log shows a useful batch of results
+    QString offset;
+    for (int page = 0; page < 5; ++page) {
+        Message req{}; req.type = MSG_SEARCH_REQUEST; strncpy(req.username, currentUser.toStdString().c_str(), sizeof(req.username)-1);
+        QString query = QString("%1\n%2").arg(words.simplified(), offset);
+        strncpy(req.content, query.toStdString().c_str(), sizeof(req.content)-1);
+        sendMessage(req);
+        Message resp{};
+        if (!(recvMessageBlocking(resp, 3000) && resp.type == MSG_SEARCH_RESPONSE)) {
+            appendLog("No search response");
+            return;
+        }
+        offset.clear();
+        const QStringList lines = QString::fromUtf8(resp.content).split('\n', Qt::SkipEmptyParts);
+        for (const QString &ln : lines) {
+            if (ln.startsWith("next:")) offset = ln.mid(QString("next:").length()).trimmed();
+            else appendLog(ln);
+        }
+        if (offset.isEmpty()) break;
+    }
+}
+
 void MainWindow::onGroupsClicked() {
     if (sockfd < 0) { appendLog("Not connected"); return; }
     Message req{}; req.type = MSG_GROUP_LIST_REQUEST; strncpy(req.username, currentUser.toStdString().c_str(), sizeof(req.username)-1); sendMessage(req);
@@ -854,15 +1036,30 @@ void MainWindow::onGroupsClicked() {
 void MainWindow::onUsersClicked() {
     // Request server for all users with friendship status relative to current user
     if (sockfd < 0) { appendLog("Not connected"); return; }
-    Message req{}; req.type = MSG_ALL_USERS_STATUS_REQUEST; strncpy(req.username, currentUser.toStdString().c_str(), sizeof(req.username)-1); sendMessage(req);
-    Message resp{};
-    if (!(recvMessageBlocking(resp, 3000) && resp.type == MSG_ALL_USERS_STATUS_RESPONSE)) {
-        appendLog("No users/status response");
-        return;
+    // The server returns one page per response; keep asking with the
+    // "next: <name>" cursor until the listing is complete.
+    QStringList lines;
+    QString after;
+    for (int page = 0; page < 100; ++page) {
+        Message req{}; req.type = MSG_ALL_USERS_STATUS_REQUEST; strncpy(req.username, currentUser.toStdString().c_str(), sizeof(req.username)-1);
+        QString query = QString("\n%1\n").arg(after);
+        strncpy(req.content, query.toStdString().c_str(), sizeof(req.content)-1);
+        sendMessage(req);
+        Message resp{};
+        if (!(recvMessageBlocking(resp, 3000) && resp.type == MSG_ALL_USERS_STATUS_RESPONSE)) {
+            appendLog("No users/status response");
+            if (page == 0) return;
+            break;
+        }
+        after.clear();
+        const QStringList pageLines = QString::fromUtf8(resp.content).split('\n', Qt::SkipEmptyParts);
+        for (const QString &ln : pageLines) {
+            if (ln.startsWith("next:")) after = ln.mid(QString("next:").length()).trimmed();
+            else lines.append(ln);
+        }
+        if (after.isEmpty()) break;
     }
 
-    QString payload = QString::fromUtf8(resp.content);
-
     // Build and show a modal dialog with the list and action buttons (Add Friend + Open Chat)
     QDialog dlg(this);
     dlg.setWindowTitle("All Users");
@@ -871,12 +1068,10 @@ void MainWindow::onUsersClicked() {
     v->addWidget(hint);
 
     QListWidget *list = new QListWidget(&dlg);
-    QStringList lines = payload.split('\n', Qt::SkipEmptyParts);
     for (const QString &ln : lines) {
         QString line = ln.trimmed();
-        if (!line.startsWith("- ") && !line.contains(":")) continue;
-        QString item = line;
-        if (item.startsWith("- ")) item = item.mid(2);
+        if (!line.startsWith("- ")) continue;
+        QString item = line.mid(2);
         QStringList parts = item.split(':', Qt::KeepEmptyParts);
         if (parts.size() < 2) continue;
         QString name = parts[0].trimmed();
@@ -988,6 +1183,7 @@ void MainWindow::onConversationChanged() {
     logView->setPlainText(lines.join("\n"));
     if (who != "All") {
         onHistoryClicked();
+        sendReadAck(who);
     }
 }
 
@@ -1028,64 +1224,125 @@ void MainWindow::pollMessages() {
             // incomplete; shouldn't happen with MSG_PEEK; break to avoid busy loop
             break;
         }
-        if (peek.type != MSG_TEXT && peek.type != MSG_GROUP_TEXT) {
+        if (peek.type != MSG_TEXT && peek.type != MSG_GROUP_TEXT &&
+            peek.type != MSG_UNREAD_SUMMARY && peek.type != MSG_SESSION_TOKEN && peek.type != MSG_EVENT &&
+            !(peek.type == MSG_THROTTLED && isThrottledSend(peek))) {
             // leave non-chat messages for the blocking handlers
             break;
         }
         Message msg{};
         ssize_t got2 = ::recv(sockfd, &msg, sizeof(Message), 0);
         if (got2 != (ssize_t)sizeof(Message)) break;
-        QString now = QDateTime::currentDateTime().toString("yyyy-MM-dd HH:mm:ss");
-        if (msg.type == MSG_TEXT) {
-            QString from = QString::fromUtf8(msg.username);
-            QString line = QString("[%1] [%2] %3").arg(now, from, QString::fromUtf8(msg.content));
-            conversations["All"].append(line);
-            conversations[from].append(line);
-            // ensure list has this conversation
-            bool found = false;
-            for (int i = 0; i < convoList->count(); ++i) {
-                if (convoList->item(i)->text() == from) { found = true; break; }
-            }
-            if (!found) convoList->addItem(from);
+        if (msg.type == MSG_UNREAD_SUMMARY) handleUnreadSummary(msg);
+        else if (msg.type == MSG_SESSION_TOKEN) resumeToken = QByteArray(msg.content, (int)strnlen(msg.content, sizeof(msg.content)));
+        else if (msg.type == MSG_THROTTLED) appendLog("Sending too fast, slow down");
+        else if (msg.type != MSG_EVENT) handleChatMessage(msg);
+    }
+}
 
-            if (convoList->currentItem()) {
-                QString cur = convoList->currentItem()->text();
-                if (cur == from || cur == "All") {
-                    if (cur == "All") logView->setPlainText(conversations["All"].join("\n"));
-                    else logView->setPlainText(conversations[from].join("\n"));
-                } else {
-                    appendLog(line);
-                }
-                logView->verticalScrollBar()->setValue(logView->verticalScrollBar()->maximum());
+// Show an incoming MSG_TEXT / MSG_GROUP_TEXT frame in its conversation
+void MainWindow::handleChatMessage(const Message &msg) {
+    QString now = QDateTime::currentDateTime().toString("yyyy-MM-dd HH:mm:ss");
+    if (msg.type == MSG_TEXT) {
+        QString from = QString::fromUtf8(msg.username);
+        QString line = QString("[%1] [%2] %3").arg(now, from, QString::fromUtf8(msg.content));
+        conversations["All"].append(line);
+        conversations[from].append(line);
+        // ensure list has this conversation
+        bool found = false;
+        for (int i = 0; i < convoList->count(); ++i) {
+            if (convoList->item(i)->text() == from) { found = true; break; }
+        }
+        if (!found) convoList->addItem(from);
+
+        if (convoList->currentItem()) {
+            QString cur = convoList->currentItem()->text();
+            if (cur == from) sendReadAck(from);
+            else setUnread(from, -1);
+            if (cur == from || cur == "All") {
+                if (cur == "All") logView->setPlainText(conversations["All"].join("\n"));
+                else logView->setPlainText(conversations[from].join("\n"));
             } else {
                 appendLog(line);
             }
-        } else if (msg.type == MSG_GROUP_TEXT) {
-            // msg.username == groupname; msg.content == "sender: body"
-            QString group = QString::fromUtf8(msg.username);
-            QString payload = QString::fromUtf8(msg.content);
-            QString line = QString("[%1] [%2] %3").arg(now, group, payload);
-            QString key = QString("Group:%1").arg(group);
-            conversations["All"].append(line);
-            conversations[key].append(line);
-            bool foundg = false;
-            for (int i = 0; i < convoList->count(); ++i) {
-                if (convoList->item(i)->text() == key) { foundg = true; break; }
-            }
-            if (!foundg) convoList->addItem(key);
-
-            if (convoList->currentItem()) {
-                QString cur = convoList->currentItem()->text();
-                if (cur == key || cur == "All") {
-                    if (cur == "All") logView->setPlainText(conversations["All"].join("\n"));
-                    else logView->setPlainText(conversations[key].join("\n"));
-                } else {
-                    appendLog(line);
-                }
-                logView->verticalScrollBar()->setValue(logView->verticalScrollBar()->maximum());
+            logView->verticalScrollBar()->setValue(logView->verticalScrollBar()->maximum());
+        } else {
+            appendLog(line);
+        }
+    } else if (msg.type == MSG_GROUP_TEXT) {
+        // msg.username == groupname; msg.content == "sender: body"
+        QString group = QString::fromUtf8(msg.username);
+        QString payload = QString::fromUtf8(msg.content);
+        QString line = QString("[%1] [%2] %3").arg(now, group, payload);
+        QString key = QString("Group:%1").arg(group);
+        conversations["All"].append(line);
+        conversations[key].append(line);
+        bool foundg = false;
+        for (int i = 0; i < convoList->count(); ++i) {
+            if (convoList->item(i)->text() == key) { foundg = true; break; }
+        }
+        if (!foundg) convoList->addItem(key);
+
+        if (convoList->currentItem()) {
+            QString cur = convoList->currentItem()->text();
+            if (cur == key) sendReadAck(key);
+            else setUnread(key, -1);
+            if (cur == key || cur == "All") {
+                if (cur == "All") logView->setPlainText(conversations["All"].join("\n"));
+                else logView->setPlainText(conversations[key].join("\n"));
             } else {
                 appendLog(line);
             }
+            logView->verticalScrollBar()->setValue(logView->verticalScrollBar()->maximum());
+        } else {
+            appendLog(line);
         }
     }
 }
+
+// MSG_UNREAD_SUMMARY: "<conv> <unread> <lastRead>" lines, conv being
+// "@<peer>" or "#<group>"
+void MainWindow::handleUnreadSummary(const Message &msg) {
+    const QStringList lines = QString::fromUtf8(msg.content).split("\n", Qt::SkipEmptyParts);
+    for (const QString &line : lines) {
+        QStringList parts = line.split(' ', Qt::SkipEmptyParts);
+        if (parts.size() < 2 || parts[0].size() < 2) continue;
+        QString conv = parts[0];
+        QString item = conv.startsWith('#') ? QString("Group:%1").arg(conv.mid(1)) : conv.mid(1);
+        bool found = false;
+        for (int i = 0; i < convoList->count(); ++i) {
+            if (convoList->item(i)->text() == item) { found = true; break; }
+        }
+        if (!found) convoList->addItem(item);
+        setUnread(item, parts[1].toInt());
+        appendLog(QString("%1 unread in %2").arg(parts[1], item));
+    }
+}
+
+// Show an unread count on a conversation: 0 clears it, -1 adds one
+void MainWindow::setUnread(const QString &item, int unread) {
+    for (int i = 0; i < convoList->count(); ++i) {
+        QListWidgetItem *it = convoList->item(i);
+        if (it->text() != item) continue;
+        int count = unread;
+        if (unread < 0) count = it->data(Qt::UserRole).toInt() + 1;
+        it->setData(Qt::UserRole, count);
+        QFont f = it->font();
+        f.setBold(count > 0);
+        it->setFont(f);
+        it->setToolTip(count > 0 ? QString("%1 unread").arg(count) : QString());
+        return;
+    }
+}
+
+// Tell the server the conversation has been read up to its newest message
+void MainWindow::sendReadAck(const QString &item) {
+    setUnread(item, 0);
+    if (sockfd < 0 || item == "All" || item.isEmpty()) return;
+    QString conv = item.startsWith("Group:", Qt::CaseInsensitive)
+        ? QString("#%1").arg(item.mid(QString("Group:").length()))
+        : QString("@%1").arg(item);
+    Message msg{}; msg.type = MSG_READ_ACK;
+    strncpy(msg.content, conv.toUtf8().constData(), sizeof(msg.content)-1);
+    sendMessage(msg);
+}
@@ -15,7 +15,11 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QFile>
+#include <QDateTime>
+#include <condition_variable>
 #include <cstring>
+#include <mutex>
+#include <thread>
 
 #include "./include/common.h"
 
@@ -33,6 +37,7 @@ private slots:
     void onUsersClicked();
     void onCreateGroupClicked();
     void onGroupsClicked();
+    void onSearchClicked();
     void onHistoryClicked();
     // removed auto read; we'll recv manually per action
     void onConversationChanged();
@@ -46,11 +51,21 @@ private:
     void sendMessage(const Message &msg);
     void flushPendingMessages();
     void appendLog(const QString &text);
+    void openLog();
+    void rotateLog(const QDateTime &now);
+    void submitArchive(const QString &path);
+    void runArchiver();
     void setLoggedInState(bool loggedIn);
     bool recvMessageBlocking(Message &out, int timeoutMs = 2000);
+    static bool isThrottledSend(const Message &m);
+    void handleChatMessage(const Message &msg);
+    void handleUnreadSummary(const Message &msg);
+    void setUnread(const QString &item, int unread);
+    void sendReadAck(const QString &item);
     void cleanupSocket();
     bool loadCredentials(QString &user, QString &pass);
     void tryAutoLogin();
+    bool tryResume();
 
     // UI
     QPlainTextEdit *logView;
@@ -78,11 +93,20 @@ private:
     // group buttons
     QPushButton *createGroupBtn;
     QPushButton *listGroupsBtn;
+    QPushButton *searchBtn;
     
 
     QString currentUser;
     bool loggedIn = false;
+    QByteArray resumeToken; // latest MSG_SESSION_TOKEN, used instead of the password on reconnect
     QMap<QString, QStringList> conversations; // username -> lines
     QList<Message> pendingMessages; // messages queued while offline
     QFile logFile;
+    QDateTime logStarted; // first line of the current client_activity.log
+    // compresses rotated logs one at a time; joined in the destructor
+    std::thread archiver;
+    std::mutex archiveMutex;
+    std::condition_variable archiveWake;
+    QStringList archiveQueue;
+    bool archiveStopping = false;
 };
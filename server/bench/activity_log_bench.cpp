@@ -0,0 +1,116 @@
+// activity-log-bench: cost of logging one request on a session thread.
+//
+//   activity-log-bench [threads] [records]    (defaults: 4 threads, 50000 records each)
+//
+// `threads` threads each log `records` direct-message requests, three ways:
+//   locked   the old logActivity(): a mutex, localtime_r and strftime, and an
+//            ofstream write and flush per line
+//   block    ActivityLog with the block overflow policy
+//   drop     ActivityLog with the drop policy (the server's default)
+// Prints the wall time per record as seen by the logging threads, the time
+// including the writer draining the ring and closing the file, and how many
+// records the drop policy lost. Files go to a scratch directory under /tmp.
+
+#include "activity_log.h"
+#include "common.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+typedef function<void(int thread, int i)> LogOne;
+
+// Run `threads` threads calling `log` `records` times each; nanoseconds per record
+static double timeThreads(int threads, int records, const LogOne& log) {
+    auto t0 = chrono::steady_clock::now();
+    vector<thread> ts;
+    for (int t = 0; t < threads; ++t) {
+        ts.emplace_back([t, records, &log] {
+            for (int i = 0; i < records; ++i) log(t, i);
+        });
+    }
+    for (auto &th : ts) th.join();
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / (double(threads) * records);
+}
+
+static void report(const char *label, double ns, double totalNs, unsigned long long dropped) {
+    printf("%-8s %9.0f ns/record   %9.0f ns/record incl. drain   %llu dropped\n", label, ns, totalNs, dropped);
+}
+
+static void benchLocked(const string& dir, int threads, int records) {
+    ofstream file(dir + "/locked.log", ios::app);
+    mutex log_mutex;
+    auto t0 = chrono::steady_clock::now();
+    double ns = timeThreads(threads, records, [&](int t, int i) {
+        string msg = "Direct message from user" + to_string(t) + " to user" + to_string(i % 1000) + " (42 bytes)";
+        lock_guard<mutex> lock(log_mutex);
+        auto now = chrono::system_clock::now();
+        time_t tt = chrono::system_clock::to_time_t(now);
+        struct tm tm;
+        localtime_r(&tt, &tm);
+        char buf[64];
+        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+        file << "[" << buf << "] " << msg << endl;
+        file.flush();
+    });
+    file.close();
+    double total = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / (double(threads) * records);
+    report("locked", ns, total, 0);
+}
+
+static bool benchRing(const char *label, const string& dir, int threads, int records, ActivityLog::Overflow policy) {
+    ActivityLog log;
+    log.configure(8192, policy);
+    log.setResolver([](NameSpace, uint32_t id) { return "user" + to_string(id); });
+    if (!log.open(dir + "/" + label + ".evlog")) {
+        cerr << COLOR_RED << "Could not open " << dir << "/" << label << ".evlog" << COLOR_RESET << endl;
+        return false;
+    }
+    auto t0 = chrono::steady_clock::now();
+    double ns = timeThreads(threads, records, [&log](int t, int i) {
+        EventRecord rec{};
+        rec.kind = EV_REQUEST;
+        rec.opcode = MSG_DIRECT_MESSAGE;
+        rec.status = EV_STATUS_OK;
+        rec.user = static_cast<uint32_t>(t + 1);
+        rec.target = static_cast<uint32_t>(i % 1000 + 1);
+        rec.value = 42;
+        log.write(rec);
+    });
+    log.close();
+    double total = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / (double(threads) * records);
+    report(label, ns, total, log.droppedCount());
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    int records = argc > 2 ? atoi(argv[2]) : 50000;
+    if (threads < 1 || records < 1) {
+        cerr << "Usage: " << argv[0] << " [threads >= 1] [records >= 1]" << endl;
+        return 1;
+    }
+    char tmpl[] = "/tmp/activity-log-bench-XXXXXX";
+    const char *dir = mkdtemp(tmpl);
+    if (!dir) {
+        cerr << COLOR_RED << "Could not create a scratch directory" << COLOR_RESET << endl;
+        return 1;
+    }
+    cout << threads << " threads x " << records << " records" << endl;
+    benchLocked(dir, threads, records);
+    bool ok = benchRing("block", dir, threads, records, ActivityLog::BLOCK);
+    ok = benchRing("drop", dir, threads, records, ActivityLog::DROP) && ok;
+    string cleanup = string("rm -rf '") + dir + "'";
+    if (system(cleanup.c_str()) != 0) cerr << COLOR_YELLOW << "Could not remove " << dir << COLOR_RESET << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// backup-bench: how much an online backup holds up writers.
+//
+//   backup-bench [messages] [pages-per-step] [pause-ms]
+//                (defaults: 200000 messages and the server's own settings,
+//                OnlineBackup::STEP_PAGES and PAUSE_MS)
+//
+// Builds a scratch SqliteStore under /tmp with `messages` direct messages,
+// then has one writer append a message every millisecond under the store
+// lock, the way saveMessage() does: for two seconds with no backup, while
+// OnlineBackup copies the database, and for two more seconds with no
+// backup. Prints the writer's p50/p99/
+// max latency (lock wait plus insert) and the p99/max of the lock wait alone
+// for both phases, and the longest backup step. Exits non-zero if writers
+// waited on the backup longer than the budget in online_backup.h; the total
+// latency is for reference, since it mostly follows the disk's own fsyncs.
+
+#include "common.h"
+#include "online_backup.h"
+#include "sqlite_store.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const int USERS = 1000;
+
+static string userName(int i) { return "user" + to_string(i); }
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+static bool fill(SqliteStore& store, int messages) {
+    sqlite3 *db = store.handle();
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+    for (int u = 0; u < USERS; ++u) store.addUser(userName(u), "pw");
+    for (int i = 0; i < messages; ++i) {
+        string text = "backup benchmark message " + to_string(i) + " with some ordinary chat text in it";
+        if (store.appendDirect(userName(i % USERS), userName((i * 7 + 1) % USERS), text, 1000 + i) < 0) return false;
+        if (i % 50000 == 49999) sqlite3_exec(db, "COMMIT; BEGIN;", nullptr, nullptr, nullptr);
+    }
+    return sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+// Latencies of the writes in one phase, in milliseconds
+struct Writes {
+    vector<double> total;    // lock wait plus insert
+    vector<double> lockWait; // waiting for the store lock alone
+};
+
+// Append one message per millisecond until `stop`
+static Writes writeUntil(SqliteStore& store, shared_mutex& lock, const atomic<bool>& stop) {
+    Writes w;
+    for (int i = 0; !stop; ++i) {
+        auto t0 = chrono::steady_clock::now();
+        {
+            unique_lock<shared_mutex> guard(lock);
+            w.lockWait.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+            store.appendDirect(userName(i % USERS), userName((i + 1) % USERS), "written during the benchmark", 0);
+        }
+        w.total.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return w;
+}
+
+static Writes writeFor(SqliteStore& store, shared_mutex& lock, int seconds) {
+    atomic<bool> stop{false};
+    Writes w;
+    thread writer([&] { w = writeUntil(store, lock, stop); });
+    this_thread::sleep_for(chrono::seconds(seconds));
+    stop = true;
+    writer.join();
+    return w;
+}
+
+static double maxOf(const vector<double>& v) {
+    return v.empty() ? 0.0 : *max_element(v.begin(), v.end());
+}
+
+static void report(const char *phase, const Writes& w) {
+    printf("%-16s %7zu writes   p50 %6.2f   p99 %6.2f   max %7.2f ms   lock wait p99 %6.2f   max %7.2f ms\n",
+           phase, w.total.size(), percentile(w.total, 0.5), percentile(w.total, 0.99), maxOf(w.total),
+           percentile(w.lockWait, 0.99), maxOf(w.lockWait));
+}
+
+int main(int argc, char **argv) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200000;
+    int pagesPerStep = argc > 2 ? atoi(argv[2]) : OnlineBackup::STEP_PAGES;
+    int pauseMs = argc > 3 ? atoi(argv[3]) : OnlineBackup::PAUSE_MS;
+    if (messages < 1 || pagesPerStep < 1 || pauseMs < 0) {
+        cerr << "Usage: " << argv[0] << " [messages >= 1] [pages-per-step >= 1] [pause-ms >= 0]" << endl;
+        return 1;
+    }
+    char tmpl[] = "/tmp/backup-bench-XXXXXX";
+    const char *dir = mkdtemp(tmpl);
+    if (!dir) {
+        cerr << COLOR_RED << "Could not create a scratch directory" << COLOR_RESET << endl;
+        return 1;
+    }
+    int status = 0;
+    {
+        SqliteStore store(string(dir) + "/users.sqlite");
+        if (!store.open() || !fill(store, messages)) {
+            cerr << COLOR_RED << "Could not build the database in " << dir << COLOR_RESET << endl;
+            status = 1;
+        } else {
+            shared_mutex lock;
+            cout << messages << " messages, " << pagesPerStep << " pages per step, " << pauseMs << " ms pause" << endl;
+
+            Writes idle = writeFor(store, lock, 2);
+
+            OnlineBackup backup(pagesPerStep, pauseMs);
+            Writes busy;
+            atomic<bool> stop{false};
+            thread writer([&] { busy = writeUntil(store, lock, stop); });
+            auto t0 = chrono::steady_clock::now();
+            if (!backup.start({OnlineBackup::Source{"users.sqlite", store.handle(), &lock}}, string(dir) + "/backups")) {
+                cerr << COLOR_RED << "Could not start the backup: " << backup.status() << COLOR_RESET << endl;
+                status = 1;
+            }
+            while (backup.running()) this_thread::sleep_for(chrono::milliseconds(20));
+            double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            stop = true;
+            writer.join();
+            Writes after = writeFor(store, lock, 2);
+            idle.total.insert(idle.total.end(), after.total.begin(), after.total.end());
+            idle.lockWait.insert(idle.lockWait.end(), after.lockWait.begin(), after.lockWait.end());
+
+            report("no backup", idle);
+            report("during backup", busy);
+            cout << "backup took " << secs << " s: " << backup.status() << endl;
+
+            double p99 = percentile(busy.lockWait, 0.99), worst = maxOf(busy.lockWait);
+            printf("lock wait during backup: p99 %.2f ms (budget %.1f), max %.2f ms (budget %.1f)\n",
+                   p99, OnlineBackup::LOCK_WAIT_P99_BUDGET_MS, worst, OnlineBackup::LOCK_WAIT_MAX_BUDGET_MS);
+            if (p99 > OnlineBackup::LOCK_WAIT_P99_BUDGET_MS || worst > OnlineBackup::LOCK_WAIT_MAX_BUDGET_MS) {
+                cerr << COLOR_RED << "Writers waited on the backup longer than its budget allows" << COLOR_RESET << endl;
+                status = 1;
+            }
+        }
+    }
+    string cleanup = string("rm -rf '") + dir + "'";
+    if (system(cleanup.c_str()) != 0) cerr << COLOR_YELLOW << "Could not remove " << dir << COLOR_RESET << endl;
+    return status;
+}
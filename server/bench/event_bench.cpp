@@ -0,0 +1,201 @@
+// event-bench: direct message throughput to a session while other users
+// type at it.
+//
+//   event-bench [messages] [conversations] [events/s]
+//               (defaults: 200000 messages, 200 conversations, 5 events/s each)
+//
+// One Outbox over a socketpair stands in for the recipient's session and a
+// reader thread drains the other end. The sender writes `messages` direct
+// messages with sendNow(), as onDirectMessage() does, in three modes:
+//   quiet       nothing else going on
+//   coalesced   `conversations` other users each send a typing event
+//               `events/s` times a second (a keystroke rate), through an
+//               EventCoalescer with the server's 1 s window
+//   raw         the same events straight onto the event lane
+// Events come from one thread that sleeps until each is due, as separate
+// clients would send them, so the runs compare lane overhead rather than
+// CPU taken by a spinning producer. Each mode runs three times, interleaved,
+// and the best run counts. Prints messages per second against quiet, the
+// p99 of a sendNow() call (which includes waiting for writeMutex while an
+// event is being written), and what happened to the events. Exits non-zero
+// if a mode with events is more than MAX_SLOWDOWN slower than quiet.
+
+#include "common.h"
+#include "event_coalescer.h"
+#include "outbox.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Same window as TYPING_WINDOW_MS in server.cpp
+static const long long TYPING_WINDOW_MS = 1000;
+// Largest throughput loss typing may cause before the bench fails
+static const double MAX_SLOWDOWN = 0.10;
+static const int ROUNDS = 3;
+
+enum Mode { QUIET, COALESCED, RAW, MODE_COUNT };
+static const char *MODE_NAMES[MODE_COUNT] = {"quiet", "coalesced", "raw"};
+
+static long long steadyMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+struct Counts {
+    atomic<unsigned long long> attempts{0}, absorbed{0}, queued{0}, coalesced{0}, dropped{0};
+    atomic<unsigned long long> textFrames{0}, eventFrames{0};
+};
+
+struct Result {
+    double msgPerSec = 0;
+    double sendP99Us = 0;
+    unsigned long long attempts = 0, absorbed = 0, queued = 0, coalesced = 0, dropped = 0, read = 0;
+};
+
+// Read whole frames off `fd` until it closes, counting them by type
+static void readFrames(int fd, Counts& c) {
+    Message m;
+    size_t have = 0;
+    for (;;) {
+        ssize_t n = read(fd, reinterpret_cast<char*>(&m) + have, sizeof(m) - have);
+        if (n <= 0) return;
+        have += static_cast<size_t>(n);
+        if (have < sizeof(m)) continue;
+        have = 0;
+        if (m.type == MSG_EVENT) ++c.eventFrames;
+        else ++c.textFrames;
+    }
+}
+
+// Send one typing event per conversation every 1/rate seconds, spread
+// evenly, until `stop`
+static void type(int conversations, double rate, Outbox& out, EventCoalescer *window,
+                 const atomic<bool>& stop, Counts& c) {
+    vector<Frame> frames;
+    vector<uint64_t> keys;
+    for (int i = 0; i < conversations; ++i) {
+        string about = "user" + to_string(i);
+        frames.push_back(makeFrame(MSG_EVENT, about, "typing @bob"));
+        keys.push_back(hash<string>()(about + "\ntyping @bob"));
+    }
+    auto gap = chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / (rate * conversations)));
+    auto due = chrono::steady_clock::now();
+    for (size_t i = 0; !stop; i = (i + 1) % frames.size()) {
+        due += gap;
+        this_thread::sleep_until(due);
+        ++c.attempts;
+        if (window && !window->admit(keys[i], steadyMillis())) {
+            ++c.absorbed;
+            continue;
+        }
+        switch (out.pushEvent(keys[i], frames[i])) {
+        case Outbox::EVENT_QUEUED: ++c.queued; break;
+        case Outbox::EVENT_COALESCED: ++c.coalesced; break;
+        case Outbox::EVENT_DROPPED: ++c.dropped; break;
+        }
+    }
+}
+
+static bool run(Mode mode, int messages, int conversations, double rate, Result& r) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        cerr << COLOR_RED << "Could not open a socket pair" << COLOR_RESET << endl;
+        return false;
+    }
+    Outbox out(sv[0], 8192);
+    out.start();
+    Counts c;
+    thread reader(readFrames, sv[1], ref(c));
+    EventCoalescer window(TYPING_WINDOW_MS);
+    atomic<bool> stop{false};
+    thread typist;
+    if (mode != QUIET) typist = thread(type, conversations, rate, ref(out), mode == RAW ? nullptr : &window, cref(stop), ref(c));
+
+    Frame dm = makeFrame(MSG_TEXT, "alice", "a direct message of ordinary length for the benchmark");
+    vector<double> sendUs;
+    sendUs.reserve(messages);
+    auto t0 = chrono::steady_clock::now();
+    int sent = 0;
+    while (sent < messages) {
+        auto s0 = chrono::steady_clock::now();
+        if (!out.sendNow(dm.get(), sizeof(Message))) break;
+        sendUs.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count());
+        ++sent;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    stop = true;
+    if (typist.joinable()) typist.join();
+    out.close();
+    ::close(sv[0]);
+    reader.join();
+    ::close(sv[1]);
+
+    r.msgPerSec = sent / secs;
+    r.sendP99Us = percentile(sendUs, 0.99);
+    r.attempts = c.attempts;
+    r.absorbed = c.absorbed;
+    r.queued = c.queued;
+    r.coalesced = c.coalesced;
+    r.dropped = c.dropped;
+    r.read = c.eventFrames;
+    return sent == messages;
+}
+
+int main(int argc, char **argv) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200000;
+    int conversations = argc > 2 ? atoi(argv[2]) : 200;
+    double rate = argc > 3 ? atof(argv[3]) : 5.0;
+    if (messages < 1 || conversations < 1 || rate <= 0) {
+        cerr << "Usage: " << argv[0] << " [messages >= 1] [conversations >= 1] [events/s > 0]" << endl;
+        return 1;
+    }
+    cout << messages << " messages; " << conversations << " conversations typing " << rate << " events/s each ("
+         << conversations * rate << " events/s)" << endl;
+
+    Result best[MODE_COUNT];
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int m = 0; m < MODE_COUNT; ++m) {
+            Result r;
+            if (!run(static_cast<Mode>(m), messages, conversations, rate, r)) {
+                cerr << COLOR_RED << "The session failed during the " << MODE_NAMES[m] << " run" << COLOR_RESET << endl;
+                return 1;
+            }
+            if (r.msgPerSec > best[m].msgPerSec) best[m] = r;
+        }
+    }
+
+    bool ok = true;
+    for (int m = 0; m < MODE_COUNT; ++m) {
+        const Result &r = best[m];
+        double relative = r.msgPerSec / best[QUIET].msgPerSec;
+        printf("%-10s %8.0f msg/s (%5.1f%% of quiet)  sendNow p99 %6.1f us  events: %6llu sent %6llu absorbed "
+               "%6llu queued %6llu coalesced %6llu dropped %6llu read\n",
+               MODE_NAMES[m], r.msgPerSec, 100 * relative, r.sendP99Us, r.attempts, r.absorbed, r.queued,
+               r.coalesced, r.dropped, r.read);
+        if (relative < 1.0 - MAX_SLOWDOWN) ok = false;
+    }
+    if (!ok) {
+        cerr << COLOR_RED << "Typing cost direct messages more than " << MAX_SLOWDOWN * 100 << "% of their throughput"
+             << COLOR_RESET << endl;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+// fanout-bench: group fan-out time, inline versus the work-stealing pool.
+//
+//   fanout-bench [workers] [rounds]      (defaults: 3 workers, 200 rounds)
+//
+// For each group size, one frame is pushed to every member's Outbox, the
+// way pushToSessions() does, once inline and once through a FanoutPool with
+// `workers` threads and the cutover pinned to 1 so every run is split. The
+// members' sockets are socketpairs drained by one reader thread. Prints the
+// p50/p99 time of a forEach() call in microseconds, the smallest size at
+// which the pool's p50 beat inline, and the cutover an adaptive pool learns
+// from the same runs. Only a host with more cores than workers says anything
+// about production: on one core the server starts no workers at all.
+
+#include "common.h"
+#include "fanout_pool.h"
+#include "outbox.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+static const size_t SIZES[] = {16, 64, 256, 512, 1024, 2048, 4096};
+
+struct Group {
+    vector<int> peers; // reader ends
+    vector<unique_ptr<Outbox>> outboxes;
+    vector<Outbox*> targets;
+    atomic<bool> done{false};
+    thread reader;
+
+    bool open(size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return false;
+            peers.push_back(sv[1]);
+            outboxes.emplace_back(new Outbox(sv[0], 1 << 20));
+            outboxes.back()->start();
+            targets.push_back(outboxes.back().get());
+        }
+        reader = thread([this] { drainPeers(); });
+        return true;
+    }
+
+    void drainPeers() {
+        vector<pollfd> fds;
+        for (int fd : peers) fds.push_back(pollfd{fd, POLLIN, 0});
+        vector<char> buf(1 << 16);
+        while (!done) {
+            if (poll(fds.data(), fds.size(), 20) <= 0) continue;
+            for (auto &p : fds) {
+                if (p.revents & POLLIN) {
+                    if (read(p.fd, buf.data(), buf.size()) <= 0) p.fd = -1;
+                }
+            }
+        }
+    }
+
+    void close() {
+        for (auto &o : outboxes) o->close();
+        done = true;
+        if (reader.joinable()) reader.join();
+        for (auto &o : outboxes) ::close(o->socket());
+        for (int fd : peers) ::close(fd);
+    }
+};
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+// Time `rounds` fan-outs of one frame to every member, in microseconds
+static vector<double> timeRounds(FanoutPool& pool, Group& g, const Frame& frame, int rounds) {
+    vector<double> us;
+    us.reserve(rounds);
+    for (int r = 0; r < rounds; ++r) {
+        auto t0 = chrono::steady_clock::now();
+        pool.forEach(g.targets.size(), [&g, &frame](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) g.targets[i]->push(frame);
+        });
+        us.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - t0).count());
+        // let the reader catch up so every round starts with empty queues
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+    return us;
+}
+
+int main(int argc, char **argv) {
+    int workers = argc > 1 ? atoi(argv[1]) : 3;
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+    if (workers < 1 || rounds < 1) {
+        cerr << "Usage: " << argv[0] << " [workers >= 1] [rounds >= 1]" << endl;
+        return 1;
+    }
+    Frame frame = makeFrame(MSG_GROUP_TEXT, "bench", "alice: fan-out benchmark message");
+
+    FanoutPool serial;
+    serial.start(0);
+    FanoutPool pool;
+    pool.start(workers);
+    pool.setThreshold(1);
+    FanoutPool adaptive;
+    adaptive.start(workers);
+
+    unsigned cores = thread::hardware_concurrency();
+    cout << "cores: " << cores << ", pool workers: " << workers << ", rounds: " << rounds << endl;
+    if (cores <= static_cast<unsigned>(workers)) {
+        cout << "fewer cores than workers + 1: the workers share the caller's cores, so the pool can only lose here" << endl;
+    }
+    printf("%8s %22s %22s\n", "members", "inline p50/p99 us", "pool p50/p99 us");
+    size_t crossover = 0;
+    for (size_t n : SIZES) {
+        Group g;
+        if (!g.open(n)) {
+            cerr << COLOR_RED << "Could not open " << n << " socket pairs" << COLOR_RESET << endl;
+            g.close();
+            return 1;
+        }
+        vector<double> a = timeRounds(serial, g, frame, rounds);
+        vector<double> b = timeRounds(pool, g, frame, rounds);
+        timeRounds(adaptive, g, frame, rounds);
+        g.close();
+        double a50 = percentile(a, 0.5), b50 = percentile(b, 0.5);
+        printf("%8zu %10.1f / %9.1f %10.1f / %9.1f\n", n, a50, percentile(a, 0.99), b50, percentile(b, 0.99));
+        if (!crossover && b50 < a50) crossover = n;
+    }
+    if (crossover) cout << "pool faster from " << crossover << " members" << endl;
+    else cout << "pool never faster than inline on this machine" << endl;
+    FanoutPool::Stats st = adaptive.stats();
+    size_t cutover = adaptive.threshold();
+    if (cutover == numeric_limits<size_t>::max()) printf("adaptive cutover: never split");
+    else printf("adaptive cutover: %zu members", cutover);
+    printf(" (per item %.0f ns, overhead %.0f us, %llu inline / %llu split runs)\n",
+           st.perItemNs, st.overheadNs / 1000, st.inlineRuns, st.parallelRuns);
+    return 0;
+}
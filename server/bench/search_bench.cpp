@@ -0,0 +1,133 @@
+// search-bench: latency of scoped full-text search on a synthetic corpus.
+//
+//   search-bench [messages] [queries]      (defaults: 200000 messages, 50 queries)
+//
+// Builds a scratch SqliteStore under /tmp with `messages` direct and group
+// messages among one user per MESSAGES_PER_USER messages (at least 1000) and
+// a tenth as many groups, so a bigger corpus means more users rather than
+// longer histories. Message words are drawn from a skewed vocabulary, so
+// "w0" is in most messages and "w3999" in very few.
+// Then, for terms of falling frequency, it runs `queries` searches
+// (SEARCH_PAGE + 1 hits, as the server asks for) as different users and
+// prints the p50/p99 latency in milliseconds.
+
+#include "common.h"
+#include "sqlite_store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const int MESSAGES_PER_USER = 1000;
+static const int MIN_USERS = 1000;
+static const int MEMBERS_PER_GROUP = 50;
+static const int VOCABULARY = 4000;
+static const int WORDS_PER_MESSAGE = 8;
+static const int SEARCH_PAGE = 20;
+
+static int users = MIN_USERS;
+static int groups = MIN_USERS / 10;
+
+static string userName(int i) { return "user" + to_string(i); }
+static string groupName(int i) { return "group" + to_string(i); }
+
+// Word index with frequency falling as 1/(rank+1)
+static int skewedWord(mt19937& rng) {
+    uniform_real_distribution<double> u(0.0, 1.0);
+    return min(VOCABULARY - 1, static_cast<int>(pow(VOCABULARY + 1.0, u(rng))) - 1);
+}
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+static bool fill(SqliteStore& store, int messages, mt19937& rng) {
+    sqlite3 *db = store.handle();
+    // one transaction per batch; a commit per message would measure fsync
+    sqlite3_exec(db, "PRAGMA synchronous=OFF;", nullptr, nullptr, nullptr);
+    sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr);
+    for (int u = 0; u < users; ++u) store.addUser(userName(u), "pw");
+    for (int g = 0; g < groups; ++g) {
+        store.createGroup(groupName(g), userName(g));
+        for (int k = 0; k < MEMBERS_PER_GROUP; ++k) store.addGroupMember(groupName(g), userName((g * 37 + k * 11) % users));
+    }
+    uniform_int_distribution<int> anyUser(0, users - 1);
+    uniform_int_distribution<int> anyGroup(0, groups - 1);
+    for (int i = 0; i < messages; ++i) {
+        string text;
+        for (int w = 0; w < WORDS_PER_MESSAGE; ++w) {
+            if (w) text += ' ';
+            text += 'w' + to_string(skewedWord(rng));
+        }
+        long long id = i % 4 == 3
+            ? store.appendGroup(groupName(anyGroup(rng)), userName(anyUser(rng)), text, 1000 + i)
+            : store.appendDirect(userName(anyUser(rng)), userName(anyUser(rng)), text, 1000 + i);
+        if (id < 0) return false;
+        if (i % 50000 == 49999) {
+            sqlite3_exec(db, "COMMIT; BEGIN;", nullptr, nullptr, nullptr);
+        }
+    }
+    return sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK;
+}
+
+int main(int argc, char **argv) {
+    int messages = argc > 1 ? atoi(argv[1]) : 200000;
+    int queries = argc > 2 ? atoi(argv[2]) : 50;
+    if (messages < 1 || queries < 1) {
+        cerr << "Usage: " << argv[0] << " [messages >= 1] [queries >= 1]" << endl;
+        return 1;
+    }
+    users = max(MIN_USERS, messages / MESSAGES_PER_USER);
+    groups = users / 10;
+    char tmpl[] = "/tmp/search-bench-XXXXXX";
+    const char *dir = mkdtemp(tmpl);
+    if (!dir) {
+        cerr << COLOR_RED << "Could not create a scratch directory" << COLOR_RESET << endl;
+        return 1;
+    }
+    string path = string(dir) + "/users.sqlite";
+    mt19937 rng(42);
+    int status = 0;
+    {
+        SqliteStore store(path);
+        auto t0 = chrono::steady_clock::now();
+        if (!store.open() || !fill(store, messages, rng)) {
+            cerr << COLOR_RED << "Could not build the corpus in " << dir << COLOR_RESET << endl;
+            status = 1;
+        } else {
+            double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            cout << messages << " messages among " << users << " users and " << groups << " groups indexed in " << secs
+                 << " s" << endl;
+            printf("%8s %10s %14s %14s\n", "term", "hits/user", "p50 ms", "p99 ms");
+            const int terms[] = {0, 3, 30, 300, 3000};
+            uniform_int_distribution<int> anyUser(0, users - 1);
+            for (int t : terms) {
+                string term = "w" + to_string(t);
+                vector<double> ms;
+                size_t hits = 0;
+                for (int q = 0; q < queries; ++q) {
+                    vector<SearchHit> out;
+                    auto q0 = chrono::steady_clock::now();
+                    store.search(userName(anyUser(rng)), term, SEARCH_PAGE + 1, 0, out);
+                    ms.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - q0).count());
+                    hits += out.size();
+                }
+                printf("%8s %10.1f %14.2f %14.2f\n", term.c_str(), static_cast<double>(hits) / queries,
+                       percentile(ms, 0.5), percentile(ms, 0.99));
+            }
+        }
+    }
+    string cleanup = string("rm -rf '") + dir + "'";
+    if (system(cleanup.c_str()) != 0) cerr << COLOR_YELLOW << "Could not remove " << dir << COLOR_RESET << endl;
+    return status;
+}
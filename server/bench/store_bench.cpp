@@ -0,0 +1,132 @@
+// store-bench: sequential writes and history pages on each MessageStore
+// backend.
+//
+//   store-bench [messages] [conversations] [pages]
+//               (defaults: 20000 messages, 100 conversations, 500 pages)
+//
+// For SqliteStore and LogStore in turn, in a scratch directory under /tmp:
+//   write    append `messages` direct messages one call at a time, round
+//            robin over `conversations` pairs of users, as saveMessage()
+//            does for each incoming message
+//   latest   read the newest HISTORY_PAGE messages of a random conversation
+//   older    read HISTORY_PAGE + 1 messages below a random id of a random
+//            conversation, as an older history page asks for
+// Prints writes per second and the p50/p99 of each operation. Each backend
+// keeps its own durability settings: every SqliteStore append is a committed
+// transaction, a LogStore append is one write(2) to the active segment.
+
+#include "common.h"
+#include "log_store.h"
+#include "sqlite_store.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Same default page as getConversationHistory() in server.cpp
+static const int HISTORY_PAGE = 100;
+
+static string userName(int i) { return "user" + to_string(i); }
+
+static double percentile(vector<double> v, double p) {
+    if (v.empty()) return 0;
+    sort(v.begin(), v.end());
+    return v[min(v.size() - 1, static_cast<size_t>(p * v.size()))];
+}
+
+static void report(const char *store, const char *op, const vector<double>& us, double perSec) {
+    printf("%-8s %-7s p50 %8.1f us   p99 %8.1f us", store, op, percentile(us, 0.5), percentile(us, 0.99));
+    if (perSec > 0) printf("   %9.0f /s", perSec);
+    printf("\n");
+}
+
+static bool run(MessageStore& store, int messages, int conversations, int pages) {
+    if (!store.open()) {
+        cerr << COLOR_RED << "Could not open the " << store.name() << " store" << COLOR_RESET << endl;
+        return false;
+    }
+    for (int u = 0; u < 2 * conversations; ++u) {
+        if (!store.addUser(userName(u), "pw")) return false;
+    }
+
+    // conversation c is between user 2c and user 2c+1; ids[c] are its messages
+    vector<vector<long long>> ids(conversations);
+    vector<double> writeUs;
+    writeUs.reserve(messages);
+    string text = "a direct message of ordinary length for the benchmark";
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0; i < messages; ++i) {
+        int c = i % conversations;
+        // the two users take turns writing
+        int from = 2 * c + (i / conversations) % 2;
+        auto w0 = chrono::steady_clock::now();
+        long long id = store.appendDirect(userName(from), userName(from ^ 1), text, 1000 + i);
+        writeUs.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - w0).count());
+        if (id < 0) return false;
+        ids[c].push_back(id);
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    report(store.name(), "write", writeUs, messages / secs);
+
+    mt19937 rng(42);
+    uniform_int_distribution<int> anyConversation(0, conversations - 1);
+    vector<double> latestUs, olderUs;
+    size_t rows = 0;
+    HistoryVisitor count = [&rows](const MessageView&) { ++rows; };
+    for (int p = 0; p < pages; ++p) {
+        int c = anyConversation(rng);
+        auto r0 = chrono::steady_clock::now();
+        if (!store.scanDirectHistory(userName(2 * c), userName(2 * c + 1), HISTORY_PAGE, 0, count)) return false;
+        latestUs.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - r0).count());
+
+        c = anyConversation(rng);
+        long long before = ids[c][uniform_int_distribution<size_t>(0, ids[c].size() - 1)(rng)];
+        r0 = chrono::steady_clock::now();
+        if (!store.scanDirectHistory(userName(2 * c), userName(2 * c + 1), HISTORY_PAGE + 1, before, count)) return false;
+        olderUs.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - r0).count());
+    }
+    report(store.name(), "latest", latestUs, 0);
+    report(store.name(), "older", olderUs, 0);
+    store.close();
+    return rows > 0;
+}
+
+int main(int argc, char **argv) {
+    int messages = argc > 1 ? atoi(argv[1]) : 20000;
+    int conversations = argc > 2 ? atoi(argv[2]) : 100;
+    int pages = argc > 3 ? atoi(argv[3]) : 500;
+    if (messages < 1 || conversations < 1 || conversations > messages || pages < 1) {
+        cerr << "Usage: " << argv[0] << " [messages >= 1] [conversations 1..messages] [pages >= 1]" << endl;
+        return 1;
+    }
+    char tmpl[] = "/tmp/store-bench-XXXXXX";
+    const char *dir = mkdtemp(tmpl);
+    if (!dir) {
+        cerr << COLOR_RED << "Could not create a scratch directory" << COLOR_RESET << endl;
+        return 1;
+    }
+    cout << messages << " messages over " << conversations << " conversations, " << pages << " pages of "
+         << HISTORY_PAGE << endl;
+    int status = 0;
+    unique_ptr<MessageStore> stores[] = {
+        unique_ptr<MessageStore>(new SqliteStore(string(dir) + "/users.sqlite")),
+        unique_ptr<MessageStore>(new LogStore(string(dir) + "/log")),
+    };
+    for (auto &store : stores) {
+        if (!run(*store, messages, conversations, pages)) {
+            cerr << COLOR_RED << "The " << store->name() << " run failed" << COLOR_RESET << endl;
+            status = 1;
+        }
+    }
+    string cleanup = string("rm -rf '") + dir + "'";
+    if (system(cleanup.c_str()) != 0) cerr << COLOR_YELLOW << "Could not remove " << dir << COLOR_RESET << endl;
+    return status;
+}
@@ -0,0 +1,125 @@
+#ifndef ACTIVITY_LOG_H
+#define ACTIVITY_LOG_H
+
+#include "event_log_format.h"
+#include "log_archiver.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Asynchronous writer of the binary activity log (event_log_format.h).
+//
+// Session threads hand records to a bounded multi-producer, single-consumer
+// ring: a producer claims a slot with one compare-exchange, copies the
+// 32-byte record (and any short text) into it and publishes it, with no lock,
+// no allocation and no formatting. A background thread takes records off in
+// batches, puts an EV_NAME record in front of the first use of each id in
+// the file (looking the name up through the resolver), and writes and
+// flushes each batch with one call. When the ring is full a record is either
+// dropped (counted, and noted in the log once there is room) or the producer
+// waits for space.
+//
+// With rotation set, the writer also starts a new file once the current one
+// reaches a size or an age: it renames the file with a time stamp and opens
+// a fresh one between batches, and LogArchiver compresses and prunes the old
+// ones on a thread of its own, so neither the producers nor the writer wait
+// on compression.
+class ActivityLog {
+public:
+    enum Overflow { DROP, BLOCK };
+    // Name of an id, looked up on the writer thread
+    typedef std::function<std::string(NameSpace, uint32_t)> NameResolver;
+
+    ActivityLog() = default;
+    ~ActivityLog() { close(); }
+    ActivityLog(const ActivityLog&) = delete;
+    ActivityLog& operator=(const ActivityLog&) = delete;
+
+    // Ring size (rounded up to a power of two) and overflow policy; only
+    // before open()
+    void configure(size_t slots, Overflow policy);
+    void setResolver(NameResolver resolver) { resolve = std::move(resolver); }
+    // Rotate at `maxBytes` or `maxSeconds` (0: no limit), keeping `keep`
+    // compressed old files (0: all); only before open()
+    void setRotation(unsigned long long maxBytes, long long maxSeconds, int keep);
+
+    // Open `path` for appending (writing the header if it is new) and start
+    // the writer thread
+    bool open(const std::string& path);
+    bool isOpen() const { return file != nullptr; }
+    // Write out everything queued, then stop the writer and close the file
+    void close();
+
+    // Queue a record; `micros` and `textLen` are filled in here, and text
+    // longer than a slot holds is cut short
+    void write(EventRecord rec, std::string_view text = std::string_view());
+    // Queue an EV_NOTE
+    void note(std::string_view text);
+
+    unsigned long long writtenCount() const { return written.load(std::memory_order_relaxed); }
+    unsigned long long droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+    unsigned long long bytesWritten() const { return bytes.load(std::memory_order_relaxed); }
+    unsigned long long rotationCount() const { return rotations.load(std::memory_order_relaxed); }
+    unsigned long long archivedCount() const { return archiver.archivedCount(); }
+
+private:
+    static const size_t TEXT_MAX = 224;
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        EventRecord rec;
+        char text[TEXT_MAX];
+    };
+
+    bool tryPush(const EventRecord& rec, std::string_view text);
+    void run();
+    size_t drainBatch(std::string& out);
+    void append(std::string& out, const EventRecord& rec, const char *text);
+    void nameOnce(std::string& out, NameSpace space, uint32_t id, int64_t micros);
+    std::FILE *openFile();
+    bool rotationDue(int64_t now) const;
+    void rotate(int64_t now);
+
+    size_t capacity = 8192;
+    Overflow overflow = DROP;
+    std::unique_ptr<Slot[]> ring;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to claim (producers)
+    alignas(64) size_t head = 0;             // next slot to read (writer only)
+
+    std::string path;
+    std::FILE *file = nullptr;
+    unsigned long long fileBytes = 0; // size of the current file
+    int64_t fileStarted = 0;          // time of its first record, microseconds
+    std::thread writer;
+    std::atomic<bool> accepting{false}; // open and not closing
+    std::atomic<bool> stopping{false};
+    std::atomic<bool> sleeping{false};
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+
+    std::atomic<unsigned long long> written{0};
+    std::atomic<unsigned long long> dropped{0};
+    std::atomic<unsigned long long> bytes{0};
+    std::atomic<unsigned long long> rotations{0};
+    unsigned long long droppedReported = 0;
+
+    // writer side: ids already named in the current file, per NameSpace
+    NameResolver resolve;
+    std::vector<bool> named[NS_COUNT];
+
+    unsigned long long rotateBytes = 0;
+    int64_t rotateMicros = 0;
+    int keepRotated = 0;
+    LogArchiver archiver;
+};
+
+#endif // ACTIVITY_LOG_H
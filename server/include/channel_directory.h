@@ -0,0 +1,197 @@
+#ifndef CHANNEL_DIRECTORY_H
+#define CHANNEL_DIRECTORY_H
+
+#include "name_table.h"
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+typedef NameId ChannelId;
+
+// In-memory copy of the `channels` and `channel_subscribers` tables.
+//
+// Subscribers are kept per channel as a sorted array of user ids with their
+// cursors alongside, 12 bytes a subscriber: 100k subscribers are about 1.2 MB
+// and a membership test is a binary search. There is no per-channel online
+// set (keeping one would cost a pass over every channel a user follows on
+// each login); instead onlineSubscribers() intersects the subscriber array
+// with the session table, walking whichever of the two is smaller.
+class ChannelDirectory {
+public:
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        channels.clear();
+        subscribedTo.clear();
+    }
+
+    void addChannel(ChannelId channel, UserId owner, long long newest) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        Channel &c = channels[channel];
+        c.owner = owner;
+        c.newest = std::max(c.newest, newest);
+    }
+
+    bool exists(ChannelId channel) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return channels.count(channel) > 0;
+    }
+
+    UserId ownerOf(ChannelId channel) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        return it == channels.end() ? 0 : it->second.owner;
+    }
+
+    // Id of the channel's latest post
+    long long newest(ChannelId channel) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        return it == channels.end() ? 0 : it->second.newest;
+    }
+
+    void onPost(ChannelId channel, long long id) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it != channels.end()) it->second.newest = std::max(it->second.newest, id);
+    }
+
+    // Bulk load: append subscriber rows in any order, then sort once with
+    // finishLoad() (inserting 100k rows one by one in order is quadratic)
+    void loadSubscriber(ChannelId channel, UserId user, long long cursor) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return;
+        it->second.subscribers.push_back(user);
+        it->second.cursors.push_back(cursor);
+        subscribedTo[user].push_back(channel);
+    }
+
+    void finishLoad() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        for (auto &entry : channels) {
+            Channel &c = entry.second;
+            std::vector<std::pair<UserId, long long>> rows(c.subscribers.size());
+            for (size_t i = 0; i < rows.size(); ++i) rows[i] = std::make_pair(c.subscribers[i], c.cursors[i]);
+            std::sort(rows.begin(), rows.end());
+            for (size_t i = 0; i < rows.size(); ++i) {
+                c.subscribers[i] = rows[i].first;
+                c.cursors[i] = rows[i].second;
+            }
+        }
+    }
+
+    // Add or re-add a subscriber; false if the channel does not exist
+    bool subscribe(ChannelId channel, UserId user, long long cursor) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return false;
+        Channel &c = it->second;
+        auto pos = std::lower_bound(c.subscribers.begin(), c.subscribers.end(), user);
+        size_t i = pos - c.subscribers.begin();
+        if (pos != c.subscribers.end() && *pos == user) {
+            c.cursors[i] = cursor;
+            return true;
+        }
+        c.subscribers.insert(pos, user);
+        c.cursors.insert(c.cursors.begin() + i, cursor);
+        subscribedTo[user].push_back(channel);
+        return true;
+    }
+
+    void unsubscribe(ChannelId channel, UserId user) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return;
+        Channel &c = it->second;
+        auto pos = std::lower_bound(c.subscribers.begin(), c.subscribers.end(), user);
+        if (pos == c.subscribers.end() || *pos != user) return;
+        c.cursors.erase(c.cursors.begin() + (pos - c.subscribers.begin()));
+        c.subscribers.erase(pos);
+        auto sit = subscribedTo.find(user);
+        if (sit == subscribedTo.end()) return;
+        auto &list = sit->second;
+        list.erase(std::remove(list.begin(), list.end(), channel), list.end());
+        if (list.empty()) subscribedTo.erase(sit);
+    }
+
+    bool isSubscribed(ChannelId channel, UserId user) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        return it != channels.end() &&
+               std::binary_search(it->second.subscribers.begin(), it->second.subscribers.end(), user);
+    }
+
+    size_t subscriberCount(ChannelId channel) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        return it == channels.end() ? 0 : it->second.subscribers.size();
+    }
+
+    // Subscriber's cursor, or -1 if not subscribed
+    long long cursorOf(ChannelId channel, UserId user) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return -1;
+        const Channel &c = it->second;
+        auto pos = std::lower_bound(c.subscribers.begin(), c.subscribers.end(), user);
+        if (pos == c.subscribers.end() || *pos != user) return -1;
+        return c.cursors[pos - c.subscribers.begin()];
+    }
+
+    // Move the cursor forward to `cursor`; returns the resulting cursor, or
+    // -1 if not subscribed
+    long long advance(ChannelId channel, UserId user, long long cursor) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return -1;
+        Channel &c = it->second;
+        auto pos = std::lower_bound(c.subscribers.begin(), c.subscribers.end(), user);
+        if (pos == c.subscribers.end() || *pos != user) return -1;
+        long long &cur = c.cursors[pos - c.subscribers.begin()];
+        cur = std::max(cur, cursor);
+        return cur;
+    }
+
+    std::vector<ChannelId> channelsOf(UserId user) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = subscribedTo.find(user);
+        return it == subscribedTo.end() ? std::vector<ChannelId>() : it->second;
+    }
+
+    // Append the subscribers of `channel` that have an entry in `online`
+    // (any map keyed by UserId) to `out`
+    template <class Map>
+    void onlineSubscribers(ChannelId channel, const Map& online, std::vector<UserId>& out) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = channels.find(channel);
+        if (it == channels.end()) return;
+        const std::vector<UserId> &subs = it->second.subscribers;
+        if (online.size() < subs.size()) {
+            for (const auto &entry : online) {
+                if (std::binary_search(subs.begin(), subs.end(), entry.first)) out.push_back(entry.first);
+            }
+        } else {
+            for (UserId u : subs) {
+                if (online.count(u)) out.push_back(u);
+            }
+        }
+    }
+
+private:
+    struct Channel {
+        UserId owner = 0;
+        long long newest = 0;
+        std::vector<UserId> subscribers; // sorted
+        std::vector<long long> cursors;  // parallel to `subscribers`
+    };
+
+    mutable std::shared_mutex mtx;
+    std::unordered_map<ChannelId, Channel> channels;
+    std::unordered_map<UserId, std::vector<ChannelId>> subscribedTo;
+};
+
+#endif // CHANNEL_DIRECTORY_H
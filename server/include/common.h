@@ -34,7 +34,10 @@
 // Unfriend
 #define MSG_FRIEND_REMOVE 25
 
-// All users with friendship status relative to requester
+// All users with friendship status relative to requester.
+// Request content: "<prefix>\n<after>\n<limit>" (all optional). The response
+// lists users sorted by name; a final "next: <name>" line means more remain and
+// <name> should be sent as <after> to fetch the following page.
 #define MSG_ALL_USERS_STATUS_REQUEST 26
 #define MSG_ALL_USERS_STATUS_RESPONSE 27
 
@@ -42,6 +45,9 @@
 // Client sends a direct message request; server stores it and delivers to the recipient as MSG_TEXT
 #define MSG_DIRECT_MESSAGE 28
 // Client requests conversation history with a peer; server responds with newline-delimited lines
+// History requests may carry a message id in content to page back from; a
+// response that starts with "... (older: <id>)" has more before <id>. The
+// same applies to MSG_GROUP_HISTORY_REQUEST.
 #define MSG_HISTORY_REQUEST 29
 #define MSG_HISTORY_RESPONSE 30
 
@@ -61,6 +67,77 @@
 #define MSG_GROUP_MEMBERS_REQUEST 51
 #define MSG_GROUP_MEMBERS_RESPONSE 52
 
+// Server statistics (history cache hit ratio, memory use); text response
+#define MSG_STATS_REQUEST 60
+#define MSG_STATS_RESPONSE 61
+
+// Full-text search over the requester's chats. content: "<words>\n<offset>";
+// the response lists "[ts] @peer|#group sender: snippet" lines, best match
+// first, and ends with "next: <offset>" when more results remain
+#define MSG_SEARCH_REQUEST 62
+#define MSG_SEARCH_RESPONSE 63
+
+// Read positions. MSG_READ_ACK marks a conversation read up to its newest
+// message (content "@<peer>" or "#<group>", no response). At login the server
+// sends MSG_UNREAD_SUMMARY with one "<conv> <unread> <lastReadId>" line per
+// conversation that has unread messages
+#define MSG_READ_ACK 64
+#define MSG_UNREAD_SUMMARY 65
+
+// Session resume. After login the server sends MSG_SESSION_TOKEN (content:
+// an opaque token, re-sent before it expires); a reconnecting client may
+// send MSG_SESSION_RESUME with that token instead of MSG_LOGIN and gets the
+// usual MSG_AUTH_RESPONSE
+#define MSG_SESSION_TOKEN 66
+#define MSG_SESSION_RESUME 67
+
+// Online backup, admins only (server --admin USER). content: "start" or
+// "status"; the MSG_BACKUP_STATUS reply is a line of progress text
+#define MSG_BACKUP_REQUEST 68
+#define MSG_BACKUP_STATUS 69
+
+// Broadcast channels: only the owner posts, any user may subscribe.
+// CREATE / SUBSCRIBE / UNSUBSCRIBE carry the channel name as content and get
+// a MSG_AUTH_RESPONSE. POST: username = channel, content = body (owner only,
+// no response); subscribers online receive MSG_CHANNEL_TEXT with username =
+// channel and content "<id> <sender>: <body>". Each subscriber has a cursor,
+// advanced by MSG_READ_ACK with content "!<channel>". FETCH: username =
+// channel, content = an id to read after, or empty for the cursor; the
+// MSG_CHANNEL_FETCH_RESPONSE holds "<id> <history line>" lines, oldest
+// first, ending in "... (newer: <id>)" when more remain. LIST replies with
+// one "<channel> <cursor> <newest>" line per subscription.
+#define MSG_CHANNEL_CREATE 70
+#define MSG_CHANNEL_SUBSCRIBE 71
+#define MSG_CHANNEL_UNSUBSCRIBE 72
+#define MSG_CHANNEL_POST 73
+#define MSG_CHANNEL_TEXT 74
+#define MSG_CHANNEL_FETCH 75
+#define MSG_CHANNEL_FETCH_RESPONSE 76
+#define MSG_CHANNEL_LIST_REQUEST 77
+#define MSG_CHANNEL_LIST_RESPONSE 78
+
+// Ephemeral events: never stored, sent on a low-priority lane that may drop
+// them under load. A client sends MSG_EPHEMERAL with content "typing @<peer>"
+// or "typing #<group>"; repeats within a second are absorbed. Recipients get
+// MSG_EVENT with username = the user it is about and content
+// "<kind> <conv> [<id>]", conv as seen by the recipient: "typing @<sender>",
+// "typing #<group>", and from the server "read @<peer> <id>" (peer read up
+// to id) and "delivered @<peer> <id>" (your messages up to id reached them).
+#define MSG_EPHEMERAL 79
+#define MSG_EVENT 80
+
+// Load shedding. When the server is behind on live messages it may answer a
+// query or admin request with MSG_BUSY instead of its usual reply; content
+// "<request type> <retry after ms>". Nothing was done, the request may be
+// sent again later
+#define MSG_BUSY 81
+
+// Rate limiting. Each user has a budget of requests per second and a burst
+// per request class; a request over it is not carried out and is answered
+// with MSG_THROTTLED, content "<request type> <retry after ms>" (typing
+// events over it are dropped silently)
+#define MSG_THROTTLED 82
+
 // Color codes for terminal output
 #define COLOR_RESET   "\033[0m"
 #define COLOR_RED     "\033[31m"
@@ -0,0 +1,96 @@
+#ifndef DUMP_FORMAT_H
+#define DUMP_FORMAT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Bulk export format shared by messenger-dump and messenger-load.
+//
+// A dump is the 8-byte header "MDMP" + uint32 version, then blocks, then a
+// block with table 0. Each block holds up to DUMP_BLOCK_ROWS rows of one table
+// stored column by column and zlib-compressed:
+//
+//     uint8 table, uint32 rows, uint32 raw_len, uint32 packed_len, payload
+//
+// In the payload every column is a varint byte length followed by its values:
+// integers as zigzag varints of the difference from the previous row (ids
+// and timestamps are nearly sequential, so most take a byte or two), text as
+// a varint length and the bytes. Reading and writing keep one block in
+// memory, whatever the size of the dump.
+
+static const char DUMP_MAGIC[4] = {'M', 'D', 'M', 'P'};
+static const uint32_t DUMP_VERSION = 1;
+static const uint32_t DUMP_BLOCK_ROWS = 8192;
+
+struct DumpTable {
+    uint8_t id;
+    const char *name;
+    const char *columns; // comma separated, in dump order
+    const char *types;   // one letter per column: 'i' integer, 's' text
+};
+
+// Every table a dump carries, in load order
+extern const DumpTable DUMP_TABLES[];
+extern const size_t DUMP_TABLE_COUNT;
+const DumpTable *dumpTable(uint8_t id);
+
+class DumpWriter {
+public:
+    explicit DumpWriter(FILE *out) : out(out) {}
+
+    bool writeHeader();
+    // Start a table; flushes the previous table's rows
+    bool begin(const DumpTable& table);
+    void addInt(long long v);
+    void addText(const char *data, size_t len);
+    // Close the row; writes the block when full
+    bool endRow();
+    // Flush and write the end marker
+    bool finish();
+
+    uint64_t rowsWritten() const { return total; }
+
+private:
+    bool flush();
+
+    FILE *out;
+    const DumpTable *table = nullptr;
+    std::vector<std::string> cols;
+    std::vector<long long> prev;
+    size_t col = 0;
+    uint32_t rows = 0;
+    uint64_t total = 0;
+};
+
+class DumpReader {
+public:
+    explicit DumpReader(FILE *in) : in(in) {}
+
+    bool readHeader();
+    // Load the next block; false at the end marker or on error (see failed())
+    bool nextBlock();
+    const DumpTable& table() const { return *tbl; }
+    uint32_t blockRows() const { return rows; }
+
+    // Values of the current row, read in column order; each row must consume
+    // every column once
+    bool nextInt(long long& v);
+    bool nextText(std::string_view& v);
+
+    bool failed() const { return bad; }
+
+private:
+    FILE *in;
+    const DumpTable *tbl = nullptr;
+    uint32_t rows = 0;
+    std::string raw;
+    std::vector<size_t> pos, end; // cursor and end of each column in `raw`
+    std::vector<long long> prev;
+    size_t col = 0;
+    bool bad = false;
+};
+
+#endif // DUMP_FORMAT_H
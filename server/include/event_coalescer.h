@@ -0,0 +1,53 @@
+#ifndef EVENT_COALESCER_H
+#define EVENT_COALESCER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+// Drops repeats of an ephemeral event within a time window. A client sends
+// "typing" on every keystroke; only the first per (sender, conversation) in
+// each window is forwarded, the rest are absorbed here without touching any
+// session. Internally synchronized; stale entries are swept as the table
+// grows.
+class EventCoalescer {
+public:
+    explicit EventCoalescer(long long windowMs) : windowMs(windowMs) {}
+
+    // True if an event with `key` at `nowMs` should be forwarded
+    bool admit(uint64_t key, long long nowMs) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = last.find(key);
+        if (it != last.end() && nowMs - it->second < windowMs) {
+            ++absorbed;
+            return false;
+        }
+        if (it != last.end()) it->second = nowMs;
+        else last.emplace(key, nowMs);
+        if (last.size() > sweepAt) sweep(nowMs);
+        return true;
+    }
+
+    unsigned long long absorbedCount() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return absorbed;
+    }
+
+private:
+    void sweep(long long nowMs) {
+        for (auto it = last.begin(); it != last.end();) {
+            if (nowMs - it->second >= windowMs) it = last.erase(it);
+            else ++it;
+        }
+        sweepAt = std::max<size_t>(1024, last.size() * 2);
+    }
+
+    const long long windowMs;
+    mutable std::mutex mtx;
+    std::unordered_map<uint64_t, long long> last; // key -> ms of the last forwarded event
+    size_t sweepAt = 1024;
+    unsigned long long absorbed = 0;
+};
+
+#endif // EVENT_COALESCER_H
@@ -0,0 +1,66 @@
+#ifndef EVENT_LOG_FORMAT_H
+#define EVENT_LOG_FORMAT_H
+
+#include <cstdint>
+
+// Binary activity log shared by the server (ActivityLog) and messenger-log.
+//
+// A file is the 16-byte header "MSGEVLOG" + uint32 version + uint32 record
+// size, then records in host byte order: a 32-byte EventRecord, followed by
+// `textLen` bytes of text when the record carries any. Users, groups and
+// channels appear as the server's interned ids; before the first record of
+// a file that mentions an id comes an EV_NAME record with its name, so every
+// file decodes on its own. Nothing is formatted when a record is written;
+// messenger-log renders, filters and counts them offline.
+
+static const char EVLOG_MAGIC[8] = {'M', 'S', 'G', 'E', 'V', 'L', 'O', 'G'};
+static const uint32_t EVLOG_VERSION = 1;
+static const uint32_t EVLOG_HEADER_SIZE = 16;
+
+enum EventKind : uint16_t {
+    EV_NOTE = 1,    // text only: startup, maintenance, failures
+    EV_NAME = 2,    // opcode = NameSpace, target = id, text = the name
+    EV_CONNECT = 3, // target = IPv4 address (network order), value = port
+    EV_JOIN = 4,    // opcode = MSG_LOGIN or MSG_SESSION_RESUME, value = clients online
+    EV_LEAVE = 5,   // value = clients online
+    EV_REQUEST = 6, // a handled request; target, other and value by opcode
+    EV_INBOX = 7,   // offline messages delivered at login; value = count
+};
+
+enum NameSpace : uint16_t {
+    NS_USER = 0,
+    NS_GROUP = 1,
+    NS_CHANNEL = 2,
+    NS_COUNT = 3,
+};
+
+enum EventStatus : uint8_t {
+    EV_STATUS_NONE = 0,
+    EV_STATUS_OK = 1,
+    EV_STATUS_FAIL = 2,
+};
+
+struct EventRecord {
+    int64_t micros;   // wall clock, microseconds since the epoch
+    uint16_t kind;    // EventKind
+    uint16_t opcode;  // request opcode (EV_REQUEST, EV_JOIN) or NameSpace (EV_NAME)
+    uint8_t status;   // EventStatus
+    uint8_t reserved;
+    uint16_t textLen; // bytes of text after the record
+    uint32_t user;    // acting user
+    uint32_t target;  // user, group or channel the request is about (targetSpace)
+    uint32_t other;   // a second user (otherIsUser) or a count
+    uint32_t value;   // body length, count, ...
+};
+static_assert(sizeof(EventRecord) == 32, "EventRecord is written as is");
+
+// Name space of EventRecord::target for a request opcode
+NameSpace targetSpace(int opcode);
+// Whether EventRecord::other of a request holds a user id
+bool otherIsUser(int opcode);
+// "DIRECT_MESSAGE" for MSG_DIRECT_MESSAGE, and so on; nullptr if unknown
+const char *opcodeName(int opcode);
+// Inverse of opcodeName, -1 if unknown
+int opcodeByName(const char *name);
+
+#endif // EVENT_LOG_FORMAT_H
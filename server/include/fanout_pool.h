@@ -0,0 +1,95 @@
+#ifndef FANOUT_POOL_H
+#define FANOUT_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool for delivering one message to a very large recipient
+// list. forEach() splits [0, n) into shards, spreads them over the workers'
+// queues and helps run them on the calling thread until all are done, so it
+// returns only once every recipient was handled, like an inline loop would,
+// and messages from one sender keep their order at each recipient. Idle
+// workers steal shards from the front of busy workers' queues.
+//
+// Small lists are not worth the hand-off and run inline: below two shards'
+// worth always, and above that the cutover adapts:
+// the pool keeps a moving average of the per-item cost of inline runs and of
+// the fixed overhead of parallel runs, and goes parallel only when
+//   n * perItem * (1 - 1/threads) > overhead
+// i.e. when splitting saves more than it costs, where `threads` counts only
+// those that have a core to run on. With no spare cores there are no workers
+// and everything runs inline.
+class FanoutPool {
+public:
+    FanoutPool() {}
+    ~FanoutPool() { stop(); }
+
+    // Start `workers` threads besides the callers; -1 picks one per spare core
+    void start(int workers = -1);
+    void stop();
+
+    // Run body(begin, end) over [0, n), in parallel shards when it pays off
+    void forEach(size_t n, const std::function<void(size_t, size_t)>& body);
+
+    // Pin the cutover to `n` items (0 = adaptive)
+    void setThreshold(size_t n) { fixedThreshold = n; }
+    // Current cutover in items
+    size_t threshold() const;
+    size_t workerCount() const { return queues.size(); }
+
+    struct Stats {
+        unsigned long long inlineRuns = 0;
+        unsigned long long parallelRuns = 0;
+        unsigned long long steals = 0;
+        double perItemNs = 0;
+        double overheadNs = 0;
+    };
+    Stats stats() const;
+
+private:
+    struct Batch {
+        const std::function<void(size_t, size_t)> *body;
+        std::atomic<size_t> pending{0};
+        std::mutex doneMutex;
+        std::condition_variable done;
+    };
+    struct Task {
+        Batch *batch;
+        size_t begin, end;
+    };
+    struct Queue {
+        std::mutex mtx;
+        std::deque<Task> tasks;
+    };
+
+    bool popOwn(size_t self, Task& out);
+    bool steal(size_t self, Task& out);
+    void runTask(const Task& t);
+    void workerLoop(size_t self);
+
+    std::vector<std::unique_ptr<Queue>> queues; // one per worker
+    std::vector<std::thread> threads;
+    std::mutex idleMutex;
+    std::condition_variable idle;
+    std::atomic<size_t> queued{0}; // tasks sitting in any queue
+    std::atomic<bool> stopping{false};
+    std::atomic<size_t> nextQueue{0};
+    size_t parallelism = 1; // threads that can run at once: workers + 1, at most the cores
+
+    std::atomic<size_t> fixedThreshold{0};
+    // moving averages, in nanoseconds
+    std::atomic<double> perItemNs{1000.0};
+    std::atomic<double> overheadNs{50000.0};
+    std::atomic<unsigned long long> inlineRuns{0};
+    std::atomic<unsigned long long> parallelRuns{0};
+    std::atomic<unsigned long long> steals{0};
+};
+
+#endif // FANOUT_POOL_H
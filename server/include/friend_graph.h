@@ -0,0 +1,157 @@
+#ifndef FRIEND_GRAPH_H
+#define FRIEND_GRAPH_H
+
+#include "name_table.h"
+
+#include <algorithm>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// In-memory copy of the `friends` table, by interned user id. Each row
+// user->friend is either 'accepted' or 'pending'; per user we keep
+//   accepted - rows user->x with status accepted
+//   outgoing - rows user->x with status pending
+//   incoming - rows x->user with status pending
+// so every relationship check is a couple of hash lookups on integers. The
+// server updates it right after the matching store write succeeds.
+class FriendGraph {
+public:
+    enum Status { NONE, SELF, FRIEND, OUTGOING, INCOMING };
+
+    struct Relations {
+        std::unordered_set<UserId> accepted;
+        std::unordered_set<UserId> outgoing;
+        std::unordered_set<UserId> incoming;
+    };
+
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        users.clear();
+    }
+
+    // Load one row of the friends table
+    void loadRow(UserId user, UserId friendId, bool accepted) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        if (accepted) {
+            users[user].accepted.insert(friendId);
+        } else {
+            users[user].outgoing.insert(friendId);
+            users[friendId].incoming.insert(user);
+        }
+    }
+
+    // Row from->to replaced by 'pending'
+    void request(UserId from, UserId to) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        Relations &f = users[from];
+        f.accepted.erase(to);
+        f.outgoing.insert(to);
+        users[to].incoming.insert(from);
+    }
+
+    bool hasPending(UserId from, UserId to) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = users.find(from);
+        return it != users.end() && it->second.outgoing.count(to) > 0;
+    }
+
+    // Both rows from->to and to->from replaced by 'accepted'
+    void accept(UserId from, UserId to) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        Relations &f = users[from];
+        Relations &t = users[to];
+        f.outgoing.erase(to);
+        t.incoming.erase(from);
+        t.outgoing.erase(from);
+        f.incoming.erase(to);
+        f.accepted.insert(to);
+        t.accepted.insert(from);
+    }
+
+    // Pending row from->to deleted
+    void refuse(UserId from, UserId to) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = users.find(from);
+        if (it != users.end()) it->second.outgoing.erase(to);
+        it = users.find(to);
+        if (it != users.end()) it->second.incoming.erase(from);
+    }
+
+    // Rows in both directions deleted
+    void remove(UserId a, UserId b) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        dropLocked(a, b);
+        dropLocked(b, a);
+    }
+
+    bool areFriends(UserId a, UserId b) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return hasLocked(a, b, &Relations::accepted) || hasLocked(b, a, &Relations::accepted);
+    }
+
+    // Same precedence as checking the viewer->other row before the
+    // other->viewer row
+    Status status(UserId viewer, UserId other) const {
+        if (viewer == other) return SELF;
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        if (hasLocked(viewer, other, &Relations::accepted)) return FRIEND;
+        if (hasLocked(viewer, other, &Relations::outgoing)) return OUTGOING;
+        if (hasLocked(other, viewer, &Relations::accepted)) return FRIEND;
+        if (hasLocked(other, viewer, &Relations::outgoing)) return INCOMING;
+        return NONE;
+    }
+
+    static const char *statusName(Status s) {
+        static const char *const names[] = {"none", "self", "friend", "outgoing", "incoming"};
+        return names[s];
+    }
+
+    // Status of every user related to `viewer`; anyone absent from the map is
+    // NONE. One lock for a whole listing instead of one per row.
+    std::unordered_map<UserId, Status> viewOf(UserId viewer) const {
+        std::unordered_map<UserId, Status> view;
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = users.find(viewer);
+        if (it == users.end()) return view;
+        // the viewer's own row wins over an incoming request
+        for (UserId n : it->second.incoming) view[n] = INCOMING;
+        for (UserId n : it->second.outgoing) view[n] = OUTGOING;
+        for (UserId n : it->second.accepted) view[n] = FRIEND;
+        return view;
+    }
+
+    // Copies of one user's relation sets, in no particular order
+    void relationsOf(UserId user, std::vector<UserId>& accepted,
+                     std::vector<UserId>& outgoing, std::vector<UserId>& incoming) const {
+        accepted.clear(); outgoing.clear(); incoming.clear();
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = users.find(user);
+        if (it == users.end()) return;
+        accepted.assign(it->second.accepted.begin(), it->second.accepted.end());
+        outgoing.assign(it->second.outgoing.begin(), it->second.outgoing.end());
+        incoming.assign(it->second.incoming.begin(), it->second.incoming.end());
+    }
+
+private:
+    bool hasLocked(UserId user, UserId other, std::unordered_set<UserId> Relations::*set) const {
+        auto it = users.find(user);
+        return it != users.end() && (it->second.*set).count(other) > 0;
+    }
+
+    void dropLocked(UserId user, UserId other) {
+        auto it = users.find(user);
+        if (it != users.end()) {
+            it->second.accepted.erase(other);
+            it->second.outgoing.erase(other);
+            it->second.incoming.erase(other);
+        }
+    }
+
+    mutable std::shared_mutex mtx;
+    std::unordered_map<UserId, Relations> users;
+};
+
+#endif // FRIEND_GRAPH_H
@@ -0,0 +1,114 @@
+#ifndef GROUP_DIRECTORY_H
+#define GROUP_DIRECTORY_H
+
+#include "name_table.h"
+
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// In-memory copy of the `groups` and `group_members` tables, by interned id,
+// plus per group the members that currently have at least one session.
+// Group fan-out walks only that online set instead of every connected client.
+class GroupDirectory {
+public:
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        groups.clear();
+        memberOf.clear();
+        online.clear();
+    }
+
+    // Register a group row (load time or after INSERT INTO groups)
+    void addGroup(GroupId group, UserId owner) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        groups[group].owner = owner;
+    }
+
+    bool exists(GroupId group) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return groups.count(group) > 0;
+    }
+
+    void addMember(GroupId group, UserId user) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        Group &g = groups[group];
+        g.members.insert(user);
+        if (online.count(user)) g.online.insert(user);
+        memberOf[user].insert(group);
+    }
+
+    void removeMember(GroupId group, UserId user) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = groups.find(group);
+        if (it != groups.end()) {
+            it->second.members.erase(user);
+            it->second.online.erase(user);
+        }
+        auto mit = memberOf.find(user);
+        if (mit != memberOf.end()) {
+            mit->second.erase(group);
+            if (mit->second.empty()) memberOf.erase(mit);
+        }
+    }
+
+    bool isMember(GroupId group, UserId user) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = groups.find(group);
+        return it != groups.end() && it->second.members.count(user) > 0;
+    }
+
+    // Members and groups come back unordered; callers sort by name for display
+    std::vector<UserId> members(GroupId group) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = groups.find(group);
+        if (it == groups.end()) return std::vector<UserId>();
+        return std::vector<UserId>(it->second.members.begin(), it->second.members.end());
+    }
+
+    std::vector<GroupId> groupsOf(UserId user) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = memberOf.find(user);
+        if (it == memberOf.end()) return std::vector<GroupId>();
+        return std::vector<GroupId>(it->second.begin(), it->second.end());
+    }
+
+    // Called when a user's first session joins or last session leaves
+    void setOnline(UserId user, bool isOnline) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        if (isOnline) online.insert(user);
+        else online.erase(user);
+        auto mit = memberOf.find(user);
+        if (mit == memberOf.end()) return;
+        for (GroupId g : mit->second) {
+            auto git = groups.find(g);
+            if (git == groups.end()) continue;
+            if (isOnline) git->second.online.insert(user);
+            else git->second.online.erase(user);
+        }
+    }
+
+    // Members of `group` with at least one live session
+    std::vector<UserId> onlineMembers(GroupId group) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = groups.find(group);
+        if (it == groups.end()) return std::vector<UserId>();
+        return std::vector<UserId>(it->second.online.begin(), it->second.online.end());
+    }
+
+private:
+    struct Group {
+        UserId owner = 0;
+        std::unordered_set<UserId> members;
+        std::unordered_set<UserId> online;
+    };
+
+    mutable std::shared_mutex mtx;
+    std::unordered_map<GroupId, Group> groups;
+    std::unordered_map<UserId, std::unordered_set<GroupId>> memberOf;
+    std::unordered_set<UserId> online;
+};
+
+#endif // GROUP_DIRECTORY_H
@@ -0,0 +1,56 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Consistent hashing of names (users, groups) onto `shards` buckets. Each
+// shard owns `vnodes` points on a 64-bit ring and a key belongs to the first
+// point at or after its hash, so growing from N to N+1 shards moves only
+// about 1/(N+1) of the keys, all of them to the new shard.
+class HashRing {
+public:
+    explicit HashRing(int shards = 1, int vnodes = 64) : count(std::max(1, shards)) {
+        points.reserve(static_cast<size_t>(count) * vnodes);
+        for (int s = 0; s < count; ++s) {
+            for (int v = 0; v < vnodes; ++v) {
+                points.emplace_back(hash("shard-" + std::to_string(s) + "#" + std::to_string(v)), s);
+            }
+        }
+        std::sort(points.begin(), points.end());
+    }
+
+    int shards() const { return count; }
+
+    int shardOf(const std::string& key) const {
+        if (count == 1) return 0;
+        uint64_t h = hash(key);
+        auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(h, 0));
+        if (it == points.end()) it = points.begin();
+        return it->second;
+    }
+
+    // FNV-1a with a final avalanche so short, similar names spread evenly
+    static uint64_t hash(const std::string& key) {
+        uint64_t h = 1469598103934665603ULL;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+private:
+    int count;
+    std::vector<std::pair<uint64_t, int>> points; // (position, shard), sorted
+};
+
+#endif // HASH_RING_H
@@ -0,0 +1,56 @@
+#ifndef LOG_ARCHIVER_H
+#define LOG_ARCHIVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Compresses rotated log files on its own thread and enforces retention.
+//
+// A log named "<stem><ext>" (server_activity.evlog) is rotated to
+// "<stem>-YYYYmmdd-HHMMSS-mmm<ext>", so rotated files sort by age. Each
+// submitted file is gzipped to "<name>.gz", the original removed, and then
+// all but the newest `keep` rotated files (compressed or not) are deleted.
+// submit() only queues the name; on start() any rotated file left
+// uncompressed by an earlier run is queued as well.
+class LogArchiver {
+public:
+    LogArchiver() = default;
+    ~LogArchiver() { stop(); }
+    LogArchiver(const LogArchiver&) = delete;
+    LogArchiver& operator=(const LogArchiver&) = delete;
+
+    // Archive rotations of `logPath`, keeping `keep` of them (0: keep all)
+    void start(const std::string& logPath, int keep);
+    // Finish the file in hand and stop; the rest are picked up next start()
+    void stop();
+
+    void submit(const std::string& rotatedPath);
+    // Name to rename the live log to, stamped with the current time
+    std::string rotatedName() const;
+
+    unsigned long long archivedCount() const { return archived.load(std::memory_order_relaxed); }
+
+private:
+    void run();
+    bool compress(const std::string& path);
+    void prune();
+    bool isRotated(const std::string& fileName, bool& compressed) const;
+
+    std::string dir;  // directory of the log, with a trailing '/' (or empty)
+    std::string stem; // file name without extension
+    std::string ext;  // ".evlog"
+    int keep = 0;
+
+    std::thread worker;
+    std::mutex queueMutex;
+    std::condition_variable wake;
+    std::deque<std::string> queue;
+    bool stopping = false;
+    std::atomic<unsigned long long> archived{0};
+};
+
+#endif // LOG_ARCHIVER_H
@@ -0,0 +1,176 @@
+#ifndef LOG_STORE_H
+#define LOG_STORE_H
+
+#include "message_store.h"
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Fixed-layout header in front of every log record. Records are padded to
+// 8 bytes so headers stay aligned; the payload is `a`, then `b`, then `body`.
+struct LogRecordHeader {
+    uint32_t magic;
+    uint32_t crc;        // crc32 of the payload bytes
+    uint8_t  kind;
+    uint8_t  reserved0;
+    uint16_t a_len;
+    uint16_t b_len;
+    uint16_t reserved1;
+    uint32_t body_len;
+    uint32_t reserved2;
+    int64_t  id;
+    int64_t  ts;
+};
+static_assert(sizeof(LogRecordHeader) == 40, "log record header layout changed");
+
+enum LogRecordKind : uint8_t {
+    LOG_USER_ADD = 1,       // a=username body=password ts=credential stamp
+    LOG_USER_PASSWORD = 2,  // a=username body=password ts=credential stamp
+    LOG_USER_DELETE = 3,    // a=username
+    LOG_FRIEND_PUT = 4,     // a=user b=friend body=status
+    LOG_FRIEND_DELETE = 5,  // a=user b=friend
+    LOG_GROUP_CREATE = 6,   // a=group b=owner
+    LOG_MEMBER_ADD = 7,     // a=group b=member
+    LOG_MEMBER_REMOVE = 8,  // a=group b=member
+    LOG_DIRECT = 9,         // a=sender b=receiver body=content
+    LOG_GROUP_MESSAGE = 10, // a=sender b=group body=content
+    LOG_INBOX_PUSH = 11,    // a=user id=direct message id
+    LOG_INBOX_TAKE = 12,    // a=user id=last message id delivered
+    LOG_READ_MARK = 13,     // a=user b=conversation id=last read message id
+};
+
+// Sparse index written next to a sealed segment (NNN.idx): the offset and id of
+// every LOG_INDEX_STRIDE-th record. Its presence with a matching segment size
+// marks the segment as verified, so reopening walks it without CRC checks and
+// only spot-checks the sampled offsets.
+struct LogIndexHeader {
+    uint32_t magic;
+    uint32_t stride;
+    uint64_t segment_size;
+    uint64_t records;
+    uint32_t entries;
+    uint32_t crc;        // crc32 of the entry array
+};
+static_assert(sizeof(LogIndexHeader) == 32, "log index header layout changed");
+
+struct LogIndexEntry {
+    int64_t  id;
+    uint32_t offset;
+    uint8_t  kind;
+    uint8_t  reserved[3];
+};
+static_assert(sizeof(LogIndexEntry) == 16, "log index entry layout changed");
+
+static const uint32_t LOG_INDEX_STRIDE = 64;
+
+// Append-only, segment-based MessageStore. Every mutation is appended to the
+// active segment file in `dir`; segments roll over at `segmentBytes`. Opening
+// replays all segments to rebuild users, relations and groups in memory and a
+// per-conversation index of record locations, so history reads go straight to
+// the right offsets. Writes are a single write(2) each with no read-modify-write.
+//
+// Only the last segment is ever written. Every older (sealed) segment is
+// immutable, so it is mapped read-only once and history reads over it are
+// pointer arithmetic on the mapping: no syscalls and no copies, with the
+// message bytes handed to the visitor in place. The mappings are shared and
+// stay valid until close(), so any thread can read through them.
+class LogStore : public MessageStore {
+public:
+    explicit LogStore(const std::string& dir, uint64_t segmentBytes = 64ull * 1024 * 1024)
+        : dir(dir), segmentBytes(segmentBytes) {}
+    ~LogStore() override { close(); }
+
+    bool open() override;
+    void close() override;
+    const char *name() const override { return "log"; }
+
+    bool addUser(const std::string& username, const std::string& password) override;
+    bool verifyUser(const std::string& username, const std::string& password) override;
+    bool changePassword(const std::string& username, const std::string& password) override;
+    bool deleteUser(const std::string& username) override;
+    bool loadUsers(std::vector<std::string>& out) override;
+    bool credentialStamp(const std::string& username, long long& out) override;
+
+    bool putFriendRow(const std::string& user, const std::string& friendname, const std::string& status) override;
+    bool deleteFriendRow(const std::string& user, const std::string& friendname, bool pendingOnly) override;
+    bool loadFriendRows(std::vector<FriendRow>& out) override;
+
+    bool createGroup(const std::string& groupname, const std::string& owner) override;
+    bool addGroupMember(const std::string& groupname, const std::string& member) override;
+    bool removeGroupMember(const std::string& groupname, const std::string& member) override;
+    bool loadGroups(std::vector<GroupRow>& out) override;
+    bool loadGroupMembers(std::vector<GroupMemberRow>& out) override;
+
+    long long appendDirect(const std::string& sender, const std::string& receiver,
+                           const std::string& content, long long ts) override;
+    long long appendGroup(const std::string& groupname, const std::string& sender,
+                          const std::string& content, long long ts) override;
+    bool scanDirectHistory(const std::string& a, const std::string& b, int limit,
+                           long long beforeId, const HistoryVisitor& visit) override;
+    bool scanGroupHistory(const std::string& groupname, int limit,
+                          long long beforeId, const HistoryVisitor& visit) override;
+
+    bool inboxPush(const std::string& user, long long messageId) override;
+    bool inboxTake(const std::string& user, int limit, std::vector<StoredMessage>& out) override;
+
+    bool putLastRead(const std::string& user, const std::string& conv, long long lastRead) override;
+    bool loadReadStates(std::vector<ReadStateRow>& out) override;
+
+private:
+    struct Segment {
+        uint64_t seq;
+        std::string path;
+        int fd;
+        uint64_t size;
+        const char *map = nullptr; // read-only mapping once sealed
+    };
+
+    // location of a record: segment index in `segments` and byte offset
+    struct RecordLoc {
+        uint32_t segment;
+        uint32_t offset;
+    };
+
+    bool append(uint8_t kind, const std::string& a, const std::string& b,
+                const std::string& body, int64_t id, int64_t ts);
+    bool openSegment(uint64_t seq);
+    bool replaySegment(size_t index);
+    bool replayVerified(size_t index);
+    bool sealSegment(size_t index);
+    bool mapSegment(Segment& s);
+    bool writeIndex(const Segment& s);
+    bool loadIndex(const Segment& s, std::vector<LogIndexEntry>& entries, uint64_t& records);
+    void apply(const LogRecordHeader& h, const char *payload, RecordLoc loc);
+    bool readView(RecordLoc loc, MessageView& out, std::string& scratch);
+    int64_t idAt(RecordLoc loc);
+    bool scanTail(const std::vector<RecordLoc>& locs, int limit, long long beforeId,
+                  const HistoryVisitor& visit);
+
+    static std::string directKey(const std::string& a, const std::string& b) {
+        return a < b ? a + '\n' + b : b + '\n' + a;
+    }
+
+    std::string dir;
+    uint64_t segmentBytes;
+    std::vector<Segment> segments; // oldest first; the last one is active
+
+    std::unordered_map<std::string, std::string> users; // username -> password
+    std::unordered_map<std::string, int64_t> credStamps; // username -> credential stamp
+    std::map<std::pair<std::string, std::string>, std::string> friends;
+    std::map<std::string, std::string> groups; // name -> owner
+    std::set<std::pair<std::string, std::string>> members;
+    std::unordered_map<std::string, std::vector<RecordLoc>> directIndex;
+    std::unordered_map<std::string, std::vector<RecordLoc>> groupIndex;
+    std::vector<RecordLoc> directById; // direct message id - 1 -> location
+    std::unordered_map<std::string, std::vector<int64_t>> inbox; // user -> undelivered ids, ascending
+    std::map<std::pair<std::string, std::string>, int64_t> readMarks; // (user, conv) -> last read id
+    int64_t lastDirectId = 0;
+    int64_t lastGroupId = 0;
+};
+
+#endif // LOG_STORE_H
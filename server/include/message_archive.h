@@ -0,0 +1,73 @@
+#ifndef MESSAGE_ARCHIVE_H
+#define MESSAGE_ARCHIVE_H
+
+#include "message_store.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// How long messages stay in the hot tables. Keys are the server's history
+// cache keys ("d:<a>\n<b>" with the pair sorted, "g:<group>"); conversations
+// without an override use the default. 0 seconds means keep forever.
+//
+// The retention file has one rule per line, '#' starts a comment:
+//     default <days>
+//     group <name> <days>
+//     direct <user> <user> <days>
+class RetentionPolicy {
+public:
+    long long defaultSeconds = 0;
+
+    bool load(const std::string& path);
+    long long secondsFor(const std::string& key) const;
+    bool empty() const { return defaultSeconds == 0 && overrides.empty(); }
+
+private:
+    std::unordered_map<std::string, long long> overrides;
+};
+
+// Compressed cold storage for messages moved out of the hot tables. Each
+// conversation has one file in `dir` named after its hex-encoded key; every
+// archiving pass appends one gzip member of fixed-layout records, so files
+// are only ever appended to. Rows within a file are in id order.
+//
+// Next to each file, a ".idx" file lists every member's byte range and id
+// range, so tail() decompresses only the members it returns rows from.
+// Bytes the index does not cover (files from before it existed, or a crash
+// between the two writes) are read sequentially and indexed by the next
+// append(). Appends to one conversation are serialized; readers take no
+// lock, since they only see whole index entries and never read past them
+// except to decode the unindexed end of the file.
+class MessageArchive {
+public:
+    explicit MessageArchive(const std::string& dir) : dir(dir) {}
+
+    bool open();
+
+    // Append rows (oldest first) to a conversation's archive and fsync it
+    bool append(const std::string& key, const std::vector<StoredMessage>& rows);
+
+    // Newest `limit` archived rows with an id below `beforeId` (0 = no bound),
+    // oldest first. A missing archive is not an error.
+    bool tail(const std::string& key, long long beforeId, int limit, std::vector<StoredMessage>& out);
+
+    // Whether anything was ever archived for the conversation
+    bool has(const std::string& key) const;
+
+    uint64_t archivedRows() const { return archived; }
+
+private:
+    static const size_t APPEND_LOCKS = 16;
+
+    std::string pathFor(const std::string& key, const char *suffix = ".gz") const;
+
+    std::string dir;
+    std::mutex appendLocks[APPEND_LOCKS]; // by hash of the key
+    std::atomic<uint64_t> archived{0}; // rows appended since startup
+};
+
+#endif // MESSAGE_ARCHIVE_H
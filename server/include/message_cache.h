@@ -0,0 +1,165 @@
+#ifndef MESSAGE_CACHE_H
+#define MESSAGE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// One history line kept in memory, already formatted as "[ts] sender: body\n"
+// so serving it needs neither SQLite nor strftime.
+struct CachedMessage {
+    long long id;
+    std::string line;
+};
+
+struct MessageCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    size_t conversations = 0;
+    size_t messages = 0;
+    size_t bytes = 0;
+};
+
+// Bounded LRU of per-conversation ring buffers holding the newest messages of
+// each conversation. Keys are opaque (the server uses "d:<a>\n<b>" for direct
+// chats and "g:<group>" for groups). Internally synchronized.
+class MessageCache {
+public:
+    explicit MessageCache(size_t maxConversations = 1024, size_t perConversation = 256,
+                          size_t maxBytes = 32u * 1024 * 1024)
+        : maxConversations(maxConversations), perConversation(perConversation), maxBytes(maxBytes) {}
+
+    size_t windowSize() const { return perConversation; }
+
+    // Append the newest lines of a conversation to `out`, oldest first, stopping
+    // after `limit` lines or when the next line would push the total past
+    // `budget`; the lines are copied straight into the response body.
+    // Returns false (a miss) when the ring runs out before either bound is hit
+    // and older rows may exist only in the database. `olderThan` is set to the
+    // id to page back from when older lines exist, 0 otherwise.
+    bool tail(const std::string& key, int limit, size_t budget,
+              std::string& out, long long& olderThan) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(key);
+        if (it == entries.end()) { ++misses; return false; }
+        Entry &e = it->second;
+        size_t used = 0;
+        size_t take = 0;
+        bool truncated = false;
+        for (auto r = e.ring.rbegin(); r != e.ring.rend(); ++r) {
+            if ((int)take >= limit) break;
+            if (used + r->line.size() > budget) { truncated = true; break; }
+            used += r->line.size();
+            ++take;
+        }
+        bool covered = truncated || (int)take >= limit || e.complete;
+        if (!covered) { ++misses; return false; }
+        out.reserve(out.size() + used);
+        for (auto r = e.ring.end() - take; r != e.ring.end(); ++r) out += r->line;
+        olderThan = 0;
+        if (take < e.ring.size() || !e.complete) olderThan = take ? (e.ring.end() - take)->id : e.ring.back().id;
+        lru.splice(lru.begin(), lru, e.pos);
+        ++hits;
+        return true;
+    }
+
+    // Install the newest rows of a conversation (oldest first). `complete` means
+    // the rows are the whole conversation, so short rings still count as hits.
+    void fill(const std::string& key, std::vector<CachedMessage> rows, bool complete) {
+        std::lock_guard<std::mutex> lock(mtx);
+        eraseLocked(key);
+        if (rows.size() > perConversation) {
+            rows.erase(rows.begin(), rows.end() - perConversation);
+            complete = false;
+        }
+        lru.push_front(key);
+        Entry &e = entries[key];
+        e.pos = lru.begin();
+        e.complete = complete;
+        e.bytes = key.size() + sizeof(Entry);
+        for (auto &m : rows) {
+            e.bytes += m.line.size() + sizeof(CachedMessage);
+            e.ring.push_back(std::move(m));
+        }
+        bytes += e.bytes;
+        evictLocked();
+    }
+
+    // Write-through from the insert path. Conversations not currently cached
+    // are left alone; the next read will load them.
+    void append(const std::string& key, long long id, const std::string& line) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(key);
+        if (it == entries.end()) return;
+        Entry &e = it->second;
+        if (!e.ring.empty() && e.ring.back().id >= id) return;
+        e.ring.push_back(CachedMessage{id, line});
+        size_t added = line.size() + sizeof(CachedMessage);
+        e.bytes += added;
+        bytes += added;
+        if (e.ring.size() > perConversation) {
+            size_t dropped = e.ring.front().line.size() + sizeof(CachedMessage);
+            e.ring.pop_front();
+            e.bytes -= dropped;
+            bytes -= dropped;
+            e.complete = false;
+        }
+        evictLocked();
+    }
+
+    void erase(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        eraseLocked(key);
+    }
+
+    MessageCacheStats stats() {
+        std::lock_guard<std::mutex> lock(mtx);
+        MessageCacheStats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.conversations = entries.size();
+        for (const auto &kv : entries) s.messages += kv.second.ring.size();
+        s.bytes = bytes;
+        return s;
+    }
+
+private:
+    struct Entry {
+        std::deque<CachedMessage> ring;
+        bool complete = false;
+        size_t bytes = 0;
+        std::list<std::string>::iterator pos;
+    };
+
+    void eraseLocked(const std::string& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) return;
+        bytes -= it->second.bytes;
+        lru.erase(it->second.pos);
+        entries.erase(it);
+    }
+
+    void evictLocked() {
+        while (!lru.empty() && (entries.size() > maxConversations || bytes > maxBytes)) {
+            std::string victim = lru.back();
+            eraseLocked(victim);
+        }
+    }
+
+    size_t maxConversations;
+    size_t perConversation;
+    size_t maxBytes;
+    std::mutex mtx;
+    std::list<std::string> lru; // most recently used at the front
+    std::unordered_map<std::string, Entry> entries;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+#endif // MESSAGE_CACHE_H
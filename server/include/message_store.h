@@ -0,0 +1,208 @@
+#ifndef MESSAGE_STORE_H
+#define MESSAGE_STORE_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// One stored chat line. `peer` is the receiver of a direct message or the
+// group name of a group message.
+struct StoredMessage {
+    long long id = 0;
+    long long ts = 0;
+    std::string sender;
+    std::string peer;
+    std::string content;
+};
+
+// Borrowed view of a stored message handed to history visitors. The pointed-to
+// bytes belong to the store (a mapped segment or the current SQLite row) and
+// are only valid for the duration of the callback.
+struct MessageView {
+    long long id = 0;
+    long long ts = 0;
+    std::string_view sender;
+    std::string_view peer;
+    std::string_view content;
+};
+
+typedef std::function<void(const MessageView&)> HistoryVisitor;
+
+// A conversation as seen by retention: a direct pair with a < b, or a group
+// named by `a`. `oldestTs` is the timestamp of its oldest hot message.
+struct ConversationRef {
+    bool group = false;
+    std::string a;
+    std::string b;
+    long long oldestTs = 0;
+};
+
+// One search result; `msg.content` is a snippet of the message with the
+// matched words marked
+struct SearchHit {
+    bool group = false;
+    StoredMessage msg;
+    double rank = 0; // bm25, lower is a better match
+};
+
+// Read position of `user` in `conv` ("@<peer>" or "#<group>"), with the
+// unread count and newest id derived from the messages at load time
+struct ReadStateRow {
+    std::string user;
+    std::string conv;
+    long long lastRead = 0;
+    long long unread = 0;
+    long long newest = 0;
+};
+
+struct FriendRow {
+    std::string user;
+    std::string friendname;
+    std::string status; // "pending" or "accepted"
+};
+
+struct GroupRow {
+    std::string name;
+    std::string owner;
+};
+
+struct GroupMemberRow {
+    std::string groupname;
+    std::string member;
+};
+
+// A broadcast channel; `newest` is the id of its latest post (0 if none)
+struct ChannelRow {
+    std::string name;
+    std::string owner;
+    long long newest = 0;
+};
+
+// `cursor` is the newest post the subscriber has acknowledged
+struct ChannelSubscriberRow {
+    std::string channel;
+    std::string user;
+    long long cursor = 0;
+};
+
+// Persistent storage for users, relations, groups and messages.
+//
+// MessengerServer keeps the hot state (friend graph, user and group
+// directories, history cache) in memory and writes every change through to
+// a store; the load* calls rebuild that state at startup. Implementations do
+// not need to be thread-safe for writes: the server holds the store lock
+// exclusively around every write. Reads (verifyUser, the scan* calls, search,
+// listConversations and oldestMessages) may run concurrently with each other
+// under a shared lock, so they must not modify the store's own state.
+class MessageStore {
+public:
+    virtual ~MessageStore() {}
+
+    virtual bool open() = 0;
+    virtual void close() = 0;
+    virtual const char *name() const = 0;
+
+    // users
+    virtual bool addUser(const std::string& username, const std::string& password) = 0;
+    virtual bool verifyUser(const std::string& username, const std::string& password) = 0;
+    virtual bool changePassword(const std::string& username, const std::string& password) = 0;
+    virtual bool deleteUser(const std::string& username) = 0;
+    virtual bool loadUsers(std::vector<std::string>& out) = 0;
+    // A value that changes whenever the user's credentials do: on
+    // registration and on every password change. Resume tokens carry it, so
+    // a new password or a re-registered name cancels the old ones. False if
+    // there is no such user.
+    virtual bool credentialStamp(const std::string& username, long long& out) = 0;
+
+    // relations: one row per direction, like the friends table
+    virtual bool putFriendRow(const std::string& user, const std::string& friendname, const std::string& status) = 0;
+    // Delete user->friend (only when pending if `pendingOnly`); false if no row went away
+    virtual bool deleteFriendRow(const std::string& user, const std::string& friendname, bool pendingOnly) = 0;
+    virtual bool loadFriendRows(std::vector<FriendRow>& out) = 0;
+
+    // groups
+    virtual bool createGroup(const std::string& groupname, const std::string& owner) = 0;
+    virtual bool addGroupMember(const std::string& groupname, const std::string& member) = 0;
+    // false if the member was not in the group
+    virtual bool removeGroupMember(const std::string& groupname, const std::string& member) = 0;
+    virtual bool loadGroups(std::vector<GroupRow>& out) = 0;
+    virtual bool loadGroupMembers(std::vector<GroupMemberRow>& out) = 0;
+
+    // messages: append returns the new message id, or -1 on failure
+    virtual long long appendDirect(const std::string& sender, const std::string& receiver,
+                                   const std::string& content, long long ts) = 0;
+    virtual long long appendGroup(const std::string& groupname, const std::string& sender,
+                                  const std::string& content, long long ts) = 0;
+    // Visit the newest `limit` messages of a conversation with an id below
+    // `beforeId` (0 = no bound), oldest first, without copying them
+    virtual bool scanDirectHistory(const std::string& a, const std::string& b, int limit,
+                                   long long beforeId, const HistoryVisitor& visit) = 0;
+    virtual bool scanGroupHistory(const std::string& groupname, int limit,
+                                  long long beforeId, const HistoryVisitor& visit) = 0;
+
+    // offline inbox: ids of direct messages not yet delivered to `user`,
+    // in id order; pushing an id back after a failed delivery is allowed
+    virtual bool inboxPush(const std::string& user, long long messageId) = 0;
+    // Remove and return up to `limit` undelivered messages, oldest first
+    virtual bool inboxTake(const std::string& user, int limit, std::vector<StoredMessage>& out) = 0;
+
+    // read state: only acknowledged positions are stored; unread counts are
+    // rebuilt from the messages by loadReadStates in one pass at startup
+    virtual bool putLastRead(const std::string& user, const std::string& conv, long long lastRead) = 0;
+    virtual bool loadReadStates(std::vector<ReadStateRow>& out) = 0;
+
+    // retention: stores that can drop old rows list their conversations and
+    // hand out the oldest rows to archive. The defaults mean "keeps everything".
+    virtual bool listConversations(std::vector<ConversationRef>&) { return false; }
+    // Oldest `limit` messages sent before `cutoffTs`, oldest first
+    virtual bool oldestMessages(const ConversationRef&, long long /*cutoffTs*/, int /*limit*/,
+                                std::vector<StoredMessage>&) { return false; }
+    // Delete the conversation's messages with id <= maxId sent before cutoffTs;
+    // returns the number deleted or -1
+    virtual long long deleteMessagesThrough(const ConversationRef&, long long /*maxId*/, long long /*cutoffTs*/) { return -1; }
+
+    // search: the best-ranked messages matching `text` among the direct
+    // messages of `user` and the groups `user` belongs to. false when the
+    // store has no search support.
+    virtual bool search(const std::string& /*user*/, const std::string& /*text*/, int /*limit*/, int /*offset*/,
+                        std::vector<SearchHit>&) { return false; }
+
+    // channels: one writer, many readers. A post is stored once, not per
+    // subscriber; a subscriber catches up by reading the posts after its
+    // cursor. The defaults mean "no channel support".
+    virtual bool createChannel(const std::string& /*name*/, const std::string& /*owner*/) { return false; }
+    virtual bool addChannelSubscriber(const std::string& /*channel*/, const std::string& /*user*/, long long /*cursor*/) { return false; }
+    // false if the user was not subscribed
+    virtual bool removeChannelSubscriber(const std::string& /*channel*/, const std::string& /*user*/) { return false; }
+    virtual bool putChannelCursor(const std::string& /*channel*/, const std::string& /*user*/, long long /*cursor*/) { return false; }
+    virtual bool loadChannels(std::vector<ChannelRow>&) { return false; }
+    virtual bool loadChannelSubscribers(std::vector<ChannelSubscriberRow>&) { return false; }
+    virtual long long appendChannel(const std::string& /*channel*/, const std::string& /*sender*/,
+                                    const std::string& /*content*/, long long /*ts*/) { return -1; }
+    // Visit up to `limit` posts of `channel` with an id above `afterId`, oldest first
+    virtual bool scanChannelSince(const std::string& /*channel*/, long long /*afterId*/, int /*limit*/,
+                                  const HistoryVisitor&) { return false; }
+
+    // Owning copies of the same rows, for callers that keep them
+    bool directHistory(const std::string& a, const std::string& b, int limit,
+                       std::vector<StoredMessage>& out, long long beforeId = 0) {
+        return scanDirectHistory(a, b, limit, beforeId, [&out](const MessageView& m) { out.push_back(copyOf(m)); });
+    }
+    bool groupHistory(const std::string& groupname, int limit,
+                      std::vector<StoredMessage>& out, long long beforeId = 0) {
+        return scanGroupHistory(groupname, limit, beforeId, [&out](const MessageView& m) { out.push_back(copyOf(m)); });
+    }
+
+    static StoredMessage copyOf(const MessageView& m) {
+        StoredMessage s;
+        s.id = m.id;
+        s.ts = m.ts;
+        s.sender.assign(m.sender.data(), m.sender.size());
+        s.peer.assign(m.peer.data(), m.peer.size());
+        s.content.assign(m.content.data(), m.content.size());
+        return s;
+    }
+};
+
+#endif // MESSAGE_STORE_H
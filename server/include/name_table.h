@@ -0,0 +1,74 @@
+#ifndef NAME_TABLE_H
+#define NAME_TABLE_H
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Small integer handle for a user or group name; 0 means "no such name"
+typedef uint32_t NameId;
+typedef NameId UserId;
+typedef NameId GroupId;
+
+// Interning table: every distinct name gets a dense id the first time it is
+// seen and keeps it for the life of the process, so the in-memory
+// directories can store and compare 4-byte ids instead of strings. Ids are
+// never reused, not even after the name is deleted, which makes a stale id
+// harmless. They are not persisted; the store keeps using names. Internally
+// synchronized.
+class NameTable {
+public:
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        ids.clear();
+        names.clear();
+    }
+
+    // Id of `name`, assigning the next one if it is new
+    NameId intern(const std::string& name) {
+        if (name.empty()) return 0;
+        {
+            std::shared_lock<std::shared_mutex> lock(mtx);
+            auto it = ids.find(name);
+            if (it != ids.end()) return it->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        auto it = ids.find(name);
+        if (it != ids.end()) return it->second;
+        names.push_back(name);
+        NameId id = static_cast<NameId>(names.size());
+        ids.emplace(std::string_view(names.back()), id);
+        return id;
+    }
+
+    // Id of a name already interned, or 0
+    NameId find(const std::string& name) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = ids.find(name);
+        return it == ids.end() ? 0 : it->second;
+    }
+
+    // The name behind an id. The reference stays valid until clear(): the
+    // deque never moves its elements on push_back.
+    const std::string& nameOf(NameId id) const {
+        static const std::string none;
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return id == 0 || id > names.size() ? none : names[id - 1];
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return names.size();
+    }
+
+private:
+    mutable std::shared_mutex mtx;
+    std::deque<std::string> names;                     // id - 1 -> name
+    std::unordered_map<std::string_view, NameId> ids;  // views into `names`
+};
+
+#endif // NAME_TABLE_H
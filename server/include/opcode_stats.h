@@ -0,0 +1,78 @@
+#ifndef OPCODE_STATS_H
+#define OPCODE_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+// Calls, rejections and a latency histogram for one opcode.
+//
+// Buckets are powers of two of microseconds (bucket b holds times below
+// 2^b us, the last one everything longer), so recording is a bit scan and
+// one relaxed increment, and percentiles come back as bucket upper bounds
+// (capped at the maximum), within a factor of two. Written by every
+// session thread without a lock.
+class OpcodeStats {
+public:
+    static const int BUCKETS = 24; // up to about 8 s
+
+    void record(long long micros) {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        hist[bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        long long seen = worst.load(std::memory_order_relaxed);
+        while (micros > seen && !worst.compare_exchange_weak(seen, micros, std::memory_order_relaxed)) {}
+    }
+
+    // Turned away before the handler ran (throttled or shed)
+    void reject() { rejected.fetch_add(1, std::memory_order_relaxed); }
+
+    unsigned long long callCount() const { return calls.load(std::memory_order_relaxed); }
+    unsigned long long rejectCount() const { return rejected.load(std::memory_order_relaxed); }
+
+    // Upper bound in microseconds of the q-th quantile (0 < q <= 1)
+    long long percentileMicros(double q) const {
+        unsigned long long counts[BUCKETS];
+        unsigned long long total = 0;
+        for (int b = 0; b < BUCKETS; ++b) total += counts[b] = hist[b].load(std::memory_order_relaxed);
+        if (total == 0) return 0;
+        unsigned long long rank = static_cast<unsigned long long>(q * total + 0.5);
+        if (rank < 1) rank = 1;
+        unsigned long long seen = 0;
+        for (int b = 0; b < BUCKETS; ++b) {
+            seen += counts[b];
+            if (seen >= rank) return std::min(1LL << b, worstMicros());
+        }
+        return worstMicros();
+    }
+
+    long long worstMicros() const { return worst.load(std::memory_order_relaxed); }
+
+    // "n=<calls> [rej=<n>] p50=<t> p99=<t> max=<t>"
+    std::string summary() const {
+        std::string out = "n=" + std::to_string(callCount());
+        if (rejectCount()) out += " rej=" + std::to_string(rejectCount());
+        out += " p50=" + formatMicros(percentileMicros(0.5)) + " p99=" + formatMicros(percentileMicros(0.99)) +
+               " max=" + formatMicros(worstMicros());
+        return out;
+    }
+
+    static std::string formatMicros(long long us) {
+        if (us < 1000) return std::to_string(us) + "us";
+        if (us < 1000000) return std::to_string(us / 1000) + "ms";
+        return std::to_string(us / 1000000) + "s";
+    }
+
+private:
+    static int bucketOf(long long micros) {
+        if (micros <= 0) return 0;
+        int b = 64 - __builtin_clzll(static_cast<unsigned long long>(micros));
+        return b < BUCKETS ? b : BUCKETS - 1;
+    }
+
+    std::atomic<unsigned long long> calls{0};
+    std::atomic<unsigned long long> rejected{0};
+    std::atomic<long long> worst{0};
+    std::atomic<unsigned long long> hist[BUCKETS] = {};
+};
+
+#endif // OPCODE_STATS_H
@@ -0,0 +1,93 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include "common.h"
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// An encoded frame shared by every recipient it is queued for. It is built
+// once and never modified, so a group message costs one allocation however
+// many members it reaches.
+typedef std::shared_ptr<const Message> Frame;
+
+Frame makeFrame(int type, const std::string& username, const std::string& content);
+
+// Outbound side of one session. Other threads queue frames by reference;
+// whoever finds the queue idle writes it out with non-blocking writev, and
+// only when the socket is full does the session's writer thread take over,
+// so fan-out never waits on a slow recipient. Frames that must be known to
+// have reached the socket (direct messages, which otherwise go to the
+// offline inbox) use sendNow(). All writes hold writeMutex, and a frame cut
+// short by a full socket is finished before anything else is written.
+//
+// A recipient that falls more than `maxQueued` frames behind, or whose socket
+// accepts nothing for a while, is cut off: its socket is shut down and the
+// client reconnects and resumes, reading what it missed from history.
+//
+// Ephemeral events (typing, receipts) use a second, low-priority lane. It is
+// only written once the regular queue is empty, an event replaces a pending
+// one with the same key, and while the session is backed up new events are
+// dropped instead of queued, so they never hold up a real message.
+class Outbox {
+public:
+    Outbox(int sock, size_t maxQueued) : sock(sock), maxQueued(maxQueued) {}
+    ~Outbox() { close(); }
+
+    void start();
+    // End the session: drop what is still queued, shut the socket down,
+    // join the writer and wait for any write in progress. Nothing is written
+    // after it returns, so close the descriptor only then; idempotent.
+    void close();
+
+    // Queue a frame; false if the session is closed or was cut off
+    bool push(const Frame& frame);
+    enum EventResult { EVENT_QUEUED, EVENT_COALESCED, EVENT_DROPPED };
+    // Queue an event on the low-priority lane
+    EventResult pushEvent(uint64_t key, const Frame& frame);
+    // Write now, blocking; false if the socket failed or the session is closed
+    bool sendNow(const void *data, size_t len);
+    // Microseconds the calling thread has spent in sendNow(), waiting for
+    // the write lock or the socket; lets callers leave a slow recipient out
+    // of their own timings
+    static long long threadSendUs();
+    // False once the session was closed or cut off
+    bool alive();
+
+    int socket() const { return sock; }
+
+private:
+    enum DrainResult { DRAINED, SOCKET_FULL, FAILED };
+    DrainResult drain(bool blocking);
+    bool writeNow(const void *data, size_t len);
+    bool finishHeadLocked();
+    bool promoteEventsLocked();
+    bool writeAll(const void *data, size_t len);
+    void fail();
+    void run();
+
+    int sock;
+    size_t maxQueued;
+    // queue state, guarded by queueMutex
+    std::mutex queueMutex;
+    std::condition_variable ready;
+    std::deque<Frame> queue;
+    std::vector<std::pair<uint64_t, Frame>> events; // low-priority lane, by key
+    size_t headSent = 0;   // bytes of queue.front() already written
+    bool draining = false; // a thread (pusher or writer) owns the queue's output
+    bool handoff = false;  // socket was full; the writer thread continues
+    bool closing = false;
+    bool broken = false;
+    std::mutex writeMutex; // held for every write to the socket
+    std::thread writer;
+};
+
+#endif // OUTBOX_H
@@ -0,0 +1,53 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include "request_gate.h"
+
+#include <algorithm>
+#include <atomic>
+
+// Sustained rate and burst allowed for one request class; intervalUs 0
+// means unlimited
+struct RateLimit {
+    long long intervalUs = 0; // one token every intervalUs
+    long long burst = 1;      // tokens that may be spent back to back
+
+    static RateLimit perSecond(double rate, long long burst) {
+        RateLimit limit;
+        limit.intervalUs = rate > 0 ? std::max(1LL, static_cast<long long>(1000000.0 / rate)) : 0;
+        limit.burst = std::max(1LL, burst);
+        return limit;
+    }
+};
+
+// Token buckets of one user, one per request class, shared by all of the
+// user's sessions.
+//
+// Each bucket is a single atomic: the time at which it would be full again
+// if nothing else were spent (the "theoretical arrival time" form of a token
+// bucket). Taking a token is a load and a compare-exchange, with no lock and
+// no allocation, so it runs on every request before any storage work.
+class RateLimiter {
+public:
+    RateLimiter() {
+        for (auto &t : tat) t.store(0, std::memory_order_relaxed);
+    }
+
+    // 0 if a request of class `c` may go ahead now, otherwise the
+    // microseconds until it may
+    long long take(RequestClass c, const RateLimit& limit, long long nowUs) {
+        if (limit.intervalUs <= 0) return 0;
+        long long tolerance = limit.intervalUs * limit.burst;
+        long long cur = tat[c].load(std::memory_order_relaxed);
+        for (;;) {
+            long long next = std::max(cur, nowUs) + limit.intervalUs;
+            if (next - nowUs > tolerance) return next - nowUs - tolerance;
+            if (tat[c].compare_exchange_weak(cur, next, std::memory_order_relaxed)) return 0;
+        }
+    }
+
+private:
+    std::atomic<long long> tat[REQ_CLASS_COUNT];
+};
+
+#endif // RATE_LIMITER_H
@@ -0,0 +1,167 @@
+#ifndef REQUEST_GATE_H
+#define REQUEST_GATE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
+// Request classes, highest priority first
+enum RequestClass {
+    REQ_REALTIME,    // live delivery: direct, group and channel messages, receipts
+    REQ_INTERACTIVE, // small queries and edits a user waits on: history, lists, friends, groups
+    REQ_BULK,        // expensive or administrative: all-users listing, search, stats, backup
+    REQ_CLASS_COUNT
+};
+
+// Admission control in front of the opcode handlers.
+//
+// Every client has its own thread, so the queues here are the threads of one
+// class waiting for that class's slots: interactive and bulk requests each
+// have a budget of requests that may run at once, and wait (up to their
+// class's maxWaitMs) for a free slot. Realtime requests never wait and never
+// take the gate's mutex; their service time is the signal, counted without
+// the time spent blocked writing to a recipient's socket, so one stalled
+// client cannot make the whole server look slow. When it averages above the
+// target, the server is falling behind on live traffic: bulk requests are
+// shed at once and interactive ones are deferred until it recovers, and shed
+// if their wait runs out. A shed request gets a busy reply and costs no
+// storage work.
+class RequestGate {
+public:
+    RequestGate() {
+        budget[REQ_INTERACTIVE] = Budget{4, 500};
+        budget[REQ_BULK] = Budget{1, 200};
+    }
+
+    // Concurrent slots and longest queue wait for a lower class
+    void configure(RequestClass c, int slots, long long maxWaitMs) {
+        if (c == REQ_REALTIME) return;
+        std::lock_guard<std::mutex> lock(mtx);
+        budget[c].slots = std::max(1, slots);
+        budget[c].maxWaitMs = std::max(0LL, maxWaitMs);
+    }
+
+    void setTargetMs(long long ms) {
+        targetUs.store(std::max(1LL, ms) * 1000, std::memory_order_relaxed);
+    }
+
+    // Take a slot for a request of class `c`; false if it was shed
+    bool enter(RequestClass c) {
+        if (c == REQ_REALTIME) {
+            realtimeAdmitted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        Counters &k = counters[c];
+        long long start = nowUs();
+        long long deadline = start + budget[c].maxWaitMs * 1000;
+        for (;;) {
+            long long now = nowUs();
+            bool behind = overloaded(now);
+            if (behind && c == REQ_BULK) break;
+            if (!behind && inFlight[c] < budget[c].slots) {
+                ++inFlight[c];
+                ++k.admitted;
+                k.waitEwmaUs = ewma(k.waitEwmaUs, now - start);
+                return true;
+            }
+            if (now >= deadline) break;
+            // recheck at least every 10 ms: pressure clears without a notify
+            long long until = std::min(deadline, now + 10000);
+            queued[c].wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::microseconds(until)));
+        }
+        ++k.shed;
+        return false;
+    }
+
+    // Release the slot taken by enter(); `serviceUs` is how long the handler
+    // ran, leaving out blocking writes to other sessions
+    void leave(RequestClass c, long long serviceUs) {
+        if (c == REQ_REALTIME) {
+            // concurrent updates may lose a sample, which an average can afford
+            long long avg = realtimeServiceEwmaUs.load(std::memory_order_relaxed);
+            realtimeServiceEwmaUs.store(ewma(avg, serviceUs), std::memory_order_relaxed);
+            // only "recently", so the shared line is written at most every 10 ms
+            long long now = nowUs();
+            if (now - lastRealtimeUs.load(std::memory_order_relaxed) >= 10000) {
+                lastRealtimeUs.store(now, std::memory_order_relaxed);
+            }
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        counters[c].serviceEwmaUs = ewma(counters[c].serviceEwmaUs, serviceUs);
+        --inFlight[c];
+        queued[c].notify_one();
+    }
+
+    // How long a shed client should wait before retrying
+    long long retryAfterMs(RequestClass c) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return std::max(50LL, budget[c].maxWaitMs);
+    }
+
+    std::string report() const {
+        static const char *names[REQ_CLASS_COUNT] = {"realtime", "interactive", "bulk"};
+        std::lock_guard<std::mutex> lock(mtx);
+        std::string out = std::string("dispatch: target=") +
+                          std::to_string(targetUs.load(std::memory_order_relaxed) / 1000) + "ms" +
+                          (overloaded(nowUs()) ? " (shedding)" : "") + "\n";
+        for (int c = 0; c < REQ_CLASS_COUNT; ++c) {
+            Counters k = counters[c];
+            if (c == REQ_REALTIME) {
+                k.admitted = realtimeAdmitted.load(std::memory_order_relaxed);
+                k.serviceEwmaUs = realtimeServiceEwmaUs.load(std::memory_order_relaxed);
+            }
+            out += std::string("  ") + names[c] + ": admitted=" + std::to_string(k.admitted) +
+                   " shed=" + std::to_string(k.shed) +
+                   " service=" + std::to_string(k.serviceEwmaUs / 1000) + "ms";
+            if (c != REQ_REALTIME) out += " wait=" + std::to_string(k.waitEwmaUs / 1000) + "ms";
+            out += "\n";
+        }
+        return out;
+    }
+
+private:
+    struct Budget {
+        int slots = 1;
+        long long maxWaitMs = 0;
+    };
+    struct Counters {
+        unsigned long long admitted = 0;
+        unsigned long long shed = 0;
+        long long waitEwmaUs = 0;
+        long long serviceEwmaUs = 0;
+    };
+
+    static long long nowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static long long ewma(long long avg, long long sample) {
+        return avg + (sample - avg) / 8;
+    }
+
+    // Live traffic is slow, judged only while there is some
+    bool overloaded(long long now) const {
+        return realtimeServiceEwmaUs.load(std::memory_order_relaxed) > targetUs.load(std::memory_order_relaxed) &&
+               now - lastRealtimeUs.load(std::memory_order_relaxed) < 1000000;
+    }
+
+    // lower classes, guarded by mtx; the realtime entries are unused
+    mutable std::mutex mtx;
+    std::condition_variable queued[REQ_CLASS_COUNT];
+    Budget budget[REQ_CLASS_COUNT];
+    Counters counters[REQ_CLASS_COUNT];
+    int inFlight[REQ_CLASS_COUNT] = {0, 0, 0};
+    // realtime counters and the overload signal, lock-free
+    std::atomic<unsigned long long> realtimeAdmitted{0};
+    std::atomic<long long> realtimeServiceEwmaUs{0};
+    std::atomic<long long> lastRealtimeUs{0};
+    std::atomic<long long> targetUs{50000};
+};
+
+#endif // REQUEST_GATE_H
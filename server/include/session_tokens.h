@@ -0,0 +1,41 @@
+#ifndef SESSION_TOKENS_H
+#define SESSION_TOKENS_H
+
+#include <string>
+
+// What a valid resume token vouches for
+struct ResumeClaim {
+    std::string user;
+    long long expires = 0; // unix seconds
+    long long seq = 0;     // newest direct message id delivered when issued
+    long long stamp = 0;   // the user's credential stamp when issued
+};
+
+// Short-lived resume tokens:
+// "<user>\n<expires>\n<seq>\n<stamp>\n<hex HMAC-SHA256>" over the first four
+// fields. Verification here is a MAC and a clock check; the caller then
+// compares the stamp with MessageStore::credentialStamp, so a password
+// change or a re-registered name cancels every token issued before. The key is kept in a file so tokens stay valid across a
+// server restart, which is when every client reconnects at once.
+// Immutable after loadKey(), so safe to share between client threads.
+class SessionTokens {
+public:
+    explicit SessionTokens(long long ttlSeconds = 600) : ttl(ttlSeconds) {}
+
+    // Read the key from `path`, creating it (mode 0600) on first use
+    bool loadKey(const std::string& path);
+
+    void setTtl(long long seconds) { ttl = seconds; }
+    long long ttlSeconds() const { return ttl; }
+
+    std::string issue(const std::string& user, long long seq, long long stamp, long long now) const;
+    bool verify(const std::string& token, long long now, ResumeClaim& out) const;
+
+private:
+    std::string mac(const std::string& payload) const;
+
+    std::string key;
+    long long ttl;
+};
+
+#endif // SESSION_TOKENS_H
@@ -0,0 +1,128 @@
+#ifndef SHARDED_STORE_H
+#define SHARDED_STORE_H
+
+#include "hash_ring.h"
+#include "sqlite_store.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// MessageStore that partitions users and groups over several SQLite files
+// (<base>.shard<k>.sqlite) by consistent hashing of the name. A user's row,
+// friend rows, inbox and direct-chat read marks live on the user's shard; a
+// group's row, members, messages and read marks live on the group's shard, and
+// likewise a channel's row, subscribers and posts on the channel's shard. A
+// direct message is written to both participants' shards, so each side's
+// history, inbox and search stay single-shard reads. Message ids are handed
+// out here rather than by SQLite, so both copies of a direct message share
+// one id and a rebalance can move rows without renumbering them.
+//
+// The shard count is recorded in <base>.shards on first open; changing it
+// takes messenger-rebalance, which moves the affected hash ranges.
+//
+// Each shard has its own lock, and calls on different shards run in
+// parallel. The caller holds the locks of the shards a call touches (shardOf
+// of the names involved, taken in shard order; all of them for the calls
+// that visit every shard), so it can keep them across its own bookkeeping.
+// Reads may share a shard's lock; writes hold it exclusively.
+// Id counters are atomic, so concurrent appends on different shards never
+// share an id.
+class ShardedStore : public MessageStore {
+public:
+    ShardedStore(const std::string& base, int shards) : base(base), ring(shards) {
+        for (int s = 0; s < ring.shards(); ++s) locks.emplace_back(new std::shared_mutex);
+    }
+    ~ShardedStore() override { close(); }
+
+    static std::string shardPath(const std::string& base, int shard) {
+        return base + ".shard" + std::to_string(shard) + ".sqlite";
+    }
+    static std::string ringPath(const std::string& base) { return base + ".shards"; }
+    // Shard count recorded for `base`, or 0 if it was never sharded
+    static int recordedShards(const std::string& base);
+
+    int shardCount() const { return static_cast<int>(shards.size()); }
+    SqliteStore& shard(int s) { return *shards[s]; }
+    // Shard holding the rows of a user, group or channel
+    int shardOf(const std::string& name) const { return ring.shardOf(name); }
+    std::shared_mutex& lockOf(int s) { return *locks[s]; }
+
+    bool open() override;
+    void close() override;
+    const char *name() const override { return "sharded"; }
+
+    bool addUser(const std::string& username, const std::string& password) override;
+    bool verifyUser(const std::string& username, const std::string& password) override;
+    bool changePassword(const std::string& username, const std::string& password) override;
+    bool deleteUser(const std::string& username) override;
+    bool loadUsers(std::vector<std::string>& out) override;
+    bool credentialStamp(const std::string& username, long long& out) override;
+
+    bool putFriendRow(const std::string& user, const std::string& friendname, const std::string& status) override;
+    bool deleteFriendRow(const std::string& user, const std::string& friendname, bool pendingOnly) override;
+    bool loadFriendRows(std::vector<FriendRow>& out) override;
+
+    bool createGroup(const std::string& groupname, const std::string& owner) override;
+    bool addGroupMember(const std::string& groupname, const std::string& member) override;
+    bool removeGroupMember(const std::string& groupname, const std::string& member) override;
+    bool loadGroups(std::vector<GroupRow>& out) override;
+    bool loadGroupMembers(std::vector<GroupMemberRow>& out) override;
+
+    long long appendDirect(const std::string& sender, const std::string& receiver,
+                           const std::string& content, long long ts) override;
+    long long appendGroup(const std::string& groupname, const std::string& sender,
+                          const std::string& content, long long ts) override;
+    bool scanDirectHistory(const std::string& a, const std::string& b, int limit,
+                           long long beforeId, const HistoryVisitor& visit) override;
+    bool scanGroupHistory(const std::string& groupname, int limit,
+                          long long beforeId, const HistoryVisitor& visit) override;
+
+    bool inboxPush(const std::string& user, long long messageId) override;
+    bool inboxTake(const std::string& user, int limit, std::vector<StoredMessage>& out) override;
+
+    bool putLastRead(const std::string& user, const std::string& conv, long long lastRead) override;
+    bool loadReadStates(std::vector<ReadStateRow>& out) override;
+
+    bool listConversations(std::vector<ConversationRef>& out) override;
+    bool oldestMessages(const ConversationRef& c, long long cutoffTs, int limit,
+                        std::vector<StoredMessage>& out) override;
+    long long deleteMessagesThrough(const ConversationRef& c, long long maxId, long long cutoffTs) override;
+
+    bool search(const std::string& user, const std::string& text, int limit, int offset,
+                std::vector<SearchHit>& out) override;
+
+    bool createChannel(const std::string& name, const std::string& owner) override;
+    bool addChannelSubscriber(const std::string& channel, const std::string& user, long long cursor) override;
+    bool removeChannelSubscriber(const std::string& channel, const std::string& user) override;
+    bool putChannelCursor(const std::string& channel, const std::string& user, long long cursor) override;
+    bool loadChannels(std::vector<ChannelRow>& out) override;
+    bool loadChannelSubscribers(std::vector<ChannelSubscriberRow>& out) override;
+    long long appendChannel(const std::string& channel, const std::string& sender,
+                            const std::string& content, long long ts) override;
+    bool scanChannelSince(const std::string& channel, long long afterId, int limit,
+                          const HistoryVisitor& visit) override;
+
+private:
+    SqliteStore& shardFor(const std::string& name) { return *shards[ring.shardOf(name)]; }
+    void removeOrphans(int shard);
+
+    std::string base;
+    HashRing ring;
+    std::vector<std::unique_ptr<SqliteStore>> shards;
+    std::vector<std::unique_ptr<std::shared_mutex>> locks; // one per shard
+    std::atomic<long long> lastDirectId{0};
+    std::atomic<long long> lastGroupId{0};
+    std::atomic<long long> lastChannelId{0};
+    // Halves of cross-shard direct messages whose rollback failed, as
+    // (shard, id); removed on the next append to that shard
+    std::mutex orphansMutex;
+    std::vector<std::pair<int, long long>> orphans;
+    std::atomic<size_t> orphanCount{0};
+};
+
+#endif // SHARDED_STORE_H
@@ -0,0 +1,97 @@
+#ifndef SQLITE_STORE_H
+#define SQLITE_STORE_H
+
+#include "message_store.h"
+
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+// MessageStore backed by a single SQLite database file (users.sqlite).
+class SqliteStore : public MessageStore {
+public:
+    explicit SqliteStore(const std::string& path) : path(path) {}
+    ~SqliteStore() override { close(); }
+
+    bool open() override;
+    void close() override;
+    const char *name() const override { return "sqlite"; }
+
+    bool addUser(const std::string& username, const std::string& password) override;
+    bool verifyUser(const std::string& username, const std::string& password) override;
+    bool changePassword(const std::string& username, const std::string& password) override;
+    bool deleteUser(const std::string& username) override;
+    bool loadUsers(std::vector<std::string>& out) override;
+    bool credentialStamp(const std::string& username, long long& out) override;
+
+    bool putFriendRow(const std::string& user, const std::string& friendname, const std::string& status) override;
+    bool deleteFriendRow(const std::string& user, const std::string& friendname, bool pendingOnly) override;
+    bool loadFriendRows(std::vector<FriendRow>& out) override;
+
+    bool createGroup(const std::string& groupname, const std::string& owner) override;
+    bool addGroupMember(const std::string& groupname, const std::string& member) override;
+    bool removeGroupMember(const std::string& groupname, const std::string& member) override;
+    bool loadGroups(std::vector<GroupRow>& out) override;
+    bool loadGroupMembers(std::vector<GroupMemberRow>& out) override;
+
+    long long appendDirect(const std::string& sender, const std::string& receiver,
+                           const std::string& content, long long ts) override;
+    long long appendGroup(const std::string& groupname, const std::string& sender,
+                          const std::string& content, long long ts) override;
+    bool scanDirectHistory(const std::string& a, const std::string& b, int limit,
+                           long long beforeId, const HistoryVisitor& visit) override;
+    bool scanGroupHistory(const std::string& groupname, int limit,
+                          long long beforeId, const HistoryVisitor& visit) override;
+
+    bool inboxPush(const std::string& user, long long messageId) override;
+    bool inboxTake(const std::string& user, int limit, std::vector<StoredMessage>& out) override;
+
+    bool putLastRead(const std::string& user, const std::string& conv, long long lastRead) override;
+    bool loadReadStates(std::vector<ReadStateRow>& out) override;
+
+    bool listConversations(std::vector<ConversationRef>& out) override;
+    bool oldestMessages(const ConversationRef& c, long long cutoffTs, int limit,
+                        std::vector<StoredMessage>& out) override;
+    long long deleteMessagesThrough(const ConversationRef& c, long long maxId, long long cutoffTs) override;
+
+    bool search(const std::string& user, const std::string& text, int limit, int offset,
+                std::vector<SearchHit>& out) override;
+
+    bool createChannel(const std::string& name, const std::string& owner) override;
+    bool addChannelSubscriber(const std::string& channel, const std::string& user, long long cursor) override;
+    bool removeChannelSubscriber(const std::string& channel, const std::string& user) override;
+    bool putChannelCursor(const std::string& channel, const std::string& user, long long cursor) override;
+    bool loadChannels(std::vector<ChannelRow>& out) override;
+    bool loadChannelSubscribers(std::vector<ChannelSubscriberRow>& out) override;
+    long long appendChannel(const std::string& channel, const std::string& sender,
+                            const std::string& content, long long ts) override;
+    bool scanChannelSince(const std::string& channel, long long afterId, int limit,
+                          const HistoryVisitor& visit) override;
+
+    // Inserts with a caller-chosen id (0 = next rowid), for stores that hand
+    // out ids across several databases
+    long long insertDirect(long long id, const std::string& sender, const std::string& receiver,
+                           const std::string& content, long long ts);
+    long long insertGroup(long long id, const std::string& groupname, const std::string& sender,
+                          const std::string& content, long long ts);
+    long long insertChannel(long long id, const std::string& channel, const std::string& sender,
+                            const std::string& content, long long ts);
+    bool removeDirect(long long id);
+    // Highest direct, group and channel message ids, 0 when empty
+    bool maxMessageIds(long long& direct, long long& group, long long& channel);
+
+    // Raw handle for SQLite-only features; nullptr until open() succeeds
+    sqlite3 *handle() const { return db; }
+
+private:
+    bool exec(const char *sql, const char *what);
+    bool addCredentialStamp();
+    bool createSearchIndex();
+    bool createReadState();
+    bool visitMessages(sqlite3_stmt *stmt, const HistoryVisitor& visit);
+
+    std::string path;
+    sqlite3 *db = nullptr;
+};
+
+#endif // SQLITE_STORE_H
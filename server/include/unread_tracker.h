@@ -0,0 +1,131 @@
+#ifndef UNREAD_TRACKER_H
+#define UNREAD_TRACKER_H
+
+#include "name_table.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// A conversation as seen from one user's side, packed in 64 bits: the peer's
+// user id for a direct chat ("@<peer>" on the wire), or the group id with
+// bit 32 set for a group ("#<group>")
+typedef uint64_t ConvKey;
+
+inline ConvKey directConv(UserId peer) { return peer; }
+inline ConvKey groupConv(GroupId group) { return (1ULL << 32) | group; }
+inline bool isGroupConv(ConvKey conv) { return (conv >> 32) != 0; }
+inline NameId convTarget(ConvKey conv) { return static_cast<NameId>(conv); }
+
+// Read position of one user in one conversation
+struct ReadState {
+    long long lastRead = 0; // newest message id the user has acknowledged
+    long long unread = 0;   // messages from others after lastRead
+    long long newest = 0;   // newest message id in the conversation
+};
+
+struct UnreadEntry {
+    ConvKey conv;
+    ReadState state;
+};
+
+// Per-user, per-conversation unread counters, rebuilt once at startup and
+// then kept current by every message insert and read acknowledgement, so the
+// login summary is a map lookup rather than a history query per
+// conversation. Internally synchronized.
+class UnreadTracker {
+public:
+    void clear() {
+        std::lock_guard<std::mutex> lock(mtx);
+        users.clear();
+        groupNewest.clear();
+    }
+
+    // Install a state loaded from the store
+    void load(UserId user, ConvKey conv, const ReadState& st) {
+        std::lock_guard<std::mutex> lock(mtx);
+        users[user][conv] = st;
+        if (isGroupConv(conv)) {
+            long long &n = groupNewest[convTarget(conv)];
+            n = std::max(n, st.newest);
+        }
+    }
+
+    void onDirect(UserId sender, UserId receiver, long long id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        ReadState &in = users[receiver][directConv(sender)];
+        in.newest = id;
+        ++in.unread;
+        users[sender][directConv(receiver)].newest = id;
+    }
+
+    void onGroup(GroupId group, UserId sender, const std::vector<UserId>& members, long long id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        ConvKey conv = groupConv(group);
+        groupNewest[group] = id;
+        for (UserId m : members) {
+            ReadState &st = users[m][conv];
+            st.newest = id;
+            if (m != sender) ++st.unread;
+        }
+    }
+
+    // Mark everything in the conversation read; returns the new lastRead to
+    // persist, or 0 when nothing changed
+    long long markRead(UserId user, ConvKey conv) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto uit = users.find(user);
+        if (uit == users.end()) return 0;
+        auto it = uit->second.find(conv);
+        if (it == uit->second.end()) return 0;
+        ReadState &st = it->second;
+        if (st.lastRead >= st.newest && st.unread == 0) return 0;
+        st.lastRead = st.newest;
+        st.unread = 0;
+        return st.lastRead;
+    }
+
+    // A new group member starts with the existing messages read; returns the
+    // lastRead to persist, or 0 for a group without messages
+    long long joinGroup(UserId user, GroupId group) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto git = groupNewest.find(group);
+        if (git == groupNewest.end()) return 0;
+        ReadState &st = users[user][groupConv(group)];
+        st.lastRead = st.newest = git->second;
+        st.unread = 0;
+        return st.lastRead;
+    }
+
+    void forget(UserId user, ConvKey conv) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto uit = users.find(user);
+        if (uit != users.end()) uit->second.erase(conv);
+    }
+
+    // Conversations of `user` with unread messages, most unread first
+    std::vector<UnreadEntry> unreadOf(UserId user) const {
+        std::vector<UnreadEntry> out;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto uit = users.find(user);
+            if (uit == users.end()) return out;
+            for (const auto &kv : uit->second) {
+                if (kv.second.unread > 0) out.push_back(UnreadEntry{kv.first, kv.second});
+            }
+        }
+        std::sort(out.begin(), out.end(), [](const UnreadEntry& a, const UnreadEntry& b) {
+            return a.state.unread != b.state.unread ? a.state.unread > b.state.unread : a.conv < b.conv;
+        });
+        return out;
+    }
+
+private:
+    mutable std::mutex mtx;
+    std::unordered_map<UserId, std::unordered_map<ConvKey, ReadState>> users;
+    std::unordered_map<GroupId, long long> groupNewest;
+};
+
+#endif // UNREAD_TRACKER_H
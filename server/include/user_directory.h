@@ -0,0 +1,60 @@
+#ifndef USER_DIRECTORY_H
+#define USER_DIRECTORY_H
+
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Sorted in-memory copy of users.username. Loaded at startup and kept in sync
+// by addUser/deleteUser so listing users never scans the users table.
+class UserDirectory {
+public:
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        names.clear();
+    }
+
+    void add(const std::string& name) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        names.insert(name);
+    }
+
+    void remove(const std::string& name) {
+        std::unique_lock<std::shared_mutex> lock(mtx);
+        names.erase(name);
+    }
+
+    bool contains(const std::string& name) const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return names.count(name) > 0;
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        return names.size();
+    }
+
+    // Up to `limit` names starting with `prefix` that sort after `after`
+    // (keyset pagination). `more` is set when further matches remain.
+    std::vector<std::string> page(const std::string& prefix, const std::string& after,
+                                  size_t limit, bool& more) const {
+        std::vector<std::string> out;
+        more = false;
+        std::shared_lock<std::shared_mutex> lock(mtx);
+        auto it = after.empty() || after < prefix ? names.lower_bound(prefix) : names.upper_bound(after);
+        for (; it != names.end(); ++it) {
+            if (it->compare(0, prefix.size(), prefix) != 0) break;
+            if (out.size() >= limit) { more = true; break; }
+            out.push_back(*it);
+        }
+        return out;
+    }
+
+private:
+    mutable std::shared_mutex mtx;
+    std::set<std::string> names;
+};
+
+#endif // USER_DIRECTORY_H
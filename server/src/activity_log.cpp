@@ -0,0 +1,273 @@
+#include "activity_log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include "common.h"
+
+using namespace std;
+
+// Records written per fwrite; also bounds how long the writer goes between flushes
+static const size_t WRITE_BATCH = 512;
+// Longest the writer sleeps without being woken (a missed wakeup costs at most this)
+static const int IDLE_WAIT_MS = 50;
+
+void ActivityLog::configure(size_t slots, Overflow policy) {
+    if (file) return;
+    size_t n = 64;
+    while (n < slots) n <<= 1;
+    capacity = n;
+    overflow = policy;
+}
+
+static int64_t nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void ActivityLog::setRotation(unsigned long long maxBytes, long long maxSeconds, int keep) {
+    if (file) return;
+    rotateBytes = maxBytes;
+    rotateMicros = max(0LL, maxSeconds) * 1000000;
+    keepRotated = keep;
+}
+
+// Open `path` for appending: a new file gets the header, an existing one
+// must already have it
+FILE *ActivityLog::openFile() {
+    FILE *f = fopen(path.c_str(), "a+b");
+    if (!f) return nullptr;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    int64_t started = 0;
+    if (size == 0) {
+        uint32_t version = EVLOG_VERSION, recordSize = sizeof(EventRecord);
+        bool ok = fwrite(EVLOG_MAGIC, 1, sizeof(EVLOG_MAGIC), f) == sizeof(EVLOG_MAGIC) &&
+                  fwrite(&version, sizeof(version), 1, f) == 1 && fwrite(&recordSize, sizeof(recordSize), 1, f) == 1 &&
+                  fflush(f) == 0;
+        if (!ok) {
+            fclose(f);
+            return nullptr;
+        }
+        size = EVLOG_HEADER_SIZE;
+    } else {
+        char magic[sizeof(EVLOG_MAGIC)];
+        rewind(f);
+        if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, EVLOG_MAGIC, sizeof(magic)) != 0) {
+            cerr << COLOR_RED << path << " is not an activity log" << COLOR_RESET << endl;
+            fclose(f);
+            return nullptr;
+        }
+        // the file's age runs from its first record
+        EventRecord first;
+        if (fseek(f, EVLOG_HEADER_SIZE, SEEK_SET) == 0 && fread(&first, sizeof(first), 1, f) == 1) started = first.micros;
+        fseek(f, 0, SEEK_END);
+    }
+    fileBytes = static_cast<unsigned long long>(size);
+    fileStarted = started;
+    return f;
+}
+
+bool ActivityLog::open(const string& logPath) {
+    if (file) return true;
+    path = logPath;
+    file = openFile();
+    if (!file) return false;
+    if (rotateBytes || rotateMicros) archiver.start(path, keepRotated);
+    for (auto &n : named) n.clear();
+    ring.reset(new Slot[capacity]);
+    for (size_t i = 0; i < capacity; ++i) ring[i].seq.store(i, memory_order_relaxed);
+    mask = capacity - 1;
+    tail.store(0, memory_order_relaxed);
+    head = 0;
+    stopping = false;
+    writer = thread(&ActivityLog::run, this);
+    accepting.store(true, memory_order_release);
+    return true;
+}
+
+void ActivityLog::close() {
+    if (!file) return;
+    accepting.store(false, memory_order_release);
+    stopping = true;
+    {
+        lock_guard<mutex> lock(wakeMutex);
+        wake.notify_one();
+    }
+    if (writer.joinable()) writer.join();
+    fclose(file);
+    file = nullptr;
+    archiver.stop();
+}
+
+void ActivityLog::write(EventRecord rec, string_view text) {
+    if (!accepting.load(memory_order_acquire)) return;
+    rec.micros = nowMicros();
+    if (text.size() > TEXT_MAX) text = text.substr(0, TEXT_MAX);
+    rec.textLen = static_cast<uint16_t>(text.size());
+    while (!tryPush(rec, text)) {
+        if (overflow == DROP || stopping.load(memory_order_relaxed)) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        this_thread::yield();
+    }
+    // pairs with the fence in run(): either the writer sees this record
+    // before it sleeps, or this thread sees it sleeping and wakes it
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping.load(memory_order_relaxed)) {
+        lock_guard<mutex> lock(wakeMutex);
+        wake.notify_one();
+    }
+}
+
+void ActivityLog::note(string_view text) {
+    EventRecord rec{};
+    rec.kind = EV_NOTE;
+    write(rec, text);
+}
+
+bool ActivityLog::tryPush(const EventRecord& rec, string_view text) {
+    size_t pos = tail.load(memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &ring[pos & mask];
+        size_t seq = slot->seq.load(memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false; // full: the writer has not freed this slot yet
+        } else {
+            pos = tail.load(memory_order_relaxed);
+        }
+    }
+    slot->rec = rec;
+    memcpy(slot->text, text.data(), text.size());
+    slot->seq.store(pos + 1, memory_order_release);
+    return true;
+}
+
+void ActivityLog::nameOnce(string& out, NameSpace space, uint32_t id, int64_t micros) {
+    if (id == 0) return;
+    vector<bool> &seen = named[space];
+    if (id < seen.size() && seen[id]) return;
+    if (id >= seen.size()) seen.resize(max<size_t>(id + 1, seen.size() * 2));
+    seen[id] = true;
+    string name = resolve ? resolve(space, id) : string();
+    EventRecord rec{};
+    rec.micros = micros;
+    rec.kind = EV_NAME;
+    rec.opcode = space;
+    rec.target = id;
+    rec.textLen = static_cast<uint16_t>(min<size_t>(name.size(), UINT16_MAX));
+    out.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    out.append(name.data(), rec.textLen);
+}
+
+void ActivityLog::append(string& out, const EventRecord& rec, const char *text) {
+    nameOnce(out, NS_USER, rec.user, rec.micros);
+    if (rec.kind == EV_REQUEST) {
+        nameOnce(out, targetSpace(rec.opcode), rec.target, rec.micros);
+        if (otherIsUser(rec.opcode)) nameOnce(out, NS_USER, rec.other, rec.micros);
+    }
+    out.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    out.append(text, rec.textLen);
+}
+
+size_t ActivityLog::drainBatch(string& out) {
+    size_t n = 0;
+    while (n < WRITE_BATCH) {
+        Slot &slot = ring[head & mask];
+        if (slot.seq.load(memory_order_acquire) != head + 1) break;
+        append(out, slot.rec, slot.text);
+        slot.seq.store(head + capacity, memory_order_release);
+        ++head;
+        ++n;
+    }
+    return n;
+}
+
+bool ActivityLog::rotationDue(int64_t now) const {
+    if (fileBytes <= EVLOG_HEADER_SIZE) return false; // nothing in it yet
+    return (rotateBytes && fileBytes >= rotateBytes) || (rotateMicros && fileStarted && now - fileStarted >= rotateMicros);
+}
+
+// Runs on the writer thread between batches: a rename and an open, while
+// records keep queueing in the ring
+void ActivityLog::rotate(int64_t now) {
+    string rotated = archiver.rotatedName();
+    if (rename(path.c_str(), rotated.c_str()) != 0) {
+        cerr << COLOR_RED << "Activity log rotation failed: " << strerror(errno) << "; rotation off" << COLOR_RESET << endl;
+        rotateBytes = 0;
+        rotateMicros = 0;
+        return;
+    }
+    FILE *next = openFile();
+    if (!next) {
+        // the open handle follows the renamed file, so nothing is lost
+        cerr << COLOR_RED << "Could not start a new " << path << "; rotation off" << COLOR_RESET << endl;
+        rotateBytes = 0;
+        rotateMicros = 0;
+        return;
+    }
+    fclose(file);
+    file = next;
+    fileStarted = now;
+    for (auto &n : named) n.clear();
+    rotations.fetch_add(1, memory_order_relaxed);
+    archiver.submit(rotated);
+}
+
+void ActivityLog::run() {
+    string batch;
+    batch.reserve(WRITE_BATCH * (sizeof(EventRecord) + 16));
+    bool failed = false;
+    for (;;) {
+        batch.clear();
+        size_t n = drainBatch(batch);
+        unsigned long long lost = dropped.load(memory_order_relaxed);
+        if (lost != droppedReported && n < WRITE_BATCH) {
+            string text = to_string(lost - droppedReported) + " log records dropped, queue full";
+            EventRecord rec{};
+            rec.micros = nowMicros();
+            rec.kind = EV_NOTE;
+            rec.textLen = static_cast<uint16_t>(text.size());
+            append(batch, rec, text.data());
+            droppedReported = lost;
+        }
+        if (!batch.empty()) {
+            if ((fwrite(batch.data(), 1, batch.size(), file) != batch.size() || fflush(file) != 0) && !failed) {
+                cerr << COLOR_RED << "Activity log write failed: " << strerror(errno) << COLOR_RESET << endl;
+                failed = true;
+            }
+            written.fetch_add(n, memory_order_relaxed);
+            bytes.fetch_add(batch.size(), memory_order_relaxed);
+            fileBytes += batch.size();
+        }
+        if (rotateBytes || rotateMicros) {
+            int64_t now = nowMicros();
+            if (!fileStarted && !batch.empty()) fileStarted = now;
+            if (rotationDue(now)) rotate(now);
+        }
+        if (n == WRITE_BATCH) continue;
+        if (stopping.load(memory_order_acquire)) {
+            // lines pushed before close() are drained by the loop above
+            if (n == 0) break;
+            continue;
+        }
+        unique_lock<mutex> lock(wakeMutex);
+        sleeping.store(true, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (ring[head & mask].seq.load(memory_order_acquire) != head + 1 && !stopping.load(memory_order_acquire)) {
+            wake.wait_for(lock, chrono::milliseconds(IDLE_WAIT_MS));
+        }
+        sleeping.store(false, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,149 @@
+// messenger-dump: stream the database to stdout in the dump format.
+//
+//   messenger-dump [--db users.sqlite] > data.mdump
+//   messenger-dump --base users > data.mdump      (every shard of a sharded store)
+//
+// Rows are read with one forward scan per table and written a block at a
+// time, so memory use does not grow with the database. Each scan holds a
+// read lock that would stall a running server's writes, so for a live system
+// dump the latest online backup (MSG_BACKUP_REQUEST) instead:
+//
+//   messenger-dump --db backups/snapshot-<time>/users.sqlite > data.mdump
+
+#include "common.h"
+#include "dump_format.h"
+#include "hash_ring.h"
+#include "sharded_store.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The shard a row is dumped from, so rows stored on two shards (direct
+// messages) come out once
+static const char *ownerOf(const string& table) {
+    if (table == "users") return "username";
+    if (table == "friends" || table == "inbox") return "user";
+    if (table == "groups") return "name";
+    if (table == "group_members" || table == "group_messages") return "groupname";
+    if (table == "channels") return "name";
+    if (table == "channel_subscribers" || table == "channel_messages") return "channel";
+    if (table == "messages") return "sender";
+    if (table == "read_state") return "CASE WHEN substr(conv, 1, 1) = '#' THEN substr(conv, 2) ELSE user END";
+    return nullptr;
+}
+
+static void shardOf(sqlite3_context *ctx, int, sqlite3_value **argv) {
+    const HashRing *ring = static_cast<const HashRing*>(sqlite3_user_data(ctx));
+    const unsigned char *name = sqlite3_value_text(argv[0]);
+    sqlite3_result_int(ctx, name ? ring->shardOf(reinterpret_cast<const char*>(name)) : -1);
+}
+
+static bool hasTable(sqlite3 *db, const char *name) {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+static bool dumpTable(sqlite3 *db, const DumpTable& t, DumpWriter& out, int shard) {
+    // a database last opened by an older server lacks the newer tables
+    if (!hasTable(db, t.name)) return true;
+    string sql = string("SELECT ") + t.columns + " FROM " + t.name;
+    if (shard >= 0) sql += string(" WHERE shard_of(") + ownerOf(t.name) + ") = ?1";
+    if (t.types[0] == 'i') sql += " ORDER BY id";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to read " << t.name << ": " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+        return false;
+    }
+    if (shard >= 0) sqlite3_bind_int(stmt, 1, shard);
+    size_t ncols = strlen(t.types);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (size_t c = 0; c < ncols; ++c) {
+            if (t.types[c] == 'i') {
+                out.addInt(sqlite3_column_int64(stmt, static_cast<int>(c)));
+            } else {
+                const unsigned char *v = sqlite3_column_text(stmt, static_cast<int>(c));
+                out.addText(v ? reinterpret_cast<const char*>(v) : "", static_cast<size_t>(sqlite3_column_bytes(stmt, static_cast<int>(c))));
+            }
+        }
+        if (!out.endRow()) {
+            rc = SQLITE_IOERR;
+            break;
+        }
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        cerr << COLOR_RED << "Failed while dumping " << t.name << COLOR_RESET << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    string dbPath = "users.sqlite";
+    string base;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--db" && i + 1 < argc) dbPath = argv[++i];
+        else if (arg == "--base" && i + 1 < argc) base = argv[++i];
+        else {
+            cerr << "Usage: " << argv[0] << " [--db users.sqlite | --base users] > dump" << endl;
+            return 1;
+        }
+    }
+
+    vector<string> paths;
+    int shards = 0;
+    if (!base.empty()) {
+        shards = ShardedStore::recordedShards(base);
+        if (shards == 0) {
+            cerr << COLOR_RED << "No sharded store at " << base << COLOR_RESET << endl;
+            return 1;
+        }
+        for (int s = 0; s < shards; ++s) paths.push_back(ShardedStore::shardPath(base, s));
+    } else {
+        paths.push_back(dbPath);
+    }
+    HashRing ring(max(1, shards));
+
+    vector<sqlite3*> dbs;
+    for (const auto &p : paths) {
+        sqlite3 *db = nullptr;
+        if (sqlite3_open_v2(p.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+            cerr << COLOR_RED << "Failed to open " << p << COLOR_RESET << endl;
+            return 1;
+        }
+        sqlite3_busy_timeout(db, 5000);
+        sqlite3_create_function(db, "shard_of", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, &ring, shardOf, nullptr, nullptr);
+        dbs.push_back(db);
+    }
+
+    static char buf[1 << 20];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    DumpWriter out(stdout);
+    bool ok = out.writeHeader();
+    for (size_t t = 0; ok && t < DUMP_TABLE_COUNT; ++t) {
+        ok = out.begin(DUMP_TABLES[t]);
+        for (size_t s = 0; ok && s < dbs.size(); ++s) {
+            ok = dumpTable(dbs[s], DUMP_TABLES[t], out, shards > 0 ? static_cast<int>(s) : -1);
+        }
+    }
+    ok = ok && out.finish();
+    for (auto db : dbs) sqlite3_close(db);
+    if (!ok) {
+        cerr << COLOR_RED << "Dump failed" << COLOR_RESET << endl;
+        return 1;
+    }
+    cerr << "Dumped " << out.rowsWritten() << " rows" << endl;
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "dump_format.h"
+
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+const DumpTable DUMP_TABLES[] = {
+    {1, "users", "username, password", "ss"},
+    {2, "friends", "user, friend, status", "sss"},
+    {3, "groups", "name, owner", "ss"},
+    {4, "group_members", "groupname, member", "ss"},
+    {5, "messages", "id, sender, receiver, content, ts", "isssi"},
+    {6, "group_messages", "id, groupname, sender, content, ts", "isssi"},
+    {7, "inbox", "user, msg_id", "si"},
+    {8, "read_state", "user, conv, last_read", "ssi"},
+    {9, "channels", "name, owner", "ss"},
+    {10, "channel_subscribers", "channel, user, cursor", "ssi"},
+    {11, "channel_messages", "id, channel, sender, content, ts", "isssi"},
+};
+const size_t DUMP_TABLE_COUNT = sizeof(DUMP_TABLES) / sizeof(DUMP_TABLES[0]);
+
+const DumpTable *dumpTable(uint8_t id) {
+    for (const auto &t : DUMP_TABLES) {
+        if (t.id == id) return &t;
+    }
+    return nullptr;
+}
+
+static void putVarint(string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+static bool getVarint(const string& in, size_t& pos, size_t end, uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(in[pos++]);
+        v |= static_cast<uint64_t>(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint64_t zigzag(long long v) { return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63); }
+static long long unzigzag(uint64_t v) { return static_cast<long long>(v >> 1) ^ -static_cast<long long>(v & 1); }
+
+bool DumpWriter::writeHeader() {
+    return fwrite(DUMP_MAGIC, 1, 4, out) == 4 && fwrite(&DUMP_VERSION, 4, 1, out) == 1;
+}
+
+bool DumpWriter::begin(const DumpTable& t) {
+    if (!flush()) return false;
+    table = &t;
+    size_t n = strlen(t.types);
+    cols.assign(n, string());
+    prev.assign(n, 0);
+    col = 0;
+    return true;
+}
+
+void DumpWriter::addInt(long long v) {
+    putVarint(cols[col], zigzag(v - prev[col]));
+    prev[col] = v;
+    ++col;
+}
+
+void DumpWriter::addText(const char *data, size_t len) {
+    putVarint(cols[col], len);
+    cols[col].append(data, len);
+    ++col;
+}
+
+bool DumpWriter::endRow() {
+    col = 0;
+    ++rows;
+    ++total;
+    return rows < DUMP_BLOCK_ROWS || flush();
+}
+
+bool DumpWriter::flush() {
+    if (!table || rows == 0) return true;
+    string raw;
+    for (auto &c : cols) {
+        putVarint(raw, c.size());
+        raw += c;
+        c.clear();
+    }
+    fill(prev.begin(), prev.end(), 0);
+
+    uLongf packedLen = compressBound(raw.size());
+    string packed(packedLen, '\0');
+    if (compress2(reinterpret_cast<Bytef*>(&packed[0]), &packedLen,
+                  reinterpret_cast<const Bytef*>(raw.data()), raw.size(), 1) != Z_OK) return false;
+
+    uint8_t id = table->id;
+    uint32_t head[3] = {rows, static_cast<uint32_t>(raw.size()), static_cast<uint32_t>(packedLen)};
+    rows = 0;
+    return fwrite(&id, 1, 1, out) == 1 && fwrite(head, sizeof(head), 1, out) == 1 &&
+           fwrite(packed.data(), 1, packedLen, out) == packedLen;
+}
+
+bool DumpWriter::finish() {
+    if (!flush()) return false;
+    uint8_t id = 0;
+    uint32_t head[3] = {0, 0, 0};
+    return fwrite(&id, 1, 1, out) == 1 && fwrite(head, sizeof(head), 1, out) == 1 && fflush(out) == 0;
+}
+
+bool DumpReader::readHeader() {
+    char magic[4];
+    uint32_t version = 0;
+    if (fread(magic, 1, 4, in) != 4 || memcmp(magic, DUMP_MAGIC, 4) != 0 ||
+        fread(&version, 4, 1, in) != 1 || version != DUMP_VERSION) {
+        bad = true;
+        return false;
+    }
+    return true;
+}
+
+bool DumpReader::nextBlock() {
+    uint8_t id = 0;
+    uint32_t head[3];
+    if (fread(&id, 1, 1, in) != 1 || fread(head, sizeof(head), 1, in) != 1) {
+        bad = true;
+        return false;
+    }
+    if (id == 0) return false;
+    tbl = dumpTable(id);
+    if (!tbl) {
+        bad = true;
+        return false;
+    }
+    rows = head[0];
+    string packed(head[2], '\0');
+    raw.assign(head[1], '\0');
+    uLongf rawLen = head[1];
+    if (fread(&packed[0], 1, packed.size(), in) != packed.size() ||
+        uncompress(reinterpret_cast<Bytef*>(&raw[0]), &rawLen,
+                   reinterpret_cast<const Bytef*>(packed.data()), packed.size()) != Z_OK ||
+        rawLen != head[1]) {
+        bad = true;
+        return false;
+    }
+
+    size_t n = strlen(tbl->types);
+    pos.assign(n, 0);
+    end.assign(n, 0);
+    prev.assign(n, 0);
+    col = 0;
+    size_t p = 0;
+    for (size_t c = 0; c < n; ++c) {
+        uint64_t len = 0;
+        if (!getVarint(raw, p, raw.size(), len) || len > raw.size() - p) {
+            bad = true;
+            return false;
+        }
+        pos[c] = p;
+        end[c] = p + len;
+        p += len;
+    }
+    return true;
+}
+
+bool DumpReader::nextInt(long long& v) {
+    uint64_t z = 0;
+    if (!getVarint(raw, pos[col], end[col], z)) {
+        bad = true;
+        return false;
+    }
+    prev[col] += unzigzag(z);
+    v = prev[col];
+    col = (col + 1) % pos.size();
+    return true;
+}
+
+bool DumpReader::nextText(string_view& v) {
+    uint64_t len = 0;
+    if (!getVarint(raw, pos[col], end[col], len) || len > end[col] - pos[col]) {
+        bad = true;
+        return false;
+    }
+    v = string_view(raw.data() + pos[col], len);
+    pos[col] += len;
+    col = (col + 1) % pos.size();
+    return true;
+}
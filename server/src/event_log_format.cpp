@@ -0,0 +1,73 @@
+#include "event_log_format.h"
+
+#include <cstring>
+
+#include "common.h"
+
+struct OpcodeInfo {
+    int opcode;
+    const char *name;
+    NameSpace target;
+    bool otherUser;
+};
+
+static const OpcodeInfo OPCODES[] = {
+    {MSG_LOGIN, "LOGIN", NS_USER, false},
+    {MSG_FRIEND_REQUEST, "FRIEND_REQUEST", NS_USER, false},
+    {MSG_FRIEND_ACCEPT, "FRIEND_ACCEPT", NS_USER, false},
+    {MSG_FRIEND_REFUSE, "FRIEND_REFUSE", NS_USER, false},
+    {MSG_FRIEND_LIST_REQUEST, "FRIEND_LIST", NS_USER, false},
+    {MSG_FRIEND_REMOVE, "FRIEND_REMOVE", NS_USER, false},
+    {MSG_ALL_USERS_STATUS_REQUEST, "ALL_USERS_STATUS", NS_USER, false},
+    {MSG_DIRECT_MESSAGE, "DIRECT_MESSAGE", NS_USER, false},
+    {MSG_HISTORY_REQUEST, "HISTORY", NS_USER, false},
+    {MSG_GROUP_CREATE, "GROUP_CREATE", NS_GROUP, false},
+    {MSG_GROUP_ADD, "GROUP_ADD", NS_GROUP, true},
+    {MSG_GROUP_REMOVE, "GROUP_REMOVE", NS_GROUP, true},
+    {MSG_GROUP_LEAVE, "GROUP_LEAVE", NS_GROUP, false},
+    {MSG_GROUP_MESSAGE, "GROUP_MESSAGE", NS_GROUP, false},
+    {MSG_GROUP_HISTORY_REQUEST, "GROUP_HISTORY", NS_GROUP, false},
+    {MSG_GROUP_LIST_REQUEST, "GROUP_LIST", NS_GROUP, false},
+    {MSG_GROUP_MEMBERS_REQUEST, "GROUP_MEMBERS", NS_GROUP, false},
+    {MSG_STATS_REQUEST, "STATS", NS_USER, false},
+    {MSG_SEARCH_REQUEST, "SEARCH", NS_USER, false},
+    {MSG_READ_ACK, "READ_ACK", NS_USER, false},
+    {MSG_SESSION_RESUME, "SESSION_RESUME", NS_USER, false},
+    {MSG_BACKUP_REQUEST, "BACKUP", NS_USER, false},
+    {MSG_CHANNEL_CREATE, "CHANNEL_CREATE", NS_CHANNEL, false},
+    {MSG_CHANNEL_SUBSCRIBE, "CHANNEL_SUBSCRIBE", NS_CHANNEL, false},
+    {MSG_CHANNEL_UNSUBSCRIBE, "CHANNEL_UNSUBSCRIBE", NS_CHANNEL, false},
+    {MSG_CHANNEL_POST, "CHANNEL_POST", NS_CHANNEL, false},
+    {MSG_CHANNEL_FETCH, "CHANNEL_FETCH", NS_CHANNEL, false},
+    {MSG_CHANNEL_LIST_REQUEST, "CHANNEL_LIST", NS_CHANNEL, false},
+    {MSG_EPHEMERAL, "EPHEMERAL", NS_USER, false},
+};
+
+static const OpcodeInfo *infoOf(int opcode) {
+    for (const auto &info : OPCODES) {
+        if (info.opcode == opcode) return &info;
+    }
+    return nullptr;
+}
+
+NameSpace targetSpace(int opcode) {
+    const OpcodeInfo *info = infoOf(opcode);
+    return info ? info->target : NS_USER;
+}
+
+bool otherIsUser(int opcode) {
+    const OpcodeInfo *info = infoOf(opcode);
+    return info && info->otherUser;
+}
+
+const char *opcodeName(int opcode) {
+    const OpcodeInfo *info = infoOf(opcode);
+    return info ? info->name : nullptr;
+}
+
+int opcodeByName(const char *name) {
+    for (const auto &info : OPCODES) {
+        if (strcmp(info.name, name) == 0) return info.opcode;
+    }
+    return -1;
+}
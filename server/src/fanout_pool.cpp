@@ -0,0 +1,160 @@
+#include "fanout_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+using namespace std;
+
+// Smallest shard worth queueing
+static const size_t MIN_SHARD = 64;
+// Never split fewer items than this, whatever the averages say: a guard
+// against a skewed average, not a tuned cutover; the model picks that
+static const size_t MIN_PARALLEL = 2 * MIN_SHARD;
+// Shards per thread, so that stealing can even out uneven shards
+static const size_t SHARDS_PER_THREAD = 4;
+// Weight of a new sample in the moving averages
+static const double EWMA_WEIGHT = 0.125;
+
+static double ewma(double avg, double sample) {
+    return avg + EWMA_WEIGHT * (sample - avg);
+}
+
+void FanoutPool::start(int workers) {
+    if (!threads.empty()) return;
+    unsigned hw = max(1u, thread::hardware_concurrency());
+    if (workers < 0) workers = static_cast<int>(hw) - 1;
+    // forced workers beyond the cores only take turns with the callers
+    parallelism = min(static_cast<size_t>(workers) + 1, static_cast<size_t>(hw));
+    stopping = false;
+    for (int i = 0; i < workers; ++i) queues.emplace_back(new Queue());
+    for (int i = 0; i < workers; ++i) threads.emplace_back(&FanoutPool::workerLoop, this, static_cast<size_t>(i));
+}
+
+void FanoutPool::stop() {
+    {
+        lock_guard<mutex> lock(idleMutex);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (auto &t : threads) t.join();
+    threads.clear();
+    queues.clear();
+}
+
+size_t FanoutPool::threshold() const {
+    size_t fixed = fixedThreshold;
+    if (fixed) return fixed;
+    if (queues.empty() || parallelism < 2) return numeric_limits<size_t>::max();
+    double saved = perItemNs.load() * (1.0 - 1.0 / static_cast<double>(parallelism));
+    double n = overheadNs.load() / max(saved, 1.0);
+    return max(MIN_PARALLEL, static_cast<size_t>(n));
+}
+
+FanoutPool::Stats FanoutPool::stats() const {
+    Stats s;
+    s.inlineRuns = inlineRuns;
+    s.parallelRuns = parallelRuns;
+    s.steals = steals;
+    s.perItemNs = perItemNs;
+    s.overheadNs = overheadNs;
+    return s;
+}
+
+void FanoutPool::forEach(size_t n, const function<void(size_t, size_t)>& body) {
+    if (n == 0) return;
+    auto t0 = chrono::steady_clock::now();
+    if (queues.empty() || n < threshold()) {
+        body(0, n);
+        ++inlineRuns;
+        // tiny runs are mostly timer noise
+        if (n >= MIN_SHARD) {
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+            perItemNs = ewma(perItemNs, ns / n);
+        }
+        return;
+    }
+
+    size_t threadsUsed = queues.size() + 1;
+    size_t shards = min(threadsUsed * SHARDS_PER_THREAD, max<size_t>(2, n / MIN_SHARD));
+    size_t shardSize = (n + shards - 1) / shards;
+    shards = (n + shardSize - 1) / shardSize;
+
+    Batch batch;
+    batch.body = &body;
+    batch.pending = shards;
+    size_t q = nextQueue.fetch_add(1);
+    for (size_t begin = 0; begin < n; begin += shardSize, ++q) {
+        Queue &queue = *queues[q % queues.size()];
+        lock_guard<mutex> lock(queue.mtx);
+        queue.tasks.push_back(Task{&batch, begin, min(n, begin + shardSize)});
+    }
+    {
+        lock_guard<mutex> lock(idleMutex);
+        queued += shards;
+    }
+    idle.notify_all();
+
+    // help out instead of waiting; this may run other callers' shards too
+    Task t;
+    while (batch.pending > 0 && steal(queues.size(), t)) runTask(t);
+    {
+        unique_lock<mutex> lock(batch.doneMutex);
+        batch.done.wait(lock, [&batch] { return batch.pending == 0; });
+    }
+    ++parallelRuns;
+
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+    double ideal = perItemNs * n / static_cast<double>(parallelism);
+    overheadNs = ewma(overheadNs, max(0.0, ns - ideal));
+}
+
+bool FanoutPool::popOwn(size_t self, Task& out) {
+    Queue &queue = *queues[self];
+    lock_guard<mutex> lock(queue.mtx);
+    if (queue.tasks.empty()) return false;
+    out = queue.tasks.back();
+    queue.tasks.pop_back();
+    --queued;
+    return true;
+}
+
+// Take the oldest task of some other queue; `self` == workerCount() for callers
+bool FanoutPool::steal(size_t self, Task& out) {
+    size_t count = queues.size();
+    size_t start = self < count ? self + 1 : nextQueue.load();
+    for (size_t i = 0; i < count; ++i) {
+        size_t victim = (start + i) % count;
+        if (victim == self) continue;
+        Queue &queue = *queues[victim];
+        lock_guard<mutex> lock(queue.mtx);
+        if (queue.tasks.empty()) continue;
+        out = queue.tasks.front();
+        queue.tasks.pop_front();
+        --queued;
+        if (self < count) ++steals;
+        return true;
+    }
+    return false;
+}
+
+void FanoutPool::runTask(const Task& t) {
+    (*t.batch->body)(t.begin, t.end);
+    // decrement under the lock: the caller may destroy the batch as soon as
+    // it sees zero
+    lock_guard<mutex> lock(t.batch->doneMutex);
+    if (--t.batch->pending == 0) t.batch->done.notify_all();
+}
+
+void FanoutPool::workerLoop(size_t self) {
+    while (true) {
+        Task t;
+        if (popOwn(self, t) || steal(self, t)) {
+            runTask(t);
+            continue;
+        }
+        unique_lock<mutex> lock(idleMutex);
+        idle.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping) return;
+    }
+}
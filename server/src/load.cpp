@@ -0,0 +1,157 @@
+// messenger-load: build a database from a dump read on stdin.
+//
+//   messenger-load [--db users.sqlite] < data.mdump
+//
+// The target must not exist yet. It is created with the server's schema and
+// then filled with journaling and syncs off, in large transactions, with the
+// full-text index dropped; the index is built once at the end, which is far
+// cheaper than maintaining it row by row. Any failure removes the partial
+// file. To load into a sharded store, load into one file and split it with
+// messenger-rebalance.
+
+#include "common.h"
+#include "dump_format.h"
+#include "sqlite_store.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const uint64_t LOAD_TXN_ROWS = 200000; // rows per transaction
+
+static bool exec(sqlite3 *db, const char *sql) {
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+        cerr << COLOR_RED << sql << ": " << (err ? err : "error") << COLOR_RESET << endl;
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+static string insertSql(const DumpTable& t) {
+    string sql = string("INSERT INTO ") + t.name + "(" + t.columns + ") VALUES(";
+    for (size_t c = 0; c < strlen(t.types); ++c) sql += c ? ",?" : "?";
+    return sql + ");";
+}
+
+static bool load(sqlite3 *db, FILE *in, uint64_t& rows) {
+    DumpReader dump(in);
+    if (!dump.readHeader()) {
+        cerr << COLOR_RED << "Not a messenger dump" << COLOR_RESET << endl;
+        return false;
+    }
+    sqlite3_stmt *stmts[256] = {nullptr};
+    bool ok = exec(db, "BEGIN;");
+    uint64_t inTxn = 0;
+    auto t0 = chrono::steady_clock::now();
+    while (ok && dump.nextBlock()) {
+        const DumpTable &t = dump.table();
+        sqlite3_stmt *&stmt = stmts[t.id];
+        if (!stmt && sqlite3_prepare_v2(db, insertSql(t).c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << COLOR_RED << "Failed to prepare insert into " << t.name << ": " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+            ok = false;
+            break;
+        }
+        size_t ncols = strlen(t.types);
+        for (uint32_t r = 0; ok && r < dump.blockRows(); ++r) {
+            for (size_t c = 0; ok && c < ncols; ++c) {
+                int idx = static_cast<int>(c) + 1;
+                if (t.types[c] == 'i') {
+                    long long v;
+                    ok = dump.nextInt(v);
+                    if (ok) sqlite3_bind_int64(stmt, idx, v);
+                } else {
+                    string_view v;
+                    ok = dump.nextText(v);
+                    if (ok) sqlite3_bind_text(stmt, idx, v.data(), static_cast<int>(v.size()), SQLITE_STATIC);
+                }
+            }
+            if (!ok) break;
+            if (sqlite3_step(stmt) != SQLITE_DONE) {
+                cerr << COLOR_RED << "Insert into " << t.name << " failed: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+                ok = false;
+            }
+            sqlite3_reset(stmt);
+        }
+        rows += dump.blockRows();
+        inTxn += dump.blockRows();
+        if (ok && inTxn >= LOAD_TXN_ROWS) {
+            ok = exec(db, "COMMIT;") && exec(db, "BEGIN;");
+            inTxn = 0;
+            double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            cerr << "\r" << rows << " rows (" << static_cast<long long>(rows / max(secs, 0.001)) << "/s)" << flush;
+        }
+    }
+    if (dump.failed()) {
+        cerr << COLOR_RED << "\nDump is truncated or corrupt" << COLOR_RESET << endl;
+        ok = false;
+    }
+    for (auto s : stmts) sqlite3_finalize(s);
+    ok = ok && exec(db, "COMMIT;");
+    cerr << endl;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    string dbPath = "users.sqlite";
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--db" && i + 1 < argc) dbPath = argv[++i];
+        else {
+            cerr << "Usage: " << argv[0] << " [--db users.sqlite] < dump" << endl;
+            return 1;
+        }
+    }
+    struct stat st;
+    if (stat(dbPath.c_str(), &st) == 0) {
+        cerr << COLOR_RED << dbPath << " already exists; load only into a new database" << COLOR_RESET << endl;
+        return 1;
+    }
+
+    {
+        SqliteStore schema(dbPath);
+        if (!schema.open()) return 1;
+    }
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(dbPath.c_str(), &db) != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to open " << dbPath << COLOR_RESET << endl;
+        return 1;
+    }
+    // the search index goes away for the load and is rebuilt by the next open
+    bool ok = exec(db, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF; PRAGMA cache_size=-262144;") &&
+              exec(db, "DROP TRIGGER messages_fts_insert; DROP TRIGGER messages_fts_delete;"
+                       "DROP TRIGGER group_messages_fts_insert; DROP TRIGGER group_messages_fts_delete;"
+                       "DROP TABLE messages_fts; DROP TABLE group_messages_fts;");
+    uint64_t rows = 0;
+    auto t0 = chrono::steady_clock::now();
+    ok = ok && load(db, stdin, rows);
+    sqlite3_close(db);
+
+    if (ok) {
+        cerr << "Building search index..." << endl;
+        SqliteStore index(dbPath);
+        ok = index.open();
+    }
+    if (ok) {
+        // the load itself never synced; flush once now that everything is in place
+        int fd = ::open(dbPath.c_str(), O_RDONLY);
+        ok = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0) ::close(fd);
+    }
+    if (!ok) {
+        unlink(dbPath.c_str());
+        cerr << COLOR_RED << "Load failed; removed " << dbPath << COLOR_RESET << endl;
+        return 1;
+    }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    cerr << "Loaded " << rows << " rows in " << secs << " s" << endl;
+    return 0;
+}
@@ -0,0 +1,316 @@
+// messenger-log: render, filter and count the server's binary activity log.
+//
+//   messenger-log [filters] [server_activity.evlog ...]      (stdin if no file)
+//   messenger-log --stats [filters] [files ...]
+//
+// Rotated files, compressed (.evlog.gz) or not, are read the same way; name
+// them oldest first, e.g. server_activity-*.evlog.gz server_activity.evlog.
+//
+// Filters (all must match):
+//   --user NAME       records by NAME or about NAME
+//   --op OPCODE       one request type, e.g. DIRECT_MESSAGE or 28
+//   --kind KIND       note, connect, join, leave, request or inbox
+//   --since TIME      records at or after TIME ("YYYY-MM-DD[ HH:MM[:SS]]", local time)
+//   --until TIME      records before TIME
+//   --failed          failed requests only
+//
+// --stats prints totals per record kind and per request type (count,
+// failures, message bytes) and the busiest users (--top N, default 10)
+// instead of the records themselves.
+
+#include "common.h"
+#include "event_log_format.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+struct Filter {
+    string user;
+    int opcode = -1;
+    int kind = 0;
+    int64_t since = INT64_MIN;
+    int64_t until = INT64_MAX;
+    bool failedOnly = false;
+};
+
+struct OpTotals {
+    uint64_t count = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+};
+
+struct Totals {
+    uint64_t records = 0;
+    int64_t first = 0;
+    int64_t last = 0;
+    map<int, uint64_t> kinds;
+    map<int, OpTotals> ops;
+    unordered_map<string, uint64_t> users;
+};
+
+// Names of the ids seen so far in the current file, per NameSpace
+struct Names {
+    unordered_map<uint32_t, string> byId[NS_COUNT];
+
+    string of(NameSpace space, uint32_t id) const {
+        if (id == 0) return string();
+        auto it = byId[space].find(id);
+        return it == byId[space].end() ? "#" + to_string(id) : it->second;
+    }
+};
+
+static const char *KIND_NAMES[] = {"", "note", "name", "connect", "join", "leave", "request", "inbox"};
+
+static int kindByName(const string& name) {
+    for (int k = EV_NOTE; k <= EV_INBOX; ++k) {
+        if (name == KIND_NAMES[k]) return k;
+    }
+    return 0;
+}
+
+static bool parseTime(const string& text, int64_t& micros) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(text.c_str(), "%Y-%m-%d %H:%M:%S", &tm);
+    if (!end) end = strptime(text.c_str(), "%Y-%m-%d %H:%M", &tm);
+    if (!end) end = strptime(text.c_str(), "%Y-%m-%d", &tm);
+    if (!end || *end) return false;
+    tm.tm_isdst = -1;
+    micros = static_cast<int64_t>(mktime(&tm)) * 1000000;
+    return true;
+}
+
+static string formatTime(int64_t micros) {
+    time_t t = static_cast<time_t>(micros / 1000000);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
+
+static string requestLine(const EventRecord& rec, const string& text, const Names& names) {
+    const char *op = opcodeName(rec.opcode);
+    string line = op ? op : "OPCODE_" + to_string(rec.opcode);
+    line += " " + names.of(NS_USER, rec.user);
+    string target = rec.target ? names.of(targetSpace(rec.opcode), rec.target) : string();
+    bool textIsName = rec.opcode != MSG_BACKUP_REQUEST && !text.empty();
+    if (!target.empty()) line += " -> " + target;
+    else if (textIsName && (rec.other || !otherIsUser(rec.opcode))) line += " -> ?" + text;
+    if (otherIsUser(rec.opcode)) {
+        line += " member=" + (rec.other ? names.of(NS_USER, rec.other) : "?" + text);
+    }
+    if (rec.opcode == MSG_DIRECT_MESSAGE || rec.opcode == MSG_GROUP_MESSAGE || rec.opcode == MSG_CHANNEL_POST) {
+        line += " len=" + to_string(rec.value);
+    }
+    if (rec.opcode == MSG_CHANNEL_POST) line += " online=" + to_string(rec.other);
+    if (rec.opcode == MSG_BACKUP_REQUEST) line += " \"" + text + "\"";
+    if (rec.status == EV_STATUS_OK) line += " [ok]";
+    else if (rec.status == EV_STATUS_FAIL) line += " [fail]";
+    return line;
+}
+
+static string render(const EventRecord& rec, const string& text, const Names& names) {
+    string body;
+    switch (rec.kind) {
+    case EV_NOTE:
+        body = text;
+        break;
+    case EV_CONNECT: {
+        struct in_addr addr;
+        addr.s_addr = rec.target;
+        body = string("New connection from ") + inet_ntoa(addr) + ":" + to_string(rec.value);
+        break;
+    }
+    case EV_JOIN:
+        body = "User '" + names.of(NS_USER, rec.user) + "' " + (rec.opcode == MSG_SESSION_RESUME ? "resumed" : "joined") +
+               " (total=" + to_string(rec.value) + ")";
+        break;
+    case EV_LEAVE:
+        body = "User '" + names.of(NS_USER, rec.user) + "' left (total=" + to_string(rec.value) + ")";
+        break;
+    case EV_INBOX:
+        body = "Delivered " + to_string(rec.value) + " offline messages to " + names.of(NS_USER, rec.user);
+        break;
+    case EV_REQUEST:
+        body = requestLine(rec, text, names);
+        break;
+    default:
+        body = "(record kind " + to_string(rec.kind) + ")";
+    }
+    return "[" + formatTime(rec.micros) + "] " + body;
+}
+
+static bool matches(const EventRecord& rec, const string& text, const Names& names, const Filter& f) {
+    if (rec.micros < f.since || rec.micros >= f.until) return false;
+    if (f.kind && rec.kind != f.kind) return false;
+    if (f.opcode >= 0 && (rec.kind != EV_REQUEST || rec.opcode != f.opcode)) return false;
+    if (f.failedOnly && rec.status != EV_STATUS_FAIL) return false;
+    if (!f.user.empty()) {
+        bool about = names.of(NS_USER, rec.user) == f.user;
+        if (rec.kind == EV_REQUEST) {
+            about = about || (targetSpace(rec.opcode) == NS_USER && rec.target && names.of(NS_USER, rec.target) == f.user) ||
+                    (otherIsUser(rec.opcode) && rec.other && names.of(NS_USER, rec.other) == f.user) ||
+                    (rec.opcode != MSG_BACKUP_REQUEST && text == f.user);
+        }
+        if (!about) return false;
+    }
+    return true;
+}
+
+static void count(const EventRecord& rec, const Names& names, Totals& totals) {
+    if (totals.records == 0) totals.first = rec.micros;
+    totals.last = rec.micros;
+    ++totals.records;
+    ++totals.kinds[rec.kind];
+    if (rec.kind != EV_REQUEST) return;
+    OpTotals &op = totals.ops[rec.opcode];
+    ++op.count;
+    if (rec.status == EV_STATUS_FAIL) ++op.failed;
+    if (rec.opcode == MSG_DIRECT_MESSAGE || rec.opcode == MSG_GROUP_MESSAGE || rec.opcode == MSG_CHANNEL_POST) op.bytes += rec.value;
+    if (rec.user) ++totals.users[names.of(NS_USER, rec.user)];
+}
+
+static bool readExact(gzFile in, void *buf, size_t n) {
+    return gzread(in, buf, static_cast<unsigned>(n)) == static_cast<int>(n);
+}
+
+// Read one log file, plain or gzipped; false if it is not a log
+static bool readLog(gzFile in, const string& label, const Filter& f, Totals *totals) {
+    char magic[sizeof(EVLOG_MAGIC)];
+    uint32_t version = 0, recordSize = 0;
+    if (!readExact(in, magic, sizeof(magic)) || memcmp(magic, EVLOG_MAGIC, sizeof(magic)) != 0 ||
+        !readExact(in, &version, sizeof(version)) || !readExact(in, &recordSize, sizeof(recordSize))) {
+        cerr << COLOR_RED << label << ": not an activity log" << COLOR_RESET << endl;
+        return false;
+    }
+    if (version != EVLOG_VERSION || recordSize != sizeof(EventRecord)) {
+        cerr << COLOR_RED << label << ": unsupported log version " << version << COLOR_RESET << endl;
+        return false;
+    }
+    Names names;
+    EventRecord rec;
+    string text;
+    int got;
+    while ((got = gzread(in, &rec, sizeof(rec))) == static_cast<int>(sizeof(rec))) {
+        text.resize(rec.textLen);
+        if (rec.textLen && !readExact(in, &text[0], rec.textLen)) {
+            got = 1;
+            break;
+        }
+        if (rec.kind == EV_NAME) {
+            if (rec.opcode < NS_COUNT) names.byId[rec.opcode][rec.target] = text;
+            continue;
+        }
+        if (!matches(rec, text, names, f)) continue;
+        if (totals) count(rec, names, *totals);
+        else cout << render(rec, text, names) << '\n';
+    }
+    if (got != 0) {
+        // a server still writing, one that died mid-batch, or a damaged .gz
+        cerr << COLOR_YELLOW << label << ": ends in a partial record" << COLOR_RESET << endl;
+    }
+    return true;
+}
+
+static void printTotals(const Totals& totals, size_t top) {
+    if (totals.records == 0) {
+        cout << "No matching records" << endl;
+        return;
+    }
+    cout << totals.records << " records from " << formatTime(totals.first) << " to " << formatTime(totals.last) << "\n";
+    for (const auto &k : totals.kinds) {
+        cout << "  " << (k.first > 0 && k.first <= EV_INBOX ? KIND_NAMES[k.first] : "?") << ": " << k.second << "\n";
+    }
+    if (!totals.ops.empty()) {
+        cout << "requests:\n";
+        vector<pair<int, OpTotals>> ops(totals.ops.begin(), totals.ops.end());
+        sort(ops.begin(), ops.end(), [](const pair<int, OpTotals>& a, const pair<int, OpTotals>& b) {
+            return a.second.count > b.second.count;
+        });
+        for (const auto &op : ops) {
+            const char *name = opcodeName(op.first);
+            cout << "  " << (name ? name : to_string(op.first).c_str()) << ": " << op.second.count;
+            if (op.second.failed) cout << " failed=" << op.second.failed;
+            if (op.second.bytes) cout << " bytes=" << op.second.bytes;
+            cout << "\n";
+        }
+    }
+    if (!totals.users.empty()) {
+        vector<pair<string, uint64_t>> users(totals.users.begin(), totals.users.end());
+        sort(users.begin(), users.end(), [](const pair<string, uint64_t>& a, const pair<string, uint64_t>& b) {
+            return a.second != b.second ? a.second > b.second : a.first < b.first;
+        });
+        cout << "busiest users (" << users.size() << " active):\n";
+        for (size_t i = 0; i < users.size() && i < top; ++i) {
+            cout << "  " << users[i].first << ": " << users[i].second << "\n";
+        }
+    }
+    cout << flush;
+}
+
+int main(int argc, char *argv[]) {
+    Filter filter;
+    bool stats = false;
+    size_t top = 10;
+    vector<string> files;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool ok = true;
+        if (arg == "--user" && i + 1 < argc) filter.user = argv[++i];
+        else if (arg == "--op" && i + 1 < argc) {
+            string op = argv[++i];
+            filter.opcode = isdigit(static_cast<unsigned char>(op[0])) ? atoi(op.c_str()) : opcodeByName(op.c_str());
+            ok = filter.opcode >= 0;
+        }
+        else if (arg == "--kind" && i + 1 < argc) ok = (filter.kind = kindByName(argv[++i])) != 0;
+        else if (arg == "--since" && i + 1 < argc) ok = parseTime(argv[++i], filter.since);
+        else if (arg == "--until" && i + 1 < argc) ok = parseTime(argv[++i], filter.until);
+        else if (arg == "--failed") filter.failedOnly = true;
+        else if (arg == "--stats") stats = true;
+        else if (arg == "--top" && i + 1 < argc) top = static_cast<size_t>(max(1, atoi(argv[++i])));
+        else if (!arg.empty() && arg[0] != '-') files.push_back(arg);
+        else ok = false;
+        if (!ok) {
+            cerr << "Usage: " << argv[0] << " [--stats [--top N]] [--user NAME] [--op OPCODE] [--kind KIND]"
+                 << " [--since TIME] [--until TIME] [--failed] [server_activity.evlog ...]" << endl;
+            return 1;
+        }
+    }
+
+    static char buf[1 << 16];
+    setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+    Totals totals;
+    bool ok = true;
+    if (files.empty()) {
+        gzFile in = gzdopen(dup(STDIN_FILENO), "rb");
+        ok = in && readLog(in, "stdin", filter, stats ? &totals : nullptr);
+        if (in) gzclose(in);
+    }
+    for (const auto &path : files) {
+        gzFile in = gzopen(path.c_str(), "rb");
+        if (!in) {
+            cerr << COLOR_RED << "Failed to open " << path << COLOR_RESET << endl;
+            ok = false;
+            continue;
+        }
+        // names are per file: a restarted server numbers them afresh
+        ok = readLog(in, path, filter, stats ? &totals : nullptr) && ok;
+        gzclose(in);
+    }
+    if (stats) printTotals(totals, top);
+    cout << flush;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,164 @@
+#include "log_archiver.h"
+
+#include <dirent.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <vector>
+
+#include "common.h"
+
+using namespace std;
+
+// "-YYYYmmdd-HHMMSS-mmm" between the stem and the extension
+static const size_t STAMP_LEN = 20;
+// Bytes per read/gzwrite while compressing
+static const size_t CHUNK = 1 << 16;
+
+void LogArchiver::start(const string& logPath, int keepCount) {
+    if (worker.joinable()) return;
+    size_t slash = logPath.rfind('/');
+    dir = slash == string::npos ? string() : logPath.substr(0, slash + 1);
+    string name = logPath.substr(dir.size());
+    size_t dot = name.rfind('.');
+    stem = dot == string::npos || dot == 0 ? name : name.substr(0, dot);
+    ext = name.substr(stem.size());
+    keep = max(0, keepCount);
+    stopping = false;
+
+    // rotated files a stopped or crashed server did not get to
+    vector<string> pending;
+    if (DIR *d = opendir(dir.empty() ? "." : dir.c_str())) {
+        while (dirent *e = readdir(d)) {
+            bool compressed;
+            if (isRotated(e->d_name, compressed) && !compressed) pending.push_back(dir + e->d_name);
+        }
+        closedir(d);
+    }
+    sort(pending.begin(), pending.end());
+    {
+        lock_guard<mutex> lock(queueMutex);
+        queue.assign(pending.begin(), pending.end());
+    }
+    worker = thread(&LogArchiver::run, this);
+}
+
+void LogArchiver::stop() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        stopping = true;
+        wake.notify_one();
+    }
+    if (worker.joinable()) worker.join();
+}
+
+void LogArchiver::submit(const string& rotatedPath) {
+    lock_guard<mutex> lock(queueMutex);
+    queue.push_back(rotatedPath);
+    wake.notify_one();
+}
+
+string LogArchiver::rotatedName() const {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    char stamp[32];
+    size_t n = strftime(stamp, sizeof(stamp), "-%Y%m%d-%H%M%S", &tm);
+    snprintf(stamp + n, sizeof(stamp) - n, "-%03d", static_cast<int>(tv.tv_usec / 1000));
+    return dir + stem + stamp + ext;
+}
+
+bool LogArchiver::isRotated(const string& fileName, bool& compressed) const {
+    string name = fileName;
+    compressed = name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0;
+    if (compressed) name.resize(name.size() - 3);
+    if (name.size() != stem.size() + STAMP_LEN + ext.size()) return false;
+    if (name.compare(0, stem.size(), stem) != 0 || name.compare(name.size() - ext.size(), ext.size(), ext) != 0) return false;
+    const char *stamp = name.c_str() + stem.size();
+    for (size_t i = 0; i < STAMP_LEN; ++i) {
+        bool dash = i == 0 || i == 9 || i == 16;
+        if (dash ? stamp[i] != '-' : !isdigit(static_cast<unsigned char>(stamp[i]))) return false;
+    }
+    return true;
+}
+
+bool LogArchiver::compress(const string& path) {
+    FILE *in = fopen(path.c_str(), "rb");
+    if (!in) return errno == ENOENT; // already handled
+    string target = path + ".gz";
+    gzFile out = gzopen(target.c_str(), "wb6");
+    if (!out) {
+        fclose(in);
+        return false;
+    }
+    vector<char> buf(CHUNK);
+    bool ok = true;
+    size_t n;
+    while (ok && (n = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        ok = gzwrite(out, buf.data(), static_cast<unsigned>(n)) == static_cast<int>(n);
+    }
+    ok = !ferror(in) && ok;
+    fclose(in);
+    ok = gzclose(out) == Z_OK && ok;
+    if (!ok) {
+        // leave the original for the next start
+        unlink(target.c_str());
+        return false;
+    }
+    unlink(path.c_str());
+    return true;
+}
+
+void LogArchiver::prune() {
+    if (keep == 0) return;
+    vector<string> rotated;
+    if (DIR *d = opendir(dir.empty() ? "." : dir.c_str())) {
+        while (dirent *e = readdir(d)) {
+            bool compressed;
+            if (isRotated(e->d_name, compressed)) rotated.push_back(e->d_name);
+        }
+        closedir(d);
+    }
+    if (rotated.size() <= static_cast<size_t>(keep)) return;
+    // the stamp makes name order age order; a ".gz" and its original are the same file
+    sort(rotated.begin(), rotated.end());
+    size_t distinct = 0;
+    for (size_t i = 0; i < rotated.size(); ++i) {
+        if (i == 0 || rotated[i].compare(0, rotated[i - 1].size(), rotated[i - 1]) != 0) ++distinct;
+    }
+    size_t excess = distinct > static_cast<size_t>(keep) ? distinct - keep : 0;
+    for (size_t i = 0; i < rotated.size() && excess > 0; ++i) {
+        unlink((dir + rotated[i]).c_str());
+        bool pair = i + 1 < rotated.size() && rotated[i + 1].compare(0, rotated[i].size(), rotated[i]) == 0;
+        if (pair) unlink((dir + rotated[++i]).c_str());
+        --excess;
+    }
+}
+
+void LogArchiver::run() {
+    for (;;) {
+        string path;
+        {
+            unique_lock<mutex> lock(queueMutex);
+            wake.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping) break;
+            path = queue.front();
+            queue.pop_front();
+        }
+        if (compress(path)) {
+            archived.fetch_add(1, memory_order_relaxed);
+        } else {
+            cerr << COLOR_YELLOW << "Could not compress " << path << ": " << strerror(errno) << COLOR_RESET << endl;
+        }
+        prune();
+    }
+}
@@ -0,0 +1,613 @@
+#include "log_store.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+static const uint32_t LOG_MAGIC = 0x474f4c4d; // "MLOG"
+static const uint32_t LOG_INDEX_MAGIC = 0x58444943; // "CIDX"
+
+static size_t paddedSize(size_t n) {
+    return (n + 7) & ~static_cast<size_t>(7);
+}
+
+static uint32_t payloadCrc(const char *p, size_t n) {
+    return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(p), static_cast<uInt>(n)));
+}
+
+static string segmentName(uint64_t seq) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%020llu.seg", static_cast<unsigned long long>(seq));
+    return buf;
+}
+
+static string indexPath(const string& segmentPath) {
+    return segmentPath.substr(0, segmentPath.size() - 3) + "idx";
+}
+
+bool LogStore::open() {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << COLOR_RED << "Failed to create log store directory " << dir << ": " << strerror(errno) << COLOR_RESET << endl;
+        return false;
+    }
+    // collect existing segments in order
+    vector<uint64_t> seqs;
+    if (DIR *d = opendir(dir.c_str())) {
+        while (dirent *e = readdir(d)) {
+            unsigned long long seq;
+            char tail[8];
+            if (sscanf(e->d_name, "%20llu.%7s", &seq, tail) == 2 && strcmp(tail, "seg") == 0) seqs.push_back(seq);
+        }
+        closedir(d);
+    }
+    sort(seqs.begin(), seqs.end());
+    for (size_t i = 0; i < seqs.size(); ++i) {
+        if (!openSegment(seqs[i])) return false;
+        size_t index = segments.size() - 1;
+        bool sealed = i + 1 < seqs.size();
+        // sealed segments with an intact sparse index were verified when they
+        // were sealed; everything else gets the full CRC-checked replay
+        if (sealed && replayVerified(index)) continue;
+        if (!replaySegment(index)) return false;
+        if (sealed && !sealSegment(index)) return false;
+    }
+    if (segments.empty() && !openSegment(1)) return false;
+    return true;
+}
+
+void LogStore::close() {
+    for (auto &s : segments) {
+        if (s.map) munmap(const_cast<char*>(s.map), s.size);
+        if (s.fd >= 0) ::close(s.fd);
+    }
+    segments.clear();
+    users.clear();
+    credStamps.clear();
+    friends.clear();
+    groups.clear();
+    members.clear();
+    directIndex.clear();
+    groupIndex.clear();
+    directById.clear();
+    inbox.clear();
+    readMarks.clear();
+}
+
+bool LogStore::openSegment(uint64_t seq) {
+    Segment s;
+    s.seq = seq;
+    s.path = dir + "/" + segmentName(seq);
+    s.fd = ::open(s.path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (s.fd < 0) {
+        cerr << COLOR_RED << "Failed to open log segment " << s.path << ": " << strerror(errno) << COLOR_RESET << endl;
+        return false;
+    }
+    struct stat st;
+    s.size = (fstat(s.fd, &st) == 0) ? static_cast<uint64_t>(st.st_size) : 0;
+    segments.push_back(s);
+    return true;
+}
+
+// Map a segment read-only
+bool LogStore::mapSegment(Segment& s) {
+    if (s.map) return true;
+    if (s.size == 0) return false;
+    void *m = mmap(nullptr, s.size, PROT_READ, MAP_SHARED, s.fd, 0);
+    if (m == MAP_FAILED) {
+        cerr << COLOR_YELLOW << "Failed to map log segment " << s.path << ": " << strerror(errno)
+             << " (falling back to pread)" << COLOR_RESET << endl;
+        return false;
+    }
+    s.map = static_cast<const char*>(m);
+    return true;
+}
+
+// Once mapped, a sealed segment needs no descriptor; close it to keep one fd
+// per store rather than one per segment
+static void dropDescriptor(int& fd) {
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+// Seal a segment that will never be written again: map it and write its
+// sparse index. A failure to map only costs speed, reads fall back to pread.
+bool LogStore::sealSegment(size_t index) {
+    Segment &s = segments[index];
+    if (!mapSegment(s)) return true;
+    if (!writeIndex(s)) {
+        cerr << COLOR_YELLOW << "Failed to write index for log segment " << s.path << COLOR_RESET << endl;
+    }
+    dropDescriptor(s.fd);
+    return true;
+}
+
+bool LogStore::writeIndex(const Segment& s) {
+    vector<LogIndexEntry> entries;
+    uint64_t records = 0;
+    for (uint64_t off = 0; off + sizeof(LogRecordHeader) <= s.size; ++records) {
+        const LogRecordHeader *h = reinterpret_cast<const LogRecordHeader*>(s.map + off);
+        if (records % LOG_INDEX_STRIDE == 0) {
+            LogIndexEntry e{};
+            e.id = h->id;
+            e.offset = static_cast<uint32_t>(off);
+            e.kind = h->kind;
+            entries.push_back(e);
+        }
+        off += paddedSize(sizeof(LogRecordHeader) + h->a_len + h->b_len + h->body_len);
+    }
+    LogIndexHeader ih{};
+    ih.magic = LOG_INDEX_MAGIC;
+    ih.stride = LOG_INDEX_STRIDE;
+    ih.segment_size = s.size;
+    ih.records = records;
+    ih.entries = static_cast<uint32_t>(entries.size());
+    ih.crc = payloadCrc(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(LogIndexEntry));
+
+    // write to a temporary name and rename, so a crash never leaves a
+    // half-written index that would vouch for an unchecked segment
+    string path = indexPath(s.path);
+    string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    size_t bytes = entries.size() * sizeof(LogIndexEntry);
+    bool ok = ::write(fd, &ih, sizeof(ih)) == static_cast<ssize_t>(sizeof(ih)) &&
+              (bytes == 0 || ::write(fd, entries.data(), bytes) == static_cast<ssize_t>(bytes)) &&
+              fsync(fd) == 0;
+    ::close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool LogStore::loadIndex(const Segment& s, vector<LogIndexEntry>& entries, uint64_t& records) {
+    int fd = ::open(indexPath(s.path).c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    LogIndexHeader ih;
+    bool ok = read(fd, &ih, sizeof(ih)) == static_cast<ssize_t>(sizeof(ih)) &&
+              ih.magic == LOG_INDEX_MAGIC && ih.stride == LOG_INDEX_STRIDE && ih.segment_size == s.size;
+    if (ok) {
+        records = ih.records;
+        entries.resize(ih.entries);
+        size_t bytes = entries.size() * sizeof(LogIndexEntry);
+        ok = (bytes == 0 || read(fd, entries.data(), bytes) == static_cast<ssize_t>(bytes)) &&
+             payloadCrc(reinterpret_cast<const char*>(entries.data()), bytes) == ih.crc;
+    }
+    ::close(fd);
+    return ok;
+}
+
+// Replay a sealed segment straight from its mapping without CRC checks. The
+// record chain and the sampled index entries are checked before anything is
+// applied, so a segment changed after sealing falls back to the full replay.
+bool LogStore::replayVerified(size_t index) {
+    Segment &s = segments[index];
+    vector<LogIndexEntry> entries;
+    uint64_t records = 0;
+    if (!loadIndex(s, entries, records) || !mapSegment(s)) return false;
+    bool ok = true;
+    for (const auto &e : entries) {
+        if (e.offset + sizeof(LogRecordHeader) > s.size) { ok = false; break; }
+        const LogRecordHeader *h = reinterpret_cast<const LogRecordHeader*>(s.map + e.offset);
+        if (h->magic != LOG_MAGIC || h->id != e.id || h->kind != e.kind) { ok = false; break; }
+    }
+    uint64_t off = 0, seen = 0;
+    while (ok && off < s.size) {
+        if (off + sizeof(LogRecordHeader) > s.size) { ok = false; break; }
+        const LogRecordHeader *h = reinterpret_cast<const LogRecordHeader*>(s.map + off);
+        if (h->magic != LOG_MAGIC) { ok = false; break; }
+        off += paddedSize(sizeof(LogRecordHeader) + h->a_len + h->b_len + h->body_len);
+        ++seen;
+    }
+    if (!ok || off != s.size || seen != records) {
+        cerr << COLOR_YELLOW << "Index for log segment " << s.path << " does not match, rechecking" << COLOR_RESET << endl;
+        munmap(const_cast<char*>(s.map), s.size);
+        s.map = nullptr;
+        return false;
+    }
+    for (off = 0; off < s.size;) {
+        const LogRecordHeader *h = reinterpret_cast<const LogRecordHeader*>(s.map + off);
+        apply(*h, s.map + off + sizeof(LogRecordHeader), RecordLoc{static_cast<uint32_t>(index), static_cast<uint32_t>(off)});
+        off += paddedSize(sizeof(LogRecordHeader) + h->a_len + h->b_len + h->body_len);
+    }
+    dropDescriptor(s.fd);
+    return true;
+}
+
+// Read every record of one segment and apply it. A torn or corrupt tail (from
+// a crash mid-write) is cut off so new appends start at a record boundary.
+bool LogStore::replaySegment(size_t index) {
+    Segment &s = segments[index];
+    vector<char> data(s.size);
+    if (s.size && pread(s.fd, data.data(), s.size, 0) != static_cast<ssize_t>(s.size)) {
+        cerr << COLOR_RED << "Failed to read log segment " << s.path << COLOR_RESET << endl;
+        return false;
+    }
+    uint64_t off = 0;
+    while (off + sizeof(LogRecordHeader) <= s.size) {
+        LogRecordHeader h;
+        memcpy(&h, data.data() + off, sizeof(h));
+        size_t payload = static_cast<size_t>(h.a_len) + h.b_len + h.body_len;
+        size_t total = paddedSize(sizeof(h) + payload);
+        if (h.magic != LOG_MAGIC || off + total > s.size) break;
+        const char *p = data.data() + off + sizeof(h);
+        if (payloadCrc(p, payload) != h.crc) break;
+        apply(h, p, RecordLoc{static_cast<uint32_t>(index), static_cast<uint32_t>(off)});
+        off += total;
+    }
+    if (off != s.size) {
+        cerr << COLOR_YELLOW << "Truncating log segment " << s.path << " at " << off
+             << " (" << (s.size - off) << " trailing bytes invalid)" << COLOR_RESET << endl;
+        if (ftruncate(s.fd, static_cast<off_t>(off)) != 0) return false;
+        s.size = off;
+    }
+    return true;
+}
+
+void LogStore::apply(const LogRecordHeader& h, const char *payload, RecordLoc loc) {
+    string a(payload, h.a_len);
+    string b(payload + h.a_len, h.b_len);
+    switch (h.kind) {
+    case LOG_USER_ADD:
+        users[a] = string(payload + h.a_len + h.b_len, h.body_len);
+        credStamps[a] = h.ts;
+        break;
+    case LOG_USER_PASSWORD: {
+        users[a] = string(payload + h.a_len + h.b_len, h.body_len);
+        // always moves forward, even if the clock has stepped back
+        int64_t &stamp = credStamps[a];
+        stamp = max(stamp + 1, static_cast<int64_t>(h.ts));
+        break;
+    }
+    case LOG_USER_DELETE:
+        users.erase(a);
+        credStamps.erase(a);
+        break;
+    case LOG_FRIEND_PUT:
+        friends[make_pair(a, b)] = string(payload + h.a_len + h.b_len, h.body_len);
+        break;
+    case LOG_FRIEND_DELETE:
+        friends.erase(make_pair(a, b));
+        break;
+    case LOG_GROUP_CREATE:
+        groups[a] = b;
+        break;
+    case LOG_MEMBER_ADD:
+        members.insert(make_pair(a, b));
+        break;
+    case LOG_MEMBER_REMOVE:
+        members.erase(make_pair(a, b));
+        break;
+    case LOG_DIRECT:
+        directIndex[directKey(a, b)].push_back(loc);
+        lastDirectId = max<int64_t>(lastDirectId, h.id);
+        // direct ids are handed out sequentially from 1
+        if (h.id == static_cast<int64_t>(directById.size()) + 1) directById.push_back(loc);
+        break;
+    case LOG_GROUP_MESSAGE:
+        groupIndex[b].push_back(loc);
+        lastGroupId = max<int64_t>(lastGroupId, h.id);
+        break;
+    case LOG_INBOX_PUSH: {
+        // kept in id order; a message put back after a failed delivery can
+        // be older than the newest entry
+        vector<int64_t> &ids = inbox[a];
+        auto at = lower_bound(ids.begin(), ids.end(), h.id);
+        if (at == ids.end() || *at != h.id) ids.insert(at, h.id);
+        break;
+    }
+    case LOG_INBOX_TAKE: {
+        auto it = inbox.find(a);
+        if (it == inbox.end()) break;
+        vector<int64_t> &ids = it->second;
+        ids.erase(ids.begin(), upper_bound(ids.begin(), ids.end(), h.id));
+        if (ids.empty()) inbox.erase(it);
+        break;
+    }
+    case LOG_READ_MARK: {
+        int64_t &mark = readMarks[make_pair(a, b)];
+        mark = max(mark, h.id);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Encode one record into a single buffer and write it with one syscall,
+// rolling to a fresh segment first when the active one is full.
+bool LogStore::append(uint8_t kind, const string& a, const string& b, const string& body,
+                      int64_t id, int64_t ts) {
+    if (segments.empty()) return false;
+    if (a.size() > 0xffff || b.size() > 0xffff || body.size() > 0xffffffffu) return false;
+    size_t payload = a.size() + b.size() + body.size();
+    size_t total = paddedSize(sizeof(LogRecordHeader) + payload);
+    if (segments.back().size > 0 && segments.back().size + total > segmentBytes) {
+        size_t full = segments.size() - 1;
+        if (!openSegment(segments.back().seq + 1)) return false;
+        sealSegment(full);
+    }
+    Segment &s = segments.back();
+
+    string buf(total, '\0');
+    LogRecordHeader h{};
+    h.magic = LOG_MAGIC;
+    h.kind = kind;
+    h.a_len = static_cast<uint16_t>(a.size());
+    h.b_len = static_cast<uint16_t>(b.size());
+    h.body_len = static_cast<uint32_t>(body.size());
+    h.id = id;
+    h.ts = ts;
+    char *p = &buf[sizeof(h)];
+    memcpy(p, a.data(), a.size());
+    memcpy(p + a.size(), b.data(), b.size());
+    memcpy(p + a.size() + b.size(), body.data(), body.size());
+    h.crc = payloadCrc(p, payload);
+    memcpy(&buf[0], &h, sizeof(h));
+
+    ssize_t w = ::write(s.fd, buf.data(), buf.size());
+    if (w != static_cast<ssize_t>(buf.size())) {
+        // drop a partial record so the segment stays parseable
+        if (w > 0 && ftruncate(s.fd, static_cast<off_t>(s.size)) != 0) {
+            cerr << COLOR_RED << "Failed to roll back partial log write in " << s.path << COLOR_RESET << endl;
+        }
+        return false;
+    }
+    RecordLoc where{static_cast<uint32_t>(segments.size() - 1), static_cast<uint32_t>(s.size)};
+    s.size += buf.size();
+    apply(h, p, where);
+    return true;
+}
+
+// View one message record. Sealed segments are read in place from their
+// mapping; the active one is read into `scratch`, which must outlive the view.
+bool LogStore::readView(RecordLoc loc, MessageView& out, string& scratch) {
+    if (loc.segment >= segments.size()) return false;
+    const Segment &s = segments[loc.segment];
+    LogRecordHeader h;
+    const char *payload;
+    if (s.map) {
+        h = *reinterpret_cast<const LogRecordHeader*>(s.map + loc.offset);
+        payload = s.map + loc.offset + sizeof(LogRecordHeader);
+    } else {
+        if (pread(s.fd, &h, sizeof(h), loc.offset) != static_cast<ssize_t>(sizeof(h))) return false;
+        size_t n = static_cast<size_t>(h.a_len) + h.b_len + h.body_len;
+        scratch.resize(n);
+        if (n && pread(s.fd, &scratch[0], n, loc.offset + sizeof(h)) != static_cast<ssize_t>(n)) return false;
+        payload = scratch.data();
+    }
+    if (h.magic != LOG_MAGIC) return false;
+    out.id = h.id;
+    out.ts = h.ts;
+    out.sender = string_view(payload, h.a_len);
+    out.peer = string_view(payload + h.a_len, h.b_len);
+    out.content = string_view(payload + h.a_len + h.b_len, h.body_len);
+    return true;
+}
+
+int64_t LogStore::idAt(RecordLoc loc) {
+    const Segment &s = segments[loc.segment];
+    if (s.map) return reinterpret_cast<const LogRecordHeader*>(s.map + loc.offset)->id;
+    LogRecordHeader h;
+    if (pread(s.fd, &h, sizeof(h), loc.offset) != static_cast<ssize_t>(sizeof(h))) return 0;
+    return h.id;
+}
+
+// Microseconds since the epoch, for credential stamps
+static int64_t credentialClock() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool LogStore::addUser(const string& username, const string& password) {
+    if (users.count(username)) return false;
+    return append(LOG_USER_ADD, username, string(), password, 0, credentialClock());
+}
+
+bool LogStore::verifyUser(const string& username, const string& password) {
+    auto it = users.find(username);
+    return it != users.end() && it->second == password;
+}
+
+bool LogStore::changePassword(const string& username, const string& password) {
+    // like UPDATE on a missing row, changing an unknown user is not an error
+    if (!users.count(username)) return true;
+    return append(LOG_USER_PASSWORD, username, string(), password, 0, credentialClock());
+}
+
+bool LogStore::deleteUser(const string& username) {
+    if (!users.count(username)) return true;
+    return append(LOG_USER_DELETE, username, string(), string(), 0, 0);
+}
+
+bool LogStore::loadUsers(vector<string>& out) {
+    for (const auto &kv : users) out.push_back(kv.first);
+    return true;
+}
+
+bool LogStore::credentialStamp(const string& username, long long& out) {
+    auto it = credStamps.find(username);
+    if (it == credStamps.end()) return false;
+    out = it->second;
+    return true;
+}
+
+bool LogStore::putFriendRow(const string& user, const string& friendname, const string& status) {
+    return append(LOG_FRIEND_PUT, user, friendname, status, 0, 0);
+}
+
+bool LogStore::deleteFriendRow(const string& user, const string& friendname, bool pendingOnly) {
+    auto it = friends.find(make_pair(user, friendname));
+    if (it == friends.end()) return false;
+    if (pendingOnly && it->second != "pending") return false;
+    return append(LOG_FRIEND_DELETE, user, friendname, string(), 0, 0);
+}
+
+bool LogStore::loadFriendRows(vector<FriendRow>& out) {
+    for (const auto &kv : friends) out.push_back(FriendRow{kv.first.first, kv.first.second, kv.second});
+    return true;
+}
+
+bool LogStore::createGroup(const string& groupname, const string& owner) {
+    if (groups.count(groupname)) return false;
+    if (!append(LOG_GROUP_CREATE, groupname, owner, string(), 0, 0)) return false;
+    return addGroupMember(groupname, owner);
+}
+
+bool LogStore::addGroupMember(const string& groupname, const string& member) {
+    if (members.count(make_pair(groupname, member))) return true;
+    return append(LOG_MEMBER_ADD, groupname, member, string(), 0, 0);
+}
+
+bool LogStore::removeGroupMember(const string& groupname, const string& member) {
+    if (!members.count(make_pair(groupname, member))) return false;
+    return append(LOG_MEMBER_REMOVE, groupname, member, string(), 0, 0);
+}
+
+bool LogStore::loadGroups(vector<GroupRow>& out) {
+    for (const auto &kv : groups) out.push_back(GroupRow{kv.first, kv.second});
+    return true;
+}
+
+bool LogStore::loadGroupMembers(vector<GroupMemberRow>& out) {
+    for (const auto &m : members) out.push_back(GroupMemberRow{m.first, m.second});
+    return true;
+}
+
+long long LogStore::appendDirect(const string& sender, const string& receiver,
+                                 const string& content, long long ts) {
+    int64_t id = lastDirectId + 1;
+    if (!append(LOG_DIRECT, sender, receiver, content, id, ts)) return -1;
+    return id;
+}
+
+long long LogStore::appendGroup(const string& groupname, const string& sender,
+                                const string& content, long long ts) {
+    int64_t id = lastGroupId + 1;
+    if (!append(LOG_GROUP_MESSAGE, sender, groupname, content, id, ts)) return -1;
+    return id;
+}
+
+// Visit the newest `limit` records of one conversation index below `beforeId`,
+// oldest first. Ids grow with the index, so the cursor is a binary search.
+bool LogStore::scanTail(const vector<RecordLoc>& locs, int limit, long long beforeId,
+                        const HistoryVisitor& visit) {
+    size_t end = locs.size();
+    if (beforeId > 0) {
+        auto it = partition_point(locs.begin(), locs.end(),
+                                  [&](const RecordLoc& l) { return idAt(l) < beforeId; });
+        end = static_cast<size_t>(it - locs.begin());
+    }
+    size_t start = end > static_cast<size_t>(limit) ? end - limit : 0;
+    string scratch;
+    for (size_t i = start; i < end; ++i) {
+        MessageView m;
+        if (!readView(locs[i], m, scratch)) return false;
+        visit(m);
+    }
+    return true;
+}
+
+bool LogStore::scanDirectHistory(const string& a, const string& b, int limit, long long beforeId,
+                                 const HistoryVisitor& visit) {
+    auto it = directIndex.find(directKey(a, b));
+    if (it == directIndex.end()) return true;
+    return scanTail(it->second, limit, beforeId, visit);
+}
+
+bool LogStore::scanGroupHistory(const string& groupname, int limit, long long beforeId,
+                                const HistoryVisitor& visit) {
+    auto it = groupIndex.find(groupname);
+    if (it == groupIndex.end()) return true;
+    return scanTail(it->second, limit, beforeId, visit);
+}
+
+bool LogStore::inboxPush(const string& user, long long messageId) {
+    return append(LOG_INBOX_PUSH, user, string(), string(), messageId, 0);
+}
+
+bool LogStore::inboxTake(const string& user, int limit, vector<StoredMessage>& out) {
+    auto it = inbox.find(user);
+    if (it == inbox.end()) return true;
+    const vector<int64_t> &ids = it->second;
+    size_t n = min(ids.size(), static_cast<size_t>(limit));
+    if (n == 0) return true;
+    int64_t through = ids[n - 1];
+    string scratch;
+    for (size_t i = 0; i < n; ++i) {
+        if (ids[i] < 1 || ids[i] > static_cast<int64_t>(directById.size())) continue;
+        MessageView m;
+        if (!readView(directById[ids[i] - 1], m, scratch)) return false;
+        out.push_back(copyOf(m));
+    }
+    // `ids` is invalidated here: applying the take record trims the inbox
+    return append(LOG_INBOX_TAKE, user, string(), string(), through, 0);
+}
+
+bool LogStore::putLastRead(const string& user, const string& conv, long long lastRead) {
+    return append(LOG_READ_MARK, user, conv, string(), lastRead, 0);
+}
+
+// Counts come from walking each conversation index once; sealed segments
+// are mapped, so reading the senders is cheap
+bool LogStore::loadReadStates(vector<ReadStateRow>& out) {
+    auto markOf = [this](const string& user, const string& conv) -> int64_t {
+        auto it = readMarks.find(make_pair(user, conv));
+        return it == readMarks.end() ? 0 : it->second;
+    };
+    string scratch;
+    for (const auto &kv : directIndex) {
+        size_t nl = kv.first.find('\n');
+        string users[2] = {kv.first.substr(0, nl), kv.first.substr(nl + 1)};
+        if (users[0] == users[1] || kv.second.empty()) continue;
+        ReadStateRow rows[2];
+        for (int i = 0; i < 2; ++i) {
+            rows[i].user = users[i];
+            rows[i].conv = "@" + users[1 - i];
+            rows[i].lastRead = markOf(rows[i].user, rows[i].conv);
+        }
+        for (const auto &loc : kv.second) {
+            MessageView m;
+            if (!readView(loc, m, scratch)) return false;
+            for (auto &r : rows) {
+                r.newest = m.id;
+                if (m.sender != r.user && m.id > r.lastRead) ++r.unread;
+            }
+        }
+        out.push_back(rows[0]);
+        out.push_back(rows[1]);
+    }
+    for (const auto &kv : groupIndex) {
+        if (kv.second.empty()) continue;
+        string conv = "#" + kv.first;
+        for (auto it = members.lower_bound(make_pair(kv.first, string()));
+             it != members.end() && it->first == kv.first; ++it) {
+            ReadStateRow r;
+            r.user = it->second;
+            r.conv = conv;
+            r.lastRead = markOf(r.user, conv);
+            r.newest = idAt(kv.second.back());
+            // walk back only over the messages after the read mark
+            for (auto loc = kv.second.rbegin(); loc != kv.second.rend(); ++loc) {
+                MessageView m;
+                if (!readView(*loc, m, scratch)) return false;
+                if (m.id <= r.lastRead) break;
+                if (m.sender != r.user) ++r.unread;
+            }
+            out.push_back(r);
+        }
+    }
+    return true;
+}
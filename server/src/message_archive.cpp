@@ -0,0 +1,296 @@
+#include "message_archive.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+using namespace std;
+
+// Record layout inside the gzip stream; sender, peer and content follow
+struct ArchiveRecordHeader {
+    int64_t  id;
+    int64_t  ts;
+    uint16_t sender_len;
+    uint16_t peer_len;
+    uint32_t content_len;
+};
+static_assert(sizeof(ArchiveRecordHeader) == 24, "archive record layout changed");
+
+// One entry of a ".idx" file: a byte range of the archive holding whole gzip
+// members, and the ids of its first and last rows
+struct ArchiveIndexEntry {
+    int64_t offset;
+    int64_t length;
+    int64_t first_id;
+    int64_t last_id;
+};
+static_assert(sizeof(ArchiveIndexEntry) == 32, "archive index layout changed");
+
+// Compressed bytes read per pread
+static const size_t READ_CHUNK = 64 * 1024;
+
+bool RetentionPolicy::load(const string& path) {
+    ifstream in(path);
+    if (!in.is_open()) {
+        cerr << COLOR_RED << "Failed to open retention file " << path << COLOR_RESET << endl;
+        return false;
+    }
+    string line;
+    int lineno = 0;
+    while (getline(in, line)) {
+        ++lineno;
+        size_t hash = line.find('#');
+        if (hash != string::npos) line.erase(hash);
+        istringstream is(line);
+        string kind;
+        if (!(is >> kind)) continue;
+        string key;
+        long long days = -1;
+        if (kind == "default") {
+            is >> days;
+        } else if (kind == "group") {
+            string g;
+            is >> g >> days;
+            key = "g:" + g;
+        } else if (kind == "direct") {
+            string a, b;
+            is >> a >> b >> days;
+            key = a < b ? "d:" + a + "\n" + b : "d:" + b + "\n" + a;
+        }
+        if (days < 0 || (kind != "default" && key.size() <= 2)) {
+            cerr << COLOR_RED << "Bad retention rule at " << path << ":" << lineno << COLOR_RESET << endl;
+            return false;
+        }
+        if (kind == "default") defaultSeconds = days * 86400;
+        else overrides[key] = days * 86400;
+    }
+    return true;
+}
+
+long long RetentionPolicy::secondsFor(const string& key) const {
+    auto it = overrides.find(key);
+    return it != overrides.end() ? it->second : defaultSeconds;
+}
+
+bool MessageArchive::open() {
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        cerr << COLOR_RED << "Failed to create archive directory " << dir << ": " << strerror(errno) << COLOR_RESET << endl;
+        return false;
+    }
+    return true;
+}
+
+// Keys hold '\n' and arbitrary user text, so file names are the key in hex
+string MessageArchive::pathFor(const string& key, const char *suffix) const {
+    static const char digits[] = "0123456789abcdef";
+    string name;
+    name.reserve(key.size() * 2 + 4);
+    for (unsigned char c : key) {
+        name += digits[c >> 4];
+        name += digits[c & 15];
+    }
+    return dir + "/" + name + suffix;
+}
+
+bool MessageArchive::has(const string& key) const {
+    return access(pathFor(key).c_str(), F_OK) == 0;
+}
+
+// Index entries of an archive `size` bytes long. Entries are kept only while
+// each starts where the one before it ended and lies within the file, so a
+// torn or stale tail of the index is ignored.
+static vector<ArchiveIndexEntry> readIndex(int fd, off_t size) {
+    vector<ArchiveIndexEntry> entries;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) return entries;
+    entries.resize(static_cast<size_t>(st.st_size) / sizeof(ArchiveIndexEntry));
+    size_t bytes = entries.size() * sizeof(ArchiveIndexEntry);
+    if (bytes && pread(fd, entries.data(), bytes, 0) != static_cast<ssize_t>(bytes)) entries.clear();
+    int64_t end = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const auto &e = entries[i];
+        if (e.offset != end || e.length <= 0 || e.offset + e.length > size) {
+            entries.resize(i);
+            break;
+        }
+        end = e.offset + e.length;
+    }
+    return entries;
+}
+
+// Inflate the gzip members in bytes [offset, offset+length) of `fd` and pass
+// each whole record to `visit`. A truncated or damaged member ends the read
+// with the records before it.
+template <typename Visit>
+static void readRecords(int fd, off_t offset, off_t length, Visit visit) {
+    z_stream zs{};
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) return;
+    vector<unsigned char> in(READ_CHUNK), out(READ_CHUNK);
+    string plain;
+    size_t used = 0;
+    off_t end = offset + length;
+    bool done = false;
+    while (!done && offset < end) {
+        ssize_t n = pread(fd, in.data(), static_cast<size_t>(min<off_t>(in.size(), end - offset)), offset);
+        if (n <= 0) break;
+        offset += n;
+        zs.next_in = in.data();
+        zs.avail_in = static_cast<uInt>(n);
+        while (zs.avail_in > 0 && !done) {
+            zs.next_out = out.data();
+            zs.avail_out = static_cast<uInt>(out.size());
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            plain.append(reinterpret_cast<const char*>(out.data()), out.size() - zs.avail_out);
+            if (rc == Z_STREAM_END) {
+                // the next member, if any, starts right after this one
+                if (inflateReset(&zs) != Z_OK) done = true;
+            } else if (rc != Z_OK) {
+                done = true;
+            }
+            while (plain.size() - used >= sizeof(ArchiveRecordHeader)) {
+                ArchiveRecordHeader h;
+                memcpy(&h, plain.data() + used, sizeof(h));
+                size_t n = static_cast<size_t>(h.sender_len) + h.peer_len + h.content_len;
+                if (plain.size() - used - sizeof(h) < n) break;
+                const char *p = plain.data() + used + sizeof(h);
+                StoredMessage m;
+                m.id = h.id;
+                m.ts = h.ts;
+                m.sender.assign(p, h.sender_len);
+                m.peer.assign(p + h.sender_len, h.peer_len);
+                m.content.assign(p + h.sender_len + h.peer_len, h.content_len);
+                visit(move(m));
+                used += sizeof(h) + n;
+            }
+            if (used > READ_CHUNK) {
+                plain.erase(0, used);
+                used = 0;
+            }
+        }
+    }
+    inflateEnd(&zs);
+}
+
+bool MessageArchive::append(const string& key, const vector<StoredMessage>& rows) {
+    if (rows.empty()) return true;
+    string buf;
+    for (const auto &m : rows) {
+        ArchiveRecordHeader h{};
+        h.id = m.id;
+        h.ts = m.ts;
+        h.sender_len = static_cast<uint16_t>(min<size_t>(m.sender.size(), 0xffff));
+        h.peer_len = static_cast<uint16_t>(min<size_t>(m.peer.size(), 0xffff));
+        h.content_len = static_cast<uint32_t>(m.content.size());
+        buf.append(reinterpret_cast<const char*>(&h), sizeof(h));
+        buf.append(m.sender, 0, h.sender_len);
+        buf.append(m.peer, 0, h.peer_len);
+        buf.append(m.content);
+    }
+
+    lock_guard<mutex> lock(appendLocks[hash<string>()(key) % APPEND_LOCKS]);
+    string path = pathFor(key);
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return false;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0;
+    off_t start = ok ? st.st_size : 0;
+    if (ok) {
+        // gzclose closes the descriptor it was given, so hand it a duplicate
+        // and keep ours for the fsync
+        gzFile gz = gzdopen(dup(fd), "ab");
+        ok = gz != nullptr;
+        if (ok) {
+            ok = gzwrite(gz, buf.data(), static_cast<unsigned>(buf.size())) == static_cast<int>(buf.size());
+            ok = (gzclose(gz) == Z_OK) && ok;
+        }
+    }
+    ok = ok && fsync(fd) == 0 && fstat(fd, &st) == 0;
+    if (!ok) {
+        ::close(fd);
+        cerr << COLOR_RED << "Failed to append to archive " << path << COLOR_RESET << endl;
+        return false;
+    }
+    archived += rows.size();
+
+    // The index is only a shortcut: without it tail() reads the file from
+    // the last indexed member on, so it is written after the data and not
+    // fsynced.
+    string indexPath = pathFor(key, ".idx");
+    int ifd = ::open(indexPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (ifd < 0) {
+        ::close(fd);
+        cerr << COLOR_YELLOW << "Failed to open archive index " << indexPath << COLOR_RESET << endl;
+        return true;
+    }
+    vector<ArchiveIndexEntry> entries = readIndex(ifd, start);
+    int64_t indexed = entries.empty() ? 0 : entries.back().offset + entries.back().length;
+    vector<ArchiveIndexEntry> add;
+    if (indexed < start) {
+        // bytes from before the index existed or a crash before it was written
+        ArchiveIndexEntry gap{indexed, start - indexed, INT64_MAX, INT64_MIN};
+        readRecords(fd, indexed, start - indexed, [&gap](StoredMessage&& m) {
+            gap.first_id = min<int64_t>(gap.first_id, m.id);
+            gap.last_id = max<int64_t>(gap.last_id, m.id);
+        });
+        add.push_back(gap);
+    }
+    add.push_back(ArchiveIndexEntry{start, st.st_size - start, rows.front().id, rows.back().id});
+    off_t at = static_cast<off_t>(entries.size() * sizeof(ArchiveIndexEntry));
+    size_t bytes = add.size() * sizeof(ArchiveIndexEntry);
+    if (ftruncate(ifd, at) != 0 || pwrite(ifd, add.data(), bytes, at) != static_cast<ssize_t>(bytes)) {
+        cerr << COLOR_YELLOW << "Failed to update archive index " << indexPath << COLOR_RESET << endl;
+    }
+    ::close(ifd);
+    ::close(fd);
+    return true;
+}
+
+bool MessageArchive::tail(const string& key, long long beforeId, int limit, vector<StoredMessage>& out) {
+    if (limit <= 0) return true;
+    int fd = ::open(pathFor(key).c_str(), O_RDONLY);
+    if (fd < 0) return true;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    int ifd = ::open(pathFor(key, ".idx").c_str(), O_RDONLY);
+    vector<ArchiveIndexEntry> entries = readIndex(ifd, st.st_size);
+    if (ifd >= 0) ::close(ifd);
+    // whatever follows the indexed members may hold any ids
+    int64_t indexed = entries.empty() ? 0 : entries.back().offset + entries.back().length;
+    if (indexed < st.st_size) {
+        entries.push_back(ArchiveIndexEntry{indexed, st.st_size - indexed, INT64_MIN, INT64_MAX});
+    }
+
+    // Walk the members newest first, keeping the newest `limit` rows below
+    // beforeId. A member is read only if it may hold such a row newer than
+    // the oldest one kept. A pass interrupted between archiving and deleting
+    // rows archives them again next time, so an id may appear twice; the
+    // copies are identical and one is kept.
+    map<long long, StoredMessage> keep;
+    for (auto e = entries.rbegin(); e != entries.rend(); ++e) {
+        if (beforeId > 0 && e->first_id >= beforeId) continue;
+        if (keep.size() >= static_cast<size_t>(limit) && e->last_id <= keep.begin()->first) continue;
+        readRecords(fd, e->offset, e->length, [&](StoredMessage&& m) {
+            if (beforeId > 0 && m.id >= beforeId) return;
+            if (keep.size() >= static_cast<size_t>(limit) && m.id <= keep.begin()->first) return;
+            keep.emplace(m.id, move(m));
+            if (keep.size() > static_cast<size_t>(limit)) keep.erase(keep.begin());
+        });
+    }
+    ::close(fd);
+    for (auto &m : keep) out.push_back(move(m.second));
+    return true;
+}
@@ -0,0 +1,146 @@
+#include "online_backup.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+bool OnlineBackup::start(const vector<Source>& sources, const string& dir) {
+    if (active || sources.empty()) return false;
+    if (worker.joinable()) worker.join();
+
+    char stamp[32];
+    time_t now = time(nullptr);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    string target = dir + "/snapshot-" + stamp;
+    if ((mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) || mkdir(target.c_str(), 0755) != 0) {
+        setResult(string("failed: cannot create ") + target + ": " + strerror(errno));
+        return false;
+    }
+
+    stopRequested = false;
+    pagesDone = 0;
+    pagesTotal = 0;
+    longestStepUs = 0;
+    active = true;
+    worker = thread(&OnlineBackup::run, this, sources, target);
+    return true;
+}
+
+void OnlineBackup::cancel() {
+    stopRequested = true;
+    if (worker.joinable()) worker.join();
+}
+
+string OnlineBackup::status() const {
+    ostringstream os;
+    os.setf(ios::fixed);
+    os.precision(1);
+    lock_guard<mutex> lock(stateMutex);
+    if (active) {
+        int total = pagesTotal;
+        os << "running: " << current << " " << pagesDone << "/" << total << " pages";
+        if (total > 0) os << " (" << (100.0 * pagesDone / total) << "%)";
+    } else {
+        os << (result.empty() ? string("idle") : result);
+    }
+    os << ", longest step " << longestStepUs / 1000.0 << " ms";
+    return os.str();
+}
+
+void OnlineBackup::setResult(const string& text) {
+    lock_guard<mutex> lock(stateMutex);
+    result = text;
+}
+
+void OnlineBackup::run(vector<Source> sources, string target) {
+    size_t copied = 0;
+    for (const auto &src : sources) {
+        if (stopRequested || !copyOne(src, target)) break;
+        ++copied;
+    }
+    if (copied == sources.size()) setResult("done: " + target);
+    else if (stopRequested) setResult("cancelled: " + target);
+    active = false;
+}
+
+bool OnlineBackup::copyOne(const Source& src, const string& target) {
+    {
+        lock_guard<mutex> lock(stateMutex);
+        current = src.name;
+    }
+    string finalPath = target + "/" + src.name;
+    string partPath = finalPath + ".part";
+    sqlite3 *dest = nullptr;
+    if (sqlite3_open(partPath.c_str(), &dest) != SQLITE_OK) {
+        setResult("failed: cannot open " + partPath);
+        sqlite3_close(dest);
+        return false;
+    }
+    // the .part file is only trusted after the rename, so it needs no journal
+    // and no syncs of its own; otherwise the final step would fsync the whole
+    // copy while writers wait
+    sqlite3_exec(dest, "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;", nullptr, nullptr, nullptr);
+
+    sqlite3_backup *backup = nullptr;
+    {
+        shared_lock<shared_mutex> lock(*src.lock);
+        backup = sqlite3_backup_init(dest, "main", src.db, "main");
+    }
+    if (!backup) {
+        setResult(string("failed: ") + sqlite3_errmsg(dest));
+        sqlite3_close(dest);
+        remove(partPath.c_str());
+        return false;
+    }
+
+    // start writeback of each step's pages during the pause, so the fsync
+    // at the end does not flush the whole copy at once and stall writers'
+    // own commits behind it
+    int partFd = open(partPath.c_str(), O_RDONLY);
+    int rc = SQLITE_OK;
+    int doneBefore = pagesDone;
+    while (!stopRequested) {
+        auto t0 = chrono::steady_clock::now();
+        {
+            shared_lock<shared_mutex> lock(*src.lock);
+            rc = sqlite3_backup_step(backup, pagesPerStep);
+            int count = sqlite3_backup_pagecount(backup);
+            pagesTotal = doneBefore + count;
+            pagesDone = doneBefore + count - sqlite3_backup_remaining(backup);
+        }
+        long long us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - t0).count();
+        if (us > longestStepUs) longestStepUs = us;
+        if (rc == SQLITE_DONE) break;
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) break;
+        if (partFd >= 0) sync_file_range(partFd, 0, 0, SYNC_FILE_RANGE_WRITE);
+        this_thread::sleep_for(chrono::milliseconds(pauseMs));
+    }
+    if (partFd >= 0) close(partFd);
+    {
+        shared_lock<shared_mutex> lock(*src.lock);
+        sqlite3_backup_finish(backup);
+    }
+    sqlite3_close(dest);
+
+    if (rc != SQLITE_DONE) {
+        if (!stopRequested) setResult(string("failed: ") + src.name + ": " + sqlite3_errstr(rc));
+        remove(partPath.c_str());
+        return false;
+    }
+    int fd = open(partPath.c_str(), O_RDONLY);
+    bool synced = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!synced || rename(partPath.c_str(), finalPath.c_str()) != 0) {
+        setResult(string("failed: cannot rename ") + partPath + ": " + strerror(errno));
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,269 @@
+#include "outbox.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+// Frames written per writev
+static const size_t WRITE_BATCH = 32;
+// A blocking write that makes no progress for this long cuts the session off
+static const int SEND_TIMEOUT_SEC = 10;
+// Pending events per session; more distinct ones are dropped
+static const size_t EVENT_LANE_MAX = 32;
+// Regular frames waiting beyond which a session counts as backed up and
+// takes no new events
+static const size_t EVENT_SHED_QUEUE = 16;
+
+Frame makeFrame(int type, const string& username, const string& content) {
+    shared_ptr<Message> m = make_shared<Message>();
+    m->type = type;
+    strncpy(m->username, username.c_str(), sizeof(m->username)-1);
+    strncpy(m->content, content.c_str(), sizeof(m->content)-1);
+    return m;
+}
+
+void Outbox::start() {
+    timeval tv{};
+    tv.tv_sec = SEND_TIMEOUT_SEC;
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    writer = thread(&Outbox::run, this);
+}
+
+bool Outbox::alive() {
+    lock_guard<mutex> lock(queueMutex);
+    return !closing && !broken;
+}
+
+void Outbox::close() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (closing) return;
+        closing = true;
+        queue.clear();
+        events.clear();
+        headSent = 0;
+    }
+    // unblocks a writer stuck on a peer that stopped reading
+    shutdown(sock, SHUT_RDWR);
+    ready.notify_all();
+    if (writer.joinable()) writer.join();
+    // wait out a sendNow() or drain already writing; every later one sees
+    // `closing` under writeMutex and writes nothing, so the descriptor can
+    // be closed (and its number reused) once this returns
+    lock_guard<mutex> lock(writeMutex);
+}
+
+bool Outbox::push(const Frame& frame) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (closing || broken) return false;
+        if (queue.size() >= maxQueued) {
+            broken = true;
+            queue.clear();
+            events.clear();
+            headSent = 0;
+            shutdown(sock, SHUT_RDWR);
+            return false;
+        }
+        queue.push_back(frame);
+        if (draining) return true;
+        draining = true;
+    }
+    // write on the caller's thread while the socket has room
+    if (drain(false) == SOCKET_FULL) {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            handoff = true;
+        }
+        ready.notify_one();
+    }
+    return true;
+}
+
+Outbox::EventResult Outbox::pushEvent(uint64_t key, const Frame& frame) {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (closing || broken || handoff || queue.size() >= EVENT_SHED_QUEUE) return EVENT_DROPPED;
+        for (auto &e : events) {
+            if (e.first == key) {
+                e.second = frame;
+                return EVENT_COALESCED;
+            }
+        }
+        if (events.size() >= EVENT_LANE_MAX) return EVENT_DROPPED;
+        events.emplace_back(key, frame);
+        if (draining) return EVENT_QUEUED;
+        draining = true;
+    }
+    if (drain(false) == SOCKET_FULL) {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            handoff = true;
+        }
+        ready.notify_one();
+    }
+    return EVENT_QUEUED;
+}
+
+// Move pending events to the regular queue once it has run dry (caller holds
+// queueMutex); false if there were none
+bool Outbox::promoteEventsLocked() {
+    if (events.empty()) return false;
+    for (auto &e : events) queue.push_back(move(e.second));
+    events.clear();
+    return true;
+}
+
+// Time spent in sendNow() by this thread
+static thread_local long long sendUs = 0;
+
+long long Outbox::threadSendUs() {
+    return sendUs;
+}
+
+bool Outbox::sendNow(const void *data, size_t len) {
+    auto start = chrono::steady_clock::now();
+    bool ok = writeNow(data, len);
+    sendUs += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+bool Outbox::writeNow(const void *data, size_t len) {
+    lock_guard<mutex> lock(writeMutex);
+    if (!finishHeadLocked()) return false;
+    {
+        lock_guard<mutex> qlock(queueMutex);
+        if (closing || broken) return false;
+    }
+    if (writeAll(data, len)) return true;
+    fail();
+    return false;
+}
+
+// Complete a frame a non-blocking drain left half written (caller holds
+// writeMutex), so other bytes never land in the middle of it; false once
+// the session is closed or cut off
+bool Outbox::finishHeadLocked() {
+    Frame head;
+    size_t sent;
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (closing || broken) return false;
+        if (headSent == 0 || queue.empty()) return true;
+        head = queue.front();
+        sent = headSent;
+    }
+    if (!writeAll(reinterpret_cast<const char*>(head.get()) + sent, sizeof(Message) - sent)) {
+        fail();
+        return false;
+    }
+    // fail() may have emptied the queue meanwhile
+    lock_guard<mutex> lock(queueMutex);
+    if (!queue.empty() && queue.front() == head) {
+        queue.pop_front();
+        headSent = 0;
+    }
+    return true;
+}
+
+bool Outbox::writeAll(const void *data, size_t len) {
+    const char *p = static_cast<const char*>(data);
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// The peer is gone or stuck: drop the queue and shut the socket down so the
+// session's reader notices too
+void Outbox::fail() {
+    {
+        lock_guard<mutex> lock(queueMutex);
+        if (closing || broken) return;
+        broken = true;
+        queue.clear();
+        events.clear();
+        headSent = 0;
+    }
+    shutdown(sock, SHUT_RDWR);
+    ready.notify_all();
+}
+
+// Write queued frames until the queue is empty, or until the socket is full
+// when not `blocking`. The caller owns `draining`; it is released on
+// DRAINED and FAILED and kept for the writer thread on SOCKET_FULL.
+Outbox::DrainResult Outbox::drain(bool blocking) {
+    Frame batch[WRITE_BATCH];
+    while (true) {
+        // a pusher never waits for a blocking sendNow() to finish; the
+        // writer thread picks the queue up instead
+        unique_lock<mutex> wlock(writeMutex, defer_lock);
+        if (blocking) wlock.lock();
+        else if (!wlock.try_lock()) return SOCKET_FULL;
+        size_t count = 0;
+        size_t offset;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            if (queue.empty() && !closing && !broken) promoteEventsLocked();
+            if (queue.empty() || closing || broken) {
+                draining = false;
+                return closing || broken ? FAILED : DRAINED;
+            }
+            for (auto it = queue.begin(); it != queue.end() && count < WRITE_BATCH; ++it) batch[count++] = *it;
+            offset = headSent;
+        }
+
+        iovec iov[WRITE_BATCH];
+        for (size_t i = 0; i < count; ++i) {
+            iov[i].iov_base = const_cast<Message*>(batch[i].get());
+            iov[i].iov_len = sizeof(Message);
+        }
+        iov[0].iov_base = static_cast<char*>(iov[0].iov_base) + offset;
+        iov[0].iov_len -= offset;
+        msghdr mh{};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = count;
+        ssize_t n = sendmsg(sock, &mh, MSG_NOSIGNAL | (blocking ? 0 : MSG_DONTWAIT));
+        bool full = n < 0 && !blocking && (errno == EAGAIN || errno == EWOULDBLOCK);
+        for (size_t i = 0; i < count; ++i) batch[i].reset();
+        if (full) return SOCKET_FULL;
+        if (n <= 0) {
+            fail();
+            lock_guard<mutex> lock(queueMutex);
+            draining = false;
+            return FAILED;
+        }
+
+        lock_guard<mutex> lock(queueMutex);
+        size_t done = static_cast<size_t>(n);
+        while (done > 0 && !queue.empty()) {
+            size_t left = sizeof(Message) - headSent;
+            if (done < left) {
+                headSent += done;
+                break;
+            }
+            done -= left;
+            headSent = 0;
+            queue.pop_front();
+        }
+    }
+}
+
+void Outbox::run() {
+    while (true) {
+        {
+            unique_lock<mutex> lock(queueMutex);
+            ready.wait(lock, [this] { return closing || broken || handoff; });
+            if (closing || broken) return;
+            handoff = false;
+        }
+        drain(true);
+    }
+}
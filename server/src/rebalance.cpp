@@ -0,0 +1,320 @@
+// messenger-rebalance: change the shard count of a sharded store.
+//
+//   messenger-rebalance --to M [--base users]            copy phase, server may keep running
+//   messenger-rebalance --to M [--base users] --finish   switch over, server stopped
+//
+// The copy phase copies every row whose owner changes under the new ring to
+// its new shard, in small transactions so the live server's writes are only
+// held up briefly. It can be repeated. --finish brings the copies up to date,
+// removes moved rows from their old shards and records the new count; it only
+// touches what changed since the copy phase, which keeps the downtime short.
+// Running against an unsharded <base>.sqlite splits it into M shards and
+// leaves the original file in place.
+
+#include "common.h"
+#include "hash_ring.h"
+#include "sharded_store.h"
+#include "sqlite_store.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static const long long COPY_BATCH = 5000; // message ids per copy transaction
+
+// Owner shard of a name under the old and the new ring. The old ring is null
+// when splitting a single unsharded file, whose rows all count as moved.
+struct Rings {
+    const HashRing *from;
+    const HashRing *to;
+};
+
+static void shardFunction(sqlite3_context *ctx, int, sqlite3_value **argv, bool old) {
+    const Rings *rings = static_cast<const Rings*>(sqlite3_user_data(ctx));
+    const HashRing *ring = old ? rings->from : rings->to;
+    const unsigned char *name = sqlite3_value_text(argv[0]);
+    if (!ring || !name) {
+        sqlite3_result_int(ctx, -1);
+        return;
+    }
+    sqlite3_result_int(ctx, ring->shardOf(reinterpret_cast<const char*>(name)));
+}
+
+static void oldShard(sqlite3_context *ctx, int argc, sqlite3_value **argv) { shardFunction(ctx, argc, argv, true); }
+static void newShard(sqlite3_context *ctx, int argc, sqlite3_value **argv) { shardFunction(ctx, argc, argv, false); }
+
+static bool exists(const string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+// Run one statement with ?1 bound to `shard`; returns changed rows or -1
+static long long run(sqlite3 *db, const string& sql, int shard, long long lo = 0, long long hi = 0) {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << COLOR_RED << "prepare failed: " << sqlite3_errmsg(db) << "\n  " << sql << COLOR_RESET << endl;
+        return -1;
+    }
+    sqlite3_bind_int(stmt, 1, shard);
+    if (sqlite3_bind_parameter_count(stmt) >= 3) {
+        sqlite3_bind_int64(stmt, 2, lo);
+        sqlite3_bind_int64(stmt, 3, hi);
+    }
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        cerr << COLOR_RED << "statement failed: " << sqlite3_errmsg(db) << "\n  " << sql << COLOR_RESET << endl;
+        return -1;
+    }
+    return sqlite3_changes(db);
+}
+
+static bool exec(sqlite3 *db, const string& sql) {
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+        cerr << COLOR_RED << sql << ": " << (err ? err : "error") << COLOR_RESET << endl;
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+static sqlite3 *openShard(const string& path, Rings *rings) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to open " << path << COLOR_RESET << endl;
+        sqlite3_close(db);
+        return nullptr;
+    }
+    sqlite3_busy_timeout(db, 5000);
+    sqlite3_create_function(db, "old_shard", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, rings, oldShard, nullptr, nullptr);
+    sqlite3_create_function(db, "new_shard", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, rings, newShard, nullptr, nullptr);
+    return db;
+}
+
+// The small, mutable tables: name, columns, the name that decides the owner
+struct TableSpec {
+    const char *table;
+    const char *columns;
+    const char *owner;
+};
+
+static const TableSpec SMALL_TABLES[] = {
+    {"users", "username, password", "username"},
+    {"friends", "user, friend, status", "user"},
+    {"groups", "name, owner", "name"},
+    {"group_members", "groupname, member", "groupname"},
+    {"inbox", "user, msg_id", "user"},
+    {"channels", "name, owner", "name"},
+    {"channel_subscribers", "channel, user, cursor", "channel"},
+    {"read_state", "user, conv, last_read",
+     "CASE WHEN substr(conv, 1, 1) = '#' THEN substr(conv, 2) ELSE user END"},
+};
+
+static string ownedBy(const char *owner, const char *fn, const char *op) {
+    return string(fn) + "(" + owner + ") " + op + " ?1";
+}
+
+// Copy what target shard `t` owns from the attached `src`
+static bool copyFrom(sqlite3 *db, int t, long long& rows) {
+    for (const auto &spec : SMALL_TABLES) {
+        string sql = string("INSERT OR IGNORE INTO main.") + spec.table + "(" + spec.columns + ") SELECT " +
+                     spec.columns + " FROM src." + spec.table + " WHERE " + ownedBy(spec.owner, "new_shard", "=") + ";";
+        long long n = run(db, sql, t);
+        if (n < 0) return false;
+        rows += n;
+    }
+    // messages in id batches, each its own transaction
+    const char *messageTables[][3] = {
+        {"messages", "id, sender, receiver, content, ts", "(new_shard(sender) = ?1 OR new_shard(receiver) = ?1)"},
+        {"group_messages", "id, groupname, sender, content, ts", "new_shard(groupname) = ?1"},
+        {"channel_messages", "id, channel, sender, content, ts", "new_shard(channel) = ?1"},
+    };
+    for (const auto &mt : messageTables) {
+        sqlite3_stmt *stmt = nullptr;
+        string maxSql = string("SELECT COALESCE(MAX(id), 0) FROM src.") + mt[0] + ";";
+        if (sqlite3_prepare_v2(db, maxSql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) return false;
+        long long maxId = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_finalize(stmt);
+        string sql = string("INSERT OR IGNORE INTO main.") + mt[0] + "(" + mt[1] + ") SELECT " + mt[1] +
+                     " FROM src." + mt[0] + " WHERE id > ?2 AND id <= ?3 AND " + mt[2] + ";";
+        for (long long lo = 0; lo < maxId; lo += COPY_BATCH) {
+            if (!exec(db, "BEGIN IMMEDIATE;")) return false;
+            long long n = run(db, sql, t, lo, lo + COPY_BATCH);
+            if (n < 0 || !exec(db, "COMMIT;")) {
+                exec(db, "ROLLBACK;");
+                return false;
+            }
+            rows += n;
+        }
+    }
+    return true;
+}
+
+// Fill target shard `t` from every source; with `resync`, first drop its
+// copies of moved keys in the small tables so deletions since the copy phase
+// (taken inboxes, removed friends, left groups) carry over
+static bool fillTarget(const string& base, const vector<string>& sources, bool legacy,
+                       int t, Rings *rings, bool resync) {
+    string path = ShardedStore::shardPath(base, t);
+    {
+        // create the schema, indexes and triggers of a new shard
+        SqliteStore schema(path);
+        if (!schema.open()) return false;
+    }
+    sqlite3 *db = openShard(path, rings);
+    if (!db) return false;
+    bool ok = true;
+    if (resync) {
+        ok = exec(db, "BEGIN IMMEDIATE;");
+        for (const auto &spec : SMALL_TABLES) {
+            if (!ok) break;
+            string moved = legacy ? ownedBy(spec.owner, "new_shard", "=")
+                                  : ownedBy(spec.owner, "new_shard", "=") + " AND " + ownedBy(spec.owner, "old_shard", "!=");
+            ok = run(db, string("DELETE FROM main.") + spec.table + " WHERE " + moved + ";", t) >= 0;
+        }
+        ok = ok && exec(db, "COMMIT;");
+        if (!ok) exec(db, "ROLLBACK;");
+    }
+    long long rows = 0;
+    for (size_t s = 0; ok && s < sources.size(); ++s) {
+        if (!legacy && static_cast<int>(s) == t) continue;
+        if (!exists(sources[s])) continue;
+        sqlite3_stmt *stmt = nullptr;
+        sqlite3_prepare_v2(db, "ATTACH DATABASE ? AS src;", -1, &stmt, nullptr);
+        sqlite3_bind_text(stmt, 1, sources[s].c_str(), -1, SQLITE_STATIC);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        if (!ok) {
+            cerr << COLOR_RED << "Failed to attach " << sources[s] << ": " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+            break;
+        }
+        ok = copyFrom(db, t, rows);
+        exec(db, "DETACH DATABASE src;");
+    }
+    sqlite3_close(db);
+    if (ok) cout << "shard " << t << ": copied " << rows << " rows" << endl;
+    return ok;
+}
+
+// Remove from old shard `s` everything it no longer owns
+static bool purgeSource(const string& path, int s, Rings *rings) {
+    sqlite3 *db = openShard(path, rings);
+    if (!db) return false;
+    bool ok = exec(db, "BEGIN IMMEDIATE;");
+    long long rows = 0;
+    for (const auto &spec : SMALL_TABLES) {
+        if (!ok) break;
+        long long n = run(db, string("DELETE FROM ") + spec.table + " WHERE " + ownedBy(spec.owner, "new_shard", "!=") + ";", s);
+        ok = n >= 0;
+        rows += max(0LL, n);
+    }
+    const char *messageDeletes[] = {
+        "DELETE FROM messages WHERE new_shard(sender) != ?1 AND new_shard(receiver) != ?1;",
+        "DELETE FROM group_messages WHERE new_shard(groupname) != ?1;",
+        "DELETE FROM channel_messages WHERE new_shard(channel) != ?1;",
+    };
+    for (const char *sql : messageDeletes) {
+        if (!ok) break;
+        long long n = run(db, sql, s);
+        ok = n >= 0;
+        rows += max(0LL, n);
+    }
+    ok = ok && exec(db, "COMMIT;");
+    if (!ok) exec(db, "ROLLBACK;");
+    sqlite3_close(db);
+    if (ok) cout << path << ": removed " << rows << " moved rows" << endl;
+    return ok;
+}
+
+static void removeShardFile(const string& path) {
+    const char *suffixes[] = {"", "-wal", "-shm", "-journal"};
+    for (const char *sfx : suffixes) unlink((path + sfx).c_str());
+}
+
+int main(int argc, char *argv[]) {
+    string base = "users";
+    int target = 0;
+    bool finish = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--to" && i + 1 < argc) target = atoi(argv[++i]);
+        else if (arg == "--base" && i + 1 < argc) base = argv[++i];
+        else if (arg == "--finish") finish = true;
+        else target = 0, i = argc;
+    }
+    if (target < 1) {
+        cerr << "Usage: " << argv[0] << " --to SHARDS [--base users] [--finish]" << endl;
+        return 1;
+    }
+
+    int current = ShardedStore::recordedShards(base);
+    bool legacy = current == 0;
+    vector<string> sources;
+    if (legacy) {
+        if (!exists(base + ".sqlite")) {
+            cerr << COLOR_RED << "Nothing to rebalance: no " << ShardedStore::ringPath(base)
+                 << " or " << base << ".sqlite" << COLOR_RESET << endl;
+            return 1;
+        }
+        sources.push_back(base + ".sqlite");
+    } else {
+        for (int s = 0; s < current; ++s) sources.push_back(ShardedStore::shardPath(base, s));
+    }
+    if (!legacy && current == target) {
+        cout << "Already " << target << " shards" << endl;
+        return 0;
+    }
+
+    HashRing from(max(1, current)), to(target);
+    Rings rings{legacy ? nullptr : &from, &to};
+    string pending = base + ".rebalance";
+
+    // a finish interrupted after the copies were complete only has the purge left
+    bool purgeOnly = false;
+    {
+        ifstream in(pending);
+        int n = 0;
+        purgeOnly = finish && (in >> n) && n == target;
+    }
+
+    if (!purgeOnly) {
+        for (int t = 0; t < target; ++t) {
+            if (!fillTarget(base, sources, legacy, t, &rings, finish)) return 1;
+        }
+    }
+    if (!finish) {
+        cout << "Copy done; stop the server and run again with --finish to switch to " << target << " shards" << endl;
+        return 0;
+    }
+
+    {
+        ofstream out(pending, ios::trunc);
+        out << target << "\n";
+    }
+    if (!legacy) {
+        for (int s = 0; s < current; ++s) {
+            if (s >= target) removeShardFile(sources[s]);
+            else if (!purgeSource(sources[s], s, &rings)) return 1;
+        }
+    }
+    {
+        ofstream out(ShardedStore::ringPath(base), ios::trunc);
+        out << target << "\n";
+        if (!out.good()) {
+            cerr << COLOR_RED << "Failed to write " << ShardedStore::ringPath(base) << COLOR_RESET << endl;
+            return 1;
+        }
+    }
+    unlink(pending.c_str());
+    cout << "Now " << target << " shards; start the server with --shards " << target << endl;
+    if (legacy) cout << base << ".sqlite was left in place and is no longer used" << endl;
+    return 0;
+}
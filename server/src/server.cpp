@@ -1,25 +1,83 @@
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
 #include <vector>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
 #include <algorithm>
+#include <unordered_map>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include "common.h"
-#include <sqlite3.h>
 #include <fstream>
 #include <chrono>
 #include <ctime>
 #include <iomanip>
+#include <sstream>
+#include "message_cache.h"
+#include "friend_graph.h"
+#include "user_directory.h"
+#include "group_directory.h"
+#include "channel_directory.h"
+#include "message_store.h"
+#include "sqlite_store.h"
+#include "log_store.h"
+#include "message_archive.h"
+#include "online_backup.h"
+#include "session_tokens.h"
+#include "sharded_store.h"
+#include "unread_tracker.h"
+#include "name_table.h"
+#include "event_coalescer.h"
+#include "fanout_pool.h"
+#include "request_gate.h"
+#include "rate_limiter.h"
+#include "opcode_stats.h"
+#include "outbox.h"
+#include "activity_log.h"
+#include <array>
+#include <memory>
+#include <functional>
+#include <string_view>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <set>
 
 using namespace std;
 
+// Byte budget for one history response; leaves room for the "...\n" marker
+static const size_t HISTORY_BUDGET = BUFFER_SIZE - 64;
+
+// Compaction moves at most this many rows per store lock hold, waits for
+// COMPACT_QUIET_MS without foreground writes before each batch and pauses
+// COMPACT_PAUSE_MS after it
+static const int COMPACT_BATCH = 500;
+static const long long COMPACT_QUIET_MS = 200;
+static const int COMPACT_PAUSE_MS = 20;
+
+// Repeated typing events from one user in one conversation within this
+// window are absorbed
+static const long long TYPING_WINDOW_MS = 1000;
+
+// Channel posts per fetch response
+static const int CHANNEL_FETCH_LIMIT = 100;
+
+// Search results per response page
+static const int SEARCH_PAGE = 20;
+
+// Offline messages taken from the inbox and pushed per send
+static const int INBOX_BATCH = 256;
+
+// Frames a session may fall behind by before it is cut off
+static const size_t OUTBOX_MAX_FRAMES = 8192;
+
 struct ClientInfo {
     int socket;
-    string username;
+    UserId user;
     sockaddr_in address;
 };
 
@@ -27,114 +85,300 @@ class MessengerServer {
 private:
     int server_socket;
     vector<ClientInfo> clients;
+    // user -> outbound queues of that user's live sessions (guarded by clients_mutex)
+    unordered_map<UserId, vector<shared_ptr<Outbox>>> sessions;
+    // user -> newest direct message id written to one of its sessions (guarded by clients_mutex)
+    unordered_map<UserId, long long> deliveredSeq;
     mutex clients_mutex;
     bool running;
     const string user_db_path = "users.sqlite"; // SQLite database file
+    const string log_store_dir = "messages.logd"; // segment directory for the log backend
+    const string shard_base = "users"; // users.shard<k>.sqlite for the sharded backend
+    // serializes account, friend, group and channel edits: the directory
+    // check, the store write and the in-memory update happen as one step
     mutex users_mutex;
-    sqlite3* db = nullptr;
-    // logging
-    ofstream logFile;
-    mutex log_mutex;
+    // persistent storage; calls hold the locks lockStore() hands out: the
+    // shards they touch for a sharded store, store_mutex for any other
+    unique_ptr<MessageStore> store;
+    shared_mutex store_mutex;
+    ShardedStore *shardedStore = nullptr; // store, when it is sharded
+    // server_activity.evlog: binary records written by a background thread
+    ActivityLog activityLog;
+    // newest messages per conversation, written through by saveMessage/saveGroupMessage
+    MessageCache historyCache;
+    // every user and group name seen since startup; the in-memory state below
+    // refers to them by id, names only appear at the store and the wire
+    NameTable userIds;
+    NameTable groupIds;
+    // in-memory mirror of the friends table, loaded in initDb and kept in sync by the friend helpers
+    FriendGraph friendGraph;
+    // sorted usernames for the all-users listing, kept in sync by addUser/deleteUser
+    UserDirectory userDirectory;
+    // groups, their members and their online members; kept in sync by the group helpers and session join/leave
+    GroupDirectory groupDirectory;
+    // broadcast channels: owners, sorted subscriber ids and their cursors;
+    // unavailable when the store has no channel support
+    NameTable channelIds;
+    ChannelDirectory channelDirectory;
+    bool channelsEnabled = false;
+    // ephemeral events (typing, receipts): never stored, low-priority lane
+    EventCoalescer typingWindow{TYPING_WINDOW_MS};
+    atomic<unsigned long long> events_sent{0};
+    atomic<unsigned long long> events_coalesced{0};
+    atomic<unsigned long long> events_dropped{0};
+    UnreadTracker unreadTracker;
+    // splits delivery to very large groups over worker threads
+    FanoutPool fanoutPool;
+    int fanout_workers = -1; // -1: one per spare core
+    // per-class admission: sheds queries and admin work while live delivery is slow
+    RequestGate requestGate;
+    // per-user token buckets by request class (limiters guarded by clients_mutex,
+    // kept after logout so reconnecting does not refill them)
+    RateLimit rateLimits[REQ_CLASS_COUNT] = {RateLimit::perSecond(200, 1000), RateLimit::perSecond(50, 100),
+                                             RateLimit::perSecond(5, 20)};
+    unordered_map<UserId, shared_ptr<RateLimiter>> rateLimiters;
+    atomic<unsigned long long> throttled[REQ_CLASS_COUNT] = {{0}, {0}, {0}};
+    // signed tokens that let a reconnecting client skip the password check
+    string session_key_path = "session.key";
+    SessionTokens sessionTokens;
+    // users allowed to trigger maintenance (MSG_BACKUP_REQUEST)
+    set<string> admins;
+    string backup_dir = "backups";
+    OnlineBackup backup{OnlineBackup::STEP_PAGES, OnlineBackup::PAUSE_MS};
+    // retention: old messages move from the store to compressed archive files
+    const string archive_dir = "messages.archive";
+    MessageArchive archive{archive_dir};
+    RetentionPolicy retention;
+    int compact_interval = 3600; // seconds between compaction passes
+    thread compactor;
+    mutex compact_mutex;
+    condition_variable compact_cv;
+    atomic<long long> last_write_ms{0}; // steady clock ms of the newest message write
+    atomic<uint64_t> compact_passes{0};
 
 public:
     MessengerServer() : server_socket(-1), running(false) {}
 
+    // Retention settings, applied before start()
+    void setRetentionDays(long long days) { retention.defaultSeconds = days * 86400; }
+    bool loadRetention(const string& path) { return retention.load(path); }
+    void setCompactInterval(int seconds) { compact_interval = max(1, seconds); }
+    void addAdmin(const string& user) { admins.insert(user); }
+    void setBackupDir(const string& dir) { backup_dir = dir; }
+    // Session resume settings, applied before start()
+    void setSessionKey(const string& path) { session_key_path = path; }
+    void setResumeTtl(long long seconds) { sessionTokens.setTtl(max(60LL, seconds)); }
+    // Group fan-out settings, applied before start()
+    void setFanoutWorkers(int n) { fanout_workers = n; }
+    void setFanoutThreshold(size_t n) { fanoutPool.setThreshold(n); }
+    void setLatencyTarget(long long ms) { requestGate.setTargetMs(ms); }
+    void setClassBudget(RequestClass c, int slots, long long maxWaitMs) { requestGate.configure(c, slots, maxWaitMs); }
+    void setRateLimit(RequestClass c, double perSecond, long long burst) { rateLimits[c] = RateLimit::perSecond(perSecond, burst); }
+    void setLogQueue(size_t slots, ActivityLog::Overflow policy) { activityLog.configure(slots, policy); }
+    void setLogRotation(unsigned long long maxBytes, long long maxSeconds, int keep) {
+        activityLog.setRotation(maxBytes, maxSeconds, keep);
+    }
+
+    // Pick the storage backend before start(): "sqlite" (default) or "log"
+    bool useStore(const string& kind) {
+        if (kind == "sqlite") store.reset(new SqliteStore(user_db_path));
+        else if (kind == "log") store.reset(new LogStore(log_store_dir));
+        else return false;
+        return true;
+    }
+
+    // Spread users and groups over `shards` SQLite files instead of one
+    bool useShards(int shards) {
+        if (shards < 1) return false;
+        store.reset(new ShardedStore(shard_base, shards));
+        return true;
+    }
+
     ~MessengerServer() {
         stop();
     }
 
-    // Initialize SQLite DB (create users table if not exists)
+    // Open the store and rebuild the in-memory directories from it
     bool initDb() {
         lock_guard<mutex> lock(users_mutex);
-        int rc = sqlite3_open(user_db_path.c_str(), &db);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to open user DB: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
-            if (db) sqlite3_close(db);
-            db = nullptr;
-            return false;
+        if (!store) store.reset(new SqliteStore(user_db_path));
+        if (!store->open()) return false;
+        shardedStore = dynamic_cast<ShardedStore*>(store.get());
+        StoreGuard guard = lockWholeStore();
+        return loadUserDirectory() && loadFriendGraph() && loadGroupDirectory() && loadReadStates() &&
+               loadChannelDirectory();
+    }
+
+    // Populate channelDirectory from the store (caller holds users_mutex and the whole store)
+    bool loadChannelDirectory() {
+        channelDirectory.clear();
+        vector<ChannelRow> channels;
+        vector<ChannelSubscriberRow> subscribers;
+        channelsEnabled = store->loadChannels(channels) && store->loadChannelSubscribers(subscribers);
+        if (!channelsEnabled) {
+            cerr << COLOR_YELLOW << "Warning: broadcast channels unavailable with the " << store->name() << " store" << COLOR_RESET << endl;
+            return true;
         }
+        for (const auto &c : channels) channelDirectory.addChannel(channelIds.intern(c.name), userIds.intern(c.owner), c.newest);
+        for (const auto &r : subscribers) {
+            channelDirectory.loadSubscriber(channelIds.intern(r.channel), userIds.intern(r.user), r.cursor);
+        }
+        channelDirectory.finishLoad();
+        return true;
+    }
 
-        const char *sql = "CREATE TABLE IF NOT EXISTS users (username TEXT PRIMARY KEY, password TEXT);";
-        char *err = nullptr;
-        rc = sqlite3_exec(db, sql, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create users table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
+    // Populate unreadTracker from the store (caller holds users_mutex and the whole store)
+    bool loadReadStates() {
+        unreadTracker.clear();
+        vector<ReadStateRow> rows;
+        if (!store->loadReadStates(rows)) {
+            cerr << COLOR_RED << "Failed to load read states" << COLOR_RESET << endl;
             return false;
         }
-        // Create friends table: store undirected friendships as two rows or requests
-        const char *sql2 = "CREATE TABLE IF NOT EXISTS friends (user TEXT, friend TEXT, status TEXT, PRIMARY KEY(user,friend));";
-        rc = sqlite3_exec(db, sql2, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create friends table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
-            return false;
+        for (const auto &r : rows) {
+            ReadState st;
+            st.lastRead = r.lastRead;
+            st.unread = r.unread;
+            st.newest = r.newest;
+            ConvKey conv = convKey(r.conv, true);
+            if (conv) unreadTracker.load(userIds.intern(r.user), conv, st);
         }
-        // Messages table: store direct messages between users
-        const char *sql3 =
-            "CREATE TABLE IF NOT EXISTS messages (\n"
-            "  id INTEGER PRIMARY KEY AUTOINCREMENT,\n"
-            "  sender TEXT NOT NULL,\n"
-            "  receiver TEXT NOT NULL,\n"
-            "  content TEXT NOT NULL,\n"
-            "  ts INTEGER NOT NULL DEFAULT (strftime('%s','now'))\n"
-            ");";
-        rc = sqlite3_exec(db, sql3, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create messages table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
+        return true;
+    }
+
+    // Populate groupDirectory from the store (caller holds users_mutex and the whole store)
+    bool loadGroupDirectory() {
+        groupDirectory.clear();
+        vector<GroupRow> groups;
+        vector<GroupMemberRow> members;
+        if (!store->loadGroups(groups) || !store->loadGroupMembers(members)) {
+            cerr << COLOR_RED << "Failed to load groups" << COLOR_RESET << endl;
             return false;
         }
-        // Groups table
-        const char *sql4 =
-            "CREATE TABLE IF NOT EXISTS groups (name TEXT PRIMARY KEY, owner TEXT);";
-        rc = sqlite3_exec(db, sql4, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create groups table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
+        for (const auto &g : groups) groupDirectory.addGroup(groupIds.intern(g.name), userIds.intern(g.owner));
+        for (const auto &m : members) groupDirectory.addMember(groupIds.intern(m.groupname), userIds.intern(m.member));
+        return true;
+    }
+
+    // Populate userDirectory from the store (caller holds users_mutex and the whole store)
+    bool loadUserDirectory() {
+        userDirectory.clear();
+        vector<string> names;
+        if (!store->loadUsers(names)) {
+            cerr << COLOR_RED << "Failed to load users" << COLOR_RESET << endl;
             return false;
         }
-        // Group members table
-        const char *sql5 =
-            "CREATE TABLE IF NOT EXISTS group_members (groupname TEXT, member TEXT, PRIMARY KEY(groupname,member));";
-        rc = sqlite3_exec(db, sql5, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create group_members table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
-            return false;
+        for (const auto &n : names) {
+            userDirectory.add(n);
+            userIds.intern(n);
         }
-        // Group messages table
-        const char *sql6 =
-            "CREATE TABLE IF NOT EXISTS group_messages ("
-            " id INTEGER PRIMARY KEY AUTOINCREMENT,"
-            " groupname TEXT NOT NULL,"
-            " sender TEXT NOT NULL,"
-            " content TEXT NOT NULL,"
-            " ts INTEGER NOT NULL DEFAULT (strftime('%s','now'))"
-            " );";
-        rc = sqlite3_exec(db, sql6, nullptr, nullptr, &err);
-        if (rc != SQLITE_OK) {
-            cerr << COLOR_RED << "Failed to create group_messages table: " << (err?err:"") << COLOR_RESET << endl;
-            if (err) sqlite3_free(err);
+        return true;
+    }
+
+    // Populate friendGraph from the store (caller holds users_mutex and the whole store)
+    bool loadFriendGraph() {
+        friendGraph.clear();
+        vector<FriendRow> rows;
+        if (!store->loadFriendRows(rows)) {
+            cerr << COLOR_RED << "Failed to load friends" << COLOR_RESET << endl;
             return false;
         }
+        for (const auto &r : rows) {
+            if (r.status != "accepted" && r.status != "pending") continue;
+            friendGraph.loadRow(userIds.intern(r.user), userIds.intern(r.friendname), r.status == "accepted");
+        }
         return true;
     }
 
+    // "@<peer>" / "#<group>" to a conversation key; 0 for a malformed or
+    // unknown conversation unless `create` interns the name
+    ConvKey convKey(const string& conv, bool create) {
+        if (conv.size() < 2) return 0;
+        string name = conv.substr(1);
+        NameTable &table = conv[0] == '#' ? groupIds : userIds;
+        NameId id = create ? table.intern(name) : table.find(name);
+        if (!id || (conv[0] != '#' && conv[0] != '@')) return 0;
+        return conv[0] == '#' ? groupConv(id) : directConv(id);
+    }
+
+    string convName(ConvKey conv) const {
+        if (isGroupConv(conv)) return "#" + groupIds.nameOf(convTarget(conv));
+        return "@" + userIds.nameOf(convTarget(conv));
+    }
+
+    // Free-text entry in the activity log, for the rare events that have no
+    // record of their own (startup, maintenance, failures)
     void logActivity(const string &msg) {
-        // thread-safe append with timestamp
-        lock_guard<mutex> lock(log_mutex);
-        if (!logFile.is_open()) return;
-        // timestamp
-        using namespace chrono;
-        auto now = system_clock::now();
-        time_t t = system_clock::to_time_t(now);
-        struct tm tm;
-        localtime_r(&t, &tm);
-        char buf[64];
-        strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
-        logFile << "[" << buf << "] " << msg << endl;
-        logFile.flush();
+        activityLog.note(msg);
+    }
+
+    // Typed entry in the activity log; queued, never formatted here
+    void logEvent(EventKind kind, int opcode, UserId user, uint32_t value = 0) {
+        EventRecord rec{};
+        rec.kind = kind;
+        rec.opcode = static_cast<uint16_t>(opcode);
+        rec.user = user;
+        rec.value = value;
+        activityLog.write(rec);
+    }
+
+    // Locks held across store calls: exclusive ones around writes, shared
+    // ones around reads, so history and search run side by side
+    struct StoreGuard {
+        vector<unique_lock<shared_mutex>> exclusive;
+        vector<shared_lock<shared_mutex>> shared;
+    };
+
+    // Lock the shards holding `names` (users, groups, channels) in shard
+    // order, so calls on other shards proceed in parallel; an unsharded store
+    // has the one store_mutex. Take users_mutex, if needed, before this.
+    StoreGuard lockStore(initializer_list<string_view> names) {
+        return lockShards(shardsOf(names), false);
+    }
+
+    // The same for calls that only read
+    StoreGuard readLockStore(initializer_list<string_view> names) {
+        return lockShards(shardsOf(names), true);
+    }
+
+    // Lock every shard, for calls that visit them all
+    StoreGuard lockWholeStore() {
+        return lockShards(allShards(), false);
+    }
+
+    StoreGuard readLockWholeStore() {
+        return lockShards(allShards(), true);
+    }
+
+    // Sorted, distinct shard ids of `names`; empty for an unsharded store
+    vector<int> shardsOf(initializer_list<string_view> names) const {
+        vector<int> ids;
+        if (!shardedStore) return ids;
+        ids.reserve(names.size());
+        for (string_view name : names) ids.push_back(shardedStore->shardOf(string(name)));
+        sort(ids.begin(), ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+        return ids;
+    }
+
+    vector<int> allShards() const {
+        vector<int> ids;
+        for (int i = 0; shardedStore && i < shardedStore->shardCount(); ++i) ids.push_back(i);
+        return ids;
+    }
+
+    StoreGuard lockShards(const vector<int>& ids, bool shared) {
+        StoreGuard held;
+        if (!shardedStore) {
+            if (shared) held.shared.emplace_back(store_mutex);
+            else held.exclusive.emplace_back(store_mutex);
+            return held;
+        }
+        for (int id : ids) {
+            if (shared) held.shared.emplace_back(shardedStore->lockOf(id));
+            else held.exclusive.emplace_back(shardedStore->lockOf(id));
+        }
+        return held;
     }
 
     // Trim leading/trailing whitespace
@@ -148,542 +392,836 @@ public:
 
     bool addUser(const string& username, const string& password) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string uname = trimStr(username);
         if (uname.empty()) return false;
-        const char *sql = "INSERT INTO users(username,password) VALUES(?,?);";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, uname.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        StoreGuard guard = lockStore({uname});
+        if (!store->addUser(uname, password)) return false;
+        userDirectory.add(uname);
+        userIds.intern(uname);
+        return true;
     }
 
     bool verifyUser(const string& username, const string& password) {
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string uname = trimStr(username);
         if (uname.empty()) return false;
-        const char *sql = "SELECT password FROM users WHERE username = ?;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, uname.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        bool ok = false;
-        if (rc == SQLITE_ROW) {
-            const unsigned char *stored = sqlite3_column_text(stmt, 0);
-            if (stored && password == reinterpret_cast<const char*>(stored)) ok = true;
-        }
-        sqlite3_finalize(stmt);
-        return ok;
+        StoreGuard guard = readLockStore({uname});
+        return store->verifyUser(uname, password);
     }
 
     bool changePassword(const string& username, const string& newpass) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string uname = trimStr(username);
         if (uname.empty()) return false;
-        const char *sql = "UPDATE users SET password = ? WHERE username = ?;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, newpass.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, uname.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        StoreGuard guard = lockStore({uname});
+        return store->changePassword(uname, newpass);
     }
 
     bool deleteUser(const string& username) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string uname = trimStr(username);
         if (uname.empty()) return false;
-        const char *sql = "DELETE FROM users WHERE username = ?;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, uname.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        StoreGuard guard = lockStore({uname});
+        if (!store->deleteUser(uname)) return false;
+        userDirectory.remove(uname);
+        return true;
     }
 
     // Friend system DB helpers
     bool sendFriendRequest(const string& from, const string& to) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string ufrom = trimStr(from);
         string uto = trimStr(to);
         if (ufrom.empty() || uto.empty()) return false;
         // Insert request with status 'pending'
-        const char *sql = "INSERT OR REPLACE INTO friends(user,friend,status) VALUES(?,?,?);";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, ufrom.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, uto.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, "pending", -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        StoreGuard guard = lockStore({ufrom});
+        if (!store->putFriendRow(ufrom, uto, "pending")) return false;
+        friendGraph.request(userIds.intern(ufrom), userIds.intern(uto));
+        return true;
     }
 
     // Group helpers
     bool createGroup(const string& groupname, const string& owner) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string g = trimStr(groupname);
         string o = trimStr(owner);
         if (g.empty() || o.empty()) return false;
         // ensure group doesn't already exist
-        const char *chk = "SELECT 1 FROM groups WHERE name = ? LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, chk, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        if (rc == SQLITE_ROW) return false; // exists
-
-        const char *ins = "INSERT INTO groups(name,owner) VALUES(?,?);";
-        if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, o.c_str(), -1, SQLITE_STATIC);
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        if (rc != SQLITE_DONE) return false;
-        // add owner as member
-        const char *minsert = "INSERT OR REPLACE INTO group_members(groupname,member) VALUES(?,?);";
-        if (sqlite3_prepare_v2(db, minsert, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, o.c_str(), -1, SQLITE_STATIC);
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        if (groupDirectory.exists(groupIds.find(g))) return false;
+        // the store adds the owner as first member
+        StoreGuard guard = lockStore({g});
+        if (!store->createGroup(g, o)) return false;
+        GroupId gid = groupIds.intern(g);
+        UserId ownerId = userIds.intern(o);
+        groupDirectory.addGroup(gid, ownerId);
+        groupDirectory.addMember(gid, ownerId);
+        return true;
     }
 
     bool addUserToGroup(const string& groupname, const string& user) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string g = trimStr(groupname);
         string u = trimStr(user);
         if (g.empty() || u.empty()) return false;
         // ensure group exists
-        const char *chk = "SELECT 1 FROM groups WHERE name = ? LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, chk, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        if (rc != SQLITE_ROW) return false;
-        const char *ins = "INSERT OR REPLACE INTO group_members(groupname,member) VALUES(?,?);";
-        if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, u.c_str(), -1, SQLITE_STATIC);
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        GroupId gid = groupIds.find(g);
+        if (!groupDirectory.exists(gid)) return false;
+        StoreGuard guard = lockStore({g});
+        if (!store->addGroupMember(g, u)) return false;
+        UserId uid = userIds.intern(u);
+        groupDirectory.addMember(gid, uid);
+        // history from before joining does not count as unread
+        long long seen = unreadTracker.joinGroup(uid, gid);
+        if (seen > 0) store->putLastRead(u, "#" + g, seen);
+        return true;
     }
 
     bool removeUserFromGroup(const string& groupname, const string& user) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string g = trimStr(groupname);
         string u = trimStr(user);
         if (g.empty() || u.empty()) return false;
-        const char *del = "DELETE FROM group_members WHERE groupname = ? AND member = ?;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, del, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, g.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, u.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        int changes = sqlite3_changes(db);
-        return (rc == SQLITE_DONE && changes > 0);
-    }
-
-    bool isMemberOfGroup(const string& groupname, const string& user) {
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
-        const char *q = "SELECT 1 FROM group_members WHERE groupname = ? AND member = ? LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        bool ok = false;
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(stmt) == SQLITE_ROW) ok = true;
-            sqlite3_finalize(stmt);
-        }
-        return ok;
+        StoreGuard guard = lockStore({g});
+        if (!store->removeGroupMember(g, u)) return false;
+        GroupId gid = groupIds.find(g);
+        UserId uid = userIds.find(u);
+        groupDirectory.removeMember(gid, uid);
+        unreadTracker.forget(uid, groupConv(gid));
+        return true;
+    }
+
+    bool isMemberOfGroup(const string& groupname, UserId user) {
+        return groupDirectory.isMember(groupIds.find(groupname), user);
     }
 
-    vector<string> listGroupsForUser(const string& user) {
+    vector<string> listGroupsForUser(UserId user) {
         vector<string> out;
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return out;
-        const char *sql = "SELECT groupname FROM group_members WHERE member = ? ORDER BY groupname;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return out;
-        sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *g = sqlite3_column_text(stmt, 0);
-            if (g) out.push_back(reinterpret_cast<const char*>(g));
-        }
-        sqlite3_finalize(stmt);
+        for (GroupId g : groupDirectory.groupsOf(user)) out.push_back(groupIds.nameOf(g));
+        sort(out.begin(), out.end());
         return out;
     }
 
-    bool saveGroupMessage(const string& groupname, const string& sender, const string& content) {
+    bool saveGroupMessage(GroupId group, UserId sender, const string& content) {
+        if (!store) return false;
+        const string &groupname = groupIds.nameOf(group);
+        const string &sendername = userIds.nameOf(sender);
+        StoreGuard guard = lockStore({groupname});
+        last_write_ms = steadyMillis();
+        long long ts = static_cast<long long>(time(nullptr));
+        long long id = store->appendGroup(groupname, sendername, content, ts);
+        if (id < 0) return false;
+        historyCache.append(groupKey(groupname), id, formatHistoryLine(ts, sendername, content));
+        unreadTracker.onGroup(group, sender, groupDirectory.members(group), id);
+        return true;
+    }
+
+    string getGroupHistory(const string& groupname, int limit = 200, long long beforeId = 0) {
+        return historyPage(groupKey(groupname), groupname, limit, beforeId, [&](int want, const HistoryVisitor& visit) {
+            return store->scanGroupHistory(groupname, want, beforeId, visit);
+        });
+    }
+
+    vector<string> listGroupMembers(const string& groupname) {
+        vector<string> out;
+        for (UserId u : groupDirectory.members(groupIds.find(groupname))) out.push_back(userIds.nameOf(u));
+        sort(out.begin(), out.end());
+        return out;
+    }
+
+    // Channel helpers
+    bool createChannel(const string& name, UserId owner) {
+        lock_guard<mutex> lock(users_mutex);
+        if (!store || !channelsEnabled) return false;
+        string c = trimStr(name);
+        if (c.empty() || channelDirectory.exists(channelIds.find(c))) return false;
+        StoreGuard guard = lockStore({c});
+        if (!store->createChannel(c, userIds.nameOf(owner))) return false;
+        channelDirectory.addChannel(channelIds.intern(c), owner, 0);
+        return true;
+    }
+
+    // New subscribers start at the newest post: the backlog stays fetchable
+    // but is not reported as unseen
+    bool subscribeChannel(const string& name, UserId user) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
-        const char *ins = "INSERT INTO group_messages(groupname,sender,content) VALUES(?,?,?);";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, sender.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, content.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
-    }
-
-    string getGroupHistory(const string& groupname, int limit = 200) {
+        if (!store || !channelsEnabled) return false;
+        ChannelId cid = channelIds.find(trimStr(name));
+        if (!channelDirectory.exists(cid)) return false;
+        if (channelDirectory.isSubscribed(cid, user)) return true;
+        long long cursor = channelDirectory.newest(cid);
+        StoreGuard guard = lockStore({channelIds.nameOf(cid)});
+        if (!store->addChannelSubscriber(channelIds.nameOf(cid), userIds.nameOf(user), cursor)) return false;
+        return channelDirectory.subscribe(cid, user, cursor);
+    }
+
+    bool unsubscribeChannel(const string& name, UserId user) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return string("No DB");
-        const char *q =
-            "SELECT sender, content, ts FROM group_messages WHERE groupname = ? ORDER BY id ASC LIMIT ?;";
-        sqlite3_stmt *stmt = nullptr;
+        if (!store || !channelsEnabled) return false;
+        ChannelId cid = channelIds.find(trimStr(name));
+        if (!channelDirectory.isSubscribed(cid, user)) return false;
+        StoreGuard guard = lockStore({channelIds.nameOf(cid)});
+        if (!store->removeChannelSubscriber(channelIds.nameOf(cid), userIds.nameOf(user))) return false;
+        channelDirectory.unsubscribe(cid, user);
+        return true;
+    }
+
+    // Store a post once; returns its id or -1
+    long long saveChannelPost(ChannelId channel, UserId sender, const string& content) {
+        if (!store) return -1;
+        StoreGuard guard = lockStore({channelIds.nameOf(channel)});
+        last_write_ms = steadyMillis();
+        long long ts = static_cast<long long>(time(nullptr));
+        long long id = store->appendChannel(channelIds.nameOf(channel), userIds.nameOf(sender), content, ts);
+        if (id > 0) channelDirectory.onPost(channel, id);
+        return id;
+    }
+
+    // Up to CHANNEL_FETCH_LIMIT posts after `afterId` (-1: after the
+    // subscriber's cursor), oldest first
+    string fetchChannel(ChannelId channel, UserId user, long long afterId) {
+        long long cursor = channelDirectory.cursorOf(channel, user);
+        if (cursor < 0 && channelDirectory.ownerOf(channel) != user) return string("Invalid channel or not subscribed\n");
+        if (afterId < 0) afterId = max(0LL, cursor);
+        vector<CachedMessage> rows;
+        {
+            if (!store) return string("No DB");
+            StoreGuard guard = readLockStore({channelIds.nameOf(channel)});
+            bool ok = store->scanChannelSince(channelIds.nameOf(channel), afterId, CHANNEL_FETCH_LIMIT + 1,
+                [&rows](const MessageView& m) {
+                    rows.push_back(CachedMessage{m.id, to_string(m.id) + " " + formatHistoryLine(m.ts, m.sender, m.content)});
+                });
+            if (!ok) return string("DB error");
+        }
+        if (rows.empty()) return string("(no messages)\n");
         string out;
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return string("DB error");
-        sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 2, limit);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *sender = sqlite3_column_text(stmt, 0);
-            const unsigned char *body = sqlite3_column_text(stmt, 1);
-            int ts = sqlite3_column_int(stmt, 2);
-            time_t t = static_cast<time_t>(ts);
-            struct tm lt;
-            localtime_r(&t, &lt);
-            char tbuf[64];
-            strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &lt);
-            string line;
-            line.reserve(128);
-            if (tbuf) line += string("[") + tbuf + "] ";
-            if (sender) line += reinterpret_cast<const char*>(sender);
-            line += ": ";
-            if (body) line += reinterpret_cast<const char*>(body);
-            line += "\n";
-            if (out.size() + line.size() > BUFFER_SIZE - 32) { out += "...\n"; break; }
-            out += line;
+        out.reserve(HISTORY_BUDGET);
+        size_t take = 0;
+        while (take < rows.size() && take < (size_t)CHANNEL_FETCH_LIMIT && out.size() + rows[take].line.size() <= HISTORY_BUDGET) {
+            out += rows[take].line;
+            ++take;
         }
-        sqlite3_finalize(stmt);
-        if (out.empty()) out = string("(no messages)\n");
+        if (take < rows.size()) out += "... (newer: " + to_string(take ? rows[take - 1].id : afterId) + ")\n";
         return out;
     }
 
-    vector<string> listGroupMembers(const string& groupname) {
-        vector<string> out;
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return out;
-        const char *sql = "SELECT member FROM group_members WHERE groupname = ? ORDER BY member;";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return out;
-        sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *m = sqlite3_column_text(stmt, 0);
-            if (m) out.push_back(reinterpret_cast<const char*>(m));
-        }
-        sqlite3_finalize(stmt);
-        return out;
+    // "<channel> <cursor> <newest>" per subscription, by name
+    string channelList(UserId user) {
+        vector<pair<string, ChannelId>> named;
+        for (ChannelId c : channelDirectory.channelsOf(user)) named.emplace_back(channelIds.nameOf(c), c);
+        sort(named.begin(), named.end());
+        string out;
+        for (const auto &n : named) {
+            string line = n.first + " " + to_string(channelDirectory.cursorOf(n.second, user)) + " " +
+                          to_string(channelDirectory.newest(n.second)) + "\n";
+            if (out.size() + line.size() > HISTORY_BUDGET) {
+                out += "...\n";
+                break;
+            }
+            out += line;
+        }
+        return out.empty() ? string("(no channels)\n") : out;
+    }
+
+    // Queue `frame` on every live session of `users` except those of `skip`,
+    // split over the fan-out pool when the list is large. The caller holds
+    // clients_mutex, which keeps the outboxes registered for the pool
+    // threads pushing on its behalf too.
+    void pushToSessions(const vector<UserId>& users, UserId skip, const Frame& frame) {
+        vector<Outbox*> targets;
+        targets.reserve(users.size());
+        for (UserId u : users) {
+            if (u == skip) continue;
+            auto sit = sessions.find(u);
+            if (sit == sessions.end()) continue;
+            for (const auto &out : sit->second) targets.push_back(out.get());
+        }
+        fanoutPool.forEach(targets.size(), [&targets, &frame](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) targets[i]->push(frame);
+        });
+    }
+
+    // Queue an ephemeral event about `about` ("<kind> <conv>[ <id>]") on the
+    // low-priority lane of every live session of `users` except those of
+    // `skip`. A pending event of the same kind and conversation is replaced,
+    // so a newer receipt supersedes an older one.
+    void sendEvent(const vector<UserId>& users, UserId skip, const string& about,
+                   const string& kindConv, long long id = 0) {
+        Frame frame = makeFrame(MSG_EVENT, about, id ? kindConv + " " + to_string(id) : kindConv);
+        uint64_t key = hash<string>()(about + "\n" + kindConv);
+        lock_guard<mutex> lock(clients_mutex);
+        for (UserId u : users) {
+            if (u == skip) continue;
+            auto sit = sessions.find(u);
+            if (sit == sessions.end()) continue;
+            for (const auto &out : sit->second) {
+                Outbox::EventResult r = out->pushEvent(key, frame);
+                if (r == Outbox::EVENT_QUEUED) ++events_sent;
+                else if (r == Outbox::EVENT_COALESCED) ++events_coalesced;
+                else ++events_dropped;
+            }
+        }
+    }
+
+    // MSG_EPHEMERAL from `user`: "typing @<peer>" or "typing #<group>"
+    void relayEphemeral(UserId user, const string& text) {
+        istringstream in(text);
+        string kind, conv;
+        in >> kind >> conv;
+        if (kind != "typing" || conv.size() < 2) return;
+        const string &name = userIds.nameOf(user);
+        ConvKey key = convKey(conv, false);
+        if (!key || !typingWindow.admit((static_cast<uint64_t>(user) << 33) | key, steadyMillis())) return;
+        if (isGroupConv(key)) {
+            GroupId gid = convTarget(key);
+            if (!groupDirectory.isMember(gid, user)) return;
+            sendEvent(groupDirectory.onlineMembers(gid), user, name, "typing " + conv);
+        } else {
+            sendEvent(vector<UserId>{convTarget(key)}, user, name, "typing @" + name);
+        }
     }
 
     bool acceptFriendRequest(const string& from, const string& to) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string ufrom = trimStr(from);
         string uto = trimStr(to);
         if (ufrom.empty() || uto.empty()) return false;
         // Only accept if there is a pending request from 'from' -> 'to'
-        const char *check_q = "SELECT status FROM friends WHERE user = ? AND friend = ? LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        bool hasPending = false;
-        if (sqlite3_prepare_v2(db, check_q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, ufrom.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, uto.c_str(), -1, SQLITE_STATIC);
-            int rc = sqlite3_step(stmt);
-            if (rc == SQLITE_ROW) {
-                const unsigned char *st = sqlite3_column_text(stmt, 0);
-                string s = st ? reinterpret_cast<const char*>(st) : string();
-                if (s == "pending") hasPending = true;
-            }
-            sqlite3_finalize(stmt);
-        } else {
-            return false;
-        }
-
-        if (!hasPending) {
-            // no pending request to accept
-            return false;
-        }
+        UserId fromId = userIds.find(ufrom);
+        UserId toId = userIds.find(uto);
+        if (!friendGraph.hasPending(fromId, toId)) return false;
 
         // set both directions to 'accepted'
-        const char *sql = "INSERT OR REPLACE INTO friends(user,friend,status) VALUES(?,?,?);";
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, ufrom.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, uto.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, "accepted", -1, SQLITE_STATIC);
-        int rc1 = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-
-        if (rc1 != SQLITE_DONE) return false;
-
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, uto.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, ufrom.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, "accepted", -1, SQLITE_STATIC);
-        int rc2 = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc2 == SQLITE_DONE);
+        StoreGuard guard = lockStore({ufrom, uto});
+        if (!store->putFriendRow(ufrom, uto, "accepted")) return false;
+        if (!store->putFriendRow(uto, ufrom, "accepted")) return false;
+        friendGraph.accept(fromId, toId);
+        return true;
     }
 
     bool refuseFriendRequest(const string& from, const string& to) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
+        if (!store) return false;
         string ufrom = trimStr(from);
         string uto = trimStr(to);
         if (ufrom.empty() || uto.empty()) return false;
-        const char *sql = "DELETE FROM friends WHERE user = ? AND friend = ? AND status = 'pending';";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, ufrom.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, uto.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        // sqlite3_step returns SQLITE_DONE even if no rows deleted; check changes
-        int changes = sqlite3_changes(db);
-        return (rc == SQLITE_DONE && changes > 0);
-    }
-
-    vector<string> listFriends(const string& username) {
+        StoreGuard guard = lockStore({ufrom});
+        if (!store->deleteFriendRow(ufrom, uto, true)) return false;
+        friendGraph.refuse(userIds.find(ufrom), userIds.find(uto));
+        return true;
+    }
+
+    vector<string> listFriends(UserId user) {
         vector<string> out;
-        
-        // First, get the friends list from DB with their friendship status
-        vector<pair<string, string>> friendsWithStatus;
-        {
-            lock_guard<mutex> lock(users_mutex);
-            if (!db) return out;
-            string uname = trimStr(username);
-            if (uname.empty()) return out;
-            
-            // Query 1: Get outgoing requests and accepted friends (where user = current user)
-            const char *sql = "SELECT friend, status FROM friends WHERE user = ? AND (status = 'accepted' OR status = 'pending');";
-            sqlite3_stmt *stmt = nullptr;
-            if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return out;
-            sqlite3_bind_text(stmt, 1, uname.c_str(), -1, SQLITE_STATIC);
-            while (sqlite3_step(stmt) == SQLITE_ROW) {
-                const unsigned char *f = sqlite3_column_text(stmt, 0);
-                const unsigned char *s = sqlite3_column_text(stmt, 1);
-                if (f) {
-                    string friendName = reinterpret_cast<const char*>(f);
-                    string friendStatus = s ? reinterpret_cast<const char*>(s) : "unknown";
-                    // Mark outgoing pending requests as "outgoing" to differentiate from incoming
-                    if (friendStatus == "pending") {
-                        friendStatus = "outgoing";
-                    }
-                    friendsWithStatus.push_back({friendName, friendStatus});
-                }
-            }
-            sqlite3_finalize(stmt);
-            
-            // Query 2: Get incoming friend requests (where friend = current user and status = pending)
-            const char *sql2 = "SELECT user FROM friends WHERE friend = ? AND status = 'pending';";
-            if (sqlite3_prepare_v2(db, sql2, -1, &stmt, nullptr) == SQLITE_OK) {
-                sqlite3_bind_text(stmt, 1, uname.c_str(), -1, SQLITE_STATIC);
-                while (sqlite3_step(stmt) == SQLITE_ROW) {
-                    const unsigned char *f = sqlite3_column_text(stmt, 0);
-                    if (f) {
-                        string friendName = reinterpret_cast<const char*>(f);
-                        friendsWithStatus.push_back({friendName, "pending"});
-                    }
-                }
-                sqlite3_finalize(stmt);
-            }
-        }
-        
+        if (!user) return out;
+
+        // accepted and outgoing rows first, then incoming requests, each by name
+        vector<UserId> accepted, outgoing, incoming;
+        friendGraph.relationsOf(user, accepted, outgoing, incoming);
+        struct Entry { const string *name; const char *status; UserId id; };
+        vector<Entry> friendsWithStatus;
+        friendsWithStatus.reserve(accepted.size() + outgoing.size() + incoming.size());
+        for (UserId f : accepted) friendsWithStatus.push_back({&userIds.nameOf(f), "accepted", f});
+        for (UserId f : outgoing) friendsWithStatus.push_back({&userIds.nameOf(f), "outgoing", f});
+        auto byName = [](const Entry& a, const Entry& b) {
+            int c = a.name->compare(*b.name);
+            return c != 0 ? c < 0 : strcmp(a.status, b.status) < 0;
+        };
+        sort(friendsWithStatus.begin(), friendsWithStatus.end(), byName);
+        size_t sorted = friendsWithStatus.size();
+        for (UserId f : incoming) friendsWithStatus.push_back({&userIds.nameOf(f), "pending", f});
+        sort(friendsWithStatus.begin() + sorted, friendsWithStatus.end(), byName);
+
         // Then check online status for each friend
+        lock_guard<mutex> lock(clients_mutex);
         for (const auto& fs : friendsWithStatus) {
-            bool isOnline = false;
-            {
-                lock_guard<mutex> lock(clients_mutex);
-                for (const auto& c : clients) {
-                    if (c.username == fs.first) {
-                        isOnline = true;
-                        break;
-                    }
-                }
-            }
+            bool isOnline = sessions.count(fs.id) > 0;
             string onlineStatus = isOnline ? "online" : "offline";
-            out.push_back(fs.first + ": " + fs.second + ", " + onlineStatus);
+            out.push_back(*fs.name + ": " + fs.status + ", " + onlineStatus);
         }
-        
+
         return out;
     }
 
-    string friendStatus(const string& viewer, const string& other) {
-        if (viewer == other) return string("self");
-        const char *q = "SELECT status FROM friends WHERE user = ? AND friend = ? LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        // check viewer -> other
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, viewer.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, other.c_str(), -1, SQLITE_STATIC);
-            int rc = sqlite3_step(stmt);
-            if (rc == SQLITE_ROW) {
-                const unsigned char *st = sqlite3_column_text(stmt, 0);
-                string s = st ? reinterpret_cast<const char*>(st) : "";
-                sqlite3_finalize(stmt);
-                if (s == "accepted") return string("friend");
-                if (s == "pending") return string("outgoing");
+    // One page of the user directory joined with the viewer's relations.
+    // Users are listed in name order starting after `after`, restricted to
+    // `prefix`; when more remain the page ends with "next: <last name>".
+    string listAllUsersWithStatus(UserId viewer, const string& prefix = string(),
+                                  const string& after = string(), int limit = 200) {
+        if (!viewer) return string("No viewer");
+        auto view = friendGraph.viewOf(viewer);
+        bool more = false;
+        vector<string> names = userDirectory.page(prefix, after, limit > 0 ? limit : 200, more);
+        string out = "Users and status:\n";
+        string last;
+        for (const auto &uname : names) {
+            UserId id = userIds.find(uname);
+            FriendGraph::Status status = FriendGraph::NONE;
+            if (id == viewer) status = FriendGraph::SELF;
+            else {
+                auto it = view.find(id);
+                if (it != view.end()) status = it->second;
             }
-            sqlite3_finalize(stmt);
-        }
-        // check other -> viewer (incoming pending)
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, other.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, viewer.c_str(), -1, SQLITE_STATIC);
-            int rc = sqlite3_step(stmt);
-            if (rc == SQLITE_ROW) {
-                const unsigned char *st = sqlite3_column_text(stmt, 0);
-                string s = st ? reinterpret_cast<const char*>(st) : "";
-                sqlite3_finalize(stmt);
-                if (s == "accepted") return string("friend");
-                if (s == "pending") return string("incoming");
-            }
-            sqlite3_finalize(stmt);
+            string line = "- " + uname + ": " + FriendGraph::statusName(status) + "\n";
+            if (out.size() + line.size() > BUFFER_SIZE - 64) { more = true; break; }
+            out += line;
+            last = uname;
         }
-        return string("none");
+        if (more && !last.empty()) out += "next: " + last + "\n";
+        return out;
     }
 
-    string listAllUsersWithStatus(const string& viewer) {
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return string("No DB");
-        string v = trimStr(viewer);
-        if (v.empty()) return string("No viewer");
-        const char *sql = "SELECT username FROM users ORDER BY username;";
-        sqlite3_stmt *stmt = nullptr;
+    // Check if two users are friends (accepted)
+    bool areFriends(UserId a, UserId b) {
+        if (a == b) return false;
+        return friendGraph.areFriends(a, b);
+    }
+
+    // Store a direct message; returns its id, or -1 on failure
+    long long saveMessage(UserId sender, const string& receiver, const string& content) {
+        if (!store) return -1;
+        const string &sendername = userIds.nameOf(sender);
+        StoreGuard guard = lockStore({sendername, receiver});
+        last_write_ms = steadyMillis();
+        long long ts = static_cast<long long>(time(nullptr));
+        long long id = store->appendDirect(sendername, receiver, content, ts);
+        if (id < 0) return -1;
+        // write through while still holding the store locks so a concurrent
+        // cache fill (which reads under one of them) cannot interleave
+        // between the insert and the append
+        historyCache.append(directKey(sendername, receiver), id, formatHistoryLine(ts, sendername, content));
+        unreadTracker.onDirect(sender, userIds.intern(receiver), id);
+        return id;
+    }
+
+    // Acknowledge everything in `conv` ("@peer" or "#group") as read
+    bool markRead(UserId user, const string& conv) {
+        if (conv.size() > 1 && conv[0] == '!') {
+            ChannelId cid = channelIds.find(conv.substr(1));
+            long long cursor = channelDirectory.advance(cid, user, channelDirectory.newest(cid));
+            if (cursor <= 0) return true;
+            if (!store) return false;
+            StoreGuard guard = lockStore({conv.substr(1)});
+            return store->putChannelCursor(conv.substr(1), userIds.nameOf(user), cursor);
+        }
+        ConvKey key = convKey(conv, false);
+        long long lastRead = key ? unreadTracker.markRead(user, key) : 0;
+        if (lastRead == 0) return true;
+        // read receipt for the other side of a direct chat
+        if (!isGroupConv(key)) {
+            const string &name = userIds.nameOf(user);
+            sendEvent(vector<UserId>{convTarget(key)}, user, name, "read @" + name, lastRead);
+        }
+        if (!store) return false;
+        // group read marks live with the group, direct ones with the user
+        const string &name = userIds.nameOf(user);
+        StoreGuard guard = isGroupConv(key) ? lockStore({conv.substr(1)}) : lockStore({name});
+        return store->putLastRead(name, conv, lastRead);
+    }
+
+    // "<conv> <unread> <lastRead>" per conversation with unread messages,
+    // most unread first; "...\n" ends a summary cut off by the frame size
+    string unreadSummary(UserId user) {
         string out;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return string("DB error");
-        out = "Users and status:\n";
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *u = sqlite3_column_text(stmt, 0);
-            if (!u) continue;
-            string uname = reinterpret_cast<const char*>(u);
-            string status = friendStatus(v, uname);
-            out += "- " + uname + ": " + status + "\n";
-            if (out.size() > BUFFER_SIZE - 64) { // safety truncation
+        for (const auto &e : unreadTracker.unreadOf(user)) {
+            string line = convName(e.conv) + " " + to_string(e.state.unread) + " " + to_string(e.state.lastRead) + "\n";
+            if (out.size() + line.size() > HISTORY_BUDGET) {
                 out += "...\n";
                 break;
             }
+            out += line;
         }
-        sqlite3_finalize(stmt);
         return out;
     }
 
-    // Check if two users are friends (accepted)
-    bool areFriends(const string& a, const string& b) {
-        if (a == b) return false;
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
-        const char *q = "SELECT 1 FROM friends WHERE user = ? AND friend = ? AND status = 'accepted' LIMIT 1;";
-        sqlite3_stmt *stmt = nullptr;
-        bool ok = false;
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, a.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, b.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(stmt) == SQLITE_ROW) ok = true;
-            sqlite3_finalize(stmt);
+    // Remember a direct message for a recipient with no live session
+    void queueOffline(UserId user, long long messageId) {
+        {
+            StoreGuard guard = lockStore({userIds.nameOf(user)});
+            if (!store || !store->inboxPush(userIds.nameOf(user), messageId)) {
+                cerr << COLOR_RED << "Failed to queue offline message for " << userIds.nameOf(user) << COLOR_RESET << endl;
+                return;
+            }
         }
-        if (ok) return true;
-        // Check reverse just in case (shouldn't be needed if both rows exist)
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, b.c_str(), -1, SQLITE_STATIC);
-            sqlite3_bind_text(stmt, 2, a.c_str(), -1, SQLITE_STATIC);
-            if (sqlite3_step(stmt) == SQLITE_ROW) ok = true;
-            sqlite3_finalize(stmt);
+        // the recipient may have logged in and drained the inbox between the
+        // online check and the push; deliver now rather than at the next login
+        shared_ptr<Outbox> out;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            auto it = sessions.find(user);
+            if (it != sessions.end() && !it->second.empty()) out = it->second.front();
         }
-        return ok;
+        if (out) deliverInbox(user, *out, 0);
     }
 
-    bool saveMessage(const string& sender, const string& receiver, const string& content) {
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
-        const char *ins = "INSERT INTO messages(sender,receiver,content) VALUES(?,?,?);";
-        sqlite3_stmt *stmt = nullptr;
-        if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, sender.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, receiver.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, content.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return rc == SQLITE_DONE;
-    }
-
-    string getConversationHistory(const string& a, const string& b, int limit = 100) {
-        lock_guard<mutex> lock(users_mutex);
-        if (!db) return string("No DB");
-        const char *q =
-            "SELECT sender, content, ts FROM messages\n"
-            "WHERE (sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?)\n"
-            "ORDER BY id ASC LIMIT ?;";
-        sqlite3_stmt *stmt = nullptr;
-        string out;
-        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return string("DB error");
-        sqlite3_bind_text(stmt, 1, a.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, b.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, b.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 4, a.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 5, limit);
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            const unsigned char *sender = sqlite3_column_text(stmt, 0);
-            const unsigned char *body = sqlite3_column_text(stmt, 1);
-            int ts = sqlite3_column_int(stmt, 2);
-            // format timestamp to human-readable
-            time_t t = static_cast<time_t>(ts);
-            struct tm lt;
-            localtime_r(&t, &lt);
-            char tbuf[64];
-            strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &lt);
-            string line;
-            line.reserve(128);
-            if (tbuf) line += string("[") + tbuf + "] ";
-            if (sender) line += reinterpret_cast<const char*>(sender);
-            line += ": ";
-            if (body) line += reinterpret_cast<const char*>(body);
-            line += "\n";
-            if (out.size() + line.size() > BUFFER_SIZE - 32) { out += "...\n"; break; }
+    // Push the user's undelivered direct messages to a session as MSG_TEXT
+    // frames, one send per batch; returns how many were sent. Messages at or
+    // below `floor` (the delivery position a resume token carries) reached
+    // the client before it dropped and are only cleared. A batch that could
+    // not be sent goes back into the inbox for the next login or resume.
+    size_t deliverInbox(UserId user, Outbox& out, long long floor) {
+        size_t total = 0;
+        while (out.alive()) {
+            vector<StoredMessage> batch;
+            {
+                StoreGuard guard = lockStore({userIds.nameOf(user)});
+                if (!store || !store->inboxTake(userIds.nameOf(user), INBOX_BATCH, batch)) break;
+            }
+            if (batch.empty()) break;
+            vector<Message> frames;
+            frames.reserve(batch.size());
+            map<string, long long> newestFrom; // sender -> newest id, for delivery receipts
+            for (const auto &m : batch) {
+                if (m.id <= floor) continue;
+                newestFrom[m.sender] = m.id;
+                Message f{};
+                f.type = MSG_TEXT;
+                strncpy(f.username, m.sender.c_str(), sizeof(f.username)-1);
+                strncpy(f.content, m.content.c_str(), sizeof(f.content)-1);
+                frames.push_back(f);
+            }
+            if (!frames.empty() && !out.sendNow(frames.data(), frames.size() * sizeof(Message))) {
+                requeueInbox(user, batch, floor);
+                break;
+            }
+            noteDelivered(user, batch.back().id);
+            const string &name = userIds.nameOf(user);
+            for (const auto &n : newestFrom) {
+                sendEvent(vector<UserId>{userIds.find(n.first)}, 0, name, "delivered @" + name, n.second);
+            }
+            total += frames.size();
+            if (batch.size() < (size_t)INBOX_BATCH) break;
+        }
+        return total;
+    }
+
+    // Put messages taken from the inbox but not delivered back into it
+    void requeueInbox(UserId user, const vector<StoredMessage>& batch, long long floor) {
+        const string &name = userIds.nameOf(user);
+        StoreGuard guard = lockStore({name});
+        for (const auto &m : batch) {
+            if (m.id <= floor) continue;
+            if (!store || !store->inboxPush(name, m.id)) {
+                cerr << COLOR_RED << "Failed to return message " << m.id << " to the inbox of " << name << COLOR_RESET << endl;
+            }
+        }
+    }
+
+    // Start an online backup of every SQLite file behind the store
+    string startBackup() {
+        if (backup.running()) return "already running";
+        vector<OnlineBackup::Source> sources;
+        {
+            StoreGuard guard = lockWholeStore();
+            if (SqliteStore *s = dynamic_cast<SqliteStore*>(store.get())) {
+                if (s->handle()) sources.push_back({"users.sqlite", s->handle(), &store_mutex});
+            } else if (ShardedStore *s = dynamic_cast<ShardedStore*>(store.get())) {
+                for (int i = 0; i < s->shardCount(); ++i) {
+                    sources.push_back({ShardedStore::shardPath(shard_base, i), s->shard(i).handle(), &s->lockOf(i)});
+                }
+            }
+        }
+        if (sources.empty()) return string("not supported by the ") + (store ? store->name() : "current") + " store";
+        if (!backup.start(sources, backup_dir)) return "could not start";
+        logActivity("Backup started into " + backup_dir);
+        return "started";
+    }
+
+    // Advance the user's delivery cursor (caller must not hold clients_mutex)
+    void noteDelivered(UserId user, long long id) {
+        lock_guard<mutex> lock(clients_mutex);
+        long long &seq = deliveredSeq[user];
+        seq = max(seq, id);
+    }
+
+    // The user's current credential stamp (MessageStore::credentialStamp);
+    // false if the account is gone
+    bool credentialStampOf(const string& name, long long& stamp) {
+        if (!store) return false;
+        StoreGuard guard = readLockStore({name});
+        return store->credentialStamp(name, stamp);
+    }
+
+    // Push a fresh resume token to a session that authenticated against
+    // credential stamp `stamp`. Once the password has changed or the account
+    // is gone the session gets no more tokens, so it cannot be resumed.
+    bool sendSessionToken(Outbox& out, UserId user, long long stamp) {
+        const string &name = userIds.nameOf(user);
+        long long current = 0;
+        if (!credentialStampOf(name, current) || current != stamp) return false;
+        long long seq = 0;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            auto it = deliveredSeq.find(user);
+            if (it != deliveredSeq.end()) seq = it->second;
+        }
+        string token = sessionTokens.issue(name, seq, stamp, static_cast<long long>(time(nullptr)));
+        Message resp{};
+        resp.type = MSG_SESSION_TOKEN;
+        strncpy(resp.username, "Server", sizeof(resp.username)-1);
+        strncpy(resp.content, token.c_str(), sizeof(resp.content)-1);
+        out.sendNow(&resp, sizeof(Message));
+        return true;
+    }
+
+    // Check a resume token: the signature and the expiry, then that the
+    // account's credential stamp is still the one the token was issued
+    // against (one point lookup in the store). Restores the delivery cursor
+    // the token carries if this process has none (e.g. after a restart);
+    // `seq` is set to that position and `stamp` to the credential stamp.
+    bool resumeSession(const string& token, UserId& user, long long& seq, long long& stamp) {
+        ResumeClaim claim;
+        if (!sessionTokens.verify(token, static_cast<long long>(time(nullptr)), claim)) return false;
+        long long current = 0;
+        if (!credentialStampOf(claim.user, current) || current != claim.stamp) return false;
+        user = userIds.intern(claim.user);
+        noteDelivered(user, claim.seq);
+        seq = claim.seq;
+        stamp = claim.stamp;
+        return true;
+    }
+
+    string getConversationHistory(const string& a, const string& b, int limit = 100, long long beforeId = 0) {
+        return historyPage(directKey(a, b), a, limit, beforeId, [&](int want, const HistoryVisitor& visit) {
+            return store->scanDirectHistory(a, b, want, beforeId, visit);
+        });
+    }
+
+    // One page of history: the newest `limit` lines below `beforeId` (0 = the
+    // latest page, served from the cache when possible). `scan` visits rows
+    // from the store, which formats them straight from its own buffers, under
+    // a shared lock on `owner`'s shard, so reads of one shard run side by
+    // side. When the store runs out, the rest of the page comes from the
+    // archive.
+    string historyPage(const string& key, const string& owner, int limit, long long beforeId,
+                       const function<bool(int, const HistoryVisitor&)>& scan) {
+        if (beforeId == 0) {
+            string lines;
+            long long olderThan = 0;
+            if (historyCache.tail(key, limit, HISTORY_BUDGET, lines, olderThan)) return renderHistory(move(lines), olderThan);
+        }
+
+        // older pages fetch one extra row to learn whether more remain
+        int want = beforeId ? limit + 1 : max(limit, (int)historyCache.windowSize());
+        vector<CachedMessage> rows;
+        rows.reserve(want);
+        {
+            if (!store) return string("No DB");
+            StoreGuard guard = readLockStore({owner});
+            bool ok = scan(want, [&rows](const MessageView& m) {
+                rows.push_back(CachedMessage{m.id, formatHistoryLine(m.ts, m.sender, m.content)});
+            });
+            if (!ok) return string("DB error");
+            bool complete = rows.size() < (size_t)want;
+            if (!complete || !archive.has(key)) {
+                string out = renderTail(rows, limit, !complete);
+                if (beforeId == 0) historyCache.fill(key, move(rows), complete);
+                return out;
+            }
+            // the cache only ever holds hot rows; marking them incomplete
+            // sends short reads back here for the archived part
+            if (beforeId == 0) historyCache.fill(key, rows, false);
+        }
+
+        // the archive is read without store locks: compaction only moves rows
+        // older than the ones just read, so nothing is missed or seen twice
+        vector<StoredMessage> cold;
+        long long below = rows.empty() ? beforeId : rows.front().id;
+        if (!archive.tail(key, below, want - (int)rows.size(), cold)) return string("Archive error");
+        vector<CachedMessage> merged;
+        merged.reserve(cold.size() + rows.size());
+        for (const auto &m : cold) merged.push_back(CachedMessage{m.id, formatHistoryLine(m.ts, m.sender, m.content)});
+        for (auto &r : rows) merged.push_back(move(r));
+        return renderTail(merged, limit, merged.size() >= (size_t)want);
+    }
+
+    // History cache keys: direct chats are keyed by the sorted pair of names
+    static string directKey(const string& a, const string& b) {
+        return a < b ? "d:" + a + "\n" + b : "d:" + b + "\n" + a;
+    }
+
+    static string groupKey(const string& groupname) {
+        return "g:" + groupname;
+    }
+
+    // Format one history line as shown by the client: "[ts] sender: body\n"
+    static string formatHistoryLine(long long ts, string_view sender, string_view body) {
+        time_t t = static_cast<time_t>(ts);
+        struct tm lt;
+        localtime_r(&t, &lt);
+        char tbuf[64];
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", &lt);
+        string line;
+        line.reserve(strlen(tbuf) + sender.size() + body.size() + 8);
+        line += '[';
+        line += tbuf;
+        line += "] ";
+        line += sender;
+        line += ": ";
+        line += body;
+        line += '\n';
+        return line;
+    }
+
+    // Newest `limit` rows that fit in one response frame, oldest first
+    // `more` says the store holds rows older than the first one in `rows`.
+    static string renderTail(const vector<CachedMessage>& rows, int limit, bool more) {
+        size_t used = 0;
+        size_t take = 0;
+        bool truncated = false;
+        for (auto r = rows.rbegin(); r != rows.rend() && (int)take < limit; ++r) {
+            if (used + r->line.size() > HISTORY_BUDGET) { truncated = true; break; }
+            used += r->line.size();
+            ++take;
+        }
+        string lines;
+        lines.reserve(used);
+        for (auto r = rows.end() - take; r != rows.end(); ++r) lines += r->line;
+        long long olderThan = 0;
+        if (truncated || take < rows.size() || more) olderThan = take ? (rows.end() - take)->id : rows.back().id;
+        return renderHistory(move(lines), olderThan);
+    }
+
+    // A leading "... (older: <id>)" line tells the client that older lines
+    // exist; sending <id> back as the request content fetches the page before it
+    static string renderHistory(string lines, long long olderThan) {
+        if (lines.empty() && !olderThan) return string("(no messages)\n");
+        if (olderThan) lines.insert(0, "... (older: " + to_string(olderThan) + ")\n");
+        return lines;
+    }
+
+    // One page of search results for `user`, formatted like history lines
+    // with the conversation in front of the sender
+    string searchMessages(const string& user, const string& text, int offset) {
+        vector<SearchHit> hits;
+        {
+            if (!store) return string("No DB");
+            StoreGuard guard = readLockWholeStore();
+            // one extra hit tells whether there is a next page
+            if (!store->search(user, text, SEARCH_PAGE + 1, offset, hits)) return string("Search is not available\n");
+        }
+        if (hits.empty()) return string("No matches\n");
+        string out = "Search results:\n";
+        size_t shown = 0;
+        for (const auto &h : hits) {
+            if ((int)shown == SEARCH_PAGE) break;
+            const string &other = h.msg.sender == user ? h.msg.peer : h.msg.sender;
+            string label = (h.group ? "#" + h.msg.peer : "@" + other) + " " + h.msg.sender;
+            string line = formatHistoryLine(h.msg.ts, label, h.msg.content);
+            if (out.size() + line.size() > HISTORY_BUDGET) break;
             out += line;
+            ++shown;
         }
-        sqlite3_finalize(stmt);
-        if (out.empty()) out = string("(no messages)\n");
+        if (shown < hits.size()) out += "next: " + to_string(offset + shown) + "\n";
         return out;
     }
 
-    bool removeFriend(const string& user, const string& friendname) {
+    static long long steadyMillis() {
+        return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Background retention: every compact_interval seconds move messages past
+    // their conversation's retention from the store into the archive
+    void compactionLoop() {
+        unique_lock<mutex> lock(compact_mutex);
+        while (running) {
+            lock.unlock();
+            bool supported = compactOnce();
+            lock.lock();
+            if (!supported) break;
+            compact_cv.wait_for(lock, chrono::seconds(compact_interval), [this] { return !running; });
+        }
+    }
+
+    // Wait until foreground writes have been quiet for a moment; false on shutdown
+    bool compactionThrottle() {
+        while (running && steadyMillis() - last_write_ms < COMPACT_QUIET_MS) {
+            this_thread::sleep_for(chrono::milliseconds(COMPACT_QUIET_MS / 4));
+        }
+        return running;
+    }
+
+    // One compaction pass; false when the store cannot drop rows at all
+    bool compactOnce() {
+        vector<ConversationRef> convs;
+        {
+            StoreGuard guard = readLockWholeStore();
+            if (!store || !store->listConversations(convs)) {
+                cerr << COLOR_YELLOW << "Retention is not supported by the " << (store ? store->name() : "missing")
+                     << " store; keeping all messages" << COLOR_RESET << endl;
+                return false;
+            }
+        }
+        long long now = static_cast<long long>(time(nullptr));
+        uint64_t moved = 0;
+        size_t touched = 0;
+        for (const auto &c : convs) {
+            string key = c.group ? groupKey(c.a) : directKey(c.a, c.b);
+            long long keep = retention.secondsFor(key);
+            if (keep <= 0 || c.oldestTs >= now - keep) continue;
+            long long cutoff = now - keep;
+            ++touched;
+            while (compactionThrottle()) {
+                vector<StoredMessage> batch;
+                {
+                    StoreGuard guard = readLockStore({c.a});
+                    if (!store->oldestMessages(c, cutoff, COMPACT_BATCH, batch)) break;
+                }
+                if (batch.empty()) break;
+                // compress and fsync outside the store locks; rows are deleted
+                // only once they are safely in the archive
+                if (!archive.append(key, batch)) return true;
+                {
+                    StoreGuard guard = c.group ? lockStore({c.a}) : lockStore({c.a, c.b});
+                    if (store->deleteMessagesThrough(c, batch.back().id, cutoff) < 0) break;
+                    historyCache.erase(key);
+                }
+                moved += batch.size();
+                if (batch.size() < (size_t)COMPACT_BATCH) break;
+                this_thread::sleep_for(chrono::milliseconds(COMPACT_PAUSE_MS));
+            }
+            if (!running) break;
+        }
+        ++compact_passes;
+        if (moved) {
+            logActivity(string("Compaction: archived ") + to_string(moved) + " messages from " +
+                        to_string(touched) + " conversations");
+        }
+        return true;
+    }
+
+    string cacheStatsReport() {
+        MessageCacheStats st = historyCache.stats();
+        uint64_t lookups = st.hits + st.misses;
+        double ratio = lookups ? (100.0 * st.hits / lookups) : 0.0;
+        ostringstream os;
+        os << fixed << setprecision(1);
+        os << "history cache: hits=" << st.hits << " misses=" << st.misses
+           << " hit_ratio=" << ratio << "%"
+           << " conversations=" << st.conversations << " messages=" << st.messages
+           << " bytes=" << st.bytes << "\n";
+        return os.str();
+    }
+
+    bool removeFriend(UserId user, const string& friendname) {
         lock_guard<mutex> lock(users_mutex);
-        if (!db) return false;
-        const char *sql = "DELETE FROM friends WHERE (user = ? AND friend = ?) OR (user = ? AND friend = ?);";
-        sqlite3_stmt *stmt = nullptr;
-        string u = trimStr(user);
+        if (!store) return false;
+        string u = userIds.nameOf(user);
         string f = trimStr(friendname);
         if (u.empty() || f.empty()) return false;
         cout << "Removing friendship between '" << u << "' and '" << f << "'" << endl;
-        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
-        sqlite3_bind_text(stmt, 1, u.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, f.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 3, f.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 4, u.c_str(), -1, SQLITE_STATIC);
-        int rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        return (rc == SQLITE_DONE);
+        StoreGuard guard = lockStore({u, f});
+        store->deleteFriendRow(u, f, false);
+        store->deleteFriendRow(f, u, false);
+        friendGraph.remove(user, userIds.find(f));
+        return true;
     }
 
     bool start() {
@@ -726,15 +1264,28 @@ public:
             return false;
         }
 
+        if (!sessionTokens.loadKey(session_key_path)) {
+            cerr << COLOR_YELLOW << "Warning: session resume disabled, clients will log in with passwords" << COLOR_RESET << endl;
+        }
+
         // open activity log
-        logFile.open("server_activity.log", ios::app);
-        if (logFile.is_open()) {
+        activityLog.setResolver([this](NameSpace space, uint32_t id) {
+            const NameTable &names = space == NS_GROUP ? groupIds : space == NS_CHANNEL ? channelIds : userIds;
+            return names.nameOf(id);
+        });
+        if (activityLog.open("server_activity.evlog")) {
             logActivity(string("Server started on port ") + to_string(PORT));
         } else {
-            cerr << COLOR_YELLOW << "Warning: could not open server_activity.log for writing" << COLOR_RESET << endl;
+            cerr << COLOR_YELLOW << "Warning: could not open server_activity.evlog for writing" << COLOR_RESET << endl;
         }
 
         running = true;
+        fanoutPool.start(fanout_workers);
+        logActivity("Fan-out pool: " + to_string(fanoutPool.workerCount()) + " workers");
+        if (!retention.empty()) {
+            if (archive.open()) compactor = thread(&MessengerServer::compactionLoop, this);
+            else cerr << COLOR_YELLOW << "Warning: retention disabled, archive directory unusable" << COLOR_RESET << endl;
+        }
         cout << COLOR_GREEN << "✓ Server started on port " << PORT << COLOR_RESET << endl;
         cout << COLOR_CYAN << "Waiting for connections..." << COLOR_RESET << endl;
         logActivity("Waiting for connections...");
@@ -768,7 +1319,11 @@ public:
             {
                 string peer = string(inet_ntoa(client_addr.sin_addr)) + ":" + to_string(ntohs(client_addr.sin_port));
                 cout << COLOR_CYAN << "New connection from " << peer << COLOR_RESET << endl;
-                logActivity(string("New connection from ") + peer);
+                EventRecord rec{};
+                rec.kind = EV_CONNECT;
+                rec.target = client_addr.sin_addr.s_addr;
+                rec.value = ntohs(client_addr.sin_port);
+                activityLog.write(rec);
             }
 
             // Start thread to handle client
@@ -776,16 +1331,416 @@ public:
         }
     }
 
+    // Read one whole frame; a client that sends back to back can have a
+    // frame split across reads. Returns the frame size, or 0 when the
+    // connection ended (mid-frame included).
+    static int recvFrame(int sock, Message& msg) {
+        ssize_t n = recv(sock, &msg, sizeof(Message), MSG_WAITALL);
+        return n == static_cast<ssize_t>(sizeof(Message)) ? static_cast<int>(n) : 0;
+    }
+
+    // One logged-in connection, as the opcode handlers see it
+    struct Session {
+        UserId user;
+        const string &name;
+        Outbox &out;
+    };
+
+    typedef void (MessengerServer::*Handler)(Session&, const Message&);
+
+    // Dispatch table entry: handler and request class of one opcode
+    struct Route {
+        Handler handler;
+        RequestClass cls;
+    };
+
+    static const int OPCODE_LIMIT = 128;
+    static const array<Route, OPCODE_LIMIT> routes;
+    // per-opcode counters and latency histograms, indexed like `routes`
+    OpcodeStats opcodeStats[OPCODE_LIMIT];
+
+    // Reply builders shared by the handlers
+    static void reply(Outbox& out, int type, const string& text) {
+        Message resp{};
+        resp.type = type;
+        strncpy(resp.username, "Server", sizeof(resp.username)-1);
+        strncpy(resp.content, text.c_str(), sizeof(resp.content)-1);
+        out.sendNow(&resp, sizeof(Message));
+    }
+
+    static void replyStatus(Outbox& out, int type, bool ok) {
+        Message resp{};
+        resp.type = type;
+        strncpy(resp.username, "Server", sizeof(resp.username)-1);
+        resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
+        out.sendNow(&resp, sizeof(Message));
+    }
+
+    // A handled request in the activity log. `target` is a user, group or
+    // channel id as targetSpace() says for the opcode; a name without an id
+    // (a user that does not exist, a group that could not be created) goes
+    // in `text` instead
+    void logRequest(const Session& s, int opcode, uint32_t target = 0, int status = EV_STATUS_NONE,
+                    uint32_t value = 0, uint32_t other = 0, string_view text = string_view()) {
+        EventRecord rec{};
+        rec.kind = EV_REQUEST;
+        rec.opcode = static_cast<uint16_t>(opcode);
+        rec.status = static_cast<uint8_t>(status);
+        rec.user = s.user;
+        rec.target = target;
+        rec.other = other;
+        rec.value = value;
+        activityLog.write(rec, text);
+    }
+
+    // Group add/remove: the group is the target, the member the other user;
+    // whichever has no id is kept as text
+    void logGroupEdit(const Session& s, int opcode, const string& group, const string& member, bool ok) {
+        GroupId gid = groupIds.find(group);
+        UserId uid = userIds.find(member);
+        string_view text = !gid ? string_view(group) : !uid ? string_view(member) : string_view();
+        logRequest(s, opcode, gid, statusOf(ok), 0, uid, text);
+    }
+
+    static int statusOf(bool ok) { return ok ? EV_STATUS_OK : EV_STATUS_FAIL; }
+
+    // Log a request about one named user/group/channel, keeping the name
+    // as text when it has no id
+    void logRequestAbout(const Session& s, int opcode, const NameTable& names, const string& name, bool ok) {
+        uint32_t id = names.find(name);
+        logRequest(s, opcode, id, statusOf(ok), 0, 0, id ? string_view() : string_view(name));
+    }
+
+    // Opcode handlers, one per table entry
+
+    void onFriendRequest(Session& s, const Message& msg) {
+        string to = string(msg.content);
+        bool ok = sendFriendRequest(s.name, to);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, userIds, to, ok);
+    }
+
+    void onFriendAccept(Session& s, const Message& msg) {
+        string from = string(msg.content); // the user who requested
+        bool ok = acceptFriendRequest(from, s.name);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, userIds, from, ok);
+    }
+
+    void onFriendRefuse(Session& s, const Message& msg) {
+        string from = string(msg.content); // the user who requested
+        bool ok = refuseFriendRequest(from, s.name);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, userIds, from, ok);
+    }
+
+    void onFriendList(Session& s, const Message& msg) {
+        auto friends = listFriends(s.user);
+        string combined = "Friends: ";
+        for (size_t i=0;i<friends.size();++i) { combined += friends[i]; if (i+1<friends.size()) combined += ", "; }
+        reply(s.out, MSG_FRIEND_LIST_RESPONSE, combined);
+        logRequest(s, msg.type);
+    }
+
+    void onFriendRemove(Session& s, const Message& msg) {
+        string target = string(msg.content);
+        bool ok = removeFriend(s.user, target);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, userIds, target, ok);
+    }
+
+    void onGroupCreate(Session& s, const Message& msg) {
+        string gname = trimStr(string(msg.content));
+        bool ok = createGroup(gname, s.name);
+        replyStatus(s.out, MSG_GROUP_CREATE_RESPONSE, ok);
+        logRequestAbout(s, msg.type, groupIds, gname, ok);
+    }
+
+    void onGroupAdd(Session& s, const Message& msg) {
+        // Expect: msg.username = groupname, msg.content = username-to-add
+        string gname = trimStr(string(msg.username));
+        string who = trimStr(string(msg.content));
+        bool ok = false;
+        // only members can add (simple policy)
+        if (isMemberOfGroup(gname, s.user)) ok = addUserToGroup(gname, who);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logGroupEdit(s, msg.type, gname, who, ok);
+    }
+
+    void onGroupRemove(Session& s, const Message& msg) {
+        // Expect: msg.username = groupname, msg.content = username-to-remove
+        string gname = trimStr(string(msg.username));
+        string who = trimStr(string(msg.content));
+        bool ok = false;
+        // only members can remove (or owner could have been enforced)
+        if (isMemberOfGroup(gname, s.user)) ok = removeUserFromGroup(gname, who);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logGroupEdit(s, msg.type, gname, who, ok);
+    }
+
+    void onGroupLeave(Session& s, const Message& msg) {
+        // Expect: msg.content = groupname
+        string gname = trimStr(string(msg.content));
+        bool ok = removeUserFromGroup(gname, s.name);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, groupIds, gname, ok);
+    }
+
+    void onGroupMessage(Session& s, const Message& msg) {
+        // msg.username = groupname, msg.content = body
+        string gname = trimStr(string(msg.username));
+        string body = string(msg.content);
+        GroupId gid = groupIds.find(gname);
+        if (body.empty() || !groupDirectory.isMember(gid, s.user)) return;
+        if (!saveGroupMessage(gid, s.user, body)) return;
+        // deliver to online members (excluding sender): one frame, content
+        // "sender: body", queued by reference
+        Frame frame = makeFrame(MSG_GROUP_TEXT, gname, s.name + ": " + body);
+        vector<UserId> online = groupDirectory.onlineMembers(gid);
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            pushToSessions(online, s.user, frame);
+        }
+        logRequest(s, msg.type, gid, EV_STATUS_OK, static_cast<uint32_t>(body.size()));
+    }
+
+    void onGroupHistory(Session& s, const Message& msg) {
+        string gname = trimStr(string(msg.username));
+        string listing;
+        if (!gname.empty() && isMemberOfGroup(gname, s.user)) {
+            listing = getGroupHistory(gname, 500, atoll(msg.content));
+        } else {
+            listing = string("Invalid group or access denied\n");
+        }
+        reply(s.out, MSG_GROUP_HISTORY_RESPONSE, listing);
+        logRequestAbout(s, msg.type, groupIds, gname, true);
+    }
+
+    void onGroupMembers(Session& s, const Message& msg) {
+        string gname = trimStr(string(msg.username));
+        string listing;
+        if (!gname.empty() && isMemberOfGroup(gname, s.user)) {
+            auto members = listGroupMembers(gname);
+            for (size_t i = 0; i < members.size(); ++i) {
+                listing += members[i];
+                if (i + 1 < members.size()) listing += ", ";
+            }
+            if (listing.empty()) listing = string("(no members)");
+        } else {
+            listing = string("Access denied or invalid group");
+        }
+        reply(s.out, MSG_GROUP_MEMBERS_RESPONSE, listing);
+        logRequestAbout(s, msg.type, groupIds, gname, true);
+    }
+
+    void onGroupList(Session& s, const Message& msg) {
+        auto groups = listGroupsForUser(s.user);
+        string combined;
+        for (size_t i = 0; i < groups.size(); ++i) { combined += groups[i]; if (i+1<groups.size()) combined += ", "; }
+        reply(s.out, MSG_GROUP_LIST_RESPONSE, combined);
+        logRequest(s, msg.type);
+    }
+
+    void onAllUsersStatus(Session& s, const Message& msg) {
+        // content: "<prefix>\n<after>\n<limit>", every line optional
+        string prefix, after, limitStr;
+        {
+            istringstream in(string(msg.content));
+            getline(in, prefix);
+            getline(in, after);
+            getline(in, limitStr);
+        }
+        int limit = atoi(limitStr.c_str());
+        if (limit <= 0 || limit > 500) limit = 200;
+        reply(s.out, MSG_ALL_USERS_STATUS_RESPONSE, listAllUsersWithStatus(s.user, trimStr(prefix), trimStr(after), limit));
+        logRequest(s, msg.type);
+    }
+
+    void onDirectMessage(Session& s, const Message& msg) {
+        // msg.username holds the receiver, msg.content holds the body; sender is s.name
+        string to = trimStr(string(msg.username));
+        string body = string(msg.content);
+        if (to.empty() || body.empty()) return;
+        long long id = saveMessage(s.user, to, body);
+        if (id < 0) return;
+        // deliver to online recipient as a chat message (MSG_TEXT)
+        bool delivered = false;
+        UserId toId = userIds.find(to);
+        shared_ptr<Outbox> out;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            auto it = sessions.find(toId);
+            if (it != sessions.end() && !it->second.empty()) out = it->second.front();
+        }
+        if (out) {
+            Message dm{};
+            dm.type = MSG_TEXT;
+            strncpy(dm.username, s.name.c_str(), sizeof(dm.username)-1);
+            strncpy(dm.content, body.c_str(), sizeof(dm.content)-1);
+            delivered = out->sendNow(&dm, sizeof(Message));
+            if (delivered) {
+                noteDelivered(toId, id);
+                sendEvent(vector<UserId>{s.user}, 0, to, "delivered @" + to, id);
+            }
+        }
+        // offline, or the session broke mid-send: keep it in the
+        // recipient's inbox until they log in or resume
+        if (!delivered && userDirectory.contains(to)) queueOffline(toId, id);
+        logRequest(s, msg.type, toId, EV_STATUS_OK, static_cast<uint32_t>(body.size()), 0, toId ? string_view() : string_view(to));
+    }
+
+    void onHistory(Session& s, const Message& msg) {
+        // msg.username holds the peer
+        string peer = trimStr(string(msg.username));
+        string listing;
+        if (!peer.empty()) {
+            listing = getConversationHistory(s.name, peer, 200, atoll(msg.content));
+        } else {
+            listing = string("Invalid peer\n");
+        }
+        reply(s.out, MSG_HISTORY_RESPONSE, listing);
+        UserId peerId = userIds.find(peer);
+        logRequest(s, msg.type, peerId, statusOf(!peer.empty()), static_cast<uint32_t>(listing.size()), 0,
+                   peerId ? string_view() : string_view(peer));
+    }
+
+    void onStats(Session& s, const Message& msg) {
+        string report = cacheStatsReport();
+        report += "archive: passes=" + to_string(compact_passes.load()) +
+                  " archived_since_start=" + to_string(archive.archivedRows()) + "\n";
+        report += "backup: " + backup.status() + "\n";
+        report += "events: sent=" + to_string(events_sent.load()) + " coalesced=" +
+                  to_string(events_coalesced.load() + typingWindow.absorbedCount()) +
+                  " dropped=" + to_string(events_dropped.load()) + "\n";
+        report += requestGate.report();
+        report += "throttled: realtime=" + to_string(throttled[REQ_REALTIME].load()) +
+                  " interactive=" + to_string(throttled[REQ_INTERACTIVE].load()) +
+                  " bulk=" + to_string(throttled[REQ_BULK].load()) + "\n";
+        report += "log: records=" + to_string(activityLog.writtenCount()) +
+                  " bytes=" + to_string(activityLog.bytesWritten()) +
+                  " dropped=" + to_string(activityLog.droppedCount()) +
+                  " rotated=" + to_string(activityLog.rotationCount()) +
+                  " archived=" + to_string(activityLog.archivedCount()) + "\n";
+        report += "opcodes:\n";
+        for (int op = 0; op < OPCODE_LIMIT; ++op) {
+            const OpcodeStats &st = opcodeStats[op];
+            if (!routes[op].handler || (st.callCount() == 0 && st.rejectCount() == 0)) continue;
+            report += string("  ") + opcodeName(op) + " " + st.summary() + "\n";
+        }
+        reply(s.out, MSG_STATS_RESPONSE, report);
+        logRequest(s, msg.type);
+    }
+
+    void onSearch(Session& s, const Message& msg) {
+        // content: "<words>\n<offset>"
+        string words, offsetStr;
+        {
+            istringstream in(string(msg.content));
+            getline(in, words);
+            getline(in, offsetStr);
+        }
+        int offset = max(0, atoi(offsetStr.c_str()));
+        reply(s.out, MSG_SEARCH_RESPONSE, trimStr(words).empty() ? string("Empty search\n")
+                                                                : searchMessages(s.name, words, offset));
+        logRequest(s, msg.type);
+    }
+
+    void onBackup(Session& s, const Message& msg) {
+        // content: "start" or "status"
+        string cmd = trimStr(string(msg.content));
+        string text;
+        if (!admins.count(s.name)) text = "not allowed";
+        else if (cmd == "start") {
+            text = startBackup();
+            text += "\n" + backup.status();
+        }
+        else text = backup.status();
+        reply(s.out, MSG_BACKUP_STATUS, text);
+        logRequest(s, msg.type, 0, EV_STATUS_NONE, 0, 0, cmd);
+    }
+
+    void onChannelCreate(Session& s, const Message& msg) {
+        string cname = trimStr(string(msg.content));
+        bool ok = createChannel(cname, s.user);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, channelIds, cname, ok);
+    }
+
+    void onChannelSubscribe(Session& s, const Message& msg) {
+        string cname = trimStr(string(msg.content));
+        bool ok = subscribeChannel(cname, s.user);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, channelIds, cname, ok);
+    }
+
+    void onChannelUnsubscribe(Session& s, const Message& msg) {
+        string cname = trimStr(string(msg.content));
+        bool ok = unsubscribeChannel(cname, s.user);
+        replyStatus(s.out, MSG_AUTH_RESPONSE, ok);
+        logRequestAbout(s, msg.type, channelIds, cname, ok);
+    }
+
+    void onChannelPost(Session& s, const Message& msg) {
+        // msg.username = channel, msg.content = body; owner only
+        string cname = trimStr(string(msg.username));
+        string body = string(msg.content);
+        ChannelId cid = channelIds.find(cname);
+        if (body.empty() || !cid || channelDirectory.ownerOf(cid) != s.user) return;
+        long long id = saveChannelPost(cid, s.user, body);
+        if (id <= 0) return;
+        // stored once; the one frame goes to the subscribers that are
+        // online, the rest catch up by cursor
+        Frame frame = makeFrame(MSG_CHANNEL_TEXT, cname, to_string(id) + " " + s.name + ": " + body);
+        vector<UserId> online;
+        {
+            lock_guard<mutex> lock(clients_mutex);
+            channelDirectory.onlineSubscribers(cid, sessions, online);
+            pushToSessions(online, s.user, frame);
+        }
+        logRequest(s, msg.type, cid, EV_STATUS_OK, static_cast<uint32_t>(body.size()), static_cast<uint32_t>(online.size()));
+    }
+
+    void onChannelFetch(Session& s, const Message& msg) {
+        string cname = trimStr(string(msg.username));
+        string after = trimStr(string(msg.content));
+        ChannelId cid = channelIds.find(cname);
+        reply(s.out, MSG_CHANNEL_FETCH_RESPONSE,
+              cid ? fetchChannel(cid, s.user, after.empty() ? -1 : atoll(after.c_str()))
+                  : string("Invalid channel or not subscribed\n"));
+        logRequest(s, msg.type, cid, cid ? EV_STATUS_OK : EV_STATUS_FAIL);
+    }
+
+    void onChannelList(Session& s, const Message& msg) {
+        reply(s.out, MSG_CHANNEL_LIST_RESPONSE, channelList(s.user));
+        logRequest(s, msg.type);
+    }
+
+    void onEphemeral(Session& s, const Message& msg) {
+        // no store, no response
+        relayEphemeral(s.user, string(msg.content));
+    }
+
+    void onReadAck(Session& s, const Message& msg) {
+        // content: "@<peer>", "#<group>" or "!<channel>"; no response
+        string conv = trimStr(string(msg.content));
+        if (!markRead(s.user, conv)) {
+            cerr << COLOR_RED << "Failed to save read position for " << s.name << COLOR_RESET << endl;
+        }
+    }
+
     void handleClient(int client_socket, sockaddr_in client_addr) {
         Message msg;
         ClientInfo client_info;
         client_info.socket = client_socket;
         client_info.address = client_addr;
-        client_info.username = "Anonymous";
+        client_info.user = 0;
 
         // Authentication flow (register/login/change/delete) before joining
-        int bytes_received = recv(client_socket, &msg, sizeof(Message), 0);
+        int bytes_received = recvFrame(client_socket, msg);
         bool authed = false;
+        bool resumed = false;
+        long long resumedSeq = 0; // delivery position the resume token carries
+        long long credStamp = -1; // credential stamp the session authenticated against
         while (bytes_received > 0) {
             if (msg.type == MSG_REGISTER) {
                 string uname = string(msg.username);
@@ -800,7 +1755,7 @@ public:
                     if (addUser(uname, pwd)) {
                         resp.content[0] = AUTH_SUCCESS;
                         send(client_socket, &resp, sizeof(Message), 0);
-                        client_info.username = uname;
+                        client_info.user = userIds.intern(uname);
                         authed = true;
                         break;
                     }
@@ -818,7 +1773,8 @@ public:
                 if (verifyUser(uname, pwd)) {
                     resp.content[0] = AUTH_SUCCESS;
                     send(client_socket, &resp, sizeof(Message), 0);
-                    client_info.username = uname;
+                    client_info.user = userIds.intern(uname);
+                    credentialStampOf(uname, credStamp);
                     authed = true;
                     break;
                 } else {
@@ -826,6 +1782,22 @@ public:
                     send(client_socket, &resp, sizeof(Message), 0);
                 }
             }
+            else if (msg.type == MSG_SESSION_RESUME) {
+                string token = string(msg.content, strnlen(msg.content, sizeof(msg.content)));
+                Message resp{};
+                resp.type = MSG_AUTH_RESPONSE;
+                strncpy(resp.username, "Server", sizeof(resp.username) - 1);
+                if (resumeSession(token, client_info.user, resumedSeq, credStamp)) {
+                    resp.content[0] = AUTH_SUCCESS;
+                    send(client_socket, &resp, sizeof(Message), 0);
+                    authed = true;
+                    resumed = true;
+                    break;
+                } else {
+                    resp.content[0] = AUTH_FAILURE;
+                    send(client_socket, &resp, sizeof(Message), 0);
+                }
+            }
             else if (msg.type == MSG_CHANGE_PASSWORD) {
                 string uname = string(msg.username);
                 string newpass = string(msg.content);
@@ -840,239 +1812,99 @@ public:
                 send(client_socket, &resp, sizeof(Message), 0);
             }
             else if (msg.type == MSG_USERNAME) {
-                client_info.username = string(msg.username);
+                client_info.user = userIds.intern(string(msg.username));
+                credentialStampOf(string(msg.username), credStamp);
                 authed = true; // fallback
                 break;
             }
 
-            bytes_received = recv(client_socket, &msg, sizeof(Message), 0);
+            bytes_received = recvFrame(client_socket, msg);
         }
 
         if (!authed) {
             close(client_socket);
             return;
         }
+        // interned names live as long as the server, so this stays valid
+        const string &username = userIds.nameOf(client_info.user);
+
+        // every write to the socket from here on goes through the outbox
+        shared_ptr<Outbox> outbox = make_shared<Outbox>(client_socket, OUTBOX_MAX_FRAMES);
+        outbox->start();
 
         // Add to client list
+        shared_ptr<RateLimiter> rateLimiter;
         {
             lock_guard<mutex> lock(clients_mutex);
             clients.push_back(client_info);
+            vector<shared_ptr<Outbox>> &outs = sessions[client_info.user];
+            outs.push_back(outbox);
+            if (outs.size() == 1) groupDirectory.setOnline(client_info.user, true);
+            shared_ptr<RateLimiter> &limiter = rateLimiters[client_info.user];
+            if (!limiter) limiter = make_shared<RateLimiter>();
+            rateLimiter = limiter;
         }
 
-        cout << COLOR_GREEN << "User '" << client_info.username 
+        cout << COLOR_GREEN << "User '" << username 
              << "' joined the chat (Total users: " << clients.size() << ")" 
              << COLOR_RESET << endl;
-        logActivity(string("User '") + client_info.username + " joined (total=" + to_string(clients.size()) + ")");
+        logEvent(EV_JOIN, resumed ? MSG_SESSION_RESUME : MSG_LOGIN, client_info.user, static_cast<uint32_t>(clients.size()));
+
+        // a token for the next reconnect, refreshed halfway through its life
+        long long tokenIssued = static_cast<long long>(time(nullptr));
+        sendSessionToken(*outbox, client_info.user, credStamp);
+
+        // direct messages that arrived while the user was offline
+        size_t queued = deliverInbox(client_info.user, *outbox, resumed ? resumedSeq : 0);
+        if (queued) logEvent(EV_INBOX, 0, client_info.user, static_cast<uint32_t>(queued));
+
+        // then where the user left off in every other conversation
+        string summary = unreadSummary(client_info.user);
+        if (!summary.empty()) {
+            reply(*outbox, MSG_UNREAD_SUMMARY, summary);
+        }
 
         // Handle messages from client
+        Session session{client_info.user, username, *outbox};
         while (running) {
-            bytes_received = recv(client_socket, &msg, sizeof(Message), 0);
+            bytes_received = recvFrame(client_socket, msg);
             
             if (bytes_received <= 0) {
                 // Client disconnected
                 break;
             }
-            if (msg.type == MSG_FRIEND_REQUEST) {
-                string to = string(msg.content);
-                bool ok = sendFriendRequest(client_info.username, to);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Friend request: ") + client_info.username + " -> " + to + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_FRIEND_ACCEPT) {
-                string from = string(msg.content); // the user who requested
-                bool ok = acceptFriendRequest(from, client_info.username);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-            }
-            else if (msg.type == MSG_GROUP_CREATE) {
-                string gname = trimStr(string(msg.content));
-                bool ok = createGroup(gname, client_info.username);
-                Message resp{}; resp.type = MSG_GROUP_CREATE_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group create: ") + client_info.username + " -> " + gname + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_GROUP_ADD) {
-                // Expect: msg.username = groupname, msg.content = username-to-add
-                string gname = trimStr(string(msg.username));
-                string who = trimStr(string(msg.content));
-                bool ok = false;
-                // only members can add (simple policy)
-                if (isMemberOfGroup(gname, client_info.username)) ok = addUserToGroup(gname, who);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group add: ") + client_info.username + " add " + who + " to " + gname + (ok?" [ok]":" [fail]"));
+            long long now = static_cast<long long>(time(nullptr));
+            if (now - tokenIssued >= sessionTokens.ttlSeconds() / 2) {
+                tokenIssued = now;
+                sendSessionToken(*outbox, client_info.user, credStamp);
             }
-            else if (msg.type == MSG_GROUP_REMOVE) {
-                // Expect: msg.username = groupname, msg.content = username-to-remove
-                string gname = trimStr(string(msg.username));
-                string who = trimStr(string(msg.content));
-                bool ok = false;
-                // only members can remove (or owner could have been enforced)
-                if (isMemberOfGroup(gname, client_info.username)) ok = removeUserFromGroup(gname, who);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group remove: ") + client_info.username + " remove " + who + " from " + gname + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_GROUP_LEAVE) {
-                // Expect: msg.content = groupname
-                string gname = trimStr(string(msg.content));
-                bool ok = removeUserFromGroup(gname, client_info.username);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group leave: ") + client_info.username + " left " + gname + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_GROUP_MESSAGE) {
-                // msg.username = groupname, msg.content = body
-                string gname = trimStr(string(msg.username));
-                string body = string(msg.content);
-                bool ok = false;
-                if (!gname.empty() && !body.empty() && isMemberOfGroup(gname, client_info.username)) {
-                    ok = saveGroupMessage(gname, client_info.username, body);
-                    if (ok) {
-                        // deliver to online members (excluding sender)
-                        vector<string> members = listGroupMembers(gname);
-                        lock_guard<mutex> lock(clients_mutex);
-                        for (const auto &c : clients) {
-                            if (c.username == client_info.username) continue;
-                            if (find(members.begin(), members.end(), c.username) != members.end()) {
-                                Message gm{}; 
-                                gm.type = MSG_GROUP_TEXT; 
-                                strncpy(gm.username, gname.c_str(), sizeof(gm.username)-1);
-                                // content: sender:body
-                                string payload = client_info.username + string(": ") + body;
-                                strncpy(gm.content, payload.c_str(), sizeof(gm.content)-1);
-                                send(c.socket, &gm, sizeof(Message), 0);
-                            }
-                        }
-                            logActivity(string("Group message: ") + client_info.username + " -> " + gname + " (len=" + to_string(body.size()) + ")");
-                    }
-                }
-            }
-            else if (msg.type == MSG_GROUP_HISTORY_REQUEST) {
-                string gname = trimStr(string(msg.username));
-                string listing;
-                if (!gname.empty() && isMemberOfGroup(gname, client_info.username)) {
-                    listing = getGroupHistory(gname, 500);
-                } else {
-                    listing = string("Invalid group or access denied\n");
-                }
-                Message resp{}; resp.type = MSG_GROUP_HISTORY_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                strncpy(resp.content, listing.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group history requested: ") + client_info.username + " -> " + gname);
-            }
-            else if (msg.type == MSG_GROUP_MEMBERS_REQUEST) {
-                string gname = trimStr(string(msg.username));
-                string listing;
-                if (!gname.empty() && isMemberOfGroup(gname, client_info.username)) {
-                    auto members = listGroupMembers(gname);
-                    for (size_t i = 0; i < members.size(); ++i) {
-                        listing += members[i];
-                        if (i + 1 < members.size()) listing += ", ";
-                    }
-                    if (listing.empty()) listing = string("(no members)");
-                } else {
-                    listing = string("Access denied or invalid group");
-                }
-                Message resp{}; resp.type = MSG_GROUP_MEMBERS_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                strncpy(resp.content, listing.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group members requested: ") + client_info.username + " -> " + gname);
-            }
-            else if (msg.type == MSG_GROUP_LIST_REQUEST) {
-                auto groups = listGroupsForUser(client_info.username);
-                Message resp{}; resp.type = MSG_GROUP_LIST_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                string combined;
-                for (size_t i = 0; i < groups.size(); ++i) { combined += groups[i]; if (i+1<groups.size()) combined += ", "; }
-                strncpy(resp.content, combined.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Group list requested: ") + client_info.username);
-            }
-            else if (msg.type == MSG_FRIEND_REFUSE) {
-                string from = string(msg.content); // the user who requested
-                bool ok = refuseFriendRequest(from, client_info.username);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Friend refuse: ") + client_info.username + " <- " + from + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_FRIEND_LIST_REQUEST) {
-                auto friends = listFriends(client_info.username);
-                Message resp{}; resp.type = MSG_FRIEND_LIST_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                string combined = "Friends: ";
-                for (size_t i=0;i<friends.size();++i) { combined += friends[i]; if (i+1<friends.size()) combined += ", "; }
-                strncpy(resp.content, combined.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Friend list requested: ") + client_info.username);
-            }
-            else if (msg.type == MSG_FRIEND_REMOVE) {
-                string target = string(msg.content);
-                bool ok = removeFriend(client_info.username, target);
-                Message resp{}; resp.type = MSG_AUTH_RESPONSE; strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = ok ? AUTH_SUCCESS : AUTH_FAILURE;
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("Friend remove: ") + client_info.username + " -/-> " + target + (ok?" [ok]":" [fail]"));
-            }
-            else if (msg.type == MSG_ALL_USERS_STATUS_REQUEST) {
-                string listing = listAllUsersWithStatus(client_info.username);
-                Message resp{}; 
-                resp.type = MSG_ALL_USERS_STATUS_RESPONSE; 
-                strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                resp.content[0] = '\0';
-                strncpy(resp.content, listing.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
-                logActivity(string("All users/status requested: ") + client_info.username);
-            }
-            else if (msg.type == MSG_DIRECT_MESSAGE) {
-                // msg.username holds the receiver, msg.content holds the body; sender is client_info.username
-                string to = trimStr(string(msg.username));
-                string body = string(msg.content);
-                bool ok = false;
-                if (!to.empty() && !body.empty()) {
-                    ok = saveMessage(client_info.username, to, body);
-                    if (ok) {
-                        // deliver to online recipient as a chat message (MSG_TEXT)
-                        lock_guard<mutex> lock(clients_mutex);
-                        for (const auto &c : clients) {
-                            if (c.username == to) {
-                                Message dm{};
-                                dm.type = MSG_TEXT;
-                                strncpy(dm.username, client_info.username.c_str(), sizeof(dm.username)-1);
-                                strncpy(dm.content, body.c_str(), sizeof(dm.content)-1);
-                          // deliver DM to online recipient
-                                send(c.socket, &dm, sizeof(Message), 0);
-                                break;
-                            }
-                        }
-                            logActivity(string("Direct message: ") + client_info.username + " -> " + to + " (len=" + to_string(body.size()) + ")");
-                    }
-                }
-            }
-            else if (msg.type == MSG_HISTORY_REQUEST) {
-                // msg.username holds the peer
-                string peer = trimStr(string(msg.username));
-                string listing;
-                if (!peer.empty()) {
-                    listing = getConversationHistory(client_info.username, peer, 200);
-                } else {
-                    listing = string("Invalid peer\n");
-                }
-                Message resp{}; 
-                resp.type = MSG_HISTORY_RESPONSE; 
-                strncpy(resp.username, "Server", sizeof(resp.username)-1);
-                strncpy(resp.content, listing.c_str(), sizeof(resp.content)-1);
-                send(client_socket, &resp, sizeof(Message), 0);
+            if (msg.type == MSG_DISCONNECT) break;
+            // unknown opcodes are ignored
+            if (msg.type < 0 || msg.type >= OPCODE_LIMIT || !routes[msg.type].handler) continue;
+            const Route &route = routes[msg.type];
+            OpcodeStats &opStats = opcodeStats[msg.type];
+            long long waitUs = rateLimiter->take(route.cls, rateLimits[route.cls], chrono::duration_cast<chrono::microseconds>(
+                                                     chrono::steady_clock::now().time_since_epoch()).count());
+            if (waitUs > 0) {
+                throttled[route.cls]++;
+                opStats.reject();
+                // typing is best effort: drop it without a notice
+                if (msg.type == MSG_EPHEMERAL) continue;
+                reply(*outbox, MSG_THROTTLED, to_string(msg.type) + " " + to_string((waitUs + 999) / 1000));
+                continue;
             }
-            else if (msg.type == MSG_DISCONNECT) {
-                break;
+            if (!requestGate.enter(route.cls)) {
+                opStats.reject();
+                reply(*outbox, MSG_BUSY, to_string(msg.type) + " " + to_string(requestGate.retryAfterMs(route.cls)));
+                continue;
             }
+            auto served = chrono::steady_clock::now();
+            long long sentBefore = Outbox::threadSendUs();
+            (this->*route.handler)(session, msg);
+            long long tookUs = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - served).count();
+            opStats.record(tookUs);
+            // the gate judges the server's own work, not a slow recipient's socket
+            requestGate.leave(route.cls, max(0LL, tookUs - (Outbox::threadSendUs() - sentBefore)));
         }
 
         // Remove client from list
@@ -1083,13 +1915,22 @@ public:
                     [client_socket](const ClientInfo& c) { return c.socket == client_socket; }),
                 clients.end()
             );
+            auto sit = sessions.find(client_info.user);
+            if (sit != sessions.end()) {
+                sit->second.erase(remove(sit->second.begin(), sit->second.end(), outbox), sit->second.end());
+                if (sit->second.empty()) {
+                    sessions.erase(sit);
+                    groupDirectory.setOnline(client_info.user, false);
+                }
+            }
         }
 
-        cout << COLOR_YELLOW << "User '" << client_info.username 
+        cout << COLOR_YELLOW << "User '" << username 
              << "' left the chat (Total users: " << clients.size() << ")" 
              << COLOR_RESET << endl;
-        logActivity(string("User '") + client_info.username + " left (total=" + to_string(clients.size()) + ")");
+        logEvent(EV_LEAVE, 0, client_info.user, static_cast<uint32_t>(clients.size()));
 
+        outbox->close();
         close(client_socket);
     }
 
@@ -1098,7 +1939,7 @@ public:
         
         string user_list = "Connected users: ";
         for (size_t i = 0; i < clients.size(); i++) {
-            user_list += clients[i].username;
+            user_list += userIds.nameOf(clients[i].user);
             if (i < clients.size() - 1) {
                 user_list += ", ";
             }
@@ -1115,14 +1956,22 @@ public:
     void stop() {
         if (running) {
             running = false;
-            
-            // Close all client connections
+            {
+                lock_guard<mutex> lock(compact_mutex);
+                compact_cv.notify_all();
+            }
+            if (compactor.joinable()) compactor.join();
+            backup.cancel();
+
+            // End all client connections; each session thread closes its
+            // own descriptor once its outbox is closed
             {
                 lock_guard<mutex> lock(clients_mutex);
                 for (const auto& client : clients) {
-                    close(client.socket);
+                    shutdown(client.socket, SHUT_RDWR);
                 }
                 clients.clear();
+                sessions.clear();
             }
 
             // Close server socket
@@ -1132,22 +1981,146 @@ public:
             }
 
             // Close DB
-            if (db) {
-                sqlite3_close(db);
-                db = nullptr;
+            {
+                lock_guard<mutex> lock(users_mutex);
+                StoreGuard guard = lockWholeStore();
+                if (store) store->close();
             }
 
             cout << COLOR_RED << "\nServer stopped" << COLOR_RESET << endl;
+            activityLog.close();
         }
     }
 };
 
-int main() {
+// Opcode -> handler and request class (names are in event_log_format.cpp).
+// Filled once during static initialization; opcodes without an entry are
+// ignored. The request classes decide shedding and rate limiting: realtime
+// is never shed, and stats stays interactive so the shed counts can be read
+// while shedding.
+const array<MessengerServer::Route, MessengerServer::OPCODE_LIMIT> MessengerServer::routes = [] {
+    array<Route, OPCODE_LIMIT> t{};
+    t[MSG_FRIEND_REQUEST] = {&MessengerServer::onFriendRequest, REQ_INTERACTIVE};
+    t[MSG_FRIEND_ACCEPT] = {&MessengerServer::onFriendAccept, REQ_INTERACTIVE};
+    t[MSG_FRIEND_REFUSE] = {&MessengerServer::onFriendRefuse, REQ_INTERACTIVE};
+    t[MSG_FRIEND_LIST_REQUEST] = {&MessengerServer::onFriendList, REQ_INTERACTIVE};
+    t[MSG_FRIEND_REMOVE] = {&MessengerServer::onFriendRemove, REQ_INTERACTIVE};
+    t[MSG_GROUP_CREATE] = {&MessengerServer::onGroupCreate, REQ_INTERACTIVE};
+    t[MSG_GROUP_ADD] = {&MessengerServer::onGroupAdd, REQ_INTERACTIVE};
+    t[MSG_GROUP_REMOVE] = {&MessengerServer::onGroupRemove, REQ_INTERACTIVE};
+    t[MSG_GROUP_LEAVE] = {&MessengerServer::onGroupLeave, REQ_INTERACTIVE};
+    t[MSG_GROUP_MESSAGE] = {&MessengerServer::onGroupMessage, REQ_REALTIME};
+    t[MSG_GROUP_HISTORY_REQUEST] = {&MessengerServer::onGroupHistory, REQ_INTERACTIVE};
+    t[MSG_GROUP_MEMBERS_REQUEST] = {&MessengerServer::onGroupMembers, REQ_INTERACTIVE};
+    t[MSG_GROUP_LIST_REQUEST] = {&MessengerServer::onGroupList, REQ_INTERACTIVE};
+    t[MSG_ALL_USERS_STATUS_REQUEST] = {&MessengerServer::onAllUsersStatus, REQ_BULK};
+    t[MSG_DIRECT_MESSAGE] = {&MessengerServer::onDirectMessage, REQ_REALTIME};
+    t[MSG_HISTORY_REQUEST] = {&MessengerServer::onHistory, REQ_INTERACTIVE};
+    t[MSG_STATS_REQUEST] = {&MessengerServer::onStats, REQ_INTERACTIVE};
+    t[MSG_SEARCH_REQUEST] = {&MessengerServer::onSearch, REQ_BULK};
+    t[MSG_BACKUP_REQUEST] = {&MessengerServer::onBackup, REQ_BULK};
+    t[MSG_CHANNEL_CREATE] = {&MessengerServer::onChannelCreate, REQ_INTERACTIVE};
+    t[MSG_CHANNEL_SUBSCRIBE] = {&MessengerServer::onChannelSubscribe, REQ_INTERACTIVE};
+    t[MSG_CHANNEL_UNSUBSCRIBE] = {&MessengerServer::onChannelUnsubscribe, REQ_INTERACTIVE};
+    t[MSG_CHANNEL_POST] = {&MessengerServer::onChannelPost, REQ_REALTIME};
+    t[MSG_CHANNEL_FETCH] = {&MessengerServer::onChannelFetch, REQ_INTERACTIVE};
+    t[MSG_CHANNEL_LIST_REQUEST] = {&MessengerServer::onChannelList, REQ_INTERACTIVE};
+    t[MSG_EPHEMERAL] = {&MessengerServer::onEphemeral, REQ_REALTIME};
+    t[MSG_READ_ACK] = {&MessengerServer::onReadAck, REQ_REALTIME};
+    return t;
+}();
+
+int main(int argc, char *argv[]) {
     cout << COLOR_MAGENTA << "========================================" << COLOR_RESET << endl;
     cout << COLOR_MAGENTA << "    C++ Messenger Server" << COLOR_RESET << endl;
     cout << COLOR_MAGENTA << "========================================" << COLOR_RESET << endl;
 
     MessengerServer server;
+
+    // usage: server [--store sqlite|log | --shards N] [--retention-days N] [--retention-file PATH] [--compact-interval SECONDS]
+    //              [--session-key PATH] [--resume-ttl SECONDS] [--admin USER]... [--backup-dir PATH]
+    size_t logSlots = 8192;
+    ActivityLog::Overflow logOverflow = ActivityLog::DROP;
+    // rotate the activity log at 64 MB or daily, keeping ten old files
+    unsigned long long logRotateBytes = 64ULL << 20;
+    long long logRotateSeconds = 24 * 3600;
+    int logKeep = 10;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--store" && i + 1 < argc) {
+            string kind = argv[++i];
+            if (!server.useStore(kind)) {
+                cerr << COLOR_RED << "Unknown store '" << kind << "' (expected sqlite or log)" << COLOR_RESET << endl;
+                return 1;
+            }
+        } else if (arg == "--shards" && i + 1 < argc) {
+            if (!server.useShards(atoi(argv[++i]))) {
+                cerr << COLOR_RED << "--shards needs a count of at least 1" << COLOR_RESET << endl;
+                return 1;
+            }
+        } else if (arg == "--retention-days" && i + 1 < argc) {
+            server.setRetentionDays(atoll(argv[++i]));
+        } else if (arg == "--retention-file" && i + 1 < argc) {
+            if (!server.loadRetention(argv[++i])) return 1;
+        } else if (arg == "--compact-interval" && i + 1 < argc) {
+            server.setCompactInterval(atoi(argv[++i]));
+        } else if (arg == "--admin" && i + 1 < argc) {
+            server.addAdmin(argv[++i]);
+        } else if (arg == "--backup-dir" && i + 1 < argc) {
+            server.setBackupDir(argv[++i]);
+        } else if (arg == "--session-key" && i + 1 < argc) {
+            server.setSessionKey(argv[++i]);
+        } else if (arg == "--resume-ttl" && i + 1 < argc) {
+            server.setResumeTtl(atoll(argv[++i]));
+        } else if (arg == "--log-queue" && i + 1 < argc) {
+            logSlots = static_cast<size_t>(atoll(argv[++i]));
+        } else if (arg == "--log-overflow" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy != "drop" && policy != "block") {
+                cerr << COLOR_RED << "Unknown log overflow policy '" << policy << "' (expected drop or block)" << COLOR_RESET << endl;
+                return 1;
+            }
+            logOverflow = policy == "block" ? ActivityLog::BLOCK : ActivityLog::DROP;
+        } else if (arg == "--log-rotate" && i + 2 < argc) {
+            // size in MB, then age in hours; 0 turns either off
+            logRotateBytes = static_cast<unsigned long long>(max(0.0, atof(argv[++i])) * (1 << 20));
+            logRotateSeconds = static_cast<long long>(max(0.0, atof(argv[++i])) * 3600);
+        } else if (arg == "--log-keep" && i + 1 < argc) {
+            logKeep = max(0, atoi(argv[++i]));
+        } else if (arg == "--fanout-workers" && i + 1 < argc) {
+            server.setFanoutWorkers(atoi(argv[++i]));
+        } else if (arg == "--fanout-threshold" && i + 1 < argc) {
+            server.setFanoutThreshold(static_cast<size_t>(atoll(argv[++i])));
+        } else if (arg == "--latency-target" && i + 1 < argc) {
+            server.setLatencyTarget(atoll(argv[++i]));
+        } else if ((arg == "--interactive-budget" || arg == "--bulk-budget") && i + 2 < argc) {
+            // slots, then the longest wait for one in ms
+            int slots = atoi(argv[++i]);
+            server.setClassBudget(arg == "--bulk-budget" ? REQ_BULK : REQ_INTERACTIVE, slots, atoll(argv[++i]));
+        } else if (arg == "--rate" && i + 3 < argc) {
+            // class, requests per second (0: unlimited), burst
+            string cls = argv[++i];
+            double perSecond = atof(argv[++i]);
+            long long burst = atoll(argv[++i]);
+            if (cls == "realtime") server.setRateLimit(REQ_REALTIME, perSecond, burst);
+            else if (cls == "interactive") server.setRateLimit(REQ_INTERACTIVE, perSecond, burst);
+            else if (cls == "bulk") server.setRateLimit(REQ_BULK, perSecond, burst);
+            else {
+                cerr << COLOR_RED << "Unknown request class '" << cls << "' (expected realtime, interactive or bulk)" << COLOR_RESET << endl;
+                return 1;
+            }
+        } else {
+            cerr << "Usage: " << argv[0] << " [--store sqlite|log | --shards N] [--retention-days N] [--retention-file PATH]"
+                 << " [--compact-interval SECONDS] [--session-key PATH] [--resume-ttl SECONDS]"
+                 << " [--admin USER]... [--backup-dir PATH] [--fanout-workers N] [--fanout-threshold N]"
+                 << " [--latency-target MS] [--interactive-budget SLOTS MS] [--bulk-budget SLOTS MS]"
+                 << " [--rate realtime|interactive|bulk PER_SEC BURST]... [--log-queue LINES] [--log-overflow drop|block]"
+                 << " [--log-rotate MB HOURS] [--log-keep N]" << endl;
+            return 1;
+        }
+    }
+    server.setLogQueue(logSlots, logOverflow);
+    server.setLogRotation(logRotateBytes, logRotateSeconds, logKeep);
     
     if (!server.start()) {
         return 1;
@@ -0,0 +1,94 @@
+#include "session_tokens.h"
+#include "common.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <sstream>
+#include <unistd.h>
+
+using namespace std;
+
+static const size_t SESSION_KEY_BYTES = 32;
+
+bool SessionTokens::loadKey(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        char buf[SESSION_KEY_BYTES];
+        ssize_t n = read(fd, buf, sizeof(buf));
+        close(fd);
+        if (n != static_cast<ssize_t>(sizeof(buf))) {
+            cerr << COLOR_RED << "Session key " << path << " is truncated" << COLOR_RESET << endl;
+            return false;
+        }
+        key.assign(buf, sizeof(buf));
+        return true;
+    }
+    if (errno != ENOENT) {
+        cerr << COLOR_RED << "Failed to open session key " << path << ": " << strerror(errno) << COLOR_RESET << endl;
+        return false;
+    }
+
+    unsigned char buf[SESSION_KEY_BYTES];
+    if (RAND_bytes(buf, sizeof(buf)) != 1) {
+        cerr << COLOR_RED << "Failed to generate session key" << COLOR_RESET << endl;
+        return false;
+    }
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        cerr << COLOR_RED << "Failed to create session key " << path << ": " << strerror(errno) << COLOR_RESET << endl;
+        return false;
+    }
+    bool ok = write(fd, buf, sizeof(buf)) == static_cast<ssize_t>(sizeof(buf)) && fsync(fd) == 0;
+    close(fd);
+    if (!ok) {
+        cerr << COLOR_RED << "Failed to write session key " << path << COLOR_RESET << endl;
+        unlink(path.c_str());
+        return false;
+    }
+    key.assign(reinterpret_cast<const char*>(buf), sizeof(buf));
+    return true;
+}
+
+string SessionTokens::mac(const string& payload) const {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+         reinterpret_cast<const unsigned char*>(payload.data()), payload.size(), digest, &len);
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    hex.reserve(len * 2);
+    for (unsigned int i = 0; i < len; ++i) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 15];
+    }
+    return hex;
+}
+
+string SessionTokens::issue(const string& user, long long seq, long long stamp, long long now) const {
+    string payload = user + "\n" + to_string(now + ttl) + "\n" + to_string(seq) + "\n" + to_string(stamp);
+    return payload + "\n" + mac(payload);
+}
+
+bool SessionTokens::verify(const string& token, long long now, ResumeClaim& out) const {
+    if (key.empty()) return false;
+    size_t cut = token.rfind('\n');
+    if (cut == string::npos) return false;
+    string payload = token.substr(0, cut);
+    string expect = mac(payload);
+    string got = token.substr(cut + 1);
+    if (got.size() != expect.size() || CRYPTO_memcmp(got.data(), expect.data(), expect.size()) != 0) return false;
+
+    istringstream in(payload);
+    string expires, seq, stamp;
+    if (!getline(in, out.user) || !getline(in, expires) || !getline(in, seq) || !getline(in, stamp)) return false;
+    out.expires = atoll(expires.c_str());
+    out.seq = atoll(seq.c_str());
+    out.stamp = atoll(stamp.c_str());
+    return !out.user.empty() && out.expires > now;
+}
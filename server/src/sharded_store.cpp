@@ -0,0 +1,307 @@
+#include "sharded_store.h"
+#include "common.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+int ShardedStore::recordedShards(const string& base) {
+    ifstream in(ringPath(base));
+    int n = 0;
+    if (!(in >> n)) return 0;
+    return n;
+}
+
+bool ShardedStore::open() {
+    int recorded = recordedShards(base);
+    if (recorded == 0) {
+        ofstream out(ringPath(base), ios::trunc);
+        out << ring.shards() << "\n";
+        if (!out.good()) {
+            cerr << COLOR_RED << "Failed to write " << ringPath(base) << COLOR_RESET << endl;
+            return false;
+        }
+    } else if (recorded != ring.shards()) {
+        cerr << COLOR_RED << "Store has " << recorded << " shards, not " << ring.shards()
+             << "; run messenger-rebalance to change the shard count" << COLOR_RESET << endl;
+        return false;
+    }
+
+    for (int s = 0; s < ring.shards(); ++s) {
+        unique_ptr<SqliteStore> shard(new SqliteStore(shardPath(base, s)));
+        if (!shard->open()) {
+            close();
+            return false;
+        }
+        long long direct = 0, group = 0, channel = 0;
+        if (!shard->maxMessageIds(direct, group, channel)) {
+            close();
+            return false;
+        }
+        lastDirectId = max(lastDirectId.load(), direct);
+        lastGroupId = max(lastGroupId.load(), group);
+        lastChannelId = max(lastChannelId.load(), channel);
+        shards.push_back(move(shard));
+    }
+    return true;
+}
+
+void ShardedStore::close() {
+    {
+        lock_guard<mutex> lock(orphansMutex);
+        for (const auto &o : orphans) {
+            cerr << COLOR_RED << "Direct message " << o.second << " is still stored only on shard " << o.first
+                 << " of its two" << COLOR_RESET << endl;
+        }
+        orphans.clear();
+        orphanCount = 0;
+    }
+    shards.clear();
+    lastDirectId = lastGroupId = lastChannelId = 0;
+}
+
+bool ShardedStore::addUser(const string& username, const string& password) {
+    return shardFor(username).addUser(username, password);
+}
+
+bool ShardedStore::verifyUser(const string& username, const string& password) {
+    return shardFor(username).verifyUser(username, password);
+}
+
+bool ShardedStore::changePassword(const string& username, const string& password) {
+    return shardFor(username).changePassword(username, password);
+}
+
+bool ShardedStore::deleteUser(const string& username) {
+    return shardFor(username).deleteUser(username);
+}
+
+bool ShardedStore::loadUsers(vector<string>& out) {
+    for (auto &s : shards) {
+        if (!s->loadUsers(out)) return false;
+    }
+    return true;
+}
+
+bool ShardedStore::credentialStamp(const string& username, long long& out) {
+    return shardFor(username).credentialStamp(username, out);
+}
+
+bool ShardedStore::putFriendRow(const string& user, const string& friendname, const string& status) {
+    return shardFor(user).putFriendRow(user, friendname, status);
+}
+
+bool ShardedStore::deleteFriendRow(const string& user, const string& friendname, bool pendingOnly) {
+    return shardFor(user).deleteFriendRow(user, friendname, pendingOnly);
+}
+
+bool ShardedStore::loadFriendRows(vector<FriendRow>& out) {
+    for (auto &s : shards) {
+        if (!s->loadFriendRows(out)) return false;
+    }
+    return true;
+}
+
+bool ShardedStore::createGroup(const string& groupname, const string& owner) {
+    return shardFor(groupname).createGroup(groupname, owner);
+}
+
+bool ShardedStore::addGroupMember(const string& groupname, const string& member) {
+    return shardFor(groupname).addGroupMember(groupname, member);
+}
+
+bool ShardedStore::removeGroupMember(const string& groupname, const string& member) {
+    return shardFor(groupname).removeGroupMember(groupname, member);
+}
+
+bool ShardedStore::loadGroups(vector<GroupRow>& out) {
+    for (auto &s : shards) {
+        if (!s->loadGroups(out)) return false;
+    }
+    return true;
+}
+
+bool ShardedStore::loadGroupMembers(vector<GroupMemberRow>& out) {
+    for (auto &s : shards) {
+        if (!s->loadGroupMembers(out)) return false;
+    }
+    return true;
+}
+
+// Retry the rollbacks that failed on `shard` (caller holds its lock)
+void ShardedStore::removeOrphans(int shard) {
+    if (orphanCount.load(memory_order_relaxed) == 0) return;
+    lock_guard<mutex> lock(orphansMutex);
+    for (auto it = orphans.begin(); it != orphans.end();) {
+        if (it->first == shard && shards[shard]->removeDirect(it->second)) it = orphans.erase(it);
+        else ++it;
+    }
+    orphanCount = orphans.size();
+}
+
+// Written to the sender's shard, then the receiver's; if the second write
+// fails the first is taken back so the message is stored everywhere or
+// nowhere. A failed rollback is remembered and retried on the next append to
+// that shard rather than left behind. An id given up on is never reused.
+long long ShardedStore::appendDirect(const string& sender, const string& receiver,
+                                     const string& content, long long ts) {
+    long long id = ++lastDirectId;
+    int firstShard = ring.shardOf(sender);
+    int secondShard = ring.shardOf(receiver);
+    SqliteStore &first = *shards[firstShard];
+    SqliteStore &second = *shards[secondShard];
+    removeOrphans(firstShard);
+    if (secondShard != firstShard) removeOrphans(secondShard);
+    if (first.insertDirect(id, sender, receiver, content, ts) != id) return -1;
+    if (&second != &first && second.insertDirect(id, sender, receiver, content, ts) != id) {
+        if (!first.removeDirect(id)) {
+            cerr << COLOR_RED << "Failed to roll back direct message " << id << " on shard " << firstShard
+                 << "; will retry" << COLOR_RESET << endl;
+            lock_guard<mutex> lock(orphansMutex);
+            orphans.emplace_back(firstShard, id);
+            orphanCount = orphans.size();
+        }
+        return -1;
+    }
+    return id;
+}
+
+long long ShardedStore::appendGroup(const string& groupname, const string& sender,
+                                    const string& content, long long ts) {
+    long long id = ++lastGroupId;
+    if (shardFor(groupname).insertGroup(id, groupname, sender, content, ts) != id) return -1;
+    return id;
+}
+
+bool ShardedStore::scanDirectHistory(const string& a, const string& b, int limit,
+                                     long long beforeId, const HistoryVisitor& visit) {
+    return shardFor(a).scanDirectHistory(a, b, limit, beforeId, visit);
+}
+
+bool ShardedStore::scanGroupHistory(const string& groupname, int limit,
+                                    long long beforeId, const HistoryVisitor& visit) {
+    return shardFor(groupname).scanGroupHistory(groupname, limit, beforeId, visit);
+}
+
+// The receiver's shard holds a copy of every message sent to them, so the
+// inbox join stays local
+bool ShardedStore::inboxPush(const string& user, long long messageId) {
+    return shardFor(user).inboxPush(user, messageId);
+}
+
+bool ShardedStore::inboxTake(const string& user, int limit, vector<StoredMessage>& out) {
+    return shardFor(user).inboxTake(user, limit, out);
+}
+
+// Group read marks sit with the group so loadReadStates can join them with
+// the group's messages on one shard
+bool ShardedStore::putLastRead(const string& user, const string& conv, long long lastRead) {
+    if (conv.size() > 1 && conv[0] == '#') return shardFor(conv.substr(1)).putLastRead(user, conv, lastRead);
+    return shardFor(user).putLastRead(user, conv, lastRead);
+}
+
+// Both shards of a cross-shard pair report it; keep each user's view from
+// their own shard, where their read marks are
+bool ShardedStore::loadReadStates(vector<ReadStateRow>& out) {
+    for (size_t s = 0; s < shards.size(); ++s) {
+        vector<ReadStateRow> rows;
+        if (!shards[s]->loadReadStates(rows)) return false;
+        for (auto &r : rows) {
+            bool group = !r.conv.empty() && r.conv[0] == '#';
+            if (group || ring.shardOf(r.user) == static_cast<int>(s)) out.push_back(move(r));
+        }
+    }
+    return true;
+}
+
+bool ShardedStore::listConversations(vector<ConversationRef>& out) {
+    for (size_t s = 0; s < shards.size(); ++s) {
+        vector<ConversationRef> convs;
+        if (!shards[s]->listConversations(convs)) return false;
+        for (auto &c : convs) {
+            if (c.group || ring.shardOf(c.a) == static_cast<int>(s)) out.push_back(move(c));
+        }
+    }
+    return true;
+}
+
+bool ShardedStore::oldestMessages(const ConversationRef& c, long long cutoffTs, int limit,
+                                  vector<StoredMessage>& out) {
+    return shardFor(c.a).oldestMessages(c, cutoffTs, limit, out);
+}
+
+long long ShardedStore::deleteMessagesThrough(const ConversationRef& c, long long maxId, long long cutoffTs) {
+    SqliteStore &first = shardFor(c.a);
+    long long n = first.deleteMessagesThrough(c, maxId, cutoffTs);
+    if (n < 0 || c.group) return n;
+    SqliteStore &second = shardFor(c.b);
+    if (&second != &first && second.deleteMessagesThrough(c, maxId, cutoffTs) < 0) return -1;
+    return n;
+}
+
+// Every shard may hold groups the user belongs to, so each is asked for its
+// best offset+limit hits and the union is ranked again. Direct hits are only
+// taken from the user's own shard, which has all of them.
+bool ShardedStore::search(const string& user, const string& text, int limit, int offset,
+                          vector<SearchHit>& out) {
+    int home = ring.shardOf(user);
+    vector<SearchHit> hits;
+    for (size_t s = 0; s < shards.size(); ++s) {
+        vector<SearchHit> part;
+        if (!shards[s]->search(user, text, offset + limit, 0, part)) return false;
+        for (auto &h : part) {
+            if (h.group || static_cast<int>(s) == home) hits.push_back(move(h));
+        }
+    }
+    sort(hits.begin(), hits.end(), [](const SearchHit& a, const SearchHit& b) {
+        return a.rank != b.rank ? a.rank < b.rank : a.msg.ts > b.msg.ts;
+    });
+    for (size_t i = static_cast<size_t>(offset); i < hits.size() && i < static_cast<size_t>(offset + limit); ++i) {
+        out.push_back(move(hits[i]));
+    }
+    return true;
+}
+
+bool ShardedStore::createChannel(const string& name, const string& owner) {
+    return shardFor(name).createChannel(name, owner);
+}
+
+bool ShardedStore::addChannelSubscriber(const string& channel, const string& user, long long cursor) {
+    return shardFor(channel).addChannelSubscriber(channel, user, cursor);
+}
+
+bool ShardedStore::removeChannelSubscriber(const string& channel, const string& user) {
+    return shardFor(channel).removeChannelSubscriber(channel, user);
+}
+
+bool ShardedStore::putChannelCursor(const string& channel, const string& user, long long cursor) {
+    return shardFor(channel).putChannelCursor(channel, user, cursor);
+}
+
+bool ShardedStore::loadChannels(vector<ChannelRow>& out) {
+    for (auto &s : shards) {
+        if (!s->loadChannels(out)) return false;
+    }
+    return true;
+}
+
+bool ShardedStore::loadChannelSubscribers(vector<ChannelSubscriberRow>& out) {
+    for (auto &s : shards) {
+        if (!s->loadChannelSubscribers(out)) return false;
+    }
+    return true;
+}
+
+long long ShardedStore::appendChannel(const string& channel, const string& sender,
+                                      const string& content, long long ts) {
+    long long id = ++lastChannelId;
+    if (shardFor(channel).insertChannel(id, channel, sender, content, ts) != id) return -1;
+    return id;
+}
+
+bool ShardedStore::scanChannelSince(const string& channel, long long afterId, int limit,
+                                    const HistoryVisitor& visit) {
+    return shardFor(channel).scanChannelSince(channel, afterId, limit, visit);
+}
@@ -0,0 +1,983 @@
+#include "sqlite_store.h"
+#include "common.h"
+
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+using namespace std;
+
+bool SqliteStore::exec(const char *sql, const char *what) {
+    char *err = nullptr;
+    int rc = sqlite3_exec(db, sql, nullptr, nullptr, &err);
+    if (rc != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to " << what << ": " << (err?err:"") << COLOR_RESET << endl;
+        if (err) sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+// Open the database and create any missing tables
+bool SqliteStore::open() {
+    // serialized mode: readers sharing the server's store lock may use the
+    // connection at the same time
+    int rc = sqlite3_open_v2(path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
+    if (rc != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to open user DB: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+        if (db) sqlite3_close(db);
+        db = nullptr;
+        return false;
+    }
+
+    if (!exec("CREATE TABLE IF NOT EXISTS users (username TEXT PRIMARY KEY, password TEXT,"
+              " cred_stamp INTEGER NOT NULL DEFAULT 0);",
+              "create users table")) return false;
+    if (!addCredentialStamp()) return false;
+    // Create friends table: store undirected friendships as two rows or requests
+    if (!exec("CREATE TABLE IF NOT EXISTS friends (user TEXT, friend TEXT, status TEXT, PRIMARY KEY(user,friend));",
+              "create friends table")) return false;
+    // Messages table: store direct messages between users
+    const char *sql3 =
+        "CREATE TABLE IF NOT EXISTS messages (\n"
+        "  id INTEGER PRIMARY KEY AUTOINCREMENT,\n"
+        "  sender TEXT NOT NULL,\n"
+        "  receiver TEXT NOT NULL,\n"
+        "  content TEXT NOT NULL,\n"
+        "  ts INTEGER NOT NULL DEFAULT (strftime('%s','now'))\n"
+        ");";
+    if (!exec(sql3, "create messages table")) return false;
+    // Groups table
+    if (!exec("CREATE TABLE IF NOT EXISTS groups (name TEXT PRIMARY KEY, owner TEXT);",
+              "create groups table")) return false;
+    // Group members table
+    if (!exec("CREATE TABLE IF NOT EXISTS group_members (groupname TEXT, member TEXT, PRIMARY KEY(groupname,member));"
+              "CREATE INDEX IF NOT EXISTS group_members_by_member ON group_members(member);",
+              "create group_members table")) return false;
+    // Group messages table
+    const char *sql6 =
+        "CREATE TABLE IF NOT EXISTS group_messages ("
+        " id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        " groupname TEXT NOT NULL,"
+        " sender TEXT NOT NULL,"
+        " content TEXT NOT NULL,"
+        " ts INTEGER NOT NULL DEFAULT (strftime('%s','now'))"
+        " );";
+    if (!exec(sql6, "create group_messages table")) return false;
+    // Offline inbox: direct messages not yet delivered, clustered by user so
+    // draining one user's inbox is a single range read
+    if (!exec("CREATE TABLE IF NOT EXISTS inbox (user TEXT NOT NULL, msg_id INTEGER NOT NULL,"
+              " PRIMARY KEY(user, msg_id)) WITHOUT ROWID;",
+              "create inbox table")) return false;
+    // Broadcast channels: posts are stored once per channel; each subscriber
+    // row carries the cursor it catches up from
+    if (!exec("CREATE TABLE IF NOT EXISTS channels (name TEXT PRIMARY KEY, owner TEXT);",
+              "create channels table")) return false;
+    if (!exec("CREATE TABLE IF NOT EXISTS channel_subscribers (channel TEXT NOT NULL, user TEXT NOT NULL,"
+              " cursor INTEGER NOT NULL DEFAULT 0, PRIMARY KEY(channel, user)) WITHOUT ROWID;",
+              "create channel_subscribers table")) return false;
+    const char *sql9 =
+        "CREATE TABLE IF NOT EXISTS channel_messages ("
+        " id INTEGER PRIMARY KEY AUTOINCREMENT,"
+        " channel TEXT NOT NULL,"
+        " sender TEXT NOT NULL,"
+        " content TEXT NOT NULL,"
+        " ts INTEGER NOT NULL DEFAULT (strftime('%s','now'))"
+        " );"
+        "CREATE INDEX IF NOT EXISTS channel_messages_by_channel ON channel_messages(channel, id);";
+    if (!exec(sql9, "create channel_messages table")) return false;
+    if (!createReadState()) return false;
+    return createSearchIndex();
+}
+
+// Databases from before resume tokens were tied to credentials lack the
+// column; their users keep stamp 0 until they next change their password.
+bool SqliteStore::addCredentialStamp() {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('users') WHERE name = 'cred_stamp';", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    bool present = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (present) return true;
+    return exec("ALTER TABLE users ADD COLUMN cred_stamp INTEGER NOT NULL DEFAULT 0;", "add users.cred_stamp");
+}
+
+// Microseconds since the epoch, for credential stamps
+static long long credentialClock() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Acknowledged read positions. When the table is new, every existing
+// conversation starts out read so an upgraded server does not report the
+// whole history as unread.
+bool SqliteStore::createReadState() {
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'read_state';", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    bool existed = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    if (!exec("CREATE TABLE IF NOT EXISTS read_state (user TEXT NOT NULL, conv TEXT NOT NULL,"
+              " last_read INTEGER NOT NULL, PRIMARY KEY(user, conv)) WITHOUT ROWID;",
+              "create read_state table")) return false;
+    if (existed) return true;
+    const char *seed =
+        "INSERT OR IGNORE INTO read_state(user, conv, last_read)"
+        " SELECT u, '@' || p, MAX(id) FROM ("
+        "  SELECT receiver AS u, sender AS p, id FROM messages"
+        "  UNION ALL SELECT sender, receiver, id FROM messages"
+        " ) GROUP BY u, p;"
+        "INSERT OR IGNORE INTO read_state(user, conv, last_read)"
+        " SELECT gm.member, '#' || gm.groupname, MAX(g.id)"
+        " FROM group_members gm JOIN group_messages g ON g.groupname = gm.groupname"
+        " GROUP BY gm.member, gm.groupname;";
+    return exec(seed, "seed read_state table");
+}
+
+// Rank of a search hit: bm25 over the text column with every query phrase
+// weighted alike. FTS5's own bm25() weighs phrases by how many rows in the
+// whole table contain them, and counts that by walking each phrase's full
+// doclist on every query, so a common word cost time in proportion to the
+// entire corpus. Every hit contains every phrase of the query, so the
+// weights would only shift phrases against each other.
+static void searchRank(const Fts5ExtensionApi *api, Fts5Context *fts, sqlite3_context *ctx, int, sqlite3_value **) {
+    const double k1 = 1.2, b = 0.75;
+    sqlite3_int64 rows = 0, tokens = 0;
+    int length = 0, insts = 0;
+    if (api->xRowCount(fts, &rows) != SQLITE_OK || api->xColumnTotalSize(fts, 0, &tokens) != SQLITE_OK ||
+        api->xColumnSize(fts, 0, &length) != SQLITE_OK || api->xInstCount(fts, &insts) != SQLITE_OK) {
+        sqlite3_result_error(ctx, "search_rank: could not read the row", -1);
+        return;
+    }
+    vector<int> hits(static_cast<size_t>(api->xPhraseCount(fts)), 0);
+    for (int i = 0; i < insts; ++i) {
+        int phrase, column, offset;
+        if (api->xInst(fts, i, &phrase, &column, &offset) == SQLITE_OK && column == 0) ++hits[phrase];
+    }
+    double average = rows > 0 && tokens > 0 ? static_cast<double>(tokens) / rows : 1.0;
+    double score = 0;
+    for (int n : hits) {
+        if (n) score += n * (k1 + 1) / (n + k1 * (1 - b + b * length / average));
+    }
+    // lower is better, as with bm25()
+    sqlite3_result_double(ctx, -score);
+}
+
+static bool registerSearchRank(sqlite3 *db) {
+    fts5_api *api = nullptr;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT fts5(?1);", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_pointer(stmt, 1, &api, "fts5_api_ptr", nullptr);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return api && api->xCreateFunction(api, "search_rank", nullptr, searchRank, nullptr) == SQLITE_OK;
+}
+
+// Full-text index over both message tables. The FTS5 tables are external
+// content tables (they store only the index, the text stays in messages and
+// group_messages) and are kept current by triggers on insert and delete.
+// Besides the text, each row indexes a `scope` column naming who may see it:
+// "u<hex of name>" for the sender and receiver of a direct message,
+// "g<hex of name>" for a group message. search() matches on it so the index
+// itself narrows hits to the caller's conversations. The content side of the
+// scope column is a view that derives it the same way.
+bool SqliteStore::createSearchIndex() {
+    if (!registerSearchRank(db)) {
+        cerr << COLOR_RED << "Failed to register search_rank: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+        return false;
+    }
+    struct Index { const char *base, *fts, *view, *scope; };
+    const Index indexes[] = {
+        {"messages", "messages_fts", "messages_search", "'u' || hex(%s.sender) || ' u' || hex(%s.receiver)"},
+        {"group_messages", "group_messages_fts", "group_messages_search", "'g' || hex(%s.groupname)"},
+    };
+    for (auto &t : indexes) {
+        string base = t.base, fts = t.fts, view = t.view;
+        auto scopeOf = [&t](const char *row) {
+            string s = t.scope;
+            for (size_t at; (at = s.find("%s")) != string::npos;) s.replace(at, 2, row);
+            return s;
+        };
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+        sqlite3_bind_text(stmt, 1, fts.c_str(), -1, SQLITE_STATIC);
+        bool existed = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+        if (existed) {
+            if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info(?) WHERE name = 'scope';", -1, &stmt, nullptr) != SQLITE_OK) return false;
+            sqlite3_bind_text(stmt, 1, fts.c_str(), -1, SQLITE_STATIC);
+            bool scoped = sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
+            // an index from before scoping: drop it and build the new one
+            if (!scoped) {
+                string drop = "DROP TRIGGER IF EXISTS " + base + "_fts_insert;"
+                              "DROP TRIGGER IF EXISTS " + base + "_fts_delete;"
+                              "DROP TABLE " + fts + ";";
+                if (!exec(drop.c_str(), "drop unscoped search index")) return false;
+                existed = false;
+            }
+        }
+
+        string sql =
+            "CREATE VIEW IF NOT EXISTS " + view + " AS SELECT id, content, " + scopeOf(t.base) + " AS scope FROM " + base + ";"
+            "CREATE VIRTUAL TABLE IF NOT EXISTS " + fts + " USING fts5(content, scope, content='" + view + "', content_rowid='id');"
+            "CREATE TRIGGER IF NOT EXISTS " + base + "_fts_insert AFTER INSERT ON " + base + " BEGIN"
+            " INSERT INTO " + fts + "(rowid, content, scope) VALUES (new.id, new.content, " + scopeOf("new") + "); END;"
+            "CREATE TRIGGER IF NOT EXISTS " + base + "_fts_delete AFTER DELETE ON " + base + " BEGIN"
+            " INSERT INTO " + fts + "(" + fts + ", rowid, content, scope) VALUES ('delete', old.id, old.content, " + scopeOf("old") + "); END;";
+        if (!exec(sql.c_str(), "create search index")) return false;
+        // a database from before the index existed: index what is already there
+        if (!existed) {
+            string build = "INSERT INTO " + fts + "(" + fts + ") VALUES ('rebuild');";
+            if (!exec(build.c_str(), "build search index")) return false;
+        }
+    }
+    return true;
+}
+
+void SqliteStore::close() {
+    if (db) {
+        sqlite3_close(db);
+        db = nullptr;
+    }
+}
+
+bool SqliteStore::addUser(const string& username, const string& password) {
+    if (!db) return false;
+    const char *sql = "INSERT INTO users(username,password,cred_stamp) VALUES(?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, password.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, credentialClock());
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::verifyUser(const string& username, const string& password) {
+    if (!db) return false;
+    const char *sql = "SELECT password FROM users WHERE username = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    bool ok = false;
+    if (rc == SQLITE_ROW) {
+        const unsigned char *stored = sqlite3_column_text(stmt, 0);
+        if (stored && password == reinterpret_cast<const char*>(stored)) ok = true;
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool SqliteStore::changePassword(const string& username, const string& password) {
+    if (!db) return false;
+    // always moves forward, even if the clock has stepped back
+    const char *sql = "UPDATE users SET password = ?, cred_stamp = max(cred_stamp + 1, ?) WHERE username = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, password.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, credentialClock());
+    sqlite3_bind_text(stmt, 3, username.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::deleteUser(const string& username) {
+    if (!db) return false;
+    const char *sql = "DELETE FROM users WHERE username = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::loadUsers(vector<string>& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT username FROM users;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *u = sqlite3_column_text(stmt, 0);
+        if (u) out.push_back(reinterpret_cast<const char*>(u));
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+bool SqliteStore::credentialStamp(const string& username, long long& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT cred_stamp FROM users WHERE username = ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_STATIC);
+    bool found = sqlite3_step(stmt) == SQLITE_ROW;
+    if (found) out = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return found;
+}
+
+bool SqliteStore::putFriendRow(const string& user, const string& friendname, const string& status) {
+    if (!db) return false;
+    const char *sql = "INSERT OR REPLACE INTO friends(user,friend,status) VALUES(?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, friendname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, status.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::deleteFriendRow(const string& user, const string& friendname, bool pendingOnly) {
+    if (!db) return false;
+    const char *sql = pendingOnly
+        ? "DELETE FROM friends WHERE user = ? AND friend = ? AND status = 'pending';"
+        : "DELETE FROM friends WHERE user = ? AND friend = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, friendname.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    // sqlite3_step returns SQLITE_DONE even if no rows deleted; check changes
+    return (rc == SQLITE_DONE && sqlite3_changes(db) > 0);
+}
+
+bool SqliteStore::loadFriendRows(vector<FriendRow>& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT user, friend, status FROM friends;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *u = sqlite3_column_text(stmt, 0);
+        const unsigned char *f = sqlite3_column_text(stmt, 1);
+        const unsigned char *st = sqlite3_column_text(stmt, 2);
+        if (!u || !f || !st) continue;
+        out.push_back(FriendRow{reinterpret_cast<const char*>(u), reinterpret_cast<const char*>(f),
+                                reinterpret_cast<const char*>(st)});
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+bool SqliteStore::createGroup(const string& groupname, const string& owner) {
+    if (!db) return false;
+    // name is the primary key, so an existing group makes the insert fail
+    const char *ins = "INSERT INTO groups(name,owner) VALUES(?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return false;
+    // add owner as member
+    return addGroupMember(groupname, owner);
+}
+
+bool SqliteStore::addGroupMember(const string& groupname, const string& member) {
+    if (!db) return false;
+    const char *ins = "INSERT OR REPLACE INTO group_members(groupname,member) VALUES(?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, member.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::removeGroupMember(const string& groupname, const string& member) {
+    if (!db) return false;
+    const char *del = "DELETE FROM group_members WHERE groupname = ? AND member = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, del, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, member.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE && sqlite3_changes(db) > 0);
+}
+
+bool SqliteStore::loadGroups(vector<GroupRow>& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT name, owner FROM groups;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *g = sqlite3_column_text(stmt, 0);
+        const unsigned char *o = sqlite3_column_text(stmt, 1);
+        if (g) out.push_back(GroupRow{reinterpret_cast<const char*>(g), o ? reinterpret_cast<const char*>(o) : ""});
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+bool SqliteStore::loadGroupMembers(vector<GroupMemberRow>& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT groupname, member FROM group_members;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *g = sqlite3_column_text(stmt, 0);
+        const unsigned char *m = sqlite3_column_text(stmt, 1);
+        if (g && m) out.push_back(GroupMemberRow{reinterpret_cast<const char*>(g), reinterpret_cast<const char*>(m)});
+    }
+    sqlite3_finalize(stmt);
+    return true;
+}
+
+long long SqliteStore::appendDirect(const string& sender, const string& receiver,
+                                    const string& content, long long ts) {
+    return insertDirect(0, sender, receiver, content, ts);
+}
+
+long long SqliteStore::appendGroup(const string& groupname, const string& sender,
+                                   const string& content, long long ts) {
+    return insertGroup(0, groupname, sender, content, ts);
+}
+
+long long SqliteStore::insertDirect(long long id, const string& sender, const string& receiver,
+                                    const string& content, long long ts) {
+    if (!db) return -1;
+    const char *ins = "INSERT INTO messages(id,sender,receiver,content,ts) VALUES(?,?,?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return -1;
+    if (id > 0) sqlite3_bind_int64(stmt, 1, id);
+    else sqlite3_bind_null(stmt, 1);
+    sqlite3_bind_text(stmt, 2, sender.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, receiver.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, content.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, ts);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return -1;
+    return sqlite3_last_insert_rowid(db);
+}
+
+long long SqliteStore::insertGroup(long long id, const string& groupname, const string& sender,
+                                   const string& content, long long ts) {
+    if (!db) return -1;
+    const char *ins = "INSERT INTO group_messages(id,groupname,sender,content,ts) VALUES(?,?,?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return -1;
+    if (id > 0) sqlite3_bind_int64(stmt, 1, id);
+    else sqlite3_bind_null(stmt, 1);
+    sqlite3_bind_text(stmt, 2, groupname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, sender.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, content.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, ts);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return -1;
+    return sqlite3_last_insert_rowid(db);
+}
+
+long long SqliteStore::insertChannel(long long id, const string& channel, const string& sender,
+                                     const string& content, long long ts) {
+    if (!db) return -1;
+    const char *ins = "INSERT INTO channel_messages(id,channel,sender,content,ts) VALUES(?,?,?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return -1;
+    if (id > 0) sqlite3_bind_int64(stmt, 1, id);
+    else sqlite3_bind_null(stmt, 1);
+    sqlite3_bind_text(stmt, 2, channel.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, sender.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, content.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, ts);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return -1;
+    return sqlite3_last_insert_rowid(db);
+}
+
+bool SqliteStore::removeDirect(long long id) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "DELETE FROM messages WHERE id = ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_int64(stmt, 1, id);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::maxMessageIds(long long& direct, long long& group, long long& channel) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    // sqlite_sequence remembers ids of rows since archived or deleted too
+    const char *sql =
+        "SELECT MAX((SELECT COALESCE(MAX(id), 0) FROM messages),"
+        "           COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'messages'), 0)),"
+        "       MAX((SELECT COALESCE(MAX(id), 0) FROM group_messages),"
+        "           COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'group_messages'), 0)),"
+        "       MAX((SELECT COALESCE(MAX(id), 0) FROM channel_messages),"
+        "           COALESCE((SELECT seq FROM sqlite_sequence WHERE name = 'channel_messages'), 0));";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    bool ok = sqlite3_step(stmt) == SQLITE_ROW;
+    if (ok) {
+        direct = sqlite3_column_int64(stmt, 0);
+        group = sqlite3_column_int64(stmt, 1);
+        channel = sqlite3_column_int64(stmt, 2);
+    }
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+// Step a prepared "SELECT id, sender, peer, content, ts" statement, handing
+// each row to the visitor straight from SQLite's column buffers
+bool SqliteStore::visitMessages(sqlite3_stmt *stmt, const HistoryVisitor& visit) {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        MessageView m;
+        m.id = sqlite3_column_int64(stmt, 0);
+        const unsigned char *sender = sqlite3_column_text(stmt, 1);
+        const unsigned char *peer = sqlite3_column_text(stmt, 2);
+        const unsigned char *body = sqlite3_column_text(stmt, 3);
+        m.ts = sqlite3_column_int64(stmt, 4);
+        if (sender) m.sender = string_view(reinterpret_cast<const char*>(sender), sqlite3_column_bytes(stmt, 1));
+        if (peer) m.peer = string_view(reinterpret_cast<const char*>(peer), sqlite3_column_bytes(stmt, 2));
+        if (body) m.content = string_view(reinterpret_cast<const char*>(body), sqlite3_column_bytes(stmt, 3));
+        visit(m);
+    }
+    return rc == SQLITE_DONE;
+}
+
+bool SqliteStore::scanDirectHistory(const string& a, const string& b, int limit, long long beforeId,
+                                    const HistoryVisitor& visit) {
+    if (!db) return false;
+    // newest rows first in the subquery, re-sorted oldest first
+    const char *q =
+        "SELECT id, sender, receiver, content, ts FROM (\n"
+        "  SELECT id, sender, receiver, content, ts FROM messages\n"
+        "  WHERE ((sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?)) AND id < ?\n"
+        "  ORDER BY id DESC LIMIT ?\n"
+        ") ORDER BY id ASC;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, a.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, b.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, b.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, a.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 5, beforeId > 0 ? beforeId : INT64_MAX);
+    sqlite3_bind_int(stmt, 6, limit);
+    bool ok = visitMessages(stmt, visit);
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool SqliteStore::scanGroupHistory(const string& groupname, int limit, long long beforeId,
+                                   const HistoryVisitor& visit) {
+    if (!db) return false;
+    const char *q =
+        "SELECT id, sender, groupname, content, ts FROM ("
+        " SELECT id, sender, groupname, content, ts FROM group_messages WHERE groupname = ? AND id < ?"
+        " ORDER BY id DESC LIMIT ?"
+        ") ORDER BY id ASC;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, groupname.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, beforeId > 0 ? beforeId : INT64_MAX);
+    sqlite3_bind_int(stmt, 3, limit);
+    bool ok = visitMessages(stmt, visit);
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool SqliteStore::createChannel(const string& name, const string& owner) {
+    if (!db) return false;
+    // name is the primary key, so an existing channel makes the insert fail
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "INSERT INTO channels(name,owner) VALUES(?,?);", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, name.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, owner.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::addChannelSubscriber(const string& channel, const string& user, long long cursor) {
+    if (!db) return false;
+    const char *ins = "INSERT OR IGNORE INTO channel_subscribers(channel,user,cursor) VALUES(?,?,?);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, ins, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, channel.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, cursor);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::removeChannelSubscriber(const string& channel, const string& user) {
+    if (!db) return false;
+    const char *del = "DELETE FROM channel_subscribers WHERE channel = ? AND user = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, del, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, channel.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE && sqlite3_changes(db) > 0);
+}
+
+bool SqliteStore::putChannelCursor(const string& channel, const string& user, long long cursor) {
+    if (!db) return false;
+    const char *upd = "UPDATE channel_subscribers SET cursor = MAX(cursor, ?) WHERE channel = ? AND user = ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, upd, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_int64(stmt, 1, cursor);
+    sqlite3_bind_text(stmt, 2, channel.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, user.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::loadChannels(vector<ChannelRow>& out) {
+    if (!db) return false;
+    const char *q =
+        "SELECT c.name, c.owner, (SELECT COALESCE(MAX(id), 0) FROM channel_messages m WHERE m.channel = c.name)"
+        " FROM channels c;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *n = sqlite3_column_text(stmt, 0);
+        const unsigned char *o = sqlite3_column_text(stmt, 1);
+        if (!n) continue;
+        out.push_back(ChannelRow{reinterpret_cast<const char*>(n), o ? reinterpret_cast<const char*>(o) : "",
+                                 sqlite3_column_int64(stmt, 2)});
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+}
+
+bool SqliteStore::loadChannelSubscribers(vector<ChannelSubscriberRow>& out) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT channel, user, cursor FROM channel_subscribers;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *c = sqlite3_column_text(stmt, 0);
+        const unsigned char *u = sqlite3_column_text(stmt, 1);
+        if (!c || !u) continue;
+        out.push_back(ChannelSubscriberRow{reinterpret_cast<const char*>(c), reinterpret_cast<const char*>(u),
+                                           sqlite3_column_int64(stmt, 2)});
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+}
+
+long long SqliteStore::appendChannel(const string& channel, const string& sender,
+                                     const string& content, long long ts) {
+    return insertChannel(0, channel, sender, content, ts);
+}
+
+bool SqliteStore::scanChannelSince(const string& channel, long long afterId, int limit,
+                                   const HistoryVisitor& visit) {
+    if (!db) return false;
+    const char *q =
+        "SELECT id, sender, channel, content, ts FROM channel_messages"
+        " WHERE channel = ? AND id > ? ORDER BY id ASC LIMIT ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, channel.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, afterId);
+    sqlite3_bind_int(stmt, 3, limit);
+    bool ok = visitMessages(stmt, visit);
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+bool SqliteStore::listConversations(vector<ConversationRef>& out) {
+    if (!db) return false;
+    const char *direct =
+        "SELECT CASE WHEN sender < receiver THEN sender ELSE receiver END AS x,"
+        " CASE WHEN sender < receiver THEN receiver ELSE sender END AS y, MIN(ts)"
+        " FROM messages GROUP BY x, y;";
+    const char *group = "SELECT groupname, '', MIN(ts) FROM group_messages GROUP BY groupname;";
+    const char *queries[] = {direct, group};
+    for (int i = 0; i < 2; ++i) {
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(db, queries[i], -1, &stmt, nullptr) != SQLITE_OK) return false;
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char *a = sqlite3_column_text(stmt, 0);
+            const unsigned char *b = sqlite3_column_text(stmt, 1);
+            if (!a) continue;
+            ConversationRef c;
+            c.group = (i == 1);
+            c.a = reinterpret_cast<const char*>(a);
+            if (b) c.b = reinterpret_cast<const char*>(b);
+            c.oldestTs = sqlite3_column_int64(stmt, 2);
+            out.push_back(c);
+        }
+        sqlite3_finalize(stmt);
+    }
+    return true;
+}
+
+// Both retention statements select or delete rows of one conversation sent
+// before a cutoff; bind the conversation and return the next free parameter
+static int bindConversation(sqlite3_stmt *stmt, const ConversationRef& c) {
+    sqlite3_bind_text(stmt, 1, c.a.c_str(), -1, SQLITE_STATIC);
+    if (c.group) return 2;
+    sqlite3_bind_text(stmt, 2, c.b.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, c.b.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, c.a.c_str(), -1, SQLITE_STATIC);
+    return 5;
+}
+
+bool SqliteStore::oldestMessages(const ConversationRef& c, long long cutoffTs, int limit,
+                                 vector<StoredMessage>& out) {
+    if (!db) return false;
+    const char *q = c.group
+        ? "SELECT id, sender, groupname, content, ts FROM group_messages"
+          " WHERE groupname = ? AND ts < ? ORDER BY id ASC LIMIT ?;"
+        : "SELECT id, sender, receiver, content, ts FROM messages"
+          " WHERE ((sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?)) AND ts < ?"
+          " ORDER BY id ASC LIMIT ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    int n = bindConversation(stmt, c);
+    sqlite3_bind_int64(stmt, n, cutoffTs);
+    sqlite3_bind_int(stmt, n + 1, limit);
+    bool ok = visitMessages(stmt, [&out](const MessageView& m) { out.push_back(MessageStore::copyOf(m)); });
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+long long SqliteStore::deleteMessagesThrough(const ConversationRef& c, long long maxId, long long cutoffTs) {
+    if (!db) return -1;
+    const char *q = c.group
+        ? "DELETE FROM group_messages WHERE groupname = ? AND ts < ? AND id <= ?;"
+        : "DELETE FROM messages"
+          " WHERE ((sender = ? AND receiver = ?) OR (sender = ? AND receiver = ?)) AND ts < ? AND id <= ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return -1;
+    int n = bindConversation(stmt, c);
+    sqlite3_bind_int64(stmt, n, cutoffTs);
+    sqlite3_bind_int64(stmt, n + 1, maxId);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return -1;
+    return sqlite3_changes(db);
+}
+
+// Turn free text into an FTS5 query: every whitespace-separated word becomes a
+// quoted phrase, so operators and punctuation in user input are plain text
+// and all words must match
+static string ftsQuery(const string& text) {
+    string q;
+    size_t i = 0;
+    while (i < text.size()) {
+        while (i < text.size() && isspace(static_cast<unsigned char>(text[i]))) ++i;
+        size_t start = i;
+        while (i < text.size() && !isspace(static_cast<unsigned char>(text[i]))) ++i;
+        if (start == i) break;
+        if (!q.empty()) q += ' ';
+        q += '"';
+        for (size_t k = start; k < i; ++k) {
+            if (text[k] == '"') q += '"';
+            q += text[k];
+        }
+        q += '"';
+    }
+    return q;
+}
+
+// An FTS5 string token for the scope column; see createSearchIndex()
+static string scopeToken(char kind, const string& name) {
+    static const char digits[] = "0123456789abcdef";
+    string t = "\"";
+    t += kind;
+    for (unsigned char c : name) {
+        t += digits[c >> 4];
+        t += digits[c & 15];
+    }
+    return t + "\"";
+}
+
+bool SqliteStore::search(const string& user, const string& text, int limit, int offset,
+                         vector<SearchHit>& out) {
+    if (!db) return false;
+    string query = ftsQuery(text);
+    if (query.empty()) return true;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT groupname FROM group_members WHERE member = ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    string groups;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const unsigned char *g = sqlite3_column_text(stmt, 0);
+        if (!groups.empty()) groups += " OR ";
+        groups += scopeToken('g', g ? reinterpret_cast<const char*>(g) : "");
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return false;
+
+    // The scope terms make FTS5 intersect the text's doclists with the
+    // caller's own, so the work follows the caller's matches rather than the
+    // whole corpus'. Each table's best offset+limit are picked first (ties
+    // newest first by id, which grows with ts within a table); only those
+    // are looked up for their ts to interleave the two, and only the
+    // returned page gets a snippet, matched on the text alone.
+    string direct = "content : (" + query + ") AND scope : " + scopeToken('u', user);
+    string inGroups = groups.empty() ? string() : "content : (" + query + ") AND scope : (" + groups + ")";
+    string words = "content : (" + query + ")";
+    string q =
+        "WITH dm(id, r) AS ("
+        " SELECT rowid, search_rank(messages_fts) FROM messages_fts WHERE messages_fts MATCH ?1"
+        " ORDER BY 2, 1 DESC LIMIT ?3 + ?4)";
+    if (!groups.empty()) {
+        q += ", gm(id, r) AS ("
+             " SELECT rowid, search_rank(group_messages_fts) FROM group_messages_fts WHERE group_messages_fts MATCH ?2"
+             " ORDER BY 2, 1 DESC LIMIT ?3 + ?4)";
+    }
+    q += ", page(grp, id, ts, r) AS ("
+         " SELECT 0, dm.id, m.ts, dm.r FROM dm JOIN messages m ON m.id = dm.id";
+    if (!groups.empty()) {
+        q += " UNION ALL"
+             " SELECT 1, gm.id, g.ts, gm.r FROM gm JOIN group_messages g ON g.id = gm.id";
+    }
+    q += " ORDER BY 4, 3 DESC LIMIT ?3 OFFSET ?4)"
+         " SELECT p.grp, m.id, m.sender, m.receiver,"
+         "  (SELECT snippet(messages_fts, 0, '*', '*', '...', 16) FROM messages_fts WHERE messages_fts MATCH ?5 AND rowid = m.id),"
+         "  m.ts, p.r"
+         " FROM page p JOIN messages m ON m.id = p.id WHERE p.grp = 0"
+         " UNION ALL"
+         " SELECT p.grp, g.id, g.sender, g.groupname,"
+         "  (SELECT snippet(group_messages_fts, 0, '*', '*', '...', 16) FROM group_messages_fts WHERE group_messages_fts MATCH ?5 AND rowid = g.id),"
+         "  g.ts, p.r"
+         " FROM page p JOIN group_messages g ON g.id = p.id WHERE p.grp = 1"
+         " ORDER BY 7, 6 DESC;";
+    if (sqlite3_prepare_v2(db, q.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << COLOR_RED << "Failed to prepare search: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, direct.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, inGroups.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 3, limit);
+    sqlite3_bind_int(stmt, 4, offset);
+    sqlite3_bind_text(stmt, 5, words.c_str(), -1, SQLITE_TRANSIENT);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        SearchHit h;
+        h.group = sqlite3_column_int(stmt, 0) != 0;
+        h.msg.id = sqlite3_column_int64(stmt, 1);
+        const unsigned char *sender = sqlite3_column_text(stmt, 2);
+        const unsigned char *peer = sqlite3_column_text(stmt, 3);
+        const unsigned char *snip = sqlite3_column_text(stmt, 4);
+        if (sender) h.msg.sender = reinterpret_cast<const char*>(sender);
+        if (peer) h.msg.peer = reinterpret_cast<const char*>(peer);
+        if (snip) h.msg.content = reinterpret_cast<const char*>(snip);
+        h.msg.ts = sqlite3_column_int64(stmt, 5);
+        h.rank = sqlite3_column_double(stmt, 6);
+        out.push_back(move(h));
+    }
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE;
+}
+
+bool SqliteStore::inboxPush(const string& user, long long messageId) {
+    if (!db) return false;
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO inbox(user,msg_id) VALUES(?,?);", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, messageId);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::inboxTake(const string& user, int limit, vector<StoredMessage>& out) {
+    if (!db) return false;
+    // LEFT JOIN so entries whose message was archived meanwhile still get
+    // cleared from the inbox
+    const char *q =
+        "SELECT i.msg_id, m.sender, m.receiver, m.content, m.ts FROM inbox i"
+        " LEFT JOIN messages m ON m.id = i.msg_id"
+        " WHERE i.user = ? ORDER BY i.msg_id LIMIT ?;";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, limit);
+    long long through = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        through = sqlite3_column_int64(stmt, 0);
+        if (sqlite3_column_type(stmt, 1) == SQLITE_NULL) continue;
+        StoredMessage m;
+        m.id = through;
+        m.sender = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        m.peer = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        m.content = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+        m.ts = sqlite3_column_int64(stmt, 4);
+        out.push_back(move(m));
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) return false;
+    if (through == 0) return true;
+
+    if (sqlite3_prepare_v2(db, "DELETE FROM inbox WHERE user = ? AND msg_id <= ?;", -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, through);
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+bool SqliteStore::putLastRead(const string& user, const string& conv, long long lastRead) {
+    if (!db) return false;
+    const char *sql =
+        "INSERT INTO read_state(user, conv, last_read) VALUES(?,?,?)"
+        " ON CONFLICT(user, conv) DO UPDATE SET last_read = MAX(last_read, excluded.last_read);";
+    sqlite3_stmt *stmt = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, conv.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, lastRead);
+    int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    return (rc == SQLITE_DONE);
+}
+
+// One aggregate pass per message table: every (user, conversation) pair with
+// its read mark, the messages from others after it, and the newest id
+bool SqliteStore::loadReadStates(vector<ReadStateRow>& out) {
+    if (!db) return false;
+    const char *direct =
+        "SELECT c.u, '@' || c.p, COALESCE(r.last_read, 0),"
+        " SUM(CASE WHEN c.incoming AND c.id > COALESCE(r.last_read, 0) THEN 1 ELSE 0 END), MAX(c.id)"
+        " FROM (SELECT receiver AS u, sender AS p, id, 1 AS incoming FROM messages WHERE sender != receiver"
+        "       UNION ALL SELECT sender, receiver, id, 0 FROM messages WHERE sender != receiver) c"
+        " LEFT JOIN read_state r ON r.user = c.u AND r.conv = '@' || c.p"
+        " GROUP BY c.u, c.p;";
+    const char *group =
+        "SELECT gm.member, '#' || gm.groupname, COALESCE(r.last_read, 0),"
+        " SUM(CASE WHEN g.sender != gm.member AND g.id > COALESCE(r.last_read, 0) THEN 1 ELSE 0 END), MAX(g.id)"
+        " FROM group_members gm JOIN group_messages g ON g.groupname = gm.groupname"
+        " LEFT JOIN read_state r ON r.user = gm.member AND r.conv = '#' || gm.groupname"
+        " GROUP BY gm.member, gm.groupname;";
+    const char *queries[] = {direct, group};
+    for (const char *q : queries) {
+        sqlite3_stmt *stmt = nullptr;
+        if (sqlite3_prepare_v2(db, q, -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << COLOR_RED << "Failed to prepare read state query: " << sqlite3_errmsg(db) << COLOR_RESET << endl;
+            return false;
+        }
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const unsigned char *u = sqlite3_column_text(stmt, 0);
+            const unsigned char *c = sqlite3_column_text(stmt, 1);
+            if (!u || !c) continue;
+            ReadStateRow r;
+            r.user = reinterpret_cast<const char*>(u);
+            r.conv = reinterpret_cast<const char*>(c);
+            r.lastRead = sqlite3_column_int64(stmt, 2);
+            r.unread = sqlite3_column_int64(stmt, 3);
+            r.newest = sqlite3_column_int64(stmt, 4);
+            out.push_back(move(r));
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) return false;
+    }
+    return true;
+}
@@ -0,0 +1,344 @@
+// store-conformance: runs the same MessageStore checks against every backend.
+//
+//   make test
+//
+// Each backend gets a fresh scratch directory under /tmp. A failed check
+// prints the backend, the line and the expression, and the run exits 1.
+
+#include "common.h"
+#include "log_store.h"
+#include "message_store.h"
+#include "sqlite_store.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static int failures = 0;
+static const char *backend = "";
+
+#define CHECK(expr) \
+    do { \
+        if (!(expr)) { \
+            ++failures; \
+            cerr << COLOR_RED << "[" << backend << "] " << __FILE__ << ":" << __LINE__ \
+                 << ": CHECK(" #expr ") failed" << COLOR_RESET << endl; \
+        } \
+    } while (0)
+
+typedef function<unique_ptr<MessageStore>(const string& dir)> StoreFactory;
+
+static vector<long long> idsOf(const vector<StoredMessage>& rows) {
+    vector<long long> ids;
+    for (const auto &m : rows) ids.push_back(m.id);
+    return ids;
+}
+
+static const ReadStateRow *findReadState(const vector<ReadStateRow>& rows, const string& user, const string& conv) {
+    for (const auto &r : rows) {
+        if (r.user == user && r.conv == conv) return &r;
+    }
+    return nullptr;
+}
+
+static void checkUsers(MessageStore& store) {
+    CHECK(store.addUser("alice", "pw-a"));
+    CHECK(store.addUser("bob", "pw-b"));
+    CHECK(store.addUser("carol", "pw-c"));
+    CHECK(!store.addUser("alice", "other"));
+    CHECK(store.verifyUser("alice", "pw-a"));
+    CHECK(!store.verifyUser("alice", "pw-b"));
+    CHECK(!store.verifyUser("nobody", "pw-a"));
+    long long before = 0, after = 0;
+    CHECK(store.credentialStamp("bob", before));
+    CHECK(store.changePassword("bob", "pw-b2"));
+    CHECK(store.verifyUser("bob", "pw-b2"));
+    CHECK(!store.verifyUser("bob", "pw-b"));
+    CHECK(store.credentialStamp("bob", after) && after != before);
+
+    // a re-registered name, even with the same password, is a new stamp
+    CHECK(!store.credentialStamp("nobody", before));
+    CHECK(store.addUser("dave", "pw-d"));
+    CHECK(store.credentialStamp("dave", before));
+    CHECK(store.deleteUser("dave"));
+    CHECK(!store.credentialStamp("dave", after));
+    CHECK(store.addUser("dave", "pw-d"));
+    CHECK(store.credentialStamp("dave", after) && after != before);
+    CHECK(store.deleteUser("dave"));
+
+    vector<string> users;
+    CHECK(store.loadUsers(users));
+    sort(users.begin(), users.end());
+    CHECK((users == vector<string>{"alice", "bob", "carol"}));
+}
+
+// Direct and group inserts hand out increasing ids and keep every field
+static void checkInsert(MessageStore& store, vector<long long>& directIds, vector<long long>& groupIds) {
+    CHECK(store.createGroup("team", "alice"));
+    CHECK(store.addGroupMember("team", "alice"));
+    CHECK(store.addGroupMember("team", "bob"));
+
+    long long prev = 0;
+    for (int i = 0; i < 10; ++i) {
+        const string &from = i % 2 ? "bob" : "alice";
+        const string &to = i % 2 ? "alice" : "bob";
+        long long id = store.appendDirect(from, to, "direct " + to_string(i), 1000 + i);
+        CHECK(id > prev);
+        prev = id;
+        directIds.push_back(id);
+    }
+    // another conversation in between must not show up in alice<->bob
+    CHECK(store.appendDirect("alice", "carol", "elsewhere", 1100) > prev);
+
+    prev = 0;
+    for (int i = 0; i < 6; ++i) {
+        long long id = store.appendGroup("team", i % 2 ? "bob" : "alice", "group " + to_string(i), 2000 + i);
+        CHECK(id > prev);
+        prev = id;
+        groupIds.push_back(id);
+    }
+
+    vector<StoredMessage> rows;
+    CHECK(store.directHistory("alice", "bob", 1, rows));
+    CHECK(rows.size() == 1);
+    if (rows.size() == 1) {
+        CHECK(rows[0].id == directIds.back());
+        CHECK(rows[0].ts == 1009);
+        CHECK(rows[0].sender == "bob");
+        CHECK(rows[0].peer == "alice");
+        CHECK(rows[0].content == "direct 9");
+    }
+    rows.clear();
+    CHECK(store.groupHistory("team", 1, rows));
+    CHECK(rows.size() == 1);
+    if (rows.size() == 1) {
+        CHECK(rows[0].id == groupIds.back());
+        CHECK(rows[0].sender == "bob");
+        CHECK(rows[0].peer == "team");
+        CHECK(rows[0].content == "group 5");
+    }
+}
+
+// Pages are the newest `limit` rows below the cursor, oldest first; walking
+// back by the first id of each page visits every message exactly once
+static void checkHistoryPaging(MessageStore& store, const vector<long long>& directIds,
+                               const vector<long long>& groupIds) {
+    vector<StoredMessage> rows;
+    CHECK(store.directHistory("bob", "alice", 4, rows));
+    CHECK((idsOf(rows) == vector<long long>(directIds.end() - 4, directIds.end())));
+
+    vector<long long> walked;
+    long long before = 0;
+    for (int page = 0; page < 10; ++page) {
+        rows.clear();
+        CHECK(store.directHistory("alice", "bob", 4, rows, before));
+        if (rows.empty()) break;
+        CHECK(rows.size() <= 4);
+        vector<long long> ids = idsOf(rows);
+        walked.insert(walked.begin(), ids.begin(), ids.end());
+        before = rows.front().id;
+    }
+    CHECK(walked == directIds);
+
+    rows.clear();
+    CHECK(store.groupHistory("team", 4, rows, groupIds[3]));
+    CHECK((idsOf(rows) == vector<long long>(groupIds.begin(), groupIds.begin() + 3)));
+
+    rows.clear();
+    CHECK(store.directHistory("bob", "carol", 10, rows));
+    CHECK(rows.empty());
+}
+
+// Taking returns the oldest undelivered messages in id order and removes
+// them; a pushed-back id is delivered again, a repeated push only once
+static void checkInboxTake(MessageStore& store, const vector<long long>& directIds) {
+    CHECK(store.inboxPush("carol", directIds[5]));
+    CHECK(store.inboxPush("carol", directIds[1]));
+    CHECK(store.inboxPush("carol", directIds[3]));
+    CHECK(store.inboxPush("carol", directIds[3]));
+
+    vector<StoredMessage> taken;
+    CHECK(store.inboxTake("carol", 2, taken));
+    CHECK((idsOf(taken) == vector<long long>{directIds[1], directIds[3]}));
+    if (!taken.empty()) {
+        CHECK(taken[0].sender == "bob");
+        CHECK(taken[0].content == "direct 1");
+    }
+
+    // delivery failed: the first one goes back in front of the rest
+    CHECK(store.inboxPush("carol", directIds[1]));
+    taken.clear();
+    CHECK(store.inboxTake("carol", 10, taken));
+    CHECK((idsOf(taken) == vector<long long>{directIds[1], directIds[5]}));
+
+    taken.clear();
+    CHECK(store.inboxTake("carol", 10, taken));
+    CHECK(taken.empty());
+
+    // left undelivered for checkReopen
+    CHECK(store.inboxPush("bob", directIds[8]));
+}
+
+// Unread counts only messages from others after the read mark; marks never
+// move backwards
+static void checkReadState(MessageStore& store, const vector<long long>& directIds,
+                           const vector<long long>& groupIds) {
+    CHECK(store.putLastRead("alice", "@bob", directIds[5]));
+    CHECK(store.putLastRead("alice", "@bob", directIds[2]));
+    CHECK(store.putLastRead("bob", "#team", groupIds[1]));
+
+    vector<ReadStateRow> rows;
+    CHECK(store.loadReadStates(rows));
+    const ReadStateRow *r = findReadState(rows, "alice", "@bob");
+    CHECK(r != nullptr);
+    if (r) {
+        CHECK(r->lastRead == directIds[5]);
+        CHECK(r->unread == 2); // bob's direct 7 and 9
+        CHECK(r->newest == directIds.back());
+    }
+    r = findReadState(rows, "bob", "@alice");
+    CHECK(r != nullptr);
+    if (r) {
+        CHECK(r->lastRead == 0);
+        CHECK(r->unread == 5);
+    }
+    r = findReadState(rows, "bob", "#team");
+    CHECK(r != nullptr);
+    if (r) {
+        CHECK(r->lastRead == groupIds[1]);
+        CHECK(r->unread == 2); // alice's group 2 and 4
+        CHECK(r->newest == groupIds.back());
+    }
+    r = findReadState(rows, "alice", "#team");
+    CHECK(r != nullptr);
+    if (r) CHECK(r->unread == 3);
+}
+
+// Stores that drop old rows list each conversation once and delete exactly
+// the archived prefix; the others must keep everything
+static void checkRetention(MessageStore& store, const vector<long long>& directIds,
+                           const vector<long long>& groupIds) {
+    vector<ConversationRef> convs;
+    if (!store.listConversations(convs)) {
+        vector<StoredMessage> rows;
+        ConversationRef pair;
+        pair.a = "alice";
+        pair.b = "bob";
+        CHECK(!store.oldestMessages(pair, 1005, 10, rows));
+        CHECK(store.deleteMessagesThrough(pair, directIds.back(), 1005) == -1);
+        CHECK(store.directHistory("alice", "bob", 100, rows));
+        CHECK(idsOf(rows) == directIds);
+        return;
+    }
+
+    const ConversationRef *pair = nullptr;
+    const ConversationRef *team = nullptr;
+    for (const auto &c : convs) {
+        if (!c.group && c.a == "alice" && c.b == "bob") pair = &c;
+        if (c.group && c.a == "team") team = &c;
+    }
+    CHECK(pair != nullptr);
+    CHECK(team != nullptr);
+    if (!pair || !team) return;
+    CHECK(pair->oldestTs == 1000);
+    CHECK(team->oldestTs == 2000);
+
+    // messages sent before ts 1005, two at a time
+    vector<StoredMessage> oldest;
+    CHECK(store.oldestMessages(*pair, 1005, 2, oldest));
+    CHECK((idsOf(oldest) == vector<long long>{directIds[0], directIds[1]}));
+    CHECK(store.deleteMessagesThrough(*pair, oldest.back().id, 1005) == 2);
+
+    vector<StoredMessage> rows;
+    CHECK(store.directHistory("alice", "bob", 100, rows));
+    CHECK((idsOf(rows) == vector<long long>(directIds.begin() + 2, directIds.end())));
+
+    // the cutoff wins over maxId
+    CHECK(store.deleteMessagesThrough(*team, groupIds.back(), 2002) == 2);
+    rows.clear();
+    CHECK(store.groupHistory("team", 100, rows));
+    CHECK((idsOf(rows) == vector<long long>(groupIds.begin() + 2, groupIds.end())));
+}
+
+// Everything above survives a close and reopen, and new ids stay above the
+// old ones
+static void checkReopen(MessageStore& store, const vector<long long>& directIds,
+                        const vector<long long>& groupIds) {
+    vector<StoredMessage> before;
+    CHECK(store.directHistory("alice", "bob", 100, before));
+    long long stamp = 0, reopened = 0;
+    CHECK(store.credentialStamp("bob", stamp));
+    store.close();
+    CHECK(store.open());
+
+    CHECK(store.verifyUser("bob", "pw-b2"));
+    CHECK(store.credentialStamp("bob", reopened) && reopened == stamp);
+    vector<StoredMessage> after;
+    CHECK(store.directHistory("alice", "bob", 100, after));
+    CHECK(idsOf(after) == idsOf(before));
+
+    vector<StoredMessage> taken;
+    CHECK(store.inboxTake("bob", 10, taken));
+    CHECK((idsOf(taken) == vector<long long>{directIds[8]}));
+
+    vector<ReadStateRow> rows;
+    CHECK(store.loadReadStates(rows));
+    const ReadStateRow *r = findReadState(rows, "alice", "@bob");
+    CHECK(r != nullptr);
+    if (r) CHECK(r->lastRead == directIds[5]);
+
+    CHECK(store.appendDirect("bob", "alice", "after reopen", 3000) > directIds.back());
+    CHECK(store.appendGroup("team", "bob", "after reopen", 3000) > groupIds.back());
+}
+
+static void runSuite(const char *label, const StoreFactory& make) {
+    backend = label;
+    int before = failures;
+    char tmpl[] = "/tmp/store-conformance-XXXXXX";
+    const char *dir = mkdtemp(tmpl);
+    if (!dir) {
+        ++failures;
+        cerr << COLOR_RED << "[" << label << "] could not create a scratch directory" << COLOR_RESET << endl;
+        return;
+    }
+    unique_ptr<MessageStore> store = make(dir);
+    if (!store->open()) {
+        ++failures;
+        cerr << COLOR_RED << "[" << label << "] could not open the store in " << dir << COLOR_RESET << endl;
+        return;
+    }
+
+    vector<long long> directIds, groupIds;
+    checkUsers(*store);
+    checkInsert(*store, directIds, groupIds);
+    if (directIds.size() == 10 && groupIds.size() == 6) {
+        checkHistoryPaging(*store, directIds, groupIds);
+        checkInboxTake(*store, directIds);
+        checkReadState(*store, directIds, groupIds);
+        checkRetention(*store, directIds, groupIds);
+        checkReopen(*store, directIds, groupIds);
+    }
+    store->close();
+
+    string cleanup = string("rm -rf '") + dir + "'";
+    if (system(cleanup.c_str()) != 0) cerr << COLOR_YELLOW << "Could not remove " << dir << COLOR_RESET << endl;
+    if (failures == before) cout << COLOR_GREEN << "[" << label << "] ok" << COLOR_RESET << endl;
+}
+
+int main() {
+    runSuite("sqlite", [](const string& dir) -> unique_ptr<MessageStore> {
+        return unique_ptr<MessageStore>(new SqliteStore(dir + "/users.sqlite"));
+    });
+    // small segments so history and reopen cross sealed, mapped segments
+    runSuite("log", [](const string& dir) -> unique_ptr<MessageStore> {
+        return unique_ptr<MessageStore>(new LogStore(dir, 512));
+    });
+    if (failures) cerr << COLOR_RED << failures << " check(s) failed" << COLOR_RESET << endl;
+    return failures ? 1 : 0;
+}